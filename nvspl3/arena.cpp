@@ -0,0 +1,43 @@
+// SEL Project
+// arena.cpp
+
+#include "arena.h"
+
+static const size_t BlockSize = 64 * 1024;
+
+AstArena::~AstArena()
+{
+    for (size_t i = Dtors.size(); i-- > 0;)
+        Dtors[i].Destroy(Dtors[i].Obj);
+}
+
+void* AstArena::allocate(size_t Size, size_t Align)
+{
+    size_t Pad = (Align - (size_t)Cur % Align) % Align;
+    if (Pad + Size > Left)
+    {
+        // A request larger than a block gets a block of its own, and the
+        // current one stays in use.
+        if (Size + Align > BlockSize)
+        {
+            Blocks.emplace(Blocks.begin(), new char[Size + Align]);
+            char* Big = Blocks.front().get();
+            return Big + (Align - (size_t)Big % Align) % Align;
+        }
+
+        Blocks.emplace_back(new char[BlockSize]);
+        Cur = Blocks.back().get();
+        Left = BlockSize;
+        Pad = (Align - (size_t)Cur % Align) % Align;
+    }
+
+    void* Ptr = Cur + Pad;
+    Cur += Pad + Size;
+    Left -= Pad + Size;
+    return Ptr;
+}
+
+const std::string* AstArena::intern(const std::string& Name)
+{
+    return &*Names.insert(Name).first;
+}
@@ -0,0 +1,98 @@
+// SEL Project
+// arena.h
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class ExprAST;
+
+/// AstArena - Bump allocator for the AST of a module. Nodes are carved out of
+/// large blocks and stay until the arena goes away, so a node points at its
+/// children without owning them and a whole tree is freed at once. The
+/// functions a module defines share its arena, which keeps their bodies alive.
+/// Only the parser and the optimizer allocate, both on the main thread.
+class AstArena
+{
+    typedef struct Dtor
+    {
+        void (*Destroy)(void*);
+        void* Obj;
+    } dtor;
+
+    std::vector<std::unique_ptr<char[]>> Blocks;
+    char* Cur = nullptr;
+    size_t Left = 0;
+    std::vector<dtor> Dtors; // run in reverse when the arena goes away
+    std::unordered_set<std::string> Names;
+
+    template<class T>
+    static void destroy(void* Obj) { static_cast<T*>(Obj)->~T(); }
+
+public:
+    AstArena() = default;
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+    ~AstArena();
+
+    void* allocate(size_t Size, size_t Align);
+
+    /// make - Construct a T in the arena.
+    template<class T, class... Args>
+    T* make(Args&&... As)
+    {
+        T* Obj = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(As)...);
+        if (!std::is_trivially_destructible<T>::value) Dtors.push_back({ destroy<T>, Obj });
+        return Obj;
+    }
+
+    /// intern - The arena's copy of Name, the same one for equal names.
+    const std::string* intern(const std::string& Name);
+};
+
+/// ExprList - The children of a node, like the arguments of a call or the
+/// indices of an array element. Up to InlineSize of them are kept in the list
+/// itself, longer lists in the arena.
+class ExprList
+{
+    static const unsigned int InlineSize = 2;
+
+    ExprAST* Inline[InlineSize];
+    ExprAST** Data;
+    unsigned int Count;
+
+public:
+    ExprList() : Data(Inline), Count(0) {}
+    ExprList(AstArena& Arena, const std::vector<ExprAST*>& Items) : Count((unsigned int)Items.size())
+    {
+        Data = Count <= InlineSize ? Inline
+            : static_cast<ExprAST**>(Arena.allocate(Count * sizeof(ExprAST*), alignof(ExprAST*)));
+        for (unsigned int i = 0; i < Count; i++) Data[i] = Items[i];
+    }
+    ExprList(const ExprList& Other) : Count(Other.Count)
+    {
+        Data = Other.Data == Other.Inline ? Inline : Other.Data;
+        for (unsigned int i = 0; i < Count && Data == Inline; i++) Inline[i] = Other.Inline[i];
+    }
+    ExprList& operator=(const ExprList&) = delete;
+
+    ExprAST** begin() { return Data; }
+    ExprAST** end() { return Data + Count; }
+    ExprAST* const* begin() const { return Data; }
+    ExprAST* const* end() const { return Data + Count; }
+    size_t size() const { return Count; }
+    bool empty() const { return Count == 0; }
+    ExprAST*& operator[](size_t i) { return Data[i]; }
+    ExprAST* operator[](size_t i) const { return Data[i]; }
+    ExprAST* back() const { return Data[Count - 1]; }
+
+    /// truncate - Drop all but the first Size children.
+    void truncate(size_t Size) { if (Size < Count) Count = (unsigned int)Size; }
+};
@@ -5,18 +5,99 @@
 #pragma once
 
 #include "value.h"
+#include "arena.h"
 #include <string>
 #include <vector>
 #include <memory>
 #include <cassert>
+#include <atomic>
+#include <utility>
+
+class Compiler;
+class ScopeResolver;
+class Optimizer;
+class JitCompiler;
+class CacheWriter;
+struct Chunk;
+struct JitFunction;
+struct MemoFunction;
+struct VecLoop;
+class TokenStream;
 
 typedef enum class NodeType
 {
     node_default = 0,
     node_var = 1,
     node_deref = 2,
+    node_number = 3,
+    node_block = 4,
+    node_unary = 5,
+    node_binary = 6,
+    node_call = 7,
 } nodeType;
 
+typedef enum class BinOp
+{
+    op_assign,
+    op_eq, op_ne, op_and, op_or,
+    op_lt, op_gt, op_le, op_ge,
+    op_add, op_sub, op_mul, op_div, op_mod, op_pow,
+    op_user, // user-defined operator
+} binOp;
+
+/// JitType - What native code statically knows about a value. A dynamic value
+/// carries its tag at runtime, every other type is known while compiling.
+typedef enum class JitType
+{
+    jt_none,   // no value: unreachable, or not assigned yet
+    jt_int,
+    jt_double,
+    jt_undef,
+    jt_dyn,
+} jitType;
+
+/// OpFeedback - Operand types a builtin binary operator has seen. An operator
+/// that only ever saw ints or only doubles skips the generic type dispatch
+/// until its guard fails, after which it stays generic.
+typedef enum class OpFeedback : unsigned char
+{
+    fb_none,    // not executed yet
+    fb_int,     // both operands int
+    fb_double,  // both operands double
+    fb_generic, // mixed or changing operand types
+} opFeedback;
+
+/// ForkHint - Whether a builtin operator on two calls of pure functions runs
+/// them in parallel when reached from top-level code. It is set by timing the
+/// last such evaluation, so calls too small to pay for waking the workers
+/// run one after the other.
+typedef enum class ForkHint : unsigned char
+{
+    fh_fork,   // fork, until a forked evaluation finishes quickly
+    fh_serial, // run in order, until one takes long
+} forkHint;
+
+/// ElemType - How the elements of an array are stored. An 'as int' array packs
+/// two int32 elements into a memory cell, an 'as double' array keeps one raw
+/// double per cell; values stored into either are converted to the type.
+typedef enum class ElemType : unsigned char
+{
+    elem_value,  // any Value
+    elem_int,
+    elem_double,
+} elemType;
+
+class FunctionAST;
+
+/// CallCache - The resolved target of a call site, valid while Generation
+/// matches FunctionGeneration.
+typedef struct CallCache
+{
+    unsigned int Generation = 0;
+    int StdFunc = -1;
+    FunctionAST* Func = nullptr;
+} callCache;
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST
 {
@@ -26,6 +107,11 @@ public:
     void setNodeType(nodeType Type) { NodeType = Type; }
     virtual ~ExprAST() = default;
     virtual Value execute() = 0;
+    virtual void compile(Compiler& C) = 0;
+    virtual void resolve(ScopeResolver& R) = 0;
+    virtual jitType jit(JitCompiler& J) = 0;
+    virtual ExprAST* optimize(Optimizer& O) = 0; // a replacement for the node, or null
+    virtual void serialize(CacheWriter& W) = 0;
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -34,186 +120,370 @@ class NumberExprAST : public ExprAST
     Value Val;
 
 public:
-    NumberExprAST(Value Val) : Val(Val) {}
+    NumberExprAST(Value Val) : Val(Val) {
+        setNodeType(nodeType::node_number);
+    }
+    const Value& getValue() const { return Val; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable or an array element, like "i" or "ar[2][3]".
 class VariableExprAST : public ExprAST
 {
-    std::string Name;
-    std::vector<std::shared_ptr<ExprAST>> Indices;
+    const std::string* Name; // interned in the arena
+    ExprList Indices;
+    int Sym = -1;  // interned name
+    int Slot = -1; // argument slot in the current frame, if resolved to one
 
 public:
-    VariableExprAST(std::string Name, std::vector<std::shared_ptr<ExprAST>> Indices)
-        : Name(Name), Indices(std::move(Indices)) {
+    VariableExprAST(const std::string* Name, const ExprList& Indices)
+        : Name(Name), Indices(Indices) {
         setNodeType(nodeType::node_var);
     }
-    VariableExprAST(std::string Name) : Name(Name) {
+    VariableExprAST(const std::string* Name) : Name(Name) {
         setNodeType(nodeType::node_var);
     }
-    const std::string getName() const { return Name; }
-    const std::vector<std::shared_ptr<ExprAST>>& getIndices() const { return Indices; }
+    const std::string& getName() const { return *Name; }
+    const ExprList& getIndices() const { return Indices; }
+    int getSymbol() const { return Sym; }
+    int getSlot() const { return Slot; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// DeRefExprAST - Expression class for dereferencing a memory address, like "@a" or "@(ptr + 10)".
 class DeRefExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> AddrExpr;
+    ExprAST* AddrExpr;
 
 public:
-    DeRefExprAST(std::shared_ptr<ExprAST> Addr) : AddrExpr(std::move(Addr)) {
+    DeRefExprAST(ExprAST* Addr) : AddrExpr(Addr) {
         setNodeType(nodeType::node_deref);
     }
-    std::shared_ptr<ExprAST> getExpr() const { return AddrExpr; }
+    ExprAST* getExpr() const { return AddrExpr; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// ArrDeclExprAST - Expression class for declaring an array, like "arr ar[2][2][2]".
 class ArrDeclExprAST : public ExprAST
 {
-    std::string Name;
+    const std::string* Name;
     std::vector<int> Indices;
+    elemType Type;
+    int Sym = -1;
 
 public:
-    ArrDeclExprAST(std::string Name, std::vector<int> Indices) : Name(Name), Indices(std::move(Indices)) {}
+    ArrDeclExprAST(const std::string* Name, std::vector<int> Indices, elemType Type = elemType::elem_value)
+        : Name(Name), Indices(std::move(Indices)), Type(Type) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
 class UnaryExprAST : public ExprAST
 {
     char Opcode;
-    std::shared_ptr<ExprAST> Operand;
+    ExprAST* Operand;
+    std::shared_ptr<FunctionAST>* UserOp; // function table slot of a user-defined operator
 
 public:
-    UnaryExprAST(char Opcode, std::shared_ptr<ExprAST> Operand)
-        : Opcode(Opcode), Operand(std::move(Operand)) {}
+    UnaryExprAST(char Opcode, ExprAST* Operand, std::shared_ptr<FunctionAST>* UserOp = nullptr)
+        : Opcode(Opcode), Operand(Operand), UserOp(UserOp) {
+        setNodeType(nodeType::node_unary);
+    }
+    char getOpcode() const { return Opcode; }
+    bool isUserOp() const { return UserOp != nullptr; }
+    ExprAST* getOperand() const { return Operand; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST
 {
-    std::string Op;
-    std::shared_ptr<ExprAST> LHS, RHS;
+    const std::string* Op;
+    binOp Opcode;
+    std::shared_ptr<FunctionAST>* UserOp; // function table slot of a user-defined operator
+    ExprAST *LHS, *RHS;
+    opFeedback Feedback = opFeedback::fb_none;
+    bool Forkable = false; // both operands are calls
+    forkHint Hint = forkHint::fh_fork;
+
+    bool forkCalls(Value& L, Value& R);
+
+public:
+    BinaryExprAST(const std::string* Op, binOp Opcode, std::shared_ptr<FunctionAST>* UserOp,
+        ExprAST* LHS, ExprAST* RHS)
+        : Op(Op), Opcode(Opcode), UserOp(UserOp), LHS(LHS), RHS(RHS) {
+        setNodeType(nodeType::node_binary);
+    }
+    binOp getOpcode() const { return Opcode; }
+    ExprAST* getLHS() const { return LHS; }
+    ExprAST* getRHS() const { return RHS; }
+    Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
+};
+
+/// LogicalExprAST - Expression class for '&&' and '||' that only evaluates the
+/// right operand when the left one does not decide the result. The optimizer
+/// lowers builtin logical operators into it.
+class LogicalExprAST : public ExprAST
+{
+    binOp Opcode; // op_and or op_or
+    ExprAST *LHS, *RHS;
 
 public:
-    BinaryExprAST(std::string Op, std::shared_ptr<ExprAST> LHS,
-        std::shared_ptr<ExprAST> RHS)
-        : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    LogicalExprAST(binOp Opcode, ExprAST* LHS, ExprAST* RHS)
+        : Opcode(Opcode), LHS(LHS), RHS(RHS) {}
+    binOp getOpcode() const { return Opcode; }
+    ExprAST* getLHS() const { return LHS; }
+    ExprAST* getRHS() const { return RHS; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST
 {
-    std::string Callee;
-    std::vector<std::shared_ptr<ExprAST>> Args;
+    const std::string* Callee;
+    ExprList Args;
+    callCache Cache;
+    bool Tail = false; // its value is the value of the enclosing function
 
 public:
-    CallExprAST(std::string Callee,
-        std::vector<std::shared_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
+    CallExprAST(const std::string* Callee, const ExprList& Args)
+        : Callee(Callee), Args(Args) {
+        setNodeType(nodeType::node_call);
+    }
+    const std::string& getCallee() const { return *Callee; }
+    size_t argsSize() const { return Args.size(); }
+    bool evaluateArgs(Value* ArgsV);
+    FunctionAST* pureCallee();
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// IfExprAST - Expression class for if/then/else.
 class IfExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> Cond, Then, Else;
+    ExprAST *Cond, *Then, *Else;
+    bool ThenScoped = true, ElseScoped = true; // whether each arm needs a scope of its own
 
 public:
-    IfExprAST(std::shared_ptr<ExprAST> Cond, std::shared_ptr<ExprAST> Then)
-        : Cond(std::move(Cond)), Then(std::move(Then)) {
-        Else = nullptr;
-    }
-    IfExprAST(std::shared_ptr<ExprAST> Cond, std::shared_ptr<ExprAST> Then,
-        std::shared_ptr<ExprAST> Else)
-        : IfExprAST(std::move(Cond), std::move(Then)) {
-        this->Else = std::move(Else);
-    }
+    IfExprAST(ExprAST* Cond, ExprAST* Then, ExprAST* Else = nullptr)
+        : Cond(Cond), Then(Then), Else(Else) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// ForExprAST - Expression class for for.
 class ForExprAST : public ExprAST
 {
-    std::string VarName;
-    std::shared_ptr<ExprAST> Start, End, Step, Body;
+    const std::string* VarName;
+    ExprAST *Start, *End, *Step, *Body;
+    int Sym = -1, Slot = -1;
+    bool Scoped = true;
+
+    // An end condition comparing the counter with a loop-invariant bound,
+    // which is then evaluated once.
+    ExprAST* Bound = nullptr;
+    binOp BoundOp = binOp::op_lt;
+    bool CounterLeft = true;
+
+    std::shared_ptr<VecLoop> Vec; // the body as bulk kernels, if it fits
 
 public:
-    ForExprAST(const std::string& VarName, std::shared_ptr<ExprAST> Start,
-        std::shared_ptr<ExprAST> End, std::shared_ptr<ExprAST> Step,
-        std::shared_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+    ForExprAST(const std::string* VarName, ExprAST* Start,
+        ExprAST* End, ExprAST* Step, ExprAST* Body)
+        : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
+    const std::string& getVarName() const { return *VarName; }
+    int getSymbol() const { return Sym; }
+    int getSlot() const { return Slot; }
+    ExprAST* getStep() const { return Step; }
+    ExprAST* getBound() const { return Bound; }
+    binOp getBoundOp() const { return BoundOp; }
+    bool isCounterLeft() const { return CounterLeft; }
+    ExprAST* getBody() const { return Body; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
+};
+
+/// Reduction - A variable of a pfor that every chunk of iterations sums or
+/// multiplies into a private copy.
+typedef struct Reduction
+{
+    std::string Name;
+    binOp Opcode; // op_add or op_mul
+    int Sym = -1;
+} reduction;
+
+/// PForExprAST - Expression class for pfor, a loop over a range of ints whose
+/// iterations run on the worker pool in any order. Each iteration has a
+/// scope of its own; variables bound outside are shared, except the
+/// reductions, whose copies are combined in iteration order when it ends.
+class PForExprAST : public ExprAST
+{
+    const std::string* VarName;
+    ExprAST *Start, *End, *Body;
+    std::vector<reduction> Reductions;
+    int Sym = -1;
+
+    bool runChunk(int First, int Last, Value* Partials);
+
+public:
+    PForExprAST(const std::string* VarName, ExprAST* Start,
+        ExprAST* End, std::vector<reduction> Reductions, ExprAST* Body)
+        : VarName(VarName), Start(Start), End(End),
+        Body(Body), Reductions(std::move(Reductions)) {}
+    Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// WhileExprAST - Expression class for while.
 class WhileExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> Cond, Body;
+    ExprAST *Cond, *Body;
+    bool Scoped = true;
 
 public:
-    WhileExprAST(std::shared_ptr<ExprAST> Cond, std::shared_ptr<ExprAST> Body)
-        : Cond(std::move(Cond)), Body(std::move(Body)) {}
+    WhileExprAST(ExprAST* Cond, ExprAST* Body)
+        : Cond(Cond), Body(Body) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// RepeatExprAST - Expression class for rep.
 class RepeatExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> IterNum;
-    std::shared_ptr<ExprAST> Body;
+    ExprAST* IterNum;
+    ExprAST* Body;
+    bool Scoped = true;
 
 public:
-    RepeatExprAST(std::shared_ptr<ExprAST> IterNum, std::shared_ptr<ExprAST> Body)
-        : IterNum(std::move(IterNum)), Body(std::move(Body)) {}
+    RepeatExprAST(ExprAST* IterNum, ExprAST* Body)
+        : IterNum(IterNum), Body(Body) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// LoopExprAST - Expression class for loop.
 class LoopExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> Body;
+    ExprAST* Body;
+    bool Scoped = true;
 
 public:
-    LoopExprAST(std::shared_ptr<ExprAST> Body) : Body(std::move(Body)) {}
+    LoopExprAST(ExprAST* Body) : Body(Body) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// BlockExprAST - Sequence of expressions.
 class BlockExprAST : public ExprAST
 {
-    std::vector<std::shared_ptr<ExprAST>> Expressions;
+    ExprList Expressions;
+    bool Scoped = true; // false when it binds nothing, or its enclosing scope ends with it
 
 public:
-    BlockExprAST(std::vector<std::shared_ptr<ExprAST>> Expressions)
-        : Expressions(std::move(Expressions)) {}
+    BlockExprAST(const ExprList& Expressions)
+        : Expressions(Expressions) {
+        setNodeType(nodeType::node_block);
+    }
+    const ExprList& getExpressions() const { return Expressions; }
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// BreakExprAST - Expression class for break.
 class BreakExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> Expr;
+    ExprAST* Expr;
 
 public:
-    BreakExprAST(std::shared_ptr<ExprAST> Expr) : Expr(std::move(Expr)) {}
+    BreakExprAST(ExprAST* Expr) : Expr(Expr) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// ReturnExprAST - Expression class for return.
 class ReturnExprAST : public ExprAST
 {
-    std::shared_ptr<ExprAST> Expr;
+    ExprAST* Expr;
 
 public:
-    ReturnExprAST(std::shared_ptr<ExprAST> Expr) : Expr(std::move(Expr)) {}
+    ReturnExprAST(ExprAST* Expr) : Expr(Expr) {}
     Value execute() override;
+    void compile(Compiler& C) override;
+    void resolve(ScopeResolver& R) override;
+    jitType jit(JitCompiler& J) override;
+    ExprAST* optimize(Optimizer& O) override;
+    void serialize(CacheWriter& W) override;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -229,11 +499,12 @@ class PrototypeAST
 public:
     PrototypeAST(std::string Name, std::vector<std::string> Args,
         bool IsOperator = false, unsigned int Prec = 0)
-        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
+        : Name(Name), Args(Args), IsOperator(IsOperator),
         Precedence(Prec) {}
 
     const std::string getName() const { return Name; }
     const std::vector<std::string>& getArgs() const { return Args; }
+    bool isOperator() const { return IsOperator; }
 
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
     bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
@@ -241,25 +512,41 @@ public:
     std::string getOperatorName() const {
         assert(isUnaryOp() || isBinaryOp());
 
-        if (isBinaryOp()) return Name.substr(0, Name.find("binary"));
-        else return Name.substr(0, Name.find("unary"));
+        // The name is "binary" or "unary" followed by the operator.
+        if (isBinaryOp()) return Name.substr(sizeof("binary") - 1);
+        else return Name.substr(sizeof("unary") - 1);
     }
 
     unsigned int getBinaryPrecedence() const { return Precedence; }
     int getArgsSize() const { return Args.size(); }
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself. Its body
+/// lives in the arena of the module that defined it, which it keeps alive.
 class FunctionAST
 {
+    std::shared_ptr<AstArena> Arena;
     std::shared_ptr<PrototypeAST> Proto;
-    std::shared_ptr<ExprAST> Body;
+    ExprAST* Body;
+    std::shared_ptr<Chunk> Bytecode; // compiled lazily on the first VM call
+    std::shared_ptr<JitFunction> Native; // native code, compiled once the function gets hot
+    std::shared_ptr<MemoFunction> Memo;  // purity and cached results
+    std::vector<int> ArgSyms;
 
 public:
-    FunctionAST(std::shared_ptr<PrototypeAST> Proto,
-        std::shared_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
-    Value execute(std::vector<Value> Ops);
+    FunctionAST(std::shared_ptr<AstArena> Arena, std::shared_ptr<PrototypeAST> Proto,
+        ExprAST* Body)
+        : Arena(std::move(Arena)), Proto(std::move(Proto)), Body(Body) {}
+    Value execute(const Value* Ops);
+    const Chunk* getBytecode();
+    const PrototypeAST& getProto() const { return *Proto; }
+    ExprAST* getBody() const { return Body; }
+    ExprAST*& getBodySlot() { return Body; }
+    AstArena& getArena() { return *Arena; }
+    std::shared_ptr<JitFunction>& getNative() { return Native; }
+    std::shared_ptr<MemoFunction>& getMemo() { return Memo; }
+    const std::vector<int>& getArgSyms() const { return ArgSyms; }
+    void setArgSyms(std::vector<int> Syms) { ArgSyms = std::move(Syms); }
     const std::string getFuncName() const { return Proto->getName(); }
     const std::vector<std::string>& getFuncArgs() const { return Proto->getArgs(); }
     int argsSize() const { return Proto->getArgsSize(); }
@@ -277,52 +564,63 @@ public:
 
 void InitBinopPrec();
 
-int GetNextToken(std::string& Code, int& Idx);
+/// GetBinopPrecedences - The binary operators that have a precedence, by name.
+std::vector<std::pair<std::string, int>> GetBinopPrecedences();
+
+void SetBinopPrecedence(const std::string& Op, int Prec);
+
+int GetNextToken(TokenStream& Toks);
 
 int GetTokPrecedence(std::string Op);
 
-std::shared_ptr<ExprAST> LogError(const char* Str);
+binOp GetBinOpcode(const std::string& Op);
+
+extern std::atomic<unsigned int> ErrorCount; // errors reported so far, by any thread
+
+ExprAST* LogError(const char* Str);
 
 std::shared_ptr<PrototypeAST> LogErrorP(const char* Str);
 
-std::shared_ptr<ExprAST> ParseNumberExpr(std::string& Code, int& Idx);
+ExprAST* ParseNumberExpr(TokenStream& Toks);
+
+ExprAST* ParseParenExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseParenExpr(std::string& Code, int& Idx);
+ExprAST* ParseIdentifierExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseIdentifierExpr(std::string& Code, int& Idx);
+ExprAST* ParseDeRefExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseDeRefExpr(std::string& Code, int& Idx);
+ExprAST* ParseArrDeclExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseArrDeclExpr(std::string& Code, int& Idx);
+ExprAST* ParseIfExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseIfExpr(std::string& Code, int& Idx);
+ExprAST* ParseForExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseForExpr(std::string& Code, int& Idx);
+ExprAST* ParsePForExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseWhileExpr(std::string& Code, int& Idx);
+ExprAST* ParseWhileExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseRepeatExpr(std::string& Code, int& Idx);
+ExprAST* ParseRepeatExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseLoopExpr(std::string& Code, int& Idx);
+ExprAST* ParseLoopExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseBreakExpr(std::string& Code, int& Idx);
+ExprAST* ParseBreakExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseReturnExpr(std::string& Code, int& Idx);
+ExprAST* ParseReturnExpr(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParsePrimary(std::string& Code, int& Idx);
+ExprAST* ParsePrimary(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseUnary(std::string& Code, int& Idx);
+ExprAST* ParseUnary(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec, std::shared_ptr<ExprAST> LHS);
+ExprAST* ParseBinOpRHS(TokenStream& Toks, int ExprPrec, ExprAST* LHS);
 
-std::shared_ptr<ExprAST> ParseExpression(std::string& Code, int& Idx);
+ExprAST* ParseExpression(TokenStream& Toks);
 
-std::shared_ptr<ExprAST> ParseBlockExpression(std::string& Code, int& Idx);
+ExprAST* ParseBlockExpression(TokenStream& Toks);
 
-std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx);
+std::shared_ptr<PrototypeAST> ParsePrototype(TokenStream& Toks);
 
-std::shared_ptr<FunctionAST> ParseDefinition(std::string& Code, int& Idx);
+std::shared_ptr<FunctionAST> ParseDefinition(TokenStream& Toks);
 
-std::shared_ptr<FunctionAST> ParseTopLevelExpr(std::string& Code, int& Idx);
+std::shared_ptr<FunctionAST> ParseTopLevelExpr(TokenStream& Toks);
 
-std::shared_ptr<ImportAST> ParseImport(std::string& Code, int& Idx);
\ No newline at end of file
+std::shared_ptr<ImportAST> ParseImport(TokenStream& Toks);
\ No newline at end of file
@@ -0,0 +1,538 @@
+// SEL Project
+// cache.cpp
+
+#include "cache.h"
+#include "execute.h"
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+bool UseCache = true;
+std::string CacheDir;
+
+// Bump when the layout of a cache or of any node changes.
+static const uint32_t CacheFormat = 1;
+static const char CacheMagic[4] = { 'S', 'E', 'L', 'C' };
+
+typedef enum class NodeTag : unsigned char
+{
+    tag_null,
+    tag_number, tag_var, tag_deref, tag_arrdecl,
+    tag_unary, tag_binary, tag_logical, tag_call,
+    tag_if, tag_for, tag_pfor, tag_while, tag_repeat, tag_loop,
+    tag_block, tag_break, tag_return,
+} nodeTag;
+
+uint64_t HashBytes(const char* Data, size_t Size)
+{
+    // FNV-1a over 8-byte words, folding the high bits back down after each
+    // multiply so every byte reaches every bit.
+    const uint64_t Prime = 0x100000001b3ULL;
+    uint64_t H = 0xcbf29ce484222325ULL ^ Size;
+    size_t i = 0;
+    for (; i + 8 <= Size; i += 8)
+    {
+        uint64_t Word;
+        memcpy(&Word, Data + i, sizeof(Word));
+        H = (H ^ Word) * Prime;
+        H ^= H >> 29;
+    }
+    for (; i < Size; i++) H = (H ^ (unsigned char)Data[i]) * Prime;
+    return H ^ (H >> 32);
+}
+
+/// CachePath - Where the cache of the source at SourcePath goes: beside it as
+/// x.selc for x.sel, or in the cache directory under its path with the
+/// separators replaced.
+static std::string CachePath(const std::string& SourcePath)
+{
+    std::string Name = SourcePath;
+    if (Name.size() >= 4 && Name.compare(Name.size() - 4, 4, ".sel") == 0) Name += 'c';
+    else Name += ".selc";
+    if (CacheDir.empty()) return Name;
+
+    for (char& c : Name)
+        if (c == '/' || c == '\\' || c == ':') c = '_';
+    char Last = CacheDir.back();
+    return CacheDir + (Last == '/' || Last == '\\' ? "" : "/") + Name;
+}
+
+// The nodes as the parser made them, in prefix order.
+
+void CacheWriter::str(const std::string& Str)
+{
+    auto It = StringIds.find(Str);
+    if (It == StringIds.end())
+    {
+        It = StringIds.emplace(Str, (uint32_t)Strings.size()).first;
+        Strings.push_back(Str);
+    }
+    u32(It->second);
+}
+
+void CacheWriter::expr(ExprAST* E)
+{
+    if (E) E->serialize(*this);
+    else u8((unsigned int)nodeTag::tag_null);
+}
+
+void CacheWriter::list(const ExprList& List)
+{
+    u32((uint32_t)List.size());
+    for (ExprAST* E : List) expr(E);
+}
+
+void CacheWriter::table(const precTable& Table)
+{
+    u32((uint32_t)Table.size());
+    for (auto& Entry : Table)
+    {
+        str(Entry.first);
+        u32((uint32_t)Entry.second);
+    }
+}
+
+void NumberExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_number);
+    W.u64(Val.getBits());
+}
+
+void VariableExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_var);
+    W.str(*Name);
+    W.list(Indices);
+}
+
+void DeRefExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_deref);
+    W.expr(AddrExpr);
+}
+
+void ArrDeclExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_arrdecl);
+    W.str(*Name);
+    W.u8((unsigned int)Type);
+    W.u32((uint32_t)Indices.size());
+    for (int Len : Indices) W.u32((uint32_t)Len);
+}
+
+void UnaryExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_unary);
+    W.u8((unsigned char)Opcode);
+    W.u8(UserOp != nullptr);
+    W.expr(Operand);
+}
+
+void BinaryExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_binary);
+    W.str(*Op);
+    W.expr(LHS);
+    W.expr(RHS);
+}
+
+void LogicalExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_logical);
+    W.u8((unsigned int)Opcode);
+    W.expr(LHS);
+    W.expr(RHS);
+}
+
+void CallExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_call);
+    W.str(*Callee);
+    W.list(Args);
+}
+
+void IfExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_if);
+    W.expr(Cond);
+    W.expr(Then);
+    W.expr(Else);
+}
+
+void ForExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_for);
+    W.str(*VarName);
+    W.expr(Start);
+    W.expr(End);
+    W.expr(Step);
+    W.expr(Body);
+}
+
+void PForExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_pfor);
+    W.str(*VarName);
+    W.expr(Start);
+    W.expr(End);
+    W.u32((uint32_t)Reductions.size());
+    for (auto& R : Reductions)
+    {
+        W.str(R.Name);
+        W.u8((unsigned int)R.Opcode);
+    }
+    W.expr(Body);
+}
+
+void WhileExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_while);
+    W.expr(Cond);
+    W.expr(Body);
+}
+
+void RepeatExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_repeat);
+    W.expr(IterNum);
+    W.expr(Body);
+}
+
+void LoopExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_loop);
+    W.expr(Body);
+}
+
+void BlockExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_block);
+    W.list(Expressions);
+}
+
+void BreakExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_break);
+    W.expr(Expr);
+}
+
+void ReturnExprAST::serialize(CacheWriter& W)
+{
+    W.u8((unsigned int)nodeTag::tag_return);
+    W.expr(Expr);
+}
+
+void CacheWriter::definition(FunctionAST& F)
+{
+    const PrototypeAST& Proto = F.getProto();
+    u8((unsigned int)cacheItem::item_def);
+    str(Proto.getName());
+    u32((uint32_t)Proto.getArgs().size());
+    for (auto& Arg : Proto.getArgs()) str(Arg);
+    u8(Proto.isOperator());
+    u32(Proto.getBinaryPrecedence());
+    expr(F.getBody());
+}
+
+void CacheWriter::topLevel(FunctionAST& F)
+{
+    u8((unsigned int)cacheItem::item_expr);
+    expr(F.getBody());
+}
+
+void CacheWriter::import(const std::string& Module, size_t Resume, const precTable& After)
+{
+    u8((unsigned int)cacheItem::item_import);
+    str(Module);
+    u64(Resume);
+    table(After);
+}
+
+void CacheWriter::adopt(const ModuleCache& C)
+{
+    Strings = C.Strings;
+    StringIds.clear();
+    for (uint32_t i = 0; i < Strings.size(); i++) StringIds.emplace(Strings[i], i);
+    Items.assign(C.TableBegin, C.ItemBegin - C.TableBegin);
+}
+
+void CacheWriter::save(const std::string& SourcePath, const SourceFile& Src, uint64_t SourceHash)
+{
+    if (!UseCache || Failed) return;
+
+    // The string table comes first, as reading anything else needs it.
+    std::string Payload;
+    uint32_t Count = (uint32_t)Strings.size();
+    Payload.append((const char*)&Count, sizeof(Count));
+    for (auto& Str : Strings)
+    {
+        uint32_t Len = (uint32_t)Str.size();
+        Payload.append((const char*)&Len, sizeof(Len));
+        Payload += Str;
+    }
+    Payload += Items;
+    Payload += (char)cacheItem::item_end;
+
+    std::string Out(CacheMagic, sizeof(CacheMagic));
+    uint32_t VersionLen = (uint32_t)strlen(SEL_VERSION);
+    uint64_t SourceSize = Src.size();
+    uint64_t PayloadHash = HashBytes(Payload.data(), Payload.size());
+    Out.append((const char*)&CacheFormat, sizeof(CacheFormat));
+    Out.append((const char*)&VersionLen, sizeof(VersionLen));
+    Out += SEL_VERSION;
+    Out.append((const char*)&SourceHash, sizeof(SourceHash));
+    Out.append((const char*)&SourceSize, sizeof(SourceSize));
+    Out.append((const char*)&PayloadHash, sizeof(PayloadHash));
+    Out += Payload;
+
+    // Write a file of our own and move it into place, so a run reading the
+    // cache meanwhile sees the old one or the new one.
+    std::string Path = CachePath(SourcePath);
+    std::string Tmp = Path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())
+        ^ (size_t)std::chrono::steady_clock::now().time_since_epoch().count());
+    FILE* fp = fopen(Tmp.c_str(), "wb");
+    if (fp == NULL) return;
+    bool Written = fwrite(Out.data(), 1, Out.size(), fp) == Out.size();
+    if (fclose(fp) != 0) Written = false;
+
+    if (Written && rename(Tmp.c_str(), Path.c_str()) != 0)
+    {
+        // Windows does not replace an existing file.
+        remove(Path.c_str());
+        Written = rename(Tmp.c_str(), Path.c_str()) == 0;
+    }
+    if (!Written) remove(Tmp.c_str());
+}
+
+unsigned int ModuleCache::u8()
+{
+    if (End - Cur < 1) { Bad = true; return 0; }
+    return (unsigned char)*Cur++;
+}
+
+uint32_t ModuleCache::u32()
+{
+    uint32_t V = 0;
+    if (End - Cur < (ptrdiff_t)sizeof(V)) { Bad = true; return 0; }
+    memcpy(&V, Cur, sizeof(V));
+    Cur += sizeof(V);
+    return V;
+}
+
+uint64_t ModuleCache::u64()
+{
+    uint64_t V = 0;
+    if (End - Cur < (ptrdiff_t)sizeof(V)) { Bad = true; return 0; }
+    memcpy(&V, Cur, sizeof(V));
+    Cur += sizeof(V);
+    return V;
+}
+
+const std::string& ModuleCache::str()
+{
+    static const std::string Empty;
+    uint32_t Id = u32();
+    if (Id >= Strings.size()) { Bad = true; return Empty; }
+    return Strings[Id];
+}
+
+const std::string* ModuleCache::name()
+{
+    uint32_t Id = u32();
+    if (Id >= Names.size()) { Bad = true; return Arena->intern(""); }
+    return Names[Id];
+}
+
+precTable ModuleCache::table()
+{
+    precTable Table;
+    uint32_t Count = u32();
+    for (uint32_t i = 0; i < Count && !Bad; i++)
+    {
+        const std::string& Op = str();
+        Table.push_back({ Op, (int)u32() });
+    }
+    return Table;
+}
+
+ExprList ModuleCache::list()
+{
+    std::vector<ExprAST*> Items;
+    uint32_t Count = u32();
+    for (uint32_t i = 0; i < Count && !Bad; i++) Items.push_back(expr());
+    return ExprList(*Arena, Items);
+}
+
+ExprAST* ModuleCache::expr()
+{
+    AstArena& A = *Arena;
+    switch ((nodeTag)u8())
+    {
+    case nodeTag::tag_null:
+        return nullptr;
+    case nodeTag::tag_number:
+        return A.make<NumberExprAST>(Value::fromBits(u64()));
+    case nodeTag::tag_var:
+    {
+        const std::string* Name = name();
+        return A.make<VariableExprAST>(Name, list());
+    }
+    case nodeTag::tag_deref:
+        return A.make<DeRefExprAST>(expr());
+    case nodeTag::tag_arrdecl:
+    {
+        const std::string* Name = name();
+        elemType Type = (elemType)u8();
+        std::vector<int> Dims(u32());
+        for (int& Len : Dims) Len = (int)u32();
+        return A.make<ArrDeclExprAST>(Name, std::move(Dims), Type);
+    }
+    case nodeTag::tag_unary:
+    {
+        char Opcode = (char)u8();
+        std::shared_ptr<FunctionAST>* UserOp = u8() ? GetFunctionSlot(std::string("unary") + Opcode) : nullptr;
+        return A.make<UnaryExprAST>(Opcode, expr(), UserOp);
+    }
+    case nodeTag::tag_binary:
+    {
+        const std::string* Op = name();
+        binOp Opcode = GetBinOpcode(*Op);
+        std::shared_ptr<FunctionAST>* UserOp = Opcode == binOp::op_user ? GetFunctionSlot("binary" + *Op) : nullptr;
+        ExprAST* LHS = expr();
+        return A.make<BinaryExprAST>(Op, Opcode, UserOp, LHS, expr());
+    }
+    case nodeTag::tag_logical:
+    {
+        binOp Opcode = (binOp)u8();
+        ExprAST* LHS = expr();
+        return A.make<LogicalExprAST>(Opcode, LHS, expr());
+    }
+    case nodeTag::tag_call:
+    {
+        const std::string* Callee = name();
+        return A.make<CallExprAST>(Callee, list());
+    }
+    case nodeTag::tag_if:
+    {
+        ExprAST* Cond = expr();
+        ExprAST* Then = expr();
+        return A.make<IfExprAST>(Cond, Then, expr());
+    }
+    case nodeTag::tag_for:
+    {
+        const std::string* VarName = name();
+        ExprAST* Start = expr();
+        ExprAST* End = expr();
+        ExprAST* Step = expr();
+        return A.make<ForExprAST>(VarName, Start, End, Step, expr());
+    }
+    case nodeTag::tag_pfor:
+    {
+        const std::string* VarName = name();
+        ExprAST* Start = expr();
+        ExprAST* End = expr();
+        std::vector<reduction> Reductions(u32());
+        for (auto& R : Reductions)
+        {
+            R.Name = str();
+            R.Opcode = (binOp)u8();
+        }
+        return A.make<PForExprAST>(VarName, Start, End, std::move(Reductions), expr());
+    }
+    case nodeTag::tag_while:
+    {
+        ExprAST* Cond = expr();
+        return A.make<WhileExprAST>(Cond, expr());
+    }
+    case nodeTag::tag_repeat:
+    {
+        ExprAST* IterNum = expr();
+        return A.make<RepeatExprAST>(IterNum, expr());
+    }
+    case nodeTag::tag_loop:
+        return A.make<LoopExprAST>(expr());
+    case nodeTag::tag_block:
+        return A.make<BlockExprAST>(list());
+    case nodeTag::tag_break:
+        return A.make<BreakExprAST>(expr());
+    case nodeTag::tag_return:
+        return A.make<ReturnExprAST>(expr());
+    default:
+        Bad = true;
+        return nullptr;
+    }
+}
+
+bool ModuleCache::load(const std::string& SourcePath, const SourceFile& Src, uint64_t SourceHash, const precTable& Start)
+{
+    if (!UseCache || !File.open(CachePath(SourcePath).c_str())) return false;
+    Cur = File.data();
+    End = Cur + File.size();
+
+    if (End - Cur < (ptrdiff_t)sizeof(CacheMagic) || memcmp(Cur, CacheMagic, sizeof(CacheMagic))) return false;
+    Cur += sizeof(CacheMagic);
+    if (u32() != CacheFormat) return false;
+
+    uint32_t VersionLen = u32();
+    if (Bad || VersionLen != strlen(SEL_VERSION) || (size_t)(End - Cur) < VersionLen
+        || memcmp(Cur, SEL_VERSION, VersionLen)) return false;
+    Cur += VersionLen;
+
+    uint64_t Hash = u64(), Size = u64(), PayloadHash = u64();
+    if (Bad || Size != Src.size() || Hash != SourceHash) return false;
+    if (PayloadHash != HashBytes(Cur, End - Cur)) return false;
+
+    uint32_t Count = u32();
+    for (uint32_t i = 0; i < Count && !Bad; i++)
+    {
+        uint32_t Len = u32();
+        if ((size_t)(End - Cur) < Len) return false;
+        Strings.emplace_back(Cur, Len);
+        Cur += Len;
+    }
+    for (auto& Str : Strings) Names.push_back(Arena->intern(Str));
+
+    TableBegin = Cur;
+    if (table() != Start || Bad) return false;
+    ItemBegin = Cur;
+    return true;
+}
+
+bool ModuleCache::next(cachedItem& Item)
+{
+    ItemBegin = Cur;
+    Item.Kind = (cacheItem)u8();
+    switch (Item.Kind)
+    {
+    case cacheItem::item_def:
+    {
+        std::string Name = str();
+        std::vector<std::string> Args(u32());
+        for (auto& Arg : Args) Arg = str();
+        bool IsOperator = u8() != 0;
+        unsigned int Prec = u32();
+        auto Proto = std::make_shared<PrototypeAST>(Name, std::move(Args), IsOperator, Prec);
+
+        // Parsing the prototype installed the operator.
+        if (Proto->isBinaryOp()) SetBinopPrecedence(Proto->getOperatorName(), Prec);
+        Item.Func = std::make_shared<FunctionAST>(Arena, Proto, expr());
+        break;
+    }
+    case cacheItem::item_expr:
+    {
+        auto Proto = std::make_shared<PrototypeAST>("__anon_expr", std::vector<std::string>());
+        Item.Func = std::make_shared<FunctionAST>(Arena, Proto, expr());
+        break;
+    }
+    case cacheItem::item_import:
+        Item.Module = str();
+        Item.Resume = (size_t)u64();
+        Item.After = table();
+        break;
+    default:
+        return false;
+    }
+    return !Bad;
+}
@@ -0,0 +1,120 @@
+// SEL Project
+// cache.h
+
+#pragma once
+
+#include "ast.h"
+#include "source.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+
+/// A script or module that parsed without errors leaves a .selc file: the
+/// AST of each top-level item as the parser made it, before any optimization,
+/// so later runs skip lexing and parsing it. The file is keyed by a hash of
+/// the source, the interpreter version and the operator precedences in force
+/// when the source started, which decide how it parses.
+///
+/// Operators a module imports can change the precedences the rest of the
+/// source parses with, so an import also records the precedences it left.
+/// When an import leaves different ones, the rest of the source is parsed
+/// again from the end of that import, and the cache is written anew.
+
+extern bool UseCache;        // --no-cache turns it off
+extern std::string CacheDir; // --cache-dir, or empty to write beside each source
+
+typedef std::vector<std::pair<std::string, int>> precTable;
+
+typedef enum class CacheItem : unsigned char
+{
+    item_end,
+    item_def,    // a function definition
+    item_expr,   // a top-level expression
+    item_import,
+} cacheItem;
+
+/// CachedItem - A top-level item read back from a cache.
+typedef struct CachedItem
+{
+    cacheItem Kind = cacheItem::item_end;
+    std::shared_ptr<FunctionAST> Func; // item_def and item_expr
+    std::string Module;                // item_import
+    size_t Resume = 0;                 // item_import: where the source goes on after it
+    precTable After;                   // item_import: the precedences it left
+} cachedItem;
+
+class ModuleCache;
+
+/// CacheWriter - Collects the items of a source as they are parsed.
+class CacheWriter
+{
+    std::string Items;
+    std::vector<std::string> Strings;
+    std::unordered_map<std::string, uint32_t> StringIds;
+
+    void table(const precTable& Table);
+
+public:
+    bool Failed = false; // a parse error: the source is not cached
+
+    /// CacheWriter - Start the cache of a source that starts with the
+    /// precedences Start.
+    explicit CacheWriter(const precTable& Start) { table(Start); }
+
+    void u8(unsigned int V) { Items += (char)V; }
+    void u32(uint32_t V) { Items.append((const char*)&V, sizeof(V)); }
+    void u64(uint64_t V) { Items.append((const char*)&V, sizeof(V)); }
+    void str(const std::string& Str);
+    void expr(ExprAST* E);
+    void list(const ExprList& List);
+
+    void definition(FunctionAST& F);
+    void topLevel(FunctionAST& F);
+    void import(const std::string& Module, size_t Resume, const precTable& After);
+
+    /// adopt - Start over from the items of C that were read before its
+    /// current one.
+    void adopt(const ModuleCache& C);
+
+    /// save - Write the cache of the source at SourcePath, whose contents
+    /// hash to SourceHash. Failing to is not an error.
+    void save(const std::string& SourcePath, const SourceFile& Src, uint64_t SourceHash);
+};
+
+/// ModuleCache - The cache of a source, mapped into memory.
+class ModuleCache
+{
+    SourceFile File;
+    const char* Cur = nullptr;
+    const char* End = nullptr;
+    const char* TableBegin = nullptr; // the precedences the source starts with
+    const char* ItemBegin = nullptr;  // the item read last
+    std::vector<std::string> Strings;
+    std::vector<const std::string*> Names; // Strings, interned in the arena
+    std::shared_ptr<AstArena> Arena = std::make_shared<AstArena>();
+    bool Bad = false;
+
+    friend class CacheWriter;
+
+public:
+    /// load - Map the cache of the source at SourcePath and check that it is
+    /// fresh for the source and the precedences it starts with.
+    bool load(const std::string& SourcePath, const SourceFile& Src, uint64_t SourceHash, const precTable& Start);
+
+    /// next - Read the next item. Returns false after the last.
+    bool next(cachedItem& Item);
+
+    unsigned int u8();
+    uint32_t u32();
+    uint64_t u64();
+    const std::string& str();
+    const std::string* name();
+    ExprAST* expr();
+    ExprList list();
+    precTable table();
+};
+
+/// HashBytes - A 64-bit hash of Size bytes at Data.
+uint64_t HashBytes(const char* Data, size_t Size);
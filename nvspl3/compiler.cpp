@@ -0,0 +1,508 @@
+// SEL Project
+// compiler.cpp
+
+#include "vm.h"
+#include "ast.h"
+#include "vectorize.h"
+
+int Compiler::emit(opCode Op, int A, int B)
+{
+    switch (Op)
+    {
+    case opCode::op_const:
+    case opCode::op_undef:
+    case opCode::op_error:
+    case opCode::op_load:
+    case opCode::op_addr:
+    case opCode::op_load_arg:
+    case opCode::op_addr_arg:
+    case opCode::op_arr_decl:
+    case opCode::op_walk:
+        Depth++;
+        break;
+    case opCode::op_pop:
+        Depth -= A;
+        break;
+    case opCode::op_load_elem:
+    case opCode::op_addr_elem:
+    case opCode::op_call:
+    case opCode::op_call_op:
+        Depth -= B - 1;
+        break;
+    case opCode::op_store_elem:
+        Depth -= B;
+        break;
+    case opCode::op_store_deref:
+    case opCode::op_binary:
+    case opCode::op_branch:
+    case opCode::op_loop_body:
+    case opCode::op_ret:
+        Depth--;
+        break;
+    case opCode::op_enter_scope:
+        ScopeDepth++;
+        break;
+    case opCode::op_leave_scope:
+        ScopeDepth -= A;
+        break;
+    default:
+        break;
+    }
+    if (Depth > Code.MaxDepth) Code.MaxDepth = Depth;
+
+    Code.Code.push_back({ Op, A, B });
+    return Code.Code.size() - 1;
+}
+
+int Compiler::addConst(Value Val)
+{
+    Code.Consts.push_back(Val);
+    return Code.Consts.size() - 1;
+}
+
+int Compiler::addName(const std::string& Name)
+{
+    for (int i = 0; i < Code.Names.size(); i++)
+        if (Code.Names[i] == Name) return i;
+
+    Code.Names.push_back(Name);
+    return Code.Names.size() - 1;
+}
+
+int Compiler::addDims(const std::vector<int>& Dims, elemType Type)
+{
+    Code.Dims.push_back(Dims);
+    Code.ElemTypes.push_back(Type);
+    return Code.Dims.size() - 1;
+}
+
+int Compiler::addCallSite(const std::string& Callee)
+{
+    Code.CallNames.push_back(Callee);
+    Code.CallSites.emplace_back();
+    return Code.CallSites.size() - 1;
+}
+
+int Compiler::addVecSite(const std::shared_ptr<VecLoop>& Loop, int Slot)
+{
+    Code.VecSites.push_back({ Loop, Slot });
+    return Code.VecSites.size() - 1;
+}
+
+int Compiler::addWalked(ExprAST* E)
+{
+    Code.Walked.push_back(E);
+    return Code.Walked.size() - 1;
+}
+
+int Compiler::addOpSlot(std::shared_ptr<FunctionAST>* Slot)
+{
+    Code.OpSlots.push_back(Slot);
+    return Code.OpSlots.size() - 1;
+}
+
+/// beginLoop - Called once the hidden loop state is on the operand stack
+/// and the loop scope has been entered.
+void Compiler::beginLoop()
+{
+    Loops.push_back({ Depth, ScopeDepth, std::vector<int>() });
+}
+
+void Compiler::endLoop(int ExitTarget)
+{
+    for (int At : Loops.back().BreakJumps) patch(At, ExitTarget);
+    Loops.pop_back();
+}
+
+/// emitBreak - Unwind the operand stack and the scopes down to the innermost
+/// loop and jump to its exit. The static state is left as it was so that the
+/// (unreachable) fallthrough keeps compiling consistently.
+void Compiler::emitBreak()
+{
+    int SavedDepth = Depth, SavedScope = ScopeDepth;
+    loopInfo& Loop = Loops.back();
+
+    if (Depth > Loop.Depth) emit(opCode::op_pop, Depth - Loop.Depth);
+    if (ScopeDepth > Loop.ScopeDepth) emit(opCode::op_leave_scope, ScopeDepth - Loop.ScopeDepth);
+    Loop.BreakJumps.push_back(emit(opCode::op_jump));
+
+    Depth = SavedDepth, ScopeDepth = SavedScope;
+}
+
+void NumberExprAST::compile(Compiler& C)
+{
+    C.emit(opCode::op_const, C.addConst(Val));
+}
+
+void VariableExprAST::compile(Compiler& C)
+{
+    if (Indices.empty())
+    {
+        if (Slot >= 0) C.emit(opCode::op_load_arg, Slot);
+        else C.emit(opCode::op_load, Sym);
+        return;
+    }
+    for (auto& Idx : Indices) Idx->compile(C);
+    C.emit(opCode::op_load_elem, Sym, Indices.size());
+}
+
+void DeRefExprAST::compile(Compiler& C)
+{
+    AddrExpr->compile(C);
+    C.emit(opCode::op_deref);
+}
+
+void ArrDeclExprAST::compile(Compiler& C)
+{
+    C.emit(opCode::op_arr_decl, Sym, C.addDims(Indices, Type));
+}
+
+void UnaryExprAST::compile(Compiler& C)
+{
+    if (Opcode == '&') // reference operator
+    {
+        if (Operand->getNodeType() != nodeType::node_var)
+        {
+            C.emit(opCode::op_error, C.addName("Operand of '&' must be a variable"));
+            return;
+        }
+        VariableExprAST* Op = static_cast<VariableExprAST*>(Operand);
+
+        const ExprList& Indices = Op->getIndices();
+        if (Indices.empty())
+        {
+            if (Op->getSlot() >= 0) C.emit(opCode::op_addr_arg, Op->getSlot());
+            else C.emit(opCode::op_addr, Op->getSymbol());
+            return;
+        }
+        for (auto& Idx : Indices) Idx->compile(C);
+        C.emit(opCode::op_addr_elem, Op->getSymbol(), Indices.size());
+        return;
+    }
+
+    Operand->compile(C);
+    if (UserOp) C.emit(opCode::op_call_op, C.addOpSlot(UserOp), 1);
+    else C.emit(opCode::op_unary, Opcode);
+}
+
+void BinaryExprAST::compile(Compiler& C)
+{
+    if (Opcode == binOp::op_assign)
+    {
+        RHS->compile(C);
+
+        if (LHS->getNodeType() == nodeType::node_var)
+        {
+            VariableExprAST* LHSE = static_cast<VariableExprAST*>(LHS);
+            const ExprList& Indices = LHSE->getIndices();
+
+            if (Indices.empty())
+            {
+                if (LHSE->getSlot() >= 0) C.emit(opCode::op_store_arg, LHSE->getSlot());
+                else C.emit(opCode::op_store, LHSE->getSymbol());
+                return;
+            }
+            for (auto& Idx : Indices) Idx->compile(C);
+            C.emit(opCode::op_store_elem, LHSE->getSymbol(), Indices.size());
+        }
+        else if (LHS->getNodeType() == nodeType::node_deref)
+        {
+            static_cast<DeRefExprAST*>(LHS)->getExpr()->compile(C);
+            C.emit(opCode::op_store_deref);
+        }
+        else
+        {
+            C.emit(opCode::op_pop, 1);
+            C.emit(opCode::op_error, C.addName("Destination of '=' must be a variable"));
+        }
+        return;
+    }
+
+    LHS->compile(C);
+    RHS->compile(C);
+
+    if (Opcode == binOp::op_user) C.emit(opCode::op_call_op, C.addOpSlot(UserOp), 2);
+    else C.emit(opCode::op_binary, (int)Opcode);
+}
+
+void LogicalExprAST::compile(Compiler& C)
+{
+    // Both arms end with the truth of the deciding operand as 0 or 1.
+    LHS->compile(C);
+    int Branch = C.emit(opCode::op_branch);
+
+    if (Opcode == binOp::op_and)
+    {
+        RHS->compile(C);
+        C.emit(opCode::op_unary, '!');
+        C.emit(opCode::op_unary, '!');
+    }
+    else C.emit(opCode::op_const, C.addConst(Value(1)));
+    int TrueJump = C.emit(opCode::op_jump);
+
+    C.patch(Branch, C.here());
+    C.Depth--;
+    if (Opcode == binOp::op_and) C.emit(opCode::op_const, C.addConst(Value(0)));
+    else
+    {
+        RHS->compile(C);
+        C.emit(opCode::op_unary, '!');
+        C.emit(opCode::op_unary, '!');
+    }
+    int FalseJump = C.emit(opCode::op_jump);
+
+    C.patchB(Branch, C.here());
+    C.Depth--;
+    C.emit(opCode::op_error, -1);
+
+    C.patch(TrueJump, C.here());
+    C.patch(FalseJump, C.here());
+}
+
+void CallExprAST::compile(Compiler& C)
+{
+    std::vector<int> Checks;
+    for (int i = 0, e = Args.size(); i != e; ++i)
+    {
+        Args[i]->compile(C);
+        Checks.push_back(C.emit(opCode::op_arg_check, 0, i + 1));
+    }
+    C.emit(opCode::op_call, C.addCallSite(*Callee), Args.size());
+
+    for (int At : Checks) C.patch(At, C.here());
+}
+
+void IfExprAST::compile(Compiler& C)
+{
+    Cond->compile(C);
+    int Branch = C.emit(opCode::op_branch);
+
+    if (ThenScoped) C.emit(opCode::op_enter_scope);
+    Then->compile(C);
+    if (ThenScoped) C.emit(opCode::op_leave_scope, 1);
+    int ThenJump = C.emit(opCode::op_jump);
+
+    C.patch(Branch, C.here());
+    C.Depth--;
+    if (Else != nullptr)
+    {
+        if (ElseScoped) C.emit(opCode::op_enter_scope);
+        Else->compile(C);
+        if (ElseScoped) C.emit(opCode::op_leave_scope, 1);
+    }
+    else C.emit(opCode::op_undef);
+    int ElseJump = C.emit(opCode::op_jump);
+
+    C.patchB(Branch, C.here());
+    C.Depth--;
+    C.emit(opCode::op_error, -1);
+
+    C.patch(ThenJump, C.here());
+    C.patch(ElseJump, C.here());
+}
+
+void ForExprAST::compile(Compiler& C)
+{
+    Start->compile(C);
+    int StartCheck = C.emit(opCode::op_jump_if_err);
+
+    if (Scoped) C.emit(opCode::op_enter_scope);
+    int BindAt = -1;
+    if (Slot >= 0) C.emit(opCode::op_for_bind_arg, Slot);
+    else BindAt = C.emit(opCode::op_for_bind, Sym);
+    int Slot = C.Depth - 1; // counter address, the step lives right above it
+
+    if (Step) Step->compile(C);
+    else C.emit(opCode::op_const, C.addConst(Value(1)));
+    int StepCheck = C.emit(opCode::op_jump_if_err);
+    int VecAt = Vec ? C.emit(opCode::op_for_vec, 0, C.addVecSite(Vec, Slot)) : -1;
+
+    int CondAt = C.here();
+    End->compile(C);
+    int Branch = C.emit(opCode::op_branch);
+
+    C.beginLoop();
+    Body->compile(C);
+    int BodyCheck = C.emit(opCode::op_loop_body);
+    C.emit(opCode::op_for_step, Slot);
+    C.emit(opCode::op_jump, CondAt);
+
+    // normal exit and break
+    int ExitAt = C.here();
+    C.patch(Branch, ExitAt);
+    if (VecAt >= 0) C.patch(VecAt, ExitAt);
+    C.endLoop(ExitAt);
+    C.emit(opCode::op_pop, 2);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_undef);
+    int ExitJump = C.emit(opCode::op_jump);
+
+    // step, condition or body evaluated to an error
+    C.patch(StepCheck, C.here());
+    C.patchB(Branch, C.here());
+    C.patch(BodyCheck, C.here());
+    if (BindAt >= 0) C.patchB(BindAt, C.here());
+    C.Depth = Slot + 2;
+    if (Scoped) C.ScopeDepth++;
+    C.emit(opCode::op_pop, 2);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_error, -1);
+
+    C.patch(StartCheck, C.here());
+    C.patch(ExitJump, C.here());
+}
+
+// The workers of a pfor run the tree walker, so the loop runs there too.
+void PForExprAST::compile(Compiler& C)
+{
+    C.emit(opCode::op_walk, C.addWalked(this));
+}
+
+void WhileExprAST::compile(Compiler& C)
+{
+    if (Scoped) C.emit(opCode::op_enter_scope);
+
+    int CondAt = C.here();
+    Cond->compile(C);
+    int Branch = C.emit(opCode::op_branch);
+
+    C.beginLoop();
+    Body->compile(C);
+    int BodyCheck = C.emit(opCode::op_loop_body);
+    C.emit(opCode::op_jump, CondAt);
+
+    int ExitAt = C.here();
+    C.patch(Branch, ExitAt);
+    C.endLoop(ExitAt);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_undef);
+    int ExitJump = C.emit(opCode::op_jump);
+
+    C.patchB(Branch, C.here());
+    C.patch(BodyCheck, C.here());
+    C.Depth--;
+    if (Scoped)
+    {
+        C.ScopeDepth++;
+        C.emit(opCode::op_leave_scope, 1);
+    }
+    C.emit(opCode::op_error, -1);
+
+    C.patch(ExitJump, C.here());
+}
+
+void RepeatExprAST::compile(Compiler& C)
+{
+    IterNum->compile(C);
+    int IterCheck = C.emit(opCode::op_jump_if_err);
+    int InitCheck = C.emit(opCode::op_rep_init);
+    int Slot = C.Depth - 1;
+
+    if (Scoped) C.emit(opCode::op_enter_scope);
+    int TestAt = C.emit(opCode::op_rep_test, 0, Slot);
+
+    C.beginLoop();
+    Body->compile(C);
+    int BodyCheck = C.emit(opCode::op_loop_body);
+    C.emit(opCode::op_jump, TestAt);
+
+    int ExitAt = C.here();
+    C.patch(TestAt, ExitAt);
+    C.endLoop(ExitAt);
+    C.emit(opCode::op_pop, 1);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_undef);
+    int ExitJump = C.emit(opCode::op_jump);
+
+    C.patch(BodyCheck, C.here());
+    C.Depth = Slot + 1;
+    if (Scoped) C.ScopeDepth++;
+    C.emit(opCode::op_pop, 1);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_error, -1);
+
+    C.patch(IterCheck, C.here());
+    C.patch(InitCheck, C.here());
+    C.patch(ExitJump, C.here());
+}
+
+void LoopExprAST::compile(Compiler& C)
+{
+    if (Scoped) C.emit(opCode::op_enter_scope);
+
+    int BodyAt = C.here();
+    C.beginLoop();
+    Body->compile(C);
+    int BodyCheck = C.emit(opCode::op_loop_body, 0);
+    C.emit(opCode::op_jump, BodyAt);
+
+    int ExitAt = C.here();
+    C.endLoop(ExitAt);
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+    C.emit(opCode::op_undef);
+    int ExitJump = C.emit(opCode::op_jump);
+
+    C.patch(BodyCheck, C.here());
+    C.Depth--;
+    if (Scoped)
+    {
+        C.ScopeDepth++;
+        C.emit(opCode::op_leave_scope, 1);
+    }
+    C.emit(opCode::op_error, -1);
+
+    C.patch(ExitJump, C.here());
+}
+
+void BreakExprAST::compile(Compiler& C)
+{
+    Expr->compile(C);
+    int Check = C.emit(opCode::op_ctrl_check);
+
+    // A break outside of any loop leaves the function, as the tree-walker does.
+    if (C.inLoop()) C.emitBreak();
+    else
+    {
+        C.emit(opCode::op_ret);
+        C.Depth++;
+    }
+    C.patch(Check, C.here());
+}
+
+void ReturnExprAST::compile(Compiler& C)
+{
+    Expr->compile(C);
+    int Check = C.emit(opCode::op_ctrl_check);
+    C.emit(opCode::op_ret);
+    C.Depth++;
+    C.patch(Check, C.here());
+}
+
+void BlockExprAST::compile(Compiler& C)
+{
+    if (Scoped) C.emit(opCode::op_enter_scope);
+    for (int i = 0, e = Expressions.size(); i != e; ++i)
+    {
+        Expressions[i]->compile(C);
+        if (i != e - 1) C.emit(opCode::op_pop, 1);
+    }
+    if (Expressions.empty()) C.emit(opCode::op_const, C.addConst(Value(0)));
+    if (Scoped) C.emit(opCode::op_leave_scope, 1);
+}
+
+std::shared_ptr<Chunk> CompileFunction(FunctionAST& F)
+{
+    auto Code = std::make_shared<Chunk>();
+    Code->KeepScope = F.getFuncName() == "__anon_expr";
+
+    Compiler C(*Code);
+    F.getBody()->compile(C);
+    C.emit(opCode::op_ret);
+    return Code;
+}
+
+const Chunk* FunctionAST::getBytecode()
+{
+    if (!Bytecode) Bytecode = CompileFunction(*this);
+    return Bytecode.get();
+}
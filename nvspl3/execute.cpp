@@ -8,7 +8,17 @@
 #include "execute.h"
 #include "stdfunc.h"
 #include "interactiveMode.h"
+#include "vm.h"
+#include "resolver.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "memo.h"
+#include "vectorize.h"
+#include "parallel.h"
+#include "source.h"
+#include "cache.h"
 #include <map>
+#include <algorithm>
 #include <cmath>
 #include <chrono>
 
@@ -16,16 +26,45 @@
 #include <Windows.h>
 #endif
 
+// Functions and symbols are only changed between top-level expressions, so
+// the workers of a pfor share them. The bindings, memory and state of the
+// running call belong to each thread.
 static std::map<std::string, std::shared_ptr<FunctionAST>> Functions;
-static std::vector<namedValue> SymTbl;
-static Memory StackMemory;
+static thread_local std::vector<namedValue> SymTbl;
+static thread_local Memory StackMemory;
 
-extern int CurTok;
+// Identifiers are interned at parse time. Bindings[Sym] holds the symbol table
+// indices of every live binding of a symbol, innermost last, so lookups no
+// longer scan the whole symbol table.
+static std::map<std::string, int> SymIds;
+static std::vector<std::string> SymNames;
+static thread_local std::vector<std::vector<int>> Bindings;
+
+// Stack address of the first argument of the function being executed.
+static thread_local unsigned int FrameBase = 0;
+
+// The function being executed and the symbol table index of its first argument.
+static thread_local FunctionAST* CurFunction = nullptr;
+static thread_local unsigned int FrameTbl = 0;
 
-int MainIdx = 0;
-std::string MainCode;
+static thread_local controlFlow Control = controlFlow::ctl_none;
+
+// A self call in tail position unwinds to FunctionAST::execute with its
+// arguments here instead of recursing. Locals the caller had bound are kept,
+// as the callee would have seen them.
+static thread_local bool TailCallPending = false;
+static thread_local std::vector<Value> TailArgs;
+static thread_local std::vector<std::pair<int, Value>> TailLocals;
+
+extern int CurTok;
 
 bool IsInteractive = true; // true for default
+bool UseVM = false;
+unsigned int StackLimit = 64 * 1024 * 1024; // 512 MiB of cells
+bool StackStats = false;
+
+// Bumped whenever a function is (re)defined, invalidating every call site cache.
+unsigned int FunctionGeneration = 1;
 
 Value LogErrorV(const char* Str)
 {
@@ -33,6 +72,211 @@ Value LogErrorV(const char* Str)
     return Value(valueType::val_err);
 }
 
+int InternSymbol(const std::string& Name)
+{
+    auto It = SymIds.find(Name);
+    if (It != SymIds.end()) return It->second;
+
+    SymNames.push_back(Name);
+    Bindings.emplace_back();
+    return SymIds[Name] = SymNames.size() - 1;
+}
+
+const std::string& SymbolName(int Sym)
+{
+    return SymNames[Sym];
+}
+
+scopeMark EnterScope()
+{
+    return { StackMemory.getSize(), (unsigned int)SymTbl.size() };
+}
+
+void LeaveScope(scopeMark Mark)
+{
+    StackMemory.deleteScope(Mark.StackIdx);
+    for (unsigned int i = SymTbl.size(); i > Mark.TblIdx; i--)
+    {
+        Bindings[SymTbl.back().Sym].pop_back();
+        SymTbl.pop_back();
+    }
+}
+
+static void Bind(const namedValue& Entry)
+{
+    Bindings[Entry.Sym].push_back(SymTbl.size());
+    SymTbl.push_back(Entry);
+}
+
+/// FindBinding - Return the symbol table index of the innermost binding of Sym,
+/// skipping arrays when Scalar is set, or -1 if there is none.
+static int FindBinding(int Sym, bool Scalar)
+{
+    const std::vector<int>& Stack = Bindings[Sym];
+    for (int i = Stack.size() - 1; i >= 0; i--)
+    {
+        if (!Scalar || !SymTbl[Stack[i]].IsArr)
+            return Stack[i];
+    }
+    return -1;
+}
+
+/// Memory::grow - Make room for Need more cells, at least doubling the arena.
+bool Memory::grow(unsigned int Need)
+{
+    if (Region || Need > StackLimit - Top) return false;
+
+    unsigned int NewCapacity = std::max(Capacity * 2, 1024u);
+    NewCapacity = std::min(std::max(NewCapacity, Top + Need), StackLimit);
+    Value* NewCells = (Value*)realloc(Cells, (size_t)NewCapacity * sizeof(Value));
+    if (!NewCells) return false;
+
+    Cells = NewCells;
+    Capacity = NewCapacity;
+    return true;
+}
+
+static Value StackOverflow()
+{
+    return LogErrorV(std::string("Stack overflow (limit " + std::to_string(StackLimit) + " cells, see --stack-size)").c_str());
+}
+
+/// DeclareVariable - Bind Sym to a new cell holding Val. Reports an error and
+/// returns false when the stack is full.
+bool DeclareVariable(int Sym, Value Val)
+{
+    int Addr = StackMemory.push(Val);
+    if (Addr < 0)
+    {
+        StackOverflow();
+        return false;
+    }
+    Bind({ Sym, Addr, false });
+    return true;
+}
+
+Value GetVariable(int Sym)
+{
+    int i = FindBinding(Sym, true);
+    if (i >= 0) return StackMemory.getValue(SymTbl[i].Addr);
+
+    return LogErrorV(std::string("Identifier \"" + SymNames[Sym] + "\" not found").c_str());
+}
+
+Value SetVariable(int Sym, Value Val)
+{
+    int i = FindBinding(Sym, false);
+    if (i >= 0) StackMemory.setValue(SymTbl[i].Addr, Val);
+    else if (!DeclareVariable(Sym, Val)) return Value(valueType::val_err);
+    return Val;
+}
+
+Value GetVariableAddr(int Sym)
+{
+    int i = FindBinding(Sym, false);
+    if (i >= 0 && SymTbl[i].ElemType == elemType::elem_int)
+        return LogErrorV(std::string("Elements of int array \"" + SymNames[Sym] + "\" have no address").c_str());
+    if (i >= 0) return Value((int)SymTbl[i].Addr);
+
+    return LogErrorV(std::string("Variable \"" + SymNames[Sym] + "\" not found").c_str());
+}
+
+/// BindForVariable - Reuse a visible variable as the loop counter or declare a new one,
+/// returning the stack address of the counter, or -1 when the stack is full.
+int BindForVariable(int Sym, Value StartVal)
+{
+    int i = FindBinding(Sym, false);
+    if (i >= 0)
+    {
+        StackMemory.setValue(SymTbl[i].Addr, StartVal);
+        return SymTbl[i].Addr;
+    }
+    if (!DeclareVariable(Sym, StartVal)) return -1;
+    return SymTbl.back().Addr;
+}
+
+Value DeclareArr(int Sym, const std::vector<int>& Dims, elemType Type)
+{
+    // Elements are stored in row-major order.
+    std::vector<int> Strides(Dims.size());
+    int size = 1;
+    for (int i = Dims.size() - 1; i >= 0; i--)
+    {
+        Strides[i] = size;
+        size *= Dims[i];
+    }
+
+    // Typed elements start out as zero bits.
+    int Addr;
+    if (Type == elemType::elem_value) Addr = StackMemory.alloc(size, Value(0));
+    else if (Type == elemType::elem_double) Addr = StackMemory.alloc(size, Value(0.0));
+    else Addr = StackMemory.alloc(((long long)size + 1) / 2, Value(0.0));
+    if (Addr < 0) return StackOverflow();
+
+    Bind({ Sym, Addr, true, Dims, std::move(Strides), Type });
+    return Value(size);
+}
+
+Value GetMemory(unsigned int Addr)
+{
+    return StackMemory.getValue(Addr);
+}
+
+void SetMemory(unsigned int Addr, Value Val)
+{
+    StackMemory.setValue(Addr, Val);
+}
+
+/// GetMemoryBlock - Return the stack memory cells for direct access. The block
+/// moves when the stack grows.
+Value* GetMemoryBlock(unsigned int& Size)
+{
+    Size = StackMemory.getSize();
+    return StackMemory.data();
+}
+
+void PrintStackStats()
+{
+    unsigned int HighWater = StackMemory.getHighWater();
+    fprintf(stderr, "stack: %u cells at most (%zu KiB), limit %u cells\n",
+        HighWater, (size_t)HighWater * sizeof(Value) / 1024, StackLimit);
+}
+
+bool IsBound(int Sym)
+{
+    return !Bindings[Sym].empty();
+}
+
+std::shared_ptr<FunctionAST> FindFunction(const std::string& Name)
+{
+    auto It = Functions.find(Name);
+    if (It == Functions.end()) return nullptr;
+    return It->second;
+}
+
+/// ResolveCallee - Refresh a call site cache. Standard functions take precedence over user functions.
+void ResolveCallee(const std::string& Callee, callCache& Cache)
+{
+    Cache.StdFunc = LookupStdFunc(Callee);
+    Cache.Func = Cache.StdFunc < 0 ? FindFunction(Callee).get() : nullptr;
+    Cache.Generation = FunctionGeneration;
+}
+
+std::vector<FunctionAST*> DefinedFunctions()
+{
+    std::vector<FunctionAST*> Defined;
+    for (auto& Entry : Functions)
+        if (Entry.second) Defined.push_back(Entry.second.get());
+    return Defined;
+}
+
+/// GetFunctionSlot - Return the function table entry for Name, creating an empty one if needed.
+/// Entries are never erased and redefinitions overwrite them in place, so the slot stays valid.
+std::shared_ptr<FunctionAST>* GetFunctionSlot(const std::string& Name)
+{
+    return &Functions[Name];
+}
+
 Value NumberExprAST::execute()
 {
     return Val;
@@ -49,93 +293,140 @@ Value DeRefExprAST::execute()
     return LogErrorV("Address must be an unsigned integer");
 }
 
-Value HandleArr(std::string ArrName, const std::vector<std::shared_ptr<ExprAST>>& Indices, arrAction Action, Value Val)
+static const int MaxInlineIndices = 8;
+static const int MaxInlineArgs = 8;
+
+static int FindArr(int Sym)
 {
-    for (int i = SymTbl.size() - 1; i >= 0; i--)
+    const std::vector<int>& Stack = Bindings[Sym];
+    for (int i = Stack.size() - 1; i >= 0; i--)
     {
-        if (SymTbl[i].Name == ArrName && SymTbl[i].IsArr)
-        {
-            std::vector<Value> IdxV;
-            for (int k = 0, e = Indices.size(); k != e; ++k) {
-                IdxV.push_back(Indices[k]->execute());
-                if (IdxV.back().isErr()) return LogErrorV("Error while calculating indices");
-                if (!IdxV.back().isInt()) return LogErrorV("Index must be an integer");
-            }
+        if (SymTbl[Stack[i]].IsArr)
+            return Stack[i];
+    }
+    return -1;
+}
 
-            if (IdxV.size() != SymTbl[i].DimInfo.size()) return LogErrorV("Dimension mismatch");
+static Value ArrElement(const namedValue& Arr, const Value* IdxV, int IdxNum, arrAction Action, Value Val)
+{
+    if (IdxNum != Arr.Strides.size()) return LogErrorV("Dimension mismatch");
 
-            int AddVal = 0;
-            for (int l = 0; l < IdxV.size(); l++)
-            {
-                int MulVal = 1;
-                for (int m = l + 1; m < IdxV.size(); m++) MulVal *= SymTbl[i].DimInfo[m];
-                AddVal += MulVal * IdxV[l].getVal().i;
-            }
-            switch (Action)
-            {
-            case arrAction::getVal:
-                return StackMemory.getValue(SymTbl[i].Addr + AddVal);
-            case arrAction::getAddr:
-                return Value((int)(SymTbl[i].Addr + AddVal));
-            case arrAction::setVal:
-                StackMemory.setValue(SymTbl[i].Addr + AddVal, Val);
-                return Val;
-            }
+    int AddVal = 0;
+    for (int l = 0; l < IdxNum; l++) AddVal += IdxV[l].getVal().i * Arr.Strides[l];
+
+    if (Arr.ElemType == elemType::elem_int)
+    {
+        switch (Action)
+        {
+        case arrAction::getVal:
+            return Value(StackMemory.getInt(Arr.Addr, AddVal));
+        case arrAction::getAddr:
+            return LogErrorV("Elements of an int array have no address");
+        case arrAction::setVal:
+            StackMemory.setInt(Arr.Addr, AddVal, Val.getiVal());
+            return Value(Val.getiVal());
         }
     }
-    return LogErrorV((((std::string)("\"") + ArrName + (std::string)("\" is not an array"))).c_str());
+    if (Arr.ElemType == elemType::elem_double && Action == arrAction::setVal)
+        Val = Value(Val.getdVal());
+
+    switch (Action)
+    {
+    case arrAction::getVal:
+        return StackMemory.getValue(Arr.Addr + AddVal);
+    case arrAction::getAddr:
+        return Value((int)(Arr.Addr + AddVal));
+    case arrAction::setVal:
+        StackMemory.setValue(Arr.Addr + AddVal, Val);
+        return Val;
+    }
+    return Value(valueType::val_err);
 }
 
-Value HandleArr(std::string ArrName, const std::vector<std::shared_ptr<ExprAST>>& Indices, arrAction Action) { return HandleArr(ArrName, Indices, Action, Value()); }
+const namedValue* FindArrayBinding(int Sym)
+{
+    int i = FindArr(Sym);
+    return i >= 0 ? &SymTbl[i] : nullptr;
+}
+
+/// FindVariableBinding - The binding a read (Scalar) or an assignment of Sym
+/// would use, or null if there is none.
+const namedValue* FindVariableBinding(int Sym, bool Scalar)
+{
+    int i = FindBinding(Sym, Scalar);
+    return i >= 0 ? &SymTbl[i] : nullptr;
+}
+
+Value AccessArr(int Sym, const Value* IdxV, int IdxNum, arrAction Action, Value Val)
+{
+    int i = FindArr(Sym);
+    if (i < 0) return LogErrorV((((std::string)("\"") + SymNames[Sym] + (std::string)("\" is not an array"))).c_str());
+
+    for (int k = 0; k < IdxNum; k++)
+    {
+        if (IdxV[k].isErr()) return LogErrorV("Error while calculating indices");
+        if (!IdxV[k].isInt()) return LogErrorV("Index must be an integer");
+    }
+    return ArrElement(SymTbl[i], IdxV, IdxNum, Action, Val);
+}
+
+Value HandleArr(int Sym, const ExprList& Indices, arrAction Action, Value Val)
+{
+    int i = FindArr(Sym);
+    if (i < 0) return LogErrorV((((std::string)("\"") + SymNames[Sym] + (std::string)("\" is not an array"))).c_str());
+
+    // Indices are kept on the stack unless there are unusually many.
+    int IdxNum = Indices.size();
+    Value InlineIdx[MaxInlineIndices];
+    std::vector<Value> SpillIdx;
+    Value* IdxV = InlineIdx;
+    if (IdxNum > MaxInlineIndices)
+    {
+        SpillIdx.resize(IdxNum);
+        IdxV = SpillIdx.data();
+    }
+
+    for (int k = 0; k < IdxNum; ++k) {
+        IdxV[k] = Indices[k]->execute();
+        if (IdxV[k].isErr()) return LogErrorV("Error while calculating indices");
+        if (!IdxV[k].isInt()) return LogErrorV("Index must be an integer");
+    }
+    return ArrElement(SymTbl[i], IdxV, IdxNum, Action, Val);
+}
+
+Value HandleArr(int Sym, const ExprList& Indices, arrAction Action) { return HandleArr(Sym, Indices, Action, Value()); }
 
 Value VariableExprAST::execute()
 {
     if (!Indices.empty()) // array element
-        return HandleArr(Name, Indices, arrAction::getVal);
+        return HandleArr(Sym, Indices, arrAction::getVal);
 
     // normal variable
-    for (int i = SymTbl.size() - 1; i >= 0; i--)
-    {
-        if (SymTbl[i].Name == Name && !SymTbl[i].IsArr)
-            return StackMemory.getValue(SymTbl[i].Addr);
-    }
-    return LogErrorV(std::string("Identifier \"" + Name + "\" not found").c_str());
+    if (Slot >= 0) return StackMemory.getValue(FrameBase + Slot);
+    return GetVariable(Sym);
 }
 
 Value ArrDeclExprAST::execute()
 {
-    namedValue Arr = { Name, StackMemory.push(Value(0)), true, Indices };
-    SymTbl.push_back(Arr);
-
-    int size = 1;
-    for (int i = 0; i < Indices.size(); i++) size *= Indices[i];
-    for (int i = 0; i < size - 1; i++) StackMemory.push(Value(0));
-    
-    return Value(size);
+    return DeclareArr(Sym, Indices, Type);
 }
 
 Value UnaryExprAST::execute()
 {
     if (Opcode == '&') // reference operator
     {
-        VariableExprAST* Op = static_cast<VariableExprAST*>(Operand.get());
+        VariableExprAST* Op = static_cast<VariableExprAST*>(Operand);
         if (!Op) return LogErrorV("Operand of '&' must be a variable");
 
-        const std::vector<std::shared_ptr<ExprAST>>& Indices = Op->getIndices();
+        const ExprList& Indices = Op->getIndices();
         if (!Indices.empty()) // array element
         {
-            return HandleArr(Op->getName(), Indices, arrAction::getAddr);
+            return HandleArr(Op->getSymbol(), Indices, arrAction::getAddr);
         }
         else // normal variable
         {
-            for (int i = SymTbl.size() - 1; i >= 0; i--)
-            {
-                if (SymTbl[i].Name == Op->getName())
-                {
-                    return Value((int)SymTbl[i].Addr);
-                }
-            }
-            return LogErrorV(std::string("Variable \"" + Op->getName() + "\" not found").c_str());
+            if (Op->getSlot() >= 0) return Value((int)(FrameBase + Op->getSlot()));
+            return GetVariableAddr(Op->getSymbol());
         }
     }
 
@@ -143,34 +434,142 @@ Value UnaryExprAST::execute()
     if (OperandV.isErr())
         return Value(valueType::val_err);
 
+    if (!UserOp) return ApplyUnaryOp(Opcode, OperandV);
+
+    FunctionAST* F = UserOp->get();
+    if (!F) return LogErrorV("Unknown unary operator");
+
+    return F->execute(&OperandV);
+}
+
+Value ApplyUnaryOp(char Opcode, Value V)
+{
     switch (Opcode)
     {
     case '!':
-        if (OperandV.getdType() == dataType::t_double) return Value(!(bool)(OperandV.getVal().dbl));
-        else if (OperandV.getdType() == dataType::t_int) return Value(!(bool)(OperandV.getVal().i));
-        break;
+        if (V.getdType() == dataType::t_double) return Value(!(bool)(V.getVal().dbl));
+        return Value(!(bool)(V.getVal().i));
     case '+':
-        if (OperandV.getdType() == dataType::t_double) return Value(+(OperandV.getVal().dbl));
-        else if (OperandV.getdType() == dataType::t_int) return Value(+(OperandV.getVal().i));
-        break;
-    case '-':
-        if (OperandV.getdType() == dataType::t_double) return Value(-(OperandV.getVal().dbl));
-        else if (OperandV.getdType() == dataType::t_int) return Value(-(OperandV.getVal().i));
-        break;
+        if (V.getdType() == dataType::t_double) return Value(+(V.getVal().dbl));
+        return Value(+(V.getVal().i));
+    default:
+        if (V.getdType() == dataType::t_double) return Value(-(V.getVal().dbl));
+        return Value(-(V.getVal().i));
     }
+}
 
-    std::shared_ptr<FunctionAST> F = Functions[(std::string("unary") + Opcode)];
-    if (!F) return LogErrorV("Unknown unary operator");
+// Cells of the stack region of each worker, and the fewest worth starting
+// the workers for.
+static const unsigned int WorkerCells = 1 << 20;
+static const unsigned int MinWorkerCells = 4096;
 
-    std::vector<Value> Op;
-    Op.push_back(OperandV);
+/// RunOnWorkers - Run tasks 0 to NumTasks - 1 on the worker pool, setting
+/// Done to whether all of them returned true. Workers get regions of this
+/// thread's arena above its top and a copy of its bindings. Returns false,
+/// running nothing, when there is no room for them or only one worker.
+static bool RunOnWorkers(unsigned int NumTasks, const std::function<bool(unsigned int)>& Task, bool& Done)
+{
+    unsigned int Workers = ThreadCount, Base = StackMemory.getSize();
+    unsigned int Cells = Workers ? std::min(WorkerCells, (StackLimit - Base) / Workers) : 0;
+    if (Workers < 2 || Cells < MinWorkerCells || !StackMemory.reserve(Cells * Workers)) return false;
+
+    const std::vector<namedValue>& CallerTbl = SymTbl;
+    const std::vector<std::vector<int>>& CallerBindings = Bindings;
+    Value* Arena = StackMemory.data();
+    unsigned int CallerBase = FrameBase;
+
+    Done = RunParallel(NumTasks,
+        [&](unsigned int Worker) {
+            SymTbl = CallerTbl;
+            Bindings = CallerBindings;
+            StackMemory.useRegion(Arena, Base + Worker * Cells, Base + (Worker + 1) * Cells);
+            FrameBase = CallerBase;
+            CurFunction = nullptr;
+            ResetWorkerLoops();
+        },
+        [&](unsigned int Worker, unsigned int Item) { return Task(Item); });
+    return true;
+}
 
-    return F->execute(Op);
+// Operators on two pure calls fork them on workers until this many forks
+// are nested, a few tasks for each worker, so the rest stays sequential.
+static unsigned int MaxForkDepth()
+{
+    unsigned int Depth = 2;
+    while ((1u << Depth) < ThreadCount * 4) Depth++;
+    return Depth;
+}
+static thread_local unsigned int ForkDepth = 0;
+
+// Top-level code forks an operator again only when running it in order took
+// longer than this, which is well above the cost of waking the workers.
+static const std::chrono::microseconds ForkGrain(1000);
+static thread_local bool Timing = false; // inside an evaluation being timed
+
+/// forkCalls - Evaluate both operands, two calls of pure functions, as a
+/// fork-join pair. The arguments are evaluated here first, in order. A pure
+/// body reads and writes nothing but its argument slots and what it binds
+/// itself on the worker's own stack region; a for counter that isn't an
+/// argument would reuse our binding, so it makes a body impure. Returns
+/// false, evaluating nothing, when the operands should run in order.
+bool BinaryExprAST::forkCalls(Value& L, Value& R)
+{
+    if (ThreadCount < 2 || UseJIT || Timing) return false;
+    if (InParallel)
+    {
+        if (ForkDepth >= MaxForkDepth()) return false;
+    }
+    else if (Hint == forkHint::fh_serial)
+    {
+        // Time one evaluation in order to see whether it became worth forking.
+        auto Begin = std::chrono::steady_clock::now();
+        Timing = true;
+        L = LHS->execute();
+        R = RHS->execute();
+        Timing = false;
+        if (std::chrono::steady_clock::now() - Begin > ForkGrain) Hint = forkHint::fh_fork;
+        return true;
+    }
+
+    CallExprAST& LCall = static_cast<CallExprAST&>(*LHS);
+    CallExprAST& RCall = static_cast<CallExprAST&>(*RHS);
+    FunctionAST* LFunc = LCall.pureCallee();
+    FunctionAST* RFunc = LFunc ? RCall.pureCallee() : nullptr;
+    if (!RFunc) return false;
+
+    Value LArgs[MaxInlineArgs], RArgs[MaxInlineArgs];
+    if (!LCall.evaluateArgs(LArgs) || !RCall.evaluateArgs(RArgs))
+    {
+        L = R = Value(valueType::val_err);
+        return true;
+    }
+
+    if (InParallel)
+    {
+        ForkDepth++;
+        ForkJoin([&] { L = LFunc->execute(LArgs); }, [&] { R = RFunc->execute(RArgs); });
+        ForkDepth--;
+        return true;
+    }
+
+    auto Begin = std::chrono::steady_clock::now();
+    bool Done;
+    if (!RunOnWorkers(2, [&](unsigned int Item) {
+            if (Item) R = RFunc->execute(RArgs);
+            else L = LFunc->execute(LArgs);
+            return true;
+        }, Done))
+    {
+        L = LFunc->execute(LArgs);
+        R = RFunc->execute(RArgs);
+    }
+    if (std::chrono::steady_clock::now() - Begin < ForkGrain) Hint = forkHint::fh_serial;
+    return true;
 }
 
 Value BinaryExprAST::execute() {
     // Special case '=' because we don't want to emit the LHS as an expression.
-    if (Op == "=")
+    if (Opcode == binOp::op_assign)
     {
         // execute the RHS.
         Value Val = RHS->execute();
@@ -181,10 +580,10 @@ Value BinaryExprAST::execute() {
         // Assignment requires the LHS to be an identifier.
         VariableExprAST* LHSE;
 
-        if (LHS->getNodeType() == nodeType::node_var) LHSE = static_cast<VariableExprAST*>(LHS.get());
+        if (LHS->getNodeType() == nodeType::node_var) LHSE = static_cast<VariableExprAST*>(LHS);
         else if (LHS->getNodeType() == nodeType::node_deref)
         {
-            DeRefExprAST* LHSE = static_cast<DeRefExprAST*>(LHS.get());
+            DeRefExprAST* LHSE = static_cast<DeRefExprAST*>(LHS);
             
             // update value at the memory address
             Value Addr = LHSE->getExpr()->execute();
@@ -196,158 +595,226 @@ Value BinaryExprAST::execute() {
         else return LogErrorV("Destination of '=' must be a variable");
 
         // Look up the name.
-        std::vector<std::shared_ptr<ExprAST>> Indices = LHSE->getIndices();
+        const ExprList& Indices = LHSE->getIndices();
         if (!Indices.empty()) // array element
         {
-            return HandleArr(LHSE->getName(), Indices, arrAction::setVal, Val);
+            return HandleArr(LHSE->getSymbol(), Indices, arrAction::setVal, Val);
         }
         else // normal variable
         {
-            bool found = false;
-            for (int i = SymTbl.size() - 1; i >= 0; i--)
-            {
-                if (SymTbl[i].Name == LHSE->getName())
-                {
-                    StackMemory.setValue(SymTbl[i].Addr, Val);
-                    found = true;
-                    break;
-                }
-            }
-            if (!found)
+            if (LHSE->getSlot() >= 0)
             {
-                namedValue Var = { LHSE->getName(), StackMemory.push(Val), false };
-                SymTbl.push_back(Var);
+                StackMemory.setValue(FrameBase + LHSE->getSlot(), Val);
+                return Val;
             }
+            return SetVariable(LHSE->getSymbol(), Val);
         }
-        return Val;
     }
 
-    Value L = LHS->execute();
-    Value R = RHS->execute();
+    Value L, R;
+    if (!Forkable || !forkCalls(L, R))
+    {
+        L = LHS->execute();
+        R = RHS->execute();
+    }
 
     if (L.isErr() || R.isErr())
         return Value(valueType::val_err);
 
-    dataType ResultType = (L.getdType() >= R.getdType()) ? L.getdType() : R.getdType();
-
-    if (Op == "==")
+    if (Opcode != binOp::op_user)
     {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() == R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() == R.getiVal()));
+        // Fast paths for the operand types this operator has seen so far. The
+        // workers of a pfor only read what was seen.
+        switch (Feedback)
+        {
+        case opFeedback::fb_int:
+            if (L.isInt() && R.isInt()) return ApplyIntBinOp(Opcode, L.getVal().i, R.getVal().i);
+            if (!InParallel) Feedback = opFeedback::fb_generic;
+            break;
+        case opFeedback::fb_double:
+            if (!L.isInt() && !R.isInt()) return ApplyDoubleBinOp(Opcode, L.getVal().dbl, R.getVal().dbl);
+            if (!InParallel) Feedback = opFeedback::fb_generic;
+            break;
+        case opFeedback::fb_none:
+            if (!InParallel) Feedback = OperandFeedback(L, R);
+            break;
+        default:
+            break;
+        }
+        return ApplyBinOp(Opcode, L, R);
     }
 
-    if (Op == "!=")
-    {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() != R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() != R.getiVal()));
-    }
+    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
+    // a call to it.
+    FunctionAST* F = UserOp->get();
+    if (!F) return LogErrorV("Binary operator not found");
 
-    if (Op == "&&")
-    {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() && R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() && R.getiVal()));
-    }
+    Value Ops[2] = { L, R };
+    return F->execute(Ops);
+}
 
-    if (Op == "||")
-    {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() || R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() || R.getiVal()));
-    }
+Value ApplyBinOp(binOp Opcode, Value L, Value R)
+{
+    dataType ResultType = (L.getdType() >= R.getdType()) ? L.getdType() : R.getdType();
 
-    if (Op == "<")
-    {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() < R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() < R.getiVal()));
-    }
+    if (ResultType == dataType::t_double) return ApplyDoubleBinOp(Opcode, L.getdVal(), R.getdVal());
+    return ApplyIntBinOp(Opcode, L.getiVal(), R.getiVal());
+}
 
-    if (Op == ">")
+Value ApplyIntBinOp(binOp Opcode, int LV, int RV)
+{
+    switch (Opcode)
     {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() > R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() > R.getiVal()));
+    case binOp::op_eq: return Value(LV == RV);
+    case binOp::op_ne: return Value(LV != RV);
+    case binOp::op_and: return Value(LV && RV);
+    case binOp::op_or: return Value(LV || RV);
+    case binOp::op_lt: return Value(LV < RV);
+    case binOp::op_gt: return Value(LV > RV);
+    case binOp::op_le: return Value(LV <= RV);
+    case binOp::op_ge: return Value(LV >= RV);
+    case binOp::op_add: return Value(LV + RV);
+    case binOp::op_sub: return Value(LV - RV);
+    case binOp::op_mul: return Value(LV * RV);
+    case binOp::op_div: return Value(LV / RV);
+    case binOp::op_mod: return Value(LV % RV);
+    case binOp::op_pow: return Value((int)pow(LV, RV));
+    default: break;
     }
+    return LogErrorV("Binary operator not found");
+}
 
-    if (Op == "<=") 
+Value ApplyDoubleBinOp(binOp Opcode, double LV, double RV)
+{
+    switch (Opcode)
     {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() <= R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() <= R.getiVal()));
+    case binOp::op_eq: return Value(LV == RV);
+    case binOp::op_ne: return Value(LV != RV);
+    case binOp::op_and: return Value(LV && RV);
+    case binOp::op_or: return Value(LV || RV);
+    case binOp::op_lt: return Value(LV < RV);
+    case binOp::op_gt: return Value(LV > RV);
+    case binOp::op_le: return Value(LV <= RV);
+    case binOp::op_ge: return Value(LV >= RV);
+    case binOp::op_add: return Value(LV + RV);
+    case binOp::op_sub: return Value(LV - RV);
+    case binOp::op_mul: return Value(LV * RV);
+    case binOp::op_div: return Value(LV / RV);
+    case binOp::op_mod: return Value((double)fmod(LV, RV));
+    case binOp::op_pow: return Value((double)pow(LV, RV));
+    default: break;
     }
+    return LogErrorV("Binary operator not found");
+}
 
-    if (Op == ">=")
-    {
-        if (ResultType == dataType::t_double) return Value((L.getdVal() >= R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((L.getiVal() >= R.getiVal()));
-    }
+/// OperandFeedback - Classify the operands of a builtin binary operator.
+opFeedback OperandFeedback(const Value& L, const Value& R)
+{
+    if (L.getdType() != R.getdType()) return opFeedback::fb_generic;
+    return L.isInt() ? opFeedback::fb_int : opFeedback::fb_double;
+}
 
-    if (Op == "+")
-    {
-        if (ResultType == dataType::t_double) return Value((double)(L.getdVal() + R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)(L.getiVal() + R.getiVal()));
-    }
+Value LogicalExprAST::execute()
+{
+    Value L = LHS->execute();
+    if (L.isErr())
+        return Value(valueType::val_err);
 
-    if (Op == "-") 
-    {
-        if (ResultType == dataType::t_double) return Value((double)(L.getdVal() - R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)(L.getiVal() - R.getiVal()));
-    }
+    bool Left = L.getdVal() != 0;
+    if (Opcode == binOp::op_and ? !Left : Left)
+        return Value(Left ? 1 : 0);
 
-    if (Op == "*")
-    {
-        if (ResultType == dataType::t_double) return Value((double)(L.getdVal() * R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)(L.getiVal() * R.getiVal()));
-    }
+    Value R = RHS->execute();
+    if (R.isErr())
+        return Value(valueType::val_err);
+    return Value(R.getdVal() != 0 ? 1 : 0);
+}
 
-    if (Op == "/")
-    {
-        if (ResultType == dataType::t_double) return Value((double)(L.getdVal() / R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)(L.getiVal() / R.getiVal()));
-    }
+/// SaveFrameLocals - Copy the locals bound in the current frame after its
+/// arguments, unless the frame holds an array.
+static bool SaveFrameLocals(unsigned int NumArgs)
+{
+    for (unsigned int i = FrameTbl + NumArgs; i < SymTbl.size(); i++)
+        if (SymTbl[i].IsArr) return false;
 
-    if (Op == "%")
-    {
-        if (ResultType == dataType::t_double) return Value((double)fmod(L.getdVal(), R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)(L.getiVal() % R.getiVal()));
-    }
+    TailLocals.clear();
+    for (unsigned int i = FrameTbl + NumArgs; i < SymTbl.size(); i++)
+        TailLocals.emplace_back(SymTbl[i].Sym, StackMemory.getValue(SymTbl[i].Addr));
+    return true;
+}
 
-    if (Op == "**")
-    {
-        if (ResultType == dataType::t_double) return Value((double)pow(L.getdVal(), R.getdVal()));
-        else if (ResultType == dataType::t_int) return Value((int)pow(L.getiVal(), R.getiVal()));
+/// evaluateArgs - Evaluate the arguments into ArgsV, in order. Returns false
+/// after the first one that fails.
+bool CallExprAST::evaluateArgs(Value* ArgsV)
+{
+    for (size_t i = 0; i != Args.size(); ++i) {
+        ArgsV[i] = Args[i]->execute();
+        if (ArgsV[i].isErr())
+            return false;
     }
+    return true;
+}
 
-    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
-    // a call to it.
-    
-    std::shared_ptr<FunctionAST> F = Functions[(std::string("binary") + Op)];
-    if (!F) return LogErrorV("Binary operator not found");
-
-    std::vector<Value> Ops;
-    Ops.push_back(L);
-    Ops.push_back(R);
+/// pureCallee - The user function this call runs, when the call site is up to
+/// date, the function is pure and takes these arguments on the stack; null
+/// otherwise. Memoized functions are left to their tables.
+FunctionAST* CallExprAST::pureCallee()
+{
+    if (Cache.Generation != FunctionGeneration || !Cache.Func) return nullptr;
 
-    return F->execute(Ops);
+    FunctionAST* F = Cache.Func;
+    int NumArgs = Args.size();
+    if (F->argsSize() != NumArgs || NumArgs > MaxInlineArgs || !IsPure(*F) || GetMemo(*F))
+        return nullptr;
+    return F;
 }
 
 Value CallExprAST::execute()
 {
-    std::vector<Value> ArgsV;
-    for (int i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->execute());
-        if (ArgsV.back().isErr())
-            return Value(valueType::val_err);
+    // Arguments are kept on the stack unless there are unusually many. They
+    // can't be evaluated into the callee's cells directly, since evaluating
+    // one may bind a variable of the caller on top of the stack.
+    int NumArgs = Args.size();
+    Value InlineArgs[MaxInlineArgs];
+    std::vector<Value> SpillArgs;
+    Value* ArgsV = InlineArgs;
+    if (NumArgs > MaxInlineArgs)
+    {
+        SpillArgs.resize(NumArgs);
+        ArgsV = SpillArgs.data();
+    }
+
+    if (!evaluateArgs(ArgsV))
+        return Value(valueType::val_err);
+
+    // Workers of a pfor resolve a stale call site into a copy; only the
+    // thread running top-level code updates the AST.
+    callCache Resolved;
+    callCache* Site = &Cache;
+    if (Cache.Generation != FunctionGeneration)
+    {
+        if (InParallel) Site = &Resolved;
+        ResolveCallee(*Callee, *Site);
     }
 
-    if (std::find(StdFuncList.begin(), StdFuncList.end(), Callee) != StdFuncList.end())
-        return CallStdFunc(Callee, ArgsV);
+    if (Site->StdFunc >= 0)
+        return CallStdFunc(Site->StdFunc, ArgsV, NumArgs);
 
-    // Look up the name in the global module table.
-    std::shared_ptr<FunctionAST> CalleeF = Functions[Callee];
+    FunctionAST* CalleeF = Site->Func;
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
     // If argument mismatch error.
-    if (CalleeF->argsSize() != Args.size())
+    if (CalleeF->argsSize() != NumArgs)
         return LogErrorV("Incorrect number of arguments passed");
-    
+
+    if (Tail && CalleeF == CurFunction && SaveFrameLocals(NumArgs))
+    {
+        TailArgs.assign(ArgsV, ArgsV + NumArgs);
+        TailCallPending = true;
+        Control = controlFlow::ctl_return;
+        return Value();
+    }
     return CalleeF->execute(ArgsV);
 }
 
@@ -359,11 +826,9 @@ Value IfExprAST::execute()
 
     if (CondV.getdVal())
     {
-        int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+        scopeMark Mark = ThenScoped ? EnterScope() : scopeMark();
         Value ThenV = Then->execute();
-
-        StackMemory.deleteScope(StackIdx);
-        for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+        if (ThenScoped) LeaveScope(Mark);
 
         if (ThenV.isErr())
             return Value(valueType::val_err);
@@ -371,11 +836,9 @@ Value IfExprAST::execute()
     }
     else if (Else != nullptr)
     {
-        int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+        scopeMark Mark = ElseScoped ? EnterScope() : scopeMark();
         Value ElseV = Else->execute();
-        
-        StackMemory.deleteScope(StackIdx);
-        for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+        if (ElseScoped) LeaveScope(Mark);
 
         if (ElseV.isErr())
             return Value(valueType::val_err);
@@ -390,26 +853,15 @@ Value ForExprAST::execute()
     if (StartVal.isErr())
         return Value(valueType::val_err);
 
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    scopeMark Mark = Scoped ? EnterScope() : scopeMark();
     int StartVarAddr;
-
-    bool found = false;
-    for (int i = SymTbl.size() - 1; i >= 0; i--)
-    {
-        if (SymTbl[i].Name == VarName)
-        {
-            StackMemory.setValue(i, StartVal);
-            StartVarAddr = i;
-            found = true;
-            break;
-        }
-    }
-    if (!found)
+    if (Slot >= 0)
     {
-        namedValue Var = { VarName, StackMemory.push(StartVal), false };
-        SymTbl.push_back(Var);
-        StartVarAddr = SymTbl.size() - 1;
+        StartVarAddr = FrameBase + Slot;
+        StackMemory.setValue(StartVarAddr, StartVal);
     }
+    else if ((StartVarAddr = BindForVariable(Sym, StartVal)) < 0)
+        return Value(valueType::val_err);
 
     // Emit the step value.
     Value StepVal(1);
@@ -417,33 +869,162 @@ Value ForExprAST::execute()
     {
         StepVal = Step->execute();
         if (StepVal.isErr())
+        {
+            if (Scoped) LeaveScope(Mark);
+            return Value(valueType::val_err);
+        }
+    }
+
+    // With an invariant bound the end condition reads the counter directly,
+    // unless an array of the same name hides it from the condition.
+    // A loop fitting the vector kernels runs them, unless its arrays or
+    // values turn out not to fit on this entry.
+    if (Vec && RunVecLoop(*Vec, StartVarAddr, StepVal, FrameBase))
+    {
+        if (Scoped) LeaveScope(Mark);
+        return Value(valueType::val_undef);
+    }
+
+    Value BoundVal;
+    bool Counted = Bound && (Slot >= 0 || FindBinding(Sym, true) == FindBinding(Sym, false));
+    if (Counted)
+    {
+        BoundVal = Bound->execute();
+        if (BoundVal.isErr())
+        {
+            if (Scoped) LeaveScope(Mark);
             return Value(valueType::val_err);
+        }
     }
 
     Value BodyExpr, EndCond;
     while (true)
     {
-        EndCond = End->execute();
+        if (Counted)
+        {
+            Value Counter = StackMemory.getValue(StartVarAddr);
+            EndCond = CounterLeft ? ApplyBinOp(BoundOp, Counter, BoundVal) : ApplyBinOp(BoundOp, BoundVal, Counter);
+        }
+        else EndCond = End->execute();
         if (EndCond.isErr() || !EndCond.getdVal()) break;
 
         BodyExpr = Body->execute();
-        if (BodyExpr.isErr() || BodyExpr.isBreak()) break;
-        StackMemory.setValue(StartVarAddr,
-            Value(StackMemory.getValue(StartVarAddr).getdVal() + StepVal.getdVal()));
-    }
+        if (BodyExpr.isErr() || Control != controlFlow::ctl_none) break;
 
-    StackMemory.deleteScope(StackIdx);
-    for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+        // An integer counter stepped by an integer stays an integer.
+        StackMemory.setValue(StartVarAddr, ApplyBinOp(binOp::op_add, StackMemory.getValue(StartVarAddr), StepVal));
+    }
+    if (Scoped) LeaveScope(Mark);
 
     if (BodyExpr.isErr() || EndCond.isErr())
         return Value(valueType::val_err);
+    if (Control == controlFlow::ctl_return)
+        return BodyExpr;
+    Control = controlFlow::ctl_none;
 
     return Value(valueType::val_undef);
 }
 
+// The iterations of a pfor are split into at most this many chunks, however
+// many workers there are, so reductions always combine the same partial results.
+static const unsigned int PForChunks = 1024;
+
+/// runChunk - Run the iterations First to Last - 1 on this thread, leaving
+/// what each reduction came to in Partials.
+bool PForExprAST::runChunk(int First, int Last, Value* Partials)
+{
+    scopeMark Mark = EnterScope();
+    bool Done = DeclareVariable(Sym, Value(First));
+    unsigned int CounterAddr = StackMemory.getSize() - 1;
+    for (auto& R : Reductions)
+        Done = Done && DeclareVariable(R.Sym, Value(R.Opcode == binOp::op_mul ? 1 : 0));
+
+    for (int i = First; Done && i < Last; i++)
+    {
+        StackMemory.setValue(CounterAddr, Value(i));
+        scopeMark Iteration = EnterScope();
+        Value BodyVal = Body->execute();
+        LeaveScope(Iteration);
+
+        Done = !BodyVal.isErr();
+        if (Control != controlFlow::ctl_none)
+        {
+            Control = controlFlow::ctl_none;
+            LogErrorV("Cannot break or return out of a pfor");
+            Done = false;
+        }
+    }
+
+    for (size_t r = 0; Done && r < Reductions.size(); r++)
+        Partials[r] = StackMemory.getValue(CounterAddr + 1 + r);
+    LeaveScope(Mark);
+    return Done;
+}
+
+Value PForExprAST::execute()
+{
+    Value StartVal = Start->execute();
+    if (StartVal.isErr())
+        return Value(valueType::val_err);
+    Value EndVal = End->execute();
+    if (EndVal.isErr())
+        return Value(valueType::val_err);
+    if (!StartVal.isInt() || !EndVal.isInt())
+        return LogErrorV("Range of pfor must be integers");
+
+    std::vector<int> ReduceAddrs;
+    for (auto& R : Reductions)
+    {
+        int i = FindBinding(R.Sym, true);
+        if (i < 0) return LogErrorV(std::string("Reduction variable \"" + R.Name + "\" not found").c_str());
+        ReduceAddrs.push_back(SymTbl[i].Addr);
+    }
+
+    int First = StartVal.getiVal(), Last = EndVal.getiVal();
+    if (Last <= First) return Value(valueType::val_undef);
+
+    unsigned long long Count = (long long)Last - First;
+    unsigned int Grain = (unsigned int)((Count + PForChunks - 1) / PForChunks);
+    unsigned int NumChunks = (unsigned int)((Count + Grain - 1) / Grain);
+    size_t NumReductions = Reductions.size();
+    std::vector<Value> Partials(NumChunks * NumReductions);
+    auto RunChunk = [&](unsigned int c) {
+        long long Begin = First + (long long)c * Grain;
+        return runChunk((int)Begin, (int)std::min(Begin + Grain, (long long)Last), Partials.data() + c * NumReductions);
+    };
+
+    // A pfor inside a worker runs on that worker.
+    bool Done = true;
+    if (InParallel || NumChunks < 2 || !RunOnWorkers(NumChunks, RunChunk, Done))
+    {
+        for (unsigned int c = 0; c < NumChunks && Done; c++) Done = RunChunk(c);
+    }
+    if (!Done) return Value(valueType::val_err);
+
+    for (size_t r = 0; r < NumReductions; r++)
+    {
+        Value Acc = StackMemory.getValue(ReduceAddrs[r]);
+        for (unsigned int c = 0; c < NumChunks; c++)
+            Acc = ApplyBinOp(Reductions[r].Opcode, Acc, Partials[c * NumReductions + r]);
+        StackMemory.setValue(ReduceAddrs[r], Acc);
+    }
+    return Value(valueType::val_undef);
+}
+
+/// ExecuteInFrame - Run E in the tree walker as part of a function whose
+/// arguments start at stack address Base.
+Value ExecuteInFrame(ExprAST& E, unsigned int Base)
+{
+    unsigned int CallerBase = FrameBase;
+    FrameBase = Base;
+    Value Result = E.execute();
+    FrameBase = CallerBase;
+    return Result;
+}
+
 Value WhileExprAST::execute()
 {
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    scopeMark Mark = Scoped ? EnterScope() : scopeMark();
 
     Value BodyExpr, EndCond;
     while (true)
@@ -452,13 +1033,15 @@ Value WhileExprAST::execute()
         if (EndCond.isErr() || !EndCond.getdVal()) break;
 
         BodyExpr = Body->execute();
-        if (BodyExpr.isErr() || BodyExpr.isBreak()) break;
+        if (BodyExpr.isErr() || Control != controlFlow::ctl_none) break;
     }
-    StackMemory.deleteScope(StackIdx);
-    for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+    if (Scoped) LeaveScope(Mark);
 
     if (EndCond.isErr() || BodyExpr.isErr())
         return Value(valueType::val_err);
+    if (Control == controlFlow::ctl_return)
+        return BodyExpr;
+    Control = controlFlow::ctl_none;
 
     return Value(valueType::val_undef);
 }
@@ -470,40 +1053,44 @@ Value RepeatExprAST::execute()
         return Value(valueType::val_err);
     if (!Iter.isUInt()) return LogErrorV("Number of iterations should be an unsigned integer");
 
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    scopeMark Mark = Scoped ? EnterScope() : scopeMark();
 
     Value BodyExpr;
     for (int i = 0; i < Iter.getiVal(); i++)
     {
         BodyExpr = Body->execute();
         
-        if (BodyExpr.isErr() || BodyExpr.isBreak()) break;
+        if (BodyExpr.isErr() || Control != controlFlow::ctl_none) break;
     }
-    StackMemory.deleteScope(StackIdx);
-    for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+    if (Scoped) LeaveScope(Mark);
 
     if (BodyExpr.isErr())
         return Value(valueType::val_err);
+    if (Control == controlFlow::ctl_return)
+        return BodyExpr;
+    Control = controlFlow::ctl_none;
     
     return Value(valueType::val_undef);
 }
 
 Value LoopExprAST::execute()
 {
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    scopeMark Mark = Scoped ? EnterScope() : scopeMark();
 
     Value BodyExpr;
     while (true)
     {
         BodyExpr = Body->execute();
 
-        if (BodyExpr.isErr() || BodyExpr.isBreak()) break;
+        if (BodyExpr.isErr() || Control != controlFlow::ctl_none) break;
     }
-    StackMemory.deleteScope(StackIdx);
-    for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+    if (Scoped) LeaveScope(Mark);
 
     if (BodyExpr.isErr())
         return Value(valueType::val_err);
+    if (Control == controlFlow::ctl_return)
+        return BodyExpr;
+    Control = controlFlow::ctl_none;
     
     return Value(valueType::val_undef);
 }
@@ -514,7 +1101,7 @@ Value BreakExprAST::execute()
     if (RetVal.isErr())
         return LogErrorV("Failed to return a value");
 
-    RetVal.setvType(valueType::val_break);
+    Control = controlFlow::ctl_break;
     return RetVal;
 }
 
@@ -524,127 +1111,195 @@ Value ReturnExprAST::execute()
     if (RetVal.isErr())
         return LogErrorV("Failed to return a value");
 
-    RetVal.setvType(valueType::val_return);
+    Control = controlFlow::ctl_return;
     return RetVal;
 }
 
 Value BlockExprAST::execute()
 {
     Value RetVal(0);
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    scopeMark Mark = Scoped ? EnterScope() : scopeMark();
 
     for (auto& Expr : Expressions)
     {
         RetVal = Expr->execute();
-        if (RetVal.isBreak() || RetVal.isReturn()) break;
+        if (Control != controlFlow::ctl_none) break;
     }
-    StackMemory.deleteScope(StackIdx);
-    for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+    if (Scoped) LeaveScope(Mark);
 
     return RetVal;
 }
 
-Value FunctionAST::execute(std::vector<Value> Ops)
+/// FunctionAST::execute - Call the function with argsSize() values at Ops,
+/// which the caller keeps alive for the whole call.
+Value FunctionAST::execute(const Value* Ops)
 {
-    int StackIdx = StackMemory.getSize(), TblIdx = SymTbl.size();
+    // Memoized functions stay in the interpreter, where every call is seen.
+    // The workers of a pfor stay there too, leaving native code to one thread.
+    Value NativeVal;
+    MemoFunction* Memo = GetMemo(*this);
+    if (Memo)
+    {
+        if (const Value* Cached = Memo->find(Ops)) return *Cached;
+    }
+    else if (UseJIT && !InParallel && RunNative(*this, Ops, Proto->getArgsSize(), NativeVal))
+        return NativeVal;
+
+    unsigned int Errors = ErrorCount;
+    scopeMark Mark = EnterScope();
+    unsigned int CallerBase = FrameBase, CallerTbl = FrameTbl;
+    FunctionAST* Caller = CurFunction;
+    FrameBase = Mark.StackIdx;
+    FrameTbl = Mark.TblIdx;
+    CurFunction = this;
+
+    int NumArgs = Proto->getArgsSize();
+    bool Bound = true;
+    for (int i = 0; i < NumArgs && Bound; i++)
+        Bound = DeclareVariable(ArgSyms[i], Ops[i]);
+
+    Value RetVal(valueType::val_err);
+    while (Bound)
+    {
+        RetVal = Body->execute();
+        Control = controlFlow::ctl_none; // a return, or a break outside of any loop, ends here
+        if (!TailCallPending) break;
+
+        // Run the tail call in this frame: the new arguments replace the old
+        // ones in place, followed by the locals the caller had.
+        TailCallPending = false;
+        LeaveScope({ Mark.StackIdx + NumArgs, Mark.TblIdx + NumArgs });
+        for (int i = 0; i < NumArgs; i++)
+            StackMemory.setValue(FrameBase + i, TailArgs[i]);
+        for (auto& Local : TailLocals)
+            DeclareVariable(Local.first, Local.second);
+    }
+
+    FrameBase = CallerBase;
+    FrameTbl = CallerTbl;
+    CurFunction = Caller;
+    if (Proto->getName() != "__anon_expr")
+        LeaveScope(Mark);
 
-    auto& Arg = Proto->getArgs();
-    for (int i = 0; i < Proto->getArgsSize(); i++)
+    if (RetVal.isErr()) return Value(valueType::val_err);
+
+    // A call that reported an error has to report it again.
+    if (Memo && ErrorCount == Errors && Cacheable(RetVal))
+        Memo->insert(Ops, RetVal);
+    return RetVal;
+}
+
+/// DefineFunction - Install a function definition.
+static void DefineFunction(std::shared_ptr<FunctionAST> FnAST)
+{
+    OptimizeFunction(*FnAST);
+    ResolveScopes(*FnAST);
+    if (IsInteractive) fprintf(stderr, "Read function definition\n");
+    Functions[FnAST->getFuncName()] = FnAST;
+    FunctionGeneration++;
+}
+
+/// RunTopLevel - Evaluate a top-level expression held in an anonymous function.
+static void RunTopLevel(FunctionAST& F)
+{
+    OptimizeFunction(F);
+    ResolveScopes(F);
+    Value RetVal = UseVM ? RunVM(F) : F.execute(nullptr);
+    if (RetVal.getvType() == valueType::val_data && IsInteractive)
     {
-        namedValue ArgVar = { Arg[i], StackMemory.push(Ops[i]), false };
-        SymTbl.push_back(ArgVar);
+        if (RetVal.getdType() == dataType::t_double)
+            fprintf(stderr, "Evaluated to %f\n", RetVal.getdVal());
+        else if (RetVal.getdType() == dataType::t_int)
+            fprintf(stderr, "Evaluated to %d\n", RetVal.getiVal());
     }
+}
 
-    Value RetVal = Body->execute();
+static void RunSource(const std::string& Path, const SourceFile& Src, bool IsModule, bool tmpFlag);
 
-    if (Proto->getName() != "__anon_expr")
+/// ImportModule - Define the functions of the module at Path.
+static void ImportModule(const std::string& Path, bool tmpFlag)
+{
+    IsInteractive = false;
+
+    SourceFile Module;
+    if (!Module.open(Path.c_str()))
     {
-        StackMemory.deleteScope(StackIdx);
-        for (int i = SymTbl.size(); i > TblIdx; i--) SymTbl.pop_back();
+        fprintf(stderr, "Error: Cannot find module\n");
+        CurTok = Token::tok_undef; // the path is eaten
+        return;
     }
 
-    if (RetVal.isErr()) return Value(valueType::val_err);
-    if (RetVal.getvType() == valueType::val_return)
-        RetVal.setvType(valueType::val_data);
-    
-    return RetVal;
+    RunSource(Path, Module, true, tmpFlag);
+    CurTok = Token::tok_undef;
+
+    if (tmpFlag) fprintf(stderr, "Successfully imported module \"%s\".\n", Path.c_str());
 }
 
-void HandleDefinition(std::string& Code, int& Idx)
+void HandleDefinition(TokenStream& Toks, CacheWriter* W)
 {
-    if (auto FnAST = ParseDefinition(Code, Idx))
+    unsigned int Errors = ErrorCount;
+    auto FnAST = ParseDefinition(Toks);
+    if (W && ErrorCount != Errors) W->Failed = true;
+
+    if (FnAST)
     {
-        if (IsInteractive) fprintf(stderr, "Read function definition\n");
-        Functions[FnAST->getFuncName()] = FnAST;
+        if (W) W->definition(*FnAST);
+        DefineFunction(FnAST);
     }
-    else GetNextToken(Code, Idx); // Skip token for error recovery.
+    else GetNextToken(Toks); // Skip token for error recovery.
 }
 
-void HandleTopLevelExpression(std::string& Code, int& Idx)
+void HandleTopLevelExpression(TokenStream& Toks, CacheWriter* W)
 {
     // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr(Code, Idx))
+    unsigned int Errors = ErrorCount;
+    auto FnAST = ParseTopLevelExpr(Toks);
+    if (W && ErrorCount != Errors) W->Failed = true;
+
+    if (FnAST)
     {
-        Value RetVal = FnAST->execute(std::vector<Value>());
-        if (RetVal.getvType() == valueType::val_data && IsInteractive)
-        {
-            if (RetVal.getdType() == dataType::t_double)
-                fprintf(stderr, "Evaluated to %f\n", RetVal.getdVal());
-            else if (RetVal.getdType() == dataType::t_int)
-                fprintf(stderr, "Evaluated to %d\n", RetVal.getiVal());
-        }
+        if (W) W->topLevel(*FnAST);
+        RunTopLevel(*FnAST);
     }
-    else GetNextToken(Code, Idx); // Skip token for error recovery.
+    else GetNextToken(Toks); // Skip token for error recovery.
 }
 
-void HandleImport(std::string& Code, int& Idx, bool tmpFlag)
+void HandleImport(TokenStream& Toks, bool tmpFlag, CacheWriter* W)
 {
-    if (auto ImAST = ParseImport(Code, Idx))
+    if (auto ImAST = ParseImport(Toks))
     {
-        IsInteractive = false;
-        int moduleIdx = 0;
-        std::string ModuleCode;
+        ImportModule(ImAST->getModuleName(), tmpFlag);
 
-        FILE* fp = fopen(ImAST->getModuleName().c_str(), "r");
-        if (fp == NULL)
-        {
-            fprintf(stderr, "Error: Cannot find module\n");
-            return;
-        }
-        while (!feof(fp)) ModuleCode += (char)fgetc(fp);
-        ModuleCode += EOF;
-        fclose(fp);
+        // The source goes on right after the path.
+        if (W) W->import(ImAST->getModuleName(), Toks.current().End + 1, GetBinopPrecedences());
+    }
+    else GetNextToken(Toks); // Skip token for error recovery.
+}
 
-		LastChar = ' ';
-		GetNextToken(ModuleCode, moduleIdx);
+/// ModuleLoop - Define the functions of a module. Anything else in it is skipped.
+static void ModuleLoop(TokenStream& Toks, bool tmpFlag, CacheWriter* W)
+{
+    while (true)
+    {
+        if (CurTok == tok_eof) break;
 
-		while (true)
+        switch (CurTok)
         {
-            if (CurTok == tok_eof) break;
-
-            switch (CurTok)
-            {
-            case tok_import:
-                HandleImport(ModuleCode, moduleIdx, tmpFlag);
-                break;
-            case tok_def:
-                HandleDefinition(ModuleCode, moduleIdx);
-                break;
-            default:
-                GetNextToken(ModuleCode, moduleIdx);
-                break;
-            }
+        case tok_import:
+            HandleImport(Toks, tmpFlag, W);
+            break;
+        case tok_def:
+            HandleDefinition(Toks, W);
+            break;
+        default:
+            GetNextToken(Toks);
+            break;
         }
-		CurTok = Token::tok_undef, LastChar = ' ';
-
-        if (tmpFlag) fprintf(stderr, "Successfully imported module \"%s\".\n",
-            ImAST->getModuleName().c_str());
     }
-    else GetNextToken(Code, Idx); // Skip token for error recovery.
 }
 
 /// top ::= definition | import | external | expression | ';'
-void MainLoop(std::string& Code, int& Idx)
+void MainLoop(TokenStream& Toks, CacheWriter* W)
 {
     bool tmpFlag = false;
     while (true)
@@ -655,51 +1310,99 @@ void MainLoop(std::string& Code, int& Idx)
         case tok_eof:
             return;
         case ';': // ignore top-level semicolons.
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
             break;
         case tok_import:
             if (IsInteractive) tmpFlag = true;
-            HandleImport(Code, Idx, tmpFlag);
+            HandleImport(Toks, tmpFlag, W);
             IsInteractive = tmpFlag;
             break;
         case tok_def:
-            HandleDefinition(Code, Idx);
+            HandleDefinition(Toks, W);
             break;
         case cmd_help:
             if (IsInteractive)
             {
-                GetNextToken(Code, Idx);
+                GetNextToken(Toks);
                 RunHelp();
             }
             break;
         default:
-            HandleTopLevelExpression(Code, Idx);
+            HandleTopLevelExpression(Toks, W);
             break;
         }
     }
 }
 
+/// RunSource - Run a script, or define the functions of a module. Its items
+/// come from its cache while that is fresh, and are parsed otherwise.
+static void RunSource(const std::string& Path, const SourceFile& Src, bool IsModule, bool tmpFlag)
+{
+    precTable Start = GetBinopPrecedences();
+    uint64_t Hash = UseCache ? HashBytes(Src.data(), Src.size()) : 0;
+    CacheWriter W(Start);
+    size_t Resume = 0;
+
+    ModuleCache Cache;
+    if (Cache.load(Path, Src, Hash, Start))
+    {
+        cachedItem Item;
+        bool Fresh = true;
+        while (Fresh && Cache.next(Item))
+        {
+            switch (Item.Kind)
+            {
+            case cacheItem::item_def:
+                DefineFunction(Item.Func);
+                break;
+            case cacheItem::item_expr:
+                RunTopLevel(*Item.Func);
+                break;
+            default:
+            {
+                ImportModule(Item.Module, tmpFlag);
+
+                // The rest of the source may parse differently with the
+                // operators the module has now.
+                precTable After = GetBinopPrecedences();
+                if (After == Item.After) break;
+                W.adopt(Cache);
+                W.import(Item.Module, Item.Resume, After);
+                Resume = Item.Resume;
+                Fresh = false;
+                break;
+            }
+            }
+        }
+        if (Fresh) return;
+    }
+
+    TokenStream Toks(Src.data(), Src.size(), Resume);
+    GetNextToken(Toks);
+    if (IsModule) ModuleLoop(Toks, tmpFlag, UseCache ? &W : nullptr);
+    else MainLoop(Toks, UseCache ? &W : nullptr);
+    W.save(Path, Src, Hash);
+}
+
 void ExecuteScript(const char* FileName)
 {
     IsInteractive = false;
 
-    FILE* fp = fopen(FileName, "r");
-    if (fp == NULL)
+    SourceFile Script;
+    if (!Script.open(FileName))
     {
         fprintf(stderr, "Error: Unknown file name\n");
         return;
     }
-    while (!feof(fp)) MainCode += (char)fgetc(fp);
-    MainCode += EOF;
-    fclose(fp);
 
     auto start_time = std::chrono::steady_clock::now();
 
     InitBinopPrec();
-    GetNextToken(MainCode, MainIdx);
-    MainLoop(MainCode, MainIdx);
+    RunSource(FileName, Script, false, false);
 
     auto end_time = std::chrono::steady_clock::now();
     std::chrono::duration<double> diff = end_time - start_time;
     fprintf(stderr, "\nExecution finished (%.3lfs).\n", diff.count());
+    if (MemoStats) PrintMemoStats();
+    if (StackStats) PrintStackStats();
 }
\ No newline at end of file
@@ -5,12 +5,32 @@
 #pragma once
 
 #include "value.h"
+#include "ast.h"
 #include <vector>
 #include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+
+/// SEL_VERSION - The interpreter version. Caches written by another version
+/// are not used.
+#define SEL_VERSION "1.3.0"
 
-extern int MainIdx;
 extern bool IsInteractive;
-extern std::string MainCode;
+extern bool UseVM;
+extern unsigned int FunctionGeneration;
+extern unsigned int StackLimit; // --stack-size, in cells
+extern bool StackStats;         // --stack-stats
+
+/// ControlFlow - A return or break on its way out. The value it carries is
+/// the ordinary result of the expression; blocks and loops stop while one is
+/// in progress.
+typedef enum class ControlFlow
+{
+    ctl_none,
+    ctl_return,
+    ctl_break,
+} controlFlow;
 
 typedef enum class ArrAction
 {
@@ -21,32 +41,145 @@ typedef enum class ArrAction
 
 typedef struct NamedValue
 {
-    std::string Name;
+    int Sym;
     int Addr;
 
     bool IsArr = false;
     std::vector<int> DimInfo;
+    std::vector<int> Strides; // elements between consecutive indices of each dimension
+    elemType ElemType = elemType::elem_value;
 } namedValue;
 
+typedef struct ScopeMark
+{
+    unsigned int StackIdx;
+    unsigned int TblIdx;
+} scopeMark;
+
+/// Memory - The cells of every variable and array, used as a stack.
+///
+/// Cells live in one arena that grows geometrically up to StackLimit; leaving
+/// a scope just moves the top back. alloc returns -1 instead of growing past
+/// the limit. Each thread has one; a pfor worker's is a fixed region of the
+/// arena of the thread running the pfor, so addresses mean the same to both.
 class Memory
 {
-    std::vector<Value> Stack;
+    Value* Cells = nullptr;
+    unsigned int Top = 0;
+    unsigned int Capacity = 0;
+    unsigned int HighWater = 0;
+    bool Region = false;
+
+    bool grow(unsigned int Need);
 public:
-    Value getValue(unsigned int Addr) { return Stack[Addr]; }
-    void setValue(unsigned int Addr, Value Val) { Stack[Addr] = Val; }
-    void deleteScope(unsigned int Addr) { unsigned int size = Stack.size(); for (unsigned int i = Addr; i < size; i++) Stack.pop_back(); }
-    unsigned int push(Value Val) { Stack.push_back(Val); return Stack.size() - 1; }
-    unsigned int getSize() { return Stack.size(); }
+    ~Memory() { if (!Region) free(Cells); }
+
+    // Make room for Count more cells without allocating them.
+    bool reserve(unsigned int Count) { return Count <= Capacity - Top || grow(Count); }
+    // Use the cells Begin to End of Arena, which belongs to another thread.
+    void useRegion(Value* Arena, unsigned int Begin, unsigned int End)
+    {
+        Cells = Arena;
+        Top = HighWater = Begin;
+        Capacity = End;
+        Region = true;
+    }
+
+    Value getValue(unsigned int Addr) { return Cells[Addr]; }
+    void setValue(unsigned int Addr, Value Val) { Cells[Addr] = Val; }
+
+    // Element Idx of a packed int array starting at cell Addr.
+    int getInt(unsigned int Addr, unsigned int Idx)
+    {
+        int32_t Val;
+        memcpy(&Val, (char*)(Cells + Addr) + Idx * sizeof(int32_t), sizeof(Val));
+        return Val;
+    }
+    void setInt(unsigned int Addr, unsigned int Idx, int Val)
+    {
+        int32_t Elem = Val;
+        memcpy((char*)(Cells + Addr) + Idx * sizeof(int32_t), &Elem, sizeof(Elem));
+    }
+
+    void deleteScope(unsigned int Addr) { Top = Addr; }
+    int alloc(unsigned int Count, Value Fill)
+    {
+        if (Count > Capacity - Top && !grow(Count)) return -1;
+        std::fill_n(Cells + Top, Count, Fill);
+        Top += Count;
+        if (Top > HighWater) HighWater = Top;
+        return Top - Count;
+    }
+    int push(Value Val) { return alloc(1, Val); }
+    unsigned int getSize() { return Top; }
+    unsigned int getHighWater() { return HighWater; }
+    Value* data() { return Cells; }
 };
 
 Value LogErrorV(const char* Str);
 
-void HandleDefinition(std::string& Code, int& Idx);
+int InternSymbol(const std::string& Name);
+
+const std::string& SymbolName(int Sym);
+
+scopeMark EnterScope();
+
+void LeaveScope(scopeMark Mark);
+
+bool DeclareVariable(int Sym, Value Val);
+
+Value GetVariable(int Sym);
+
+Value SetVariable(int Sym, Value Val);
+
+Value GetVariableAddr(int Sym);
+
+int BindForVariable(int Sym, Value StartVal);
+
+Value DeclareArr(int Sym, const std::vector<int>& Dims, elemType Type = elemType::elem_value);
+
+Value AccessArr(int Sym, const Value* IdxV, int IdxNum, arrAction Action, Value Val);
+
+Value GetMemory(unsigned int Addr);
+
+void SetMemory(unsigned int Addr, Value Val);
+
+Value* GetMemoryBlock(unsigned int& Size);
+
+void PrintStackStats();
+
+bool IsBound(int Sym);
+
+const namedValue* FindArrayBinding(int Sym);
+
+const namedValue* FindVariableBinding(int Sym, bool Scalar);
+
+std::shared_ptr<FunctionAST> FindFunction(const std::string& Name);
+
+std::shared_ptr<FunctionAST>* GetFunctionSlot(const std::string& Name);
+
+std::vector<FunctionAST*> DefinedFunctions();
+
+void ResolveCallee(const std::string& Callee, callCache& Cache);
+
+Value ExecuteInFrame(ExprAST& E, unsigned int Base);
+
+Value ApplyUnaryOp(char Opcode, Value V);
+
+Value ApplyBinOp(binOp Opcode, Value L, Value R);
+
+Value ApplyIntBinOp(binOp Opcode, int LV, int RV);
+
+Value ApplyDoubleBinOp(binOp Opcode, double LV, double RV);
+
+opFeedback OperandFeedback(const Value& L, const Value& R);
+
+void HandleDefinition(TokenStream& Toks, CacheWriter* W = nullptr);
 
-void HandleTopLevelExpression(std::string& Code, int& Idx);
+void HandleTopLevelExpression(TokenStream& Toks, CacheWriter* W = nullptr);
 
-void HandleImport(std::string& Code, int& Idx, bool tmpFlag);
+void HandleImport(TokenStream& Toks, bool tmpFlag, CacheWriter* W = nullptr);
 
-void MainLoop(std::string& Code, int& Idx);
+void MainLoop(TokenStream& Toks, CacheWriter* W = nullptr);
 
 void ExecuteScript(const char* FileName);
\ No newline at end of file
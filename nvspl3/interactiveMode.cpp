@@ -6,7 +6,7 @@
 
 void RunInteractiveShell()
 {
-    std::string VerStr = "v1.3.0 ";
+    std::string VerStr = "v" SEL_VERSION " ";
     #if defined(_WIN32)
         #if defined(_WIN64)
             #if defined(_M_ARM64)
@@ -58,10 +58,11 @@ void RunInteractiveShell()
     fprintf(stderr, ("SEL " + VerStr + " Interactive Shell\n").c_str());
     fprintf(stderr, "Type \"help;\" for help. Visit https://github.com/moon44432/sel-interpreter for more information.\n\n");
     fprintf(stderr, ">>> ");
-    GetNextToken(MainCode, MainIdx);
+    TokenStream Toks;
+    GetNextToken(Toks);
 
     // Run the main "interpreter loop" now.
-    MainLoop(MainCode, MainIdx);
+    MainLoop(Toks);
 }
 
 void RunHelp()
@@ -0,0 +1,315 @@
+// SEL Project
+// jit.cpp
+
+#include "jit.h"
+#include "execute.h"
+#include "stdfunc.h"
+#include "memo.h"
+#include "vm.h"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define SEL_JIT_AVAILABLE
+#include <sys/mman.h>
+#endif
+
+bool UseJIT = false;
+unsigned int JitThreshold = 1000;
+
+Value* JitMemBase = nullptr;
+unsigned int JitMemSize = 0;
+unsigned int JitCallDepth = 0;
+
+// Passes over a function before its slot types are given up on.
+static const int MaxJitPasses = 16;
+
+jitType JoinType(jitType A, jitType B)
+{
+    if (A == B || B == jitType::jt_none) return A;
+    if (A == jitType::jt_none) return B;
+    return jitType::jt_dyn;
+}
+
+static jitType TypeOf(const Value& V)
+{
+    if (V.getvType() == valueType::val_undef) return jitType::jt_undef;
+    return V.isInt() ? jitType::jt_int : jitType::jt_double;
+}
+
+static jitSlot SlotOf(const Value& V)
+{
+    jitSlot Slot = { 0, tag_undef, 0 };
+    if (V.getvType() == valueType::val_undef) return Slot;
+
+    if (V.isInt())
+    {
+        Slot.Bits = (uint32_t)V.getVal().i;
+        Slot.Tag = tag_int;
+    }
+    else
+    {
+        double D = V.getVal().dbl;
+        memcpy(&Slot.Bits, &D, sizeof(D));
+        Slot.Tag = tag_double;
+    }
+    return Slot;
+}
+
+static Value ValueOf(uint64_t Bits, int Tag)
+{
+    switch (Tag)
+    {
+    case tag_int:
+        return Value((int)(uint32_t)Bits);
+    case tag_double:
+    {
+        double D;
+        memcpy(&D, &Bits, sizeof(D));
+        return Value(D);
+    }
+    case tag_undef:
+        return Value(valueType::val_undef);
+    default:
+        return Value(valueType::val_err);
+    }
+}
+
+static jitPair PairOf(const Value& V)
+{
+    if (V.isErr()) return { 0, tag_err };
+
+    jitSlot Slot = SlotOf(V);
+    return { Slot.Bits, (uint64_t)Slot.Tag };
+}
+
+void JitLogError(const char* Msg)
+{
+    LogErrorV(Msg);
+}
+
+jitPair JitBinary(int Op, uint64_t LBits, int LTag, uint64_t RBits, int RTag)
+{
+    return PairOf(ApplyBinOp((binOp)Op, ValueOf(LBits, LTag), ValueOf(RBits, RTag)));
+}
+
+jitPair JitUnary(int Op, uint64_t Bits, int Tag)
+{
+    return PairOf(ApplyUnaryOp((char)Op, ValueOf(Bits, Tag)));
+}
+
+jitPair JitCallStd(int Id, const jitSlot* Args, int NumArgs)
+{
+    Value Small[8];
+    std::vector<Value> Large;
+    Value* ArgsV = Small;
+    if (NumArgs > 8)
+    {
+        Large.resize(NumArgs);
+        ArgsV = Large.data();
+    }
+    for (int i = 0; i < NumArgs; i++) ArgsV[i] = ValueOf(Args[i].Bits, Args[i].Tag);
+    return PairOf(CallStdFunc(Id, ArgsV, NumArgs));
+}
+
+/// JitCallInterp - Run a call of native code in the interpreter instead, once
+/// native frames are MaxJitCallDepth deep. The VM keeps its frames off the
+/// machine stack, so it goes on there when it is the interpreter in use.
+jitPair JitCallInterp(FunctionAST* F, const jitSlot* Args)
+{
+    int NumArgs = F->argsSize();
+    Value Small[8];
+    std::vector<Value> Large;
+    Value* ArgsV = Small;
+    if (NumArgs > 8)
+    {
+        Large.resize(NumArgs);
+        ArgsV = Large.data();
+    }
+    for (int i = 0; i < NumArgs; i++) ArgsV[i] = ValueOf(Args[i].Bits, Args[i].Tag);
+    Value RetVal = UseVM ? RunVM(*F, ArgsV) : F->execute(ArgsV);
+
+    // The interpreter may have grown stack memory and moved it; the native
+    // callers reload it from here.
+    JitMemBase = GetMemoryBlock(JitMemSize);
+    return PairOf(RetVal);
+}
+
+JitUnit::~JitUnit()
+{
+#ifdef SEL_JIT_AVAILABLE
+    if (Code) munmap(Code, CodeSize);
+#endif
+}
+
+/// InstallCode - Copy machine code into executable memory.
+static bool InstallCode(JitUnit& U, const std::vector<uint8_t>& Bytes)
+{
+#ifdef SEL_JIT_AVAILABLE
+    void* Mem = mmap(nullptr, Bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mem == MAP_FAILED) return false;
+
+    memcpy(Mem, Bytes.data(), Bytes.size());
+    if (mprotect(Mem, Bytes.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(Mem, Bytes.size());
+        return false;
+    }
+    U.Code = Mem;
+    U.CodeSize = Bytes.size();
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// GetJitFunction - Return the native code state of F. Units compiled before a
+/// function was (re)defined may call stale code and are dropped.
+static JitFunction& GetJitFunction(FunctionAST& F)
+{
+    std::shared_ptr<JitFunction>& Native = F.getNative();
+    if (!Native) Native = std::make_shared<JitFunction>();
+
+    if (Native->Generation != FunctionGeneration)
+    {
+        Native->Units.clear();
+        Native->Last = nullptr;
+        Native->Generation = FunctionGeneration;
+    }
+    return *Native;
+}
+
+/// CompileUnit - Compile F for the signature of U. Every pass assumes the slot
+/// and return types found by the previous one, until they stop changing.
+static void CompileUnit(FunctionAST& F, JitUnit& U)
+{
+    std::vector<jitType> SlotTypes = U.Signature;
+    jitType RetType = jitType::jt_none;
+
+    U.Compiling = true;
+    U.Failed = true;
+    for (int Pass = 0; Pass < MaxJitPasses; Pass++)
+    {
+        U.Arrays.clear();
+        U.Messages.clear();
+
+        JitCompiler J(F, U, SlotTypes, RetType);
+        J.compileBody();
+        if (J.Failed) break;
+
+        bool Stable = JoinType(RetType, J.NextRetType) == RetType;
+        SlotTypes.resize(J.NextSlotTypes.size(), jitType::jt_none);
+        for (int i = 0; i < SlotTypes.size(); i++)
+        {
+            jitType Joined = JoinType(SlotTypes[i], J.NextSlotTypes[i]);
+            Stable &= Joined == SlotTypes[i];
+            SlotTypes[i] = Joined;
+        }
+        RetType = JoinType(RetType, J.NextRetType);
+        if (!Stable) continue;
+
+        if (!InstallCode(U, J.A.code())) break;
+        U.RetType = RetType;
+        U.Failed = false;
+
+        for (int Sym : J.LocalSyms)
+            if (Sym >= 0) U.LocalSyms.insert(Sym);
+        for (auto& Arr : U.Arrays) U.UsedArrays.push_back(Arr.get());
+        for (JitUnit* Callee : J.Callees)
+        {
+            U.LocalSyms.insert(Callee->LocalSyms.begin(), Callee->LocalSyms.end());
+            for (jitArray* Arr : Callee->UsedArrays)
+                if (std::find(U.UsedArrays.begin(), U.UsedArrays.end(), Arr) == U.UsedArrays.end())
+                    U.UsedArrays.push_back(Arr);
+        }
+        break;
+    }
+    U.Compiling = false;
+}
+
+/// FindUnit - Return the unit of F for Signature, compiling it on first use.
+/// The unit may have failed to compile.
+static JitUnit* FindUnit(FunctionAST& F, const std::vector<jitType>& Signature)
+{
+    if (F.getFuncName() == "__anon_expr" || GetMemo(F)) return nullptr;
+
+    JitFunction& Native = GetJitFunction(F);
+    for (auto& U : Native.Units)
+        if (U->Signature == Signature) return U.get();
+
+    Native.Units.emplace_back(new JitUnit());
+    JitUnit* U = Native.Units.back().get();
+    U->Signature = Signature;
+    CompileUnit(F, *U);
+    return U;
+}
+
+JitUnit* GetJitUnit(FunctionAST& F, const std::vector<jitType>& Signature)
+{
+    JitUnit* U = FindUnit(F, Signature);
+    return U && !U->Failed ? U : nullptr;
+}
+
+static bool SameSignature(const JitUnit& U, const Value* Args, int NumArgs)
+{
+    for (int i = 0; i < NumArgs; i++)
+        if (U.Signature[i] != TypeOf(Args[i])) return false;
+    return true;
+}
+
+/// RunNative - Run F as native code once it is hot. Returns false when the
+/// interpreter has to run the call instead.
+bool RunNative(FunctionAST& F, const Value* Args, int NumArgs, Value& RetVal)
+{
+#ifdef SEL_JIT_AVAILABLE
+    JitFunction& Native = GetJitFunction(F);
+    if (Native.CallCount < JitThreshold)
+    {
+        Native.CallCount++;
+        return false;
+    }
+    if (JitCallDepth >= MaxJitCallDepth) return false;
+
+    JitUnit* U = Native.Last;
+    if (!U || !SameSignature(*U, Args, NumArgs))
+    {
+        std::vector<jitType> Signature;
+        for (int i = 0; i < NumArgs; i++) Signature.push_back(TypeOf(Args[i]));
+        if (!(U = FindUnit(F, Signature))) return false;
+        Native.Last = U;
+    }
+    if (U->Failed) return false;
+
+    // Native code keeps its locals to itself, which only holds while nobody
+    // else has bound their names.
+    for (int Sym : U->LocalSyms)
+        if (IsBound(Sym)) return false;
+
+    for (jitArray* Arr : U->UsedArrays)
+    {
+        const namedValue* Binding = FindArrayBinding(Arr->Sym);
+        if (!Binding || Binding->DimInfo.size() != Arr->NumDims) return false;
+        if (Binding->ElemType != elemType::elem_value) return false; // native code reads whole cells
+
+        Arr->Info[0] = Binding->Addr;
+        std::copy(Binding->Strides.begin(), Binding->Strides.end(), &Arr->Info[1]);
+    }
+    JitMemBase = GetMemoryBlock(JitMemSize);
+
+    jitSlot Small[8];
+    std::vector<jitSlot> Large;
+    jitSlot* Slots = Small;
+    if (NumArgs > 8)
+    {
+        Large.resize(NumArgs);
+        Slots = Large.data();
+    }
+    for (int i = 0; i < NumArgs; i++) Slots[i] = SlotOf(Args[i]);
+
+    jitPair Result = ((jitEntry)U->Code)(Slots);
+    RetVal = ValueOf(Result.Bits, (int)Result.Tag);
+    return true;
+#else
+    return false;
+#endif
+}
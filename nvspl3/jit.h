@@ -0,0 +1,194 @@
+// SEL Project
+// jit.h
+
+#pragma once
+
+#include "value.h"
+#include "ast.h"
+#include "x64.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <deque>
+#include <set>
+#include <cstdint>
+
+extern bool UseJIT;
+extern unsigned int JitThreshold;
+
+jitType JoinType(jitType A, jitType B);
+
+// Runtime tags of dynamic values.
+enum JitTag
+{
+    tag_undef = 0,
+    tag_int = 1,
+    tag_double = 2,
+    tag_err = 3, // only in values returned by native code and helpers
+};
+
+/// JitSlot - A variable, temporary or argument of native code.
+typedef struct JitSlot
+{
+    uint64_t Bits;
+    int32_t Tag;
+    int32_t Depth; // scope depth a local was declared at, -1 while it is not
+} jitSlot;
+
+/// JitPair - A value returned by native code or a runtime helper, in rax:rdx.
+typedef struct JitPair
+{
+    uint64_t Bits;
+    uint64_t Tag;
+} jitPair;
+
+typedef jitPair (*jitEntry)(const jitSlot* Args);
+
+// Runtime state and helpers used by native code.
+extern Value* JitMemBase;
+extern unsigned int JitMemSize;
+
+// Native frames live on the machine stack, so a recursion deeper than this
+// goes on in the interpreter.
+static const unsigned int MaxJitCallDepth = 1000;
+extern unsigned int JitCallDepth; // native frames active
+
+void JitLogError(const char* Msg);
+jitPair JitBinary(int Op, uint64_t LBits, int LTag, uint64_t RBits, int RTag);
+jitPair JitUnary(int Op, uint64_t Bits, int Tag);
+jitPair JitCallStd(int Id, const jitSlot* Args, int NumArgs);
+jitPair JitCallInterp(FunctionAST* F, const jitSlot* Args);
+
+/// JitArray - An array referenced by native code. Arrays are found through the
+/// dynamic scope, so the binding is looked up each time native code is entered.
+typedef struct JitArray
+{
+    int Sym;
+    int NumDims;
+    std::unique_ptr<int[]> Info; // base address, then the stride of each dimension
+} jitArray;
+
+/// JitUnit - The native code of a function for one signature of argument types.
+struct JitUnit
+{
+    std::vector<jitType> Signature;
+    jitType RetType = jitType::jt_none;
+    bool Compiling = false;
+    bool Failed = false;
+
+    void* Code = nullptr;
+    size_t CodeSize = 0;
+
+    std::vector<std::unique_ptr<jitArray>> Arrays;
+    std::deque<std::string> Messages;   // error texts referenced by the code
+    std::set<int> LocalSyms;            // locals of this unit and every callee
+    std::vector<jitArray*> UsedArrays;  // arrays of this unit and every callee
+
+    ~JitUnit();
+};
+
+/// JitFunction - Native code state of a FunctionAST.
+struct JitFunction
+{
+    unsigned int Generation = 0;
+    unsigned int CallCount = 0;
+    std::vector<std::unique_ptr<JitUnit>> Units;
+    JitUnit* Last = nullptr; // unit of the previous call, possibly a failed one
+};
+
+/// JitCompiler - Lowers the AST of a function into x86-64 code for one
+/// signature, assuming the slot and return types found by the previous pass.
+///
+/// SEL is dynamically scoped, so the compiled subset is restricted to code
+/// whose variables cannot be seen by anyone else: arguments, and locals that
+/// are not bound when the code is entered (checked on entry) and are not used
+/// by any callee. Everything else makes the unit fail and the interpreter
+/// keeps running the function.
+class JitCompiler
+{
+    typedef struct LoopInfo
+    {
+        int Exit;
+    } loopInfo;
+
+    FunctionAST& F;
+    JitUnit& Unit;
+    std::vector<loopInfo> Loops;
+    std::vector<std::set<int>> Scopes; // local slots assigned in each open scope
+    int Epilogue, FnErr, Entry;
+    int NumTemps = 0;
+
+public:
+    Assembler A;
+    bool Failed = false;
+
+    std::vector<jitType> SlotTypes, NextSlotTypes; // arguments, then locals
+    std::vector<int> LocalSyms;                    // symbol of each local slot
+    std::set<int> AssignedLocals, ArraySyms;
+    std::vector<JitUnit*> Callees;
+    bool CallsSelf = false;
+    jitType RetType, NextRetType = jitType::jt_none;
+
+    int ErrTarget;           // label errors jump to
+    int ScopeDepth = 1;
+    bool BreakOK = false;    // a break here reaches the innermost loop
+    bool ReturnOK = true;    // a return here leaves the function
+    int MaxTemps = 0;
+
+    JitCompiler(FunctionAST& F, JitUnit& Unit, std::vector<jitType> SlotTypes, jitType RetType);
+
+    void fail() { Failed = true; }
+    void compileBody();
+
+    // frame
+    int numVars() const { return SlotTypes.size(); }
+    int varDisp(int Slot) const { return 16 * Slot; }             // [rsp + disp]
+    int tempDisp(int Temp) const { return -16 - 16 * (Temp + 1); } // [rbp + disp]
+    int allocTemps(int N);
+    void freeTemps(int N) { NumTemps -= N; }
+    int localSlot(int Sym);
+
+    // values
+    void storeValue(jitType T, reg Base, int Disp);
+    jitType loadValue(jitType T, reg Base, int Disp);
+    void loadInt(jitType T, reg Base, int Disp, reg Dst);
+    void loadDouble(jitType T, reg Base, int Disp, xreg Dst);
+    void loadDynRegs(jitType T, reg Base, int Disp, reg Bits, reg Tag);
+    void toDyn(jitType T);
+    void toInt(jitType T);
+    void toDouble(jitType T);
+    void convert(jitType From, jitType To);
+    void testFalse(jitType T, int IfFalse);
+    void truthToEax(xreg X);
+
+    // variables and memory
+    void storeVar(int Slot, jitType T);
+    jitType loadVar(int Slot);
+    void declareLocal(int Slot);
+    void checkLocal(int Slot, int Sym);
+    bool arrayAddress(int Sym, const ExprList& Indices);
+    void loadMemory();
+    void cellPointer();
+    jitType readCell();
+    void writeCell(jitType T);
+    void checkAddress(jitType T);
+
+    // control
+    const char* message(const std::string& Text);
+    void logError(const std::string& Text);
+    void beginScope();
+    std::set<int> endScope();
+    void cleanup(const std::set<int>& Slots, int Depth);
+    void errorPad(int Pad, const std::set<int>& Slots, int OuterErr);
+    void beginLoop(int Exit) { Loops.push_back({ Exit }); }
+    void endLoop() { Loops.pop_back(); }
+    int loopExit() const { return Loops.back().Exit; }
+    void emitReturn(jitType T);
+
+    // calls
+    jitType callUnit(FunctionAST* Callee, const std::vector<jitType>& Types, int ArgsDisp);
+};
+
+bool RunNative(FunctionAST& F, const Value* Args, int NumArgs, Value& RetVal);
+
+JitUnit* GetJitUnit(FunctionAST& F, const std::vector<jitType>& Signature);
@@ -0,0 +1,1397 @@
+// SEL Project
+// jitcompiler.cpp
+
+#include "jit.h"
+#include "execute.h"
+#include "stdfunc.h"
+#include <cstring>
+#include <cmath>
+
+// Native code keeps an integer in eax (zero-extended into rax), a double in
+// xmm0 and a dynamic value as bits in rax and tag in edx. Arguments and locals
+// live in slots above rsp, temporaries in slots below the saved registers.
+// Memory cells are accessed in place as one NaN-boxed 64-bit word each: a
+// double as its own bits, or a tag in the top 16 bits (Value::IntTag with the
+// int in the low 32 bits, UndefBits, ErrBits); see readCell and writeCell.
+static_assert(sizeof(Value) == 8, "native code assumes NaN-boxed 8-byte memory cells");
+
+static double (*const FmodFn)(double, double) = fmod;
+static double (*const PowFn)(double, double) = pow;
+
+static uint64_t DoubleBits(double D)
+{
+    uint64_t Bits;
+    memcpy(&Bits, &D, sizeof(Bits));
+    return Bits;
+}
+
+/// ValuePosition - Marks the expressions compiled while it is alive as operands.
+/// A break or return there would be turned into data by the tree-walker instead
+/// of leaving the loop or the function, so such code is not compiled.
+struct ValuePosition
+{
+    JitCompiler& J;
+    bool Break, Return;
+
+    ValuePosition(JitCompiler& J) : J(J), Break(J.BreakOK), Return(J.ReturnOK) { J.BreakOK = J.ReturnOK = false; }
+    ~ValuePosition() { J.BreakOK = Break; J.ReturnOK = Return; }
+};
+
+/// LoopBody - Compiles a loop body, where a break leaves the loop and a return
+/// propagates as far as it would from the loop itself.
+struct LoopBody
+{
+    JitCompiler& J;
+    bool Break;
+
+    LoopBody(JitCompiler& J, int Exit) : J(J), Break(J.BreakOK) { J.BreakOK = true; J.beginLoop(Exit); }
+    ~LoopBody() { J.BreakOK = Break; J.endLoop(); }
+};
+
+JitCompiler::JitCompiler(FunctionAST& F, JitUnit& Unit, std::vector<jitType> SlotTypes, jitType RetType)
+    : F(F), Unit(Unit), SlotTypes(std::move(SlotTypes)), RetType(RetType)
+{
+    NextSlotTypes = Unit.Signature;
+    NextSlotTypes.resize(this->SlotTypes.size(), jitType::jt_none);
+    for (int i = F.argsSize(); i < this->SlotTypes.size(); i++) LocalSyms.push_back(-1);
+}
+
+int JitCompiler::allocTemps(int N)
+{
+    int Temp = NumTemps;
+    NumTemps += N;
+    if (NumTemps > MaxTemps) MaxTemps = NumTemps;
+    return Temp;
+}
+
+/// localSlot - Return the slot of a local. Locals are numbered in the order they
+/// are met, which is the same in every pass.
+int JitCompiler::localSlot(int Sym)
+{
+    int NumArgs = F.argsSize();
+    for (int i = 0; i < LocalSyms.size(); i++)
+    {
+        if (LocalSyms[i] == Sym) return NumArgs + i;
+        if (LocalSyms[i] < 0)
+        {
+            LocalSyms[i] = Sym;
+            return NumArgs + i;
+        }
+    }
+    LocalSyms.push_back(Sym);
+    SlotTypes.push_back(jitType::jt_none);
+    NextSlotTypes.push_back(jitType::jt_none);
+    return NumArgs + LocalSyms.size() - 1;
+}
+
+void JitCompiler::storeValue(jitType T, reg Base, int Disp)
+{
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.store64(Base, Disp, reg::rax);
+        A.storeImm32(Base, Disp + 8, tag_int);
+        break;
+    case jitType::jt_double:
+        A.movsdStore(Base, Disp, xreg::xmm0);
+        A.storeImm32(Base, Disp + 8, tag_double);
+        break;
+    case jitType::jt_undef:
+        A.storeImm32(Base, Disp, 0);
+        A.storeImm32(Base, Disp + 4, 0);
+        A.storeImm32(Base, Disp + 8, tag_undef);
+        break;
+    case jitType::jt_dyn:
+        A.store64(Base, Disp, reg::rax);
+        A.store32(Base, Disp + 8, reg::rdx);
+        break;
+    default:
+        break;
+    }
+}
+
+jitType JitCompiler::loadValue(jitType T, reg Base, int Disp)
+{
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.load32(reg::rax, Base, Disp);
+        break;
+    case jitType::jt_double:
+        A.movsdLoad(xreg::xmm0, Base, Disp);
+        break;
+    case jitType::jt_dyn:
+        A.load64(reg::rax, Base, Disp);
+        A.load32(reg::rdx, Base, Disp + 8);
+        break;
+    default:
+        break;
+    }
+    return T;
+}
+
+void JitCompiler::loadInt(jitType T, reg Base, int Disp, reg Dst)
+{
+    if (T == jitType::jt_int) A.load32(Dst, Base, Disp);
+    else A.alu32(aluOp::alu_xor, Dst, Dst);
+}
+
+void JitCompiler::loadDouble(jitType T, reg Base, int Disp, xreg Dst)
+{
+    if (T == jitType::jt_double) A.movsdLoad(Dst, Base, Disp);
+    else if (T == jitType::jt_int)
+    {
+        A.load32(reg::r11, Base, Disp);
+        A.cvtsi2sd(Dst, reg::r11);
+    }
+    else A.xorpd(Dst, Dst);
+}
+
+void JitCompiler::loadDynRegs(jitType T, reg Base, int Disp, reg Bits, reg Tag)
+{
+    switch (T)
+    {
+    case jitType::jt_dyn:
+        A.load64(Bits, Base, Disp);
+        A.load32(Tag, Base, Disp + 8);
+        break;
+    case jitType::jt_int:
+        A.load32(Bits, Base, Disp);
+        A.movImm32(Tag, tag_int);
+        break;
+    case jitType::jt_double:
+        A.load64(Bits, Base, Disp);
+        A.movImm32(Tag, tag_double);
+        break;
+    default:
+        A.alu32(aluOp::alu_xor, Bits, Bits);
+        A.movImm32(Tag, tag_undef);
+        break;
+    }
+}
+
+void JitCompiler::toDyn(jitType T)
+{
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.movImm32(reg::rdx, tag_int);
+        break;
+    case jitType::jt_double:
+        A.movqFromX(reg::rax, xreg::xmm0);
+        A.movImm32(reg::rdx, tag_double);
+        break;
+    case jitType::jt_dyn:
+        break;
+    default:
+        A.alu32(aluOp::alu_xor, reg::rax, reg::rax);
+        A.movImm32(reg::rdx, tag_undef);
+        break;
+    }
+}
+
+void JitCompiler::toInt(jitType T)
+{
+    if (T != jitType::jt_int) A.alu32(aluOp::alu_xor, reg::rax, reg::rax);
+}
+
+void JitCompiler::toDouble(jitType T)
+{
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.cvtsi2sd(xreg::xmm0, reg::rax);
+        break;
+    case jitType::jt_double:
+        break;
+    case jitType::jt_dyn:
+    {
+        int IsDouble = A.newLabel(), Done = A.newLabel();
+        A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+        A.jcc(cond::cc_e, IsDouble);
+        A.cvtsi2sd(xreg::xmm0, reg::rax); // an undefined value holds 0
+        A.jmp(Done);
+        A.bind(IsDouble);
+        A.movqToX(xreg::xmm0, reg::rax);
+        A.bind(Done);
+        break;
+    }
+    default:
+        A.xorpd(xreg::xmm0, xreg::xmm0);
+        break;
+    }
+}
+
+void JitCompiler::convert(jitType From, jitType To)
+{
+    if (From == To || From == jitType::jt_none) return;
+    if (To == jitType::jt_dyn) toDyn(From);
+    else if (To == jitType::jt_double) toDouble(From);
+    else if (To == jitType::jt_int) toInt(From);
+}
+
+/// testFalse - Jump to IfFalse unless the value is true. Like getdVal() in the
+/// tree-walker, a NaN counts as true.
+void JitCompiler::testFalse(jitType T, int IfFalse)
+{
+    int IsTrue = A.newLabel();
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+        A.jcc(cond::cc_e, IfFalse);
+        break;
+    case jitType::jt_double:
+        A.xorpd(xreg::xmm1, xreg::xmm1);
+        A.ucomisd(xreg::xmm0, xreg::xmm1);
+        A.jcc(cond::cc_p, IsTrue);
+        A.jcc(cond::cc_e, IfFalse);
+        break;
+    case jitType::jt_dyn:
+    {
+        int IsInt = A.newLabel();
+        A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+        A.jcc(cond::cc_ne, IsInt);
+        A.movqToX(xreg::xmm0, reg::rax);
+        A.xorpd(xreg::xmm1, xreg::xmm1);
+        A.ucomisd(xreg::xmm0, xreg::xmm1);
+        A.jcc(cond::cc_p, IsTrue);
+        A.jcc(cond::cc_e, IfFalse);
+        A.jmp(IsTrue);
+        A.bind(IsInt);
+        A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+        A.jcc(cond::cc_e, IfFalse);
+        break;
+    }
+    default:
+        A.jmp(IfFalse);
+        break;
+    }
+    A.bind(IsTrue);
+}
+
+/// truthToEax - eax = (bool)X, clobbering rcx and xmm2.
+void JitCompiler::truthToEax(xreg X)
+{
+    A.xorpd(xreg::xmm2, xreg::xmm2);
+    A.ucomisd(X, xreg::xmm2);
+    A.setcc(cond::cc_ne, reg::rax);
+    A.setcc(cond::cc_p, reg::rcx);
+    A.movzx8(reg::rax, reg::rax);
+    A.movzx8(reg::rcx, reg::rcx);
+    A.alu32(aluOp::alu_or, reg::rax, reg::rcx);
+}
+
+void JitCompiler::storeVar(int Slot, jitType T)
+{
+    storeValue(T, reg::rsp, varDisp(Slot));
+    NextSlotTypes[Slot] = JoinType(NextSlotTypes[Slot], T);
+}
+
+jitType JitCompiler::loadVar(int Slot)
+{
+    return loadValue(SlotTypes[Slot], reg::rsp, varDisp(Slot));
+}
+
+/// declareLocal - An assignment to a local that is not bound declares it in the
+/// innermost scope, like SetVariable does.
+void JitCompiler::declareLocal(int Slot)
+{
+    int Bound = A.newLabel();
+    A.cmpImm32(reg::rsp, varDisp(Slot) + 12, (uint32_t)-1);
+    A.jcc(cond::cc_ne, Bound);
+    A.storeImm32(reg::rsp, varDisp(Slot) + 12, ScopeDepth);
+    A.bind(Bound);
+
+    AssignedLocals.insert(LocalSyms[Slot - F.argsSize()]);
+    if (!Scopes.empty()) Scopes.back().insert(Slot);
+}
+
+void JitCompiler::checkLocal(int Slot, int Sym)
+{
+    int Bound = A.newLabel();
+    A.cmpImm32(reg::rsp, varDisp(Slot) + 12, (uint32_t)-1);
+    A.jcc(cond::cc_ne, Bound);
+    logError("Identifier \"" + SymbolName(Sym) + "\" not found");
+    A.bind(Bound);
+}
+
+/// arrayAddress - Compute the address of an array element into eax. The base
+/// and the strides of the array are filled in when native code is entered.
+bool JitCompiler::arrayAddress(int Sym, const ExprList& Indices)
+{
+    jitArray* Arr = nullptr;
+    for (auto& Known : Unit.Arrays)
+        if (Known->Sym == Sym) Arr = Known.get();
+    if (!Arr)
+    {
+        Unit.Arrays.push_back(std::unique_ptr<jitArray>(new jitArray{ Sym, (int)Indices.size(), std::unique_ptr<int[]>(new int[Indices.size() + 1]) }));
+        Arr = Unit.Arrays.back().get();
+    }
+    if (Arr->NumDims != Indices.size())
+    {
+        fail();
+        return false;
+    }
+    ArraySyms.insert(Sym);
+
+    int Acc = tempDisp(allocTemps(1));
+    int OuterErr = ErrTarget, IdxErr = A.newLabel();
+    for (int k = 0; k < Indices.size(); k++)
+    {
+        ErrTarget = IdxErr;
+        jitType T = Indices[k]->jit(*this);
+        ErrTarget = OuterErr;
+
+        if (T == jitType::jt_double) logError("Index must be an integer");
+        else if (T == jitType::jt_dyn)
+        {
+            int IsInt = A.newLabel();
+            A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+            A.jcc(cond::cc_ne, IsInt);
+            logError("Index must be an integer");
+            A.bind(IsInt);
+        }
+        else toInt(T);
+
+        A.movImm64(reg::rcx, Arr->Info.get());
+        A.imul32Mem(reg::rax, reg::rcx, 4 * (k + 1));
+        if (k > 0) A.alu32Mem(aluOp::alu_add, reg::rax, reg::rbp, Acc);
+        A.store32(reg::rbp, Acc, reg::rax);
+    }
+    A.movImm64(reg::rcx, Arr->Info.get());
+    A.alu32Mem(aluOp::alu_add, reg::rax, reg::rcx, 0);
+    freeTemps(1);
+
+    if (A.used(IdxErr))
+    {
+        int Done = A.newLabel();
+        A.jmp(Done);
+        A.bind(IdxErr);
+        logError("Error while calculating indices");
+        A.bind(Done);
+    }
+    return true;
+}
+
+/// cellPointer - rcx = &StackMemory[eax].
+void JitCompiler::cellPointer()
+{
+    int InRange = A.newLabel();
+    A.alu32(aluOp::alu_cmp, reg::rax, reg::r13);
+    A.jcc(cond::cc_b, InRange);
+    logError("Address out of range");
+    A.bind(InRange);
+
+    A.alu32(aluOp::alu_mov, reg::rcx, reg::rax);
+    A.shl64(reg::rcx, 3);
+    A.alu64(aluOp::alu_add, reg::rcx, reg::r12);
+}
+
+/// loadMemory - Load the base and size of stack memory into r12 and r13,
+/// leaving rax and rdx alone.
+void JitCompiler::loadMemory()
+{
+    A.movImm64(reg::r12, &JitMemBase);
+    A.load64(reg::r12, reg::r12, 0);
+    A.movImm64(reg::r13, &JitMemSize);
+    A.load32(reg::r13, reg::r13, 0);
+}
+
+/// readCell - Load the Value at rcx as a dynamic value, unboxing it by the
+/// top 16 bits: below the int tag it is a double, above it undef (an error
+/// cell reads as undef too).
+jitType JitCompiler::readCell()
+{
+    int Double = A.newLabel(), Int = A.newLabel(), Done = A.newLabel();
+    A.load64(reg::rax, reg::rcx, 0);
+    A.alu64(aluOp::alu_mov, reg::rdx, reg::rax);
+    A.shr64(reg::rdx, 48);
+    A.aluImm32(aluOp::alu_cmp, reg::rdx, (uint32_t)(Value::IntTag >> 48));
+    A.jcc(cond::cc_b, Double);
+    A.jcc(cond::cc_e, Int);
+    A.alu32(aluOp::alu_xor, reg::rax, reg::rax);
+    A.alu32(aluOp::alu_xor, reg::rdx, reg::rdx);
+    A.jmp(Done);
+
+    A.bind(Int);
+    A.alu32(aluOp::alu_mov, reg::rax, reg::rax);
+    A.movImm32(reg::rdx, tag_int);
+    A.jmp(Done);
+
+    A.bind(Double);
+    A.movImm32(reg::rdx, tag_double);
+    A.bind(Done);
+    return jitType::jt_dyn;
+}
+
+/// writeCell - Store the value in registers as the Value at rcx, keeping it in registers.
+void JitCompiler::writeCell(jitType T)
+{
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.alu32(aluOp::alu_mov, reg::r8, reg::rax);
+        A.movImm64(reg::r9, Value::IntTag);
+        A.alu64(aluOp::alu_or, reg::r8, reg::r9);
+        A.store64(reg::rcx, 0, reg::r8);
+        break;
+    case jitType::jt_double:
+        A.movsdStore(reg::rcx, 0, xreg::xmm0);
+        break;
+    case jitType::jt_dyn:
+    {
+        int Boxed = A.newLabel(), Undef = A.newLabel(), Done = A.newLabel();
+        A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+        A.jcc(cond::cc_ne, Boxed);
+        A.store64(reg::rcx, 0, reg::rax);
+        A.jmp(Done);
+
+        A.bind(Boxed);
+        A.alu32(aluOp::alu_test, reg::rdx, reg::rdx);
+        A.jcc(cond::cc_e, Undef);
+        A.alu32(aluOp::alu_mov, reg::r8, reg::rax);
+        A.movImm64(reg::r9, Value::IntTag);
+        A.alu64(aluOp::alu_or, reg::r8, reg::r9);
+        A.store64(reg::rcx, 0, reg::r8);
+        A.jmp(Done);
+
+        A.bind(Undef);
+        A.movImm64(reg::r8, Value::UndefBits);
+        A.store64(reg::rcx, 0, reg::r8);
+        A.bind(Done);
+        break;
+    }
+    default:
+        A.movImm64(reg::r8, Value::UndefBits);
+        A.store64(reg::rcx, 0, reg::r8);
+        break;
+    }
+}
+
+/// checkAddress - Check that the value in registers is an unsigned integer and
+/// leave it in eax.
+void JitCompiler::checkAddress(jitType T)
+{
+    const char* Msg = "Address must be an unsigned integer";
+    int Valid = A.newLabel();
+    switch (T)
+    {
+    case jitType::jt_int:
+        A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+        A.jcc(cond::cc_ns, Valid);
+        logError(Msg);
+        break;
+    case jitType::jt_double:
+        logError(Msg);
+        break;
+    case jitType::jt_dyn:
+    {
+        int Invalid = A.newLabel();
+        A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+        A.jcc(cond::cc_e, Invalid);
+        A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+        A.jcc(cond::cc_ns, Valid);
+        A.bind(Invalid);
+        logError(Msg);
+        break;
+    }
+    default:
+        toInt(T);
+        break;
+    }
+    A.bind(Valid);
+}
+
+const char* JitCompiler::message(const std::string& Text)
+{
+    for (auto& Msg : Unit.Messages)
+        if (Msg == Text) return Msg.c_str();
+    Unit.Messages.push_back(Text);
+    return Unit.Messages.back().c_str();
+}
+
+/// logError - Report an error and jump to the current error target.
+void JitCompiler::logError(const std::string& Text)
+{
+    A.movImm64(reg::rdi, message(Text));
+    A.call((const void*)JitLogError);
+    A.jmp(ErrTarget);
+}
+
+void JitCompiler::beginScope()
+{
+    ScopeDepth++;
+    Scopes.emplace_back();
+}
+
+std::set<int> JitCompiler::endScope()
+{
+    std::set<int> Slots = Scopes.back();
+    Scopes.pop_back();
+    ScopeDepth--;
+    if (!Scopes.empty()) Scopes.back().insert(Slots.begin(), Slots.end());
+    return Slots;
+}
+
+/// cleanup - Unbind the locals declared deeper than Depth, as LeaveScope does.
+void JitCompiler::cleanup(const std::set<int>& Slots, int Depth)
+{
+    for (int Slot : Slots)
+    {
+        int Keep = A.newLabel();
+        A.cmpImm32(reg::rsp, varDisp(Slot) + 12, Depth);
+        A.jcc(cond::cc_le, Keep);
+        A.storeImm32(reg::rsp, varDisp(Slot) + 12, (uint32_t)-1);
+        A.bind(Keep);
+    }
+}
+
+/// errorPad - Errors raised inside a scope leave it before they propagate.
+void JitCompiler::errorPad(int Pad, const std::set<int>& Slots, int OuterErr)
+{
+    if (!A.used(Pad)) return;
+
+    int Skip = A.newLabel();
+    A.jmp(Skip);
+    A.bind(Pad);
+    cleanup(Slots, ScopeDepth);
+    A.jmp(OuterErr);
+    A.bind(Skip);
+}
+
+void JitCompiler::emitReturn(jitType T)
+{
+    if (T == jitType::jt_none) return;
+
+    toDyn(T);
+    NextRetType = JoinType(NextRetType, T);
+    A.jmp(Epilogue);
+}
+
+/// callUnit - Call the native code of Callee with the arguments stored at
+/// [rbp + ArgsDisp]. The callee is compiled right away if needed.
+jitType JitCompiler::callUnit(FunctionAST* Callee, const std::vector<jitType>& Types, int ArgsDisp)
+{
+    std::vector<jitType> Signature;
+    for (jitType T : Types) Signature.push_back(T == jitType::jt_none ? jitType::jt_int : T);
+
+    jitType Result;
+    if (Callee == &F && Signature == Unit.Signature)
+    {
+        A.lea(reg::rdi, reg::rbp, ArgsDisp);
+        A.call(Entry);
+        Result = RetType;
+        CallsSelf = true;
+    }
+    else
+    {
+        JitUnit* U = GetJitUnit(*Callee, Signature);
+        if (!U || U->Compiling)
+        {
+            fail();
+            return jitType::jt_none;
+        }
+        A.lea(reg::rdi, reg::rbp, ArgsDisp);
+        A.call(U->Code);
+        Result = U->RetType;
+        Callees.push_back(U);
+    }
+    // A call past MaxJitCallDepth runs in the interpreter, which may move
+    // stack memory.
+    loadMemory();
+
+    A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_err);
+    A.jcc(cond::cc_e, ErrTarget);
+    if (Result == jitType::jt_double) A.movqToX(xreg::xmm0, reg::rax);
+    return Result;
+}
+
+void JitCompiler::compileBody()
+{
+    Epilogue = A.newLabel(), FnErr = A.newLabel(), Entry = A.newLabel();
+    int Init = A.newLabel(), Body = A.newLabel(), Deep = A.newLabel();
+
+    // Every native call counts itself in JitCallDepth; past the limit the
+    // interpreter takes the call over.
+    A.bind(Entry);
+    A.movImm64(reg::rcx, &JitCallDepth);
+    A.cmpImm32(reg::rcx, 0, MaxJitCallDepth);
+    A.jcc(cond::cc_ae, Deep);
+    A.load32(reg::rax, reg::rcx, 0);
+    A.aluImm32(aluOp::alu_add, reg::rax, 1);
+    A.store32(reg::rcx, 0, reg::rax);
+
+    // prologue: rsp stays 16-byte aligned so helpers can be called anywhere
+    A.push(reg::rbp);
+    A.alu64(aluOp::alu_mov, reg::rbp, reg::rsp);
+    A.push(reg::r12);
+    A.push(reg::r13);
+    A.aluImm64(aluOp::alu_sub, reg::rsp, 0);
+    int FrameAt = A.size() - 4;
+    loadMemory();
+    for (int i = 0; i < F.argsSize(); i++)
+    {
+        A.load64(reg::rax, reg::rdi, 16 * i);
+        A.store64(reg::rsp, varDisp(i), reg::rax);
+        A.load32(reg::rax, reg::rdi, 16 * i + 8);
+        A.store32(reg::rsp, varDisp(i) + 8, reg::rax);
+    }
+    A.jmp(Init);
+    A.bind(Body);
+
+    ErrTarget = FnErr;
+    emitReturn(F.getBody()->jit(*this));
+
+    A.bind(FnErr);
+    A.alu32(aluOp::alu_xor, reg::rax, reg::rax);
+    A.movImm32(reg::rdx, tag_err);
+
+    A.bind(Epilogue);
+    A.lea(reg::rsp, reg::rbp, -16);
+    A.pop(reg::r13);
+    A.pop(reg::r12);
+    A.pop(reg::rbp);
+    A.movImm64(reg::rcx, &JitCallDepth);
+    A.load32(reg::rsi, reg::rcx, 0);
+    A.aluImm32(aluOp::alu_sub, reg::rsi, 1);
+    A.store32(reg::rcx, 0, reg::rsi);
+    A.ret();
+
+    // too deep: JitCallInterp(F, Args) returns in rax:rdx like native code
+    A.bind(Deep);
+    A.aluImm64(aluOp::alu_sub, reg::rsp, 8);
+    A.alu64(aluOp::alu_mov, reg::rsi, reg::rdi);
+    A.movImm64(reg::rdi, &F);
+    A.call((const void*)JitCallInterp);
+    A.aluImm64(aluOp::alu_add, reg::rsp, 8);
+    A.ret();
+
+    // locals start unbound; emitted last because they are found while compiling
+    A.bind(Init);
+    for (int i = F.argsSize(); i < numVars(); i++)
+        A.storeImm32(reg::rsp, varDisp(i) + 12, (uint32_t)-1);
+    A.jmp(Body);
+
+    A.patch32(FrameAt, 16 * (numVars() + MaxTemps));
+    if (!A.finish()) fail();
+
+    // A name that is read but never assigned belongs to a caller or is global.
+    std::set<int> Visible(F.getArgSyms().begin(), F.getArgSyms().end());
+    for (int Sym : LocalSyms)
+    {
+        if (Sym < 0) continue;
+        if (!AssignedLocals.count(Sym) || ArraySyms.count(Sym)) fail();
+        Visible.insert(Sym);
+    }
+
+    // In the tree-walker a callee would see our arguments and locals, and a
+    // recursive call would share our locals.
+    if (CallsSelf && AssignedLocals.size()) fail();
+    for (JitUnit* Callee : Callees)
+        for (int Sym : Callee->LocalSyms)
+            if (Visible.count(Sym)) fail();
+}
+
+jitType NumberExprAST::jit(JitCompiler& J)
+{
+    if (Val.getvType() == valueType::val_undef) return jitType::jt_undef;
+    if (Val.isInt())
+    {
+        J.A.movImm32(reg::rax, Val.getVal().i);
+        return jitType::jt_int;
+    }
+    J.A.movImm64(reg::rax, DoubleBits(Val.getVal().dbl));
+    J.A.movqToX(xreg::xmm0, reg::rax);
+    return jitType::jt_double;
+}
+
+jitType VariableExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+
+    if (!Indices.empty()) // array element
+    {
+        if (!J.arrayAddress(Sym, Indices)) return jitType::jt_none;
+        J.cellPointer();
+        return J.readCell();
+    }
+
+    if (Slot >= 0) return J.loadVar(Slot);
+
+    int Local = J.localSlot(Sym);
+    J.checkLocal(Local, Sym);
+    return J.loadVar(Local);
+}
+
+jitType DeRefExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+
+    J.checkAddress(AddrExpr->jit(J));
+    J.cellPointer();
+    return J.readCell();
+}
+
+jitType PForExprAST::jit(JitCompiler& J)
+{
+    J.fail(); // the workers of a pfor run the tree walker
+    return jitType::jt_none;
+}
+
+jitType ArrDeclExprAST::jit(JitCompiler& J)
+{
+    J.fail(); // a binding native code could not hide from its callees
+    return jitType::jt_none;
+}
+
+jitType UnaryExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+    Assembler& A = J.A;
+
+    if (Opcode == '&') // only array elements, locals have no address
+    {
+        VariableExprAST* Op = static_cast<VariableExprAST*>(Operand);
+        if (Operand->getNodeType() != nodeType::node_var || Op->getIndices().empty())
+        {
+            J.fail();
+            return jitType::jt_none;
+        }
+        if (!J.arrayAddress(Op->getSymbol(), Op->getIndices())) return jitType::jt_none;
+        return jitType::jt_int;
+    }
+
+    jitType T = Operand->jit(J);
+
+    if (UserOp)
+    {
+        if (!*UserOp)
+        {
+            J.fail();
+            return jitType::jt_none;
+        }
+        int Args = J.tempDisp(J.allocTemps(1));
+        J.storeValue(T, reg::rbp, Args);
+        jitType Result = J.callUnit(UserOp->get(), { T }, Args);
+        J.freeTemps(1);
+        return Result;
+    }
+
+    if (T == jitType::jt_dyn)
+    {
+        A.alu64(aluOp::alu_mov, reg::rsi, reg::rax);
+        A.movImm32(reg::rdi, Opcode);
+        A.call((const void*)JitUnary);
+        return Opcode == '!' ? jitType::jt_int : jitType::jt_dyn;
+    }
+    if (T != jitType::jt_int && T != jitType::jt_double) // undefined reads as 0
+    {
+        A.movImm32(reg::rax, Opcode == '!' ? 1 : 0);
+        return jitType::jt_int;
+    }
+
+    switch (Opcode)
+    {
+    case '!':
+        if (T == jitType::jt_double)
+        {
+            A.xorpd(xreg::xmm1, xreg::xmm1);
+            A.ucomisd(xreg::xmm0, xreg::xmm1);
+            A.setcc(cond::cc_e, reg::rax);
+            A.setcc(cond::cc_np, reg::rcx);
+            A.movzx8(reg::rax, reg::rax);
+            A.movzx8(reg::rcx, reg::rcx);
+            A.alu32(aluOp::alu_and, reg::rax, reg::rcx);
+        }
+        else
+        {
+            A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+            A.setcc(cond::cc_e, reg::rax);
+            A.movzx8(reg::rax, reg::rax);
+        }
+        return jitType::jt_int;
+    case '+':
+        return T;
+    default:
+        if (T == jitType::jt_double)
+        {
+            A.movImm64(reg::rcx, DoubleBits(-0.0));
+            A.movqToX(xreg::xmm1, reg::rcx);
+            A.xorpd(xreg::xmm0, xreg::xmm1);
+        }
+        else A.neg32(reg::rax);
+        return T;
+    }
+}
+
+/// EmitBinOp - Apply a builtin operator to the left operand spilled at
+/// [rbp + LDisp] and the right operand in registers, as ApplyBinOp does.
+static jitType EmitBinOp(JitCompiler& J, binOp Op, jitType L, jitType R, int LDisp)
+{
+    Assembler& A = J.A;
+    bool IsLogical = Op >= binOp::op_eq && Op <= binOp::op_ge;
+
+    if (L == jitType::jt_dyn || R == jitType::jt_dyn)
+    {
+        J.toDyn(R);
+        A.alu64(aluOp::alu_mov, reg::rcx, reg::rax);
+        A.alu32(aluOp::alu_mov, reg::r8, reg::rdx);
+        J.loadDynRegs(L, reg::rbp, LDisp, reg::rsi, reg::rdx);
+        A.movImm32(reg::rdi, (uint32_t)Op);
+        A.call((const void*)JitBinary);
+        return IsLogical ? jitType::jt_int : jitType::jt_dyn;
+    }
+
+    if (L == jitType::jt_double || R == jitType::jt_double)
+    {
+        J.toDouble(R);
+        A.movapd(xreg::xmm1, xreg::xmm0);
+        J.loadDouble(L, reg::rbp, LDisp, xreg::xmm0);
+
+        switch (Op)
+        {
+        case binOp::op_add: A.sse(sseOp::sse_add, xreg::xmm0, xreg::xmm1); return jitType::jt_double;
+        case binOp::op_sub: A.sse(sseOp::sse_sub, xreg::xmm0, xreg::xmm1); return jitType::jt_double;
+        case binOp::op_mul: A.sse(sseOp::sse_mul, xreg::xmm0, xreg::xmm1); return jitType::jt_double;
+        case binOp::op_div: A.sse(sseOp::sse_div, xreg::xmm0, xreg::xmm1); return jitType::jt_double;
+        case binOp::op_mod: A.call((const void*)FmodFn); return jitType::jt_double;
+        case binOp::op_pow: A.call((const void*)PowFn); return jitType::jt_double;
+        case binOp::op_eq:
+        case binOp::op_ne:
+            A.ucomisd(xreg::xmm0, xreg::xmm1);
+            A.setcc(Op == binOp::op_eq ? cond::cc_e : cond::cc_ne, reg::rax);
+            A.setcc(Op == binOp::op_eq ? cond::cc_np : cond::cc_p, reg::rcx);
+            A.movzx8(reg::rax, reg::rax);
+            A.movzx8(reg::rcx, reg::rcx);
+            A.alu32(Op == binOp::op_eq ? aluOp::alu_and : aluOp::alu_or, reg::rax, reg::rcx);
+            return jitType::jt_int;
+        case binOp::op_lt:
+        case binOp::op_le:
+            A.ucomisd(xreg::xmm1, xreg::xmm0);
+            A.setcc(Op == binOp::op_lt ? cond::cc_a : cond::cc_ae, reg::rax);
+            A.movzx8(reg::rax, reg::rax);
+            return jitType::jt_int;
+        case binOp::op_gt:
+        case binOp::op_ge:
+            A.ucomisd(xreg::xmm0, xreg::xmm1);
+            A.setcc(Op == binOp::op_gt ? cond::cc_a : cond::cc_ae, reg::rax);
+            A.movzx8(reg::rax, reg::rax);
+            return jitType::jt_int;
+        default: // && and ||
+            J.truthToEax(xreg::xmm1);
+            A.alu32(aluOp::alu_mov, reg::r8, reg::rax);
+            J.truthToEax(xreg::xmm0);
+            A.alu32(Op == binOp::op_and ? aluOp::alu_and : aluOp::alu_or, reg::rax, reg::r8);
+            return jitType::jt_int;
+        }
+    }
+
+    J.toInt(R);
+    A.alu32(aluOp::alu_mov, reg::rcx, reg::rax);
+    J.loadInt(L, reg::rbp, LDisp, reg::rax);
+
+    switch (Op)
+    {
+    case binOp::op_add: A.alu32(aluOp::alu_add, reg::rax, reg::rcx); break;
+    case binOp::op_sub: A.alu32(aluOp::alu_sub, reg::rax, reg::rcx); break;
+    case binOp::op_mul: A.imul32(reg::rax, reg::rcx); break;
+    case binOp::op_div:
+        A.cdq();
+        A.idiv32(reg::rcx);
+        break;
+    case binOp::op_mod:
+        A.cdq();
+        A.idiv32(reg::rcx);
+        A.alu32(aluOp::alu_mov, reg::rax, reg::rdx);
+        break;
+    case binOp::op_pow:
+        A.cvtsi2sd(xreg::xmm0, reg::rax);
+        A.cvtsi2sd(xreg::xmm1, reg::rcx);
+        A.call((const void*)PowFn);
+        A.cvttsd2si(reg::rax, xreg::xmm0);
+        break;
+    case binOp::op_and:
+    case binOp::op_or:
+        A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+        A.setcc(cond::cc_ne, reg::rax);
+        A.alu32(aluOp::alu_test, reg::rcx, reg::rcx);
+        A.setcc(cond::cc_ne, reg::rcx);
+        A.movzx8(reg::rax, reg::rax);
+        A.movzx8(reg::rcx, reg::rcx);
+        A.alu32(Op == binOp::op_and ? aluOp::alu_and : aluOp::alu_or, reg::rax, reg::rcx);
+        break;
+    default:
+    {
+        cond Cc = cond::cc_e;
+        if (Op == binOp::op_ne) Cc = cond::cc_ne;
+        else if (Op == binOp::op_lt) Cc = cond::cc_l;
+        else if (Op == binOp::op_gt) Cc = cond::cc_g;
+        else if (Op == binOp::op_le) Cc = cond::cc_le;
+        else if (Op == binOp::op_ge) Cc = cond::cc_ge;
+        A.alu32(aluOp::alu_cmp, reg::rax, reg::rcx);
+        A.setcc(Cc, reg::rax);
+        A.movzx8(reg::rax, reg::rax);
+        break;
+    }
+    }
+    return jitType::jt_int;
+}
+
+jitType BinaryExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+    Assembler& A = J.A;
+
+    if (Opcode == binOp::op_assign)
+    {
+        if (LHS->getNodeType() == nodeType::node_var)
+        {
+            VariableExprAST* LHSE = static_cast<VariableExprAST*>(LHS);
+            jitType T = RHS->jit(J);
+
+            if (LHSE->getIndices().empty())
+            {
+                int Slot = LHSE->getSlot();
+                if (Slot < 0)
+                {
+                    Slot = J.localSlot(LHSE->getSymbol());
+                    J.declareLocal(Slot);
+                }
+                J.storeVar(Slot, T);
+                return T;
+            }
+
+            int Val = J.tempDisp(J.allocTemps(1));
+            J.storeValue(T, reg::rbp, Val);
+            if (!J.arrayAddress(LHSE->getSymbol(), LHSE->getIndices())) return jitType::jt_none;
+            J.cellPointer();
+            J.loadValue(T, reg::rbp, Val);
+            J.writeCell(T);
+            J.freeTemps(1);
+            return T;
+        }
+        if (LHS->getNodeType() == nodeType::node_deref)
+        {
+            jitType T = RHS->jit(J);
+            int Val = J.tempDisp(J.allocTemps(1));
+            J.storeValue(T, reg::rbp, Val);
+
+            // An address that fails to evaluate is an error value, which the
+            // tree-walker takes as address 0.
+            int OuterErr = J.ErrTarget, AddrErr = A.newLabel();
+            J.ErrTarget = AddrErr;
+            jitType AddrT = static_cast<DeRefExprAST*>(LHS)->getExpr()->jit(J);
+            J.ErrTarget = OuterErr;
+            J.checkAddress(AddrT);
+            if (A.used(AddrErr))
+            {
+                int Done = A.newLabel();
+                A.jmp(Done);
+                A.bind(AddrErr);
+                A.alu32(aluOp::alu_xor, reg::rax, reg::rax);
+                A.bind(Done);
+            }
+
+            J.cellPointer();
+            J.loadValue(T, reg::rbp, Val);
+            J.writeCell(T);
+            J.freeTemps(1);
+            return T;
+        }
+        J.fail();
+        return jitType::jt_none;
+    }
+
+    if (Opcode == binOp::op_user && !*UserOp)
+    {
+        J.fail();
+        return jitType::jt_none;
+    }
+
+    // A user operator takes both operands as arguments, so they are spilled
+    // next to each other; the left one is at the lower address.
+    int NumTemps = Opcode == binOp::op_user ? 2 : 1;
+    int LDisp = J.tempDisp(J.allocTemps(NumTemps) + NumTemps - 1);
+
+    // The right operand is evaluated even when the left one fails.
+    int OuterErr = J.ErrTarget, LErr = A.newLabel();
+    J.ErrTarget = LErr;
+    jitType L = LHS->jit(J);
+    J.ErrTarget = OuterErr;
+    J.storeValue(L, reg::rbp, LDisp);
+
+    bool LeftMayFail = A.used(LErr);
+    if (LeftMayFail)
+    {
+        int Done = A.newLabel();
+        A.storeImm32(reg::rbp, LDisp + 12, 0);
+        A.jmp(Done);
+        A.bind(LErr);
+        A.storeImm32(reg::rbp, LDisp + 12, 1);
+        A.bind(Done);
+    }
+
+    jitType R = RHS->jit(J);
+    if (LeftMayFail)
+    {
+        A.cmpImm32(reg::rbp, LDisp + 12, 0);
+        A.jcc(cond::cc_ne, J.ErrTarget);
+    }
+
+    jitType Result;
+    if (Opcode == binOp::op_user)
+    {
+        J.storeValue(R, reg::rbp, LDisp + 16);
+        Result = J.callUnit(UserOp->get(), { L, R }, LDisp);
+    }
+    else Result = EmitBinOp(J, Opcode, L, R, LDisp);
+
+    J.freeTemps(NumTemps);
+    return Result;
+}
+
+jitType LogicalExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+    Assembler& A = J.A;
+    int IfFalse = A.newLabel(), False = A.newLabel(), Done = A.newLabel();
+
+    J.testFalse(LHS->jit(J), IfFalse);
+    if (Opcode == binOp::op_and) J.testFalse(RHS->jit(J), False);
+    A.movImm32(reg::rax, 1);
+    A.jmp(Done);
+
+    A.bind(IfFalse);
+    if (Opcode == binOp::op_or)
+    {
+        J.testFalse(RHS->jit(J), False);
+        A.movImm32(reg::rax, 1);
+        A.jmp(Done);
+    }
+    A.bind(False);
+    A.movImm32(reg::rax, 0);
+    A.bind(Done);
+    return jitType::jt_int;
+}
+
+jitType CallExprAST::jit(JitCompiler& J)
+{
+    ValuePosition V(J);
+    Assembler& A = J.A;
+
+    int StdFunc = LookupStdFunc(*Callee);
+    FunctionAST* CalleeF = nullptr;
+    if (StdFunc < 0)
+    {
+        CalleeF = FindFunction(*Callee).get();
+        if (!CalleeF || CalleeF->argsSize() != Args.size())
+        {
+            J.fail();
+            return jitType::jt_none;
+        }
+    }
+
+    int NumArgs = Args.size();
+    int ArgsDisp = J.tempDisp(J.allocTemps(NumArgs) + NumArgs - 1);
+    std::vector<jitType> Types;
+    for (int i = 0; i < NumArgs; i++)
+    {
+        Types.push_back(Args[i]->jit(J));
+        J.storeValue(Types.back(), reg::rbp, ArgsDisp + 16 * i);
+    }
+
+    jitType Result;
+    if (StdFunc >= 0)
+    {
+        A.movImm32(reg::rdi, StdFunc);
+        A.lea(reg::rsi, reg::rbp, ArgsDisp);
+        A.movImm32(reg::rdx, NumArgs);
+        A.call((const void*)JitCallStd);
+        A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_err);
+        A.jcc(cond::cc_e, J.ErrTarget);
+        bool Returns = StdFunc >= FirstArrayFunc || *Callee == "input" || *Callee == "inputch";
+        Result = Returns ? jitType::jt_dyn : jitType::jt_undef;
+    }
+    else Result = J.callUnit(CalleeF, Types, ArgsDisp);
+
+    J.freeTemps(NumArgs);
+    return Result;
+}
+
+jitType IfExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    int OuterErr = J.ErrTarget;
+    int IfFalse = A.newLabel(), ThenDone = A.newLabel(), Join = A.newLabel();
+
+    {
+        ValuePosition V(J);
+        J.testFalse(Cond->jit(J), IfFalse);
+    }
+
+    int ThenErr = A.newLabel();
+    J.ErrTarget = ThenErr;
+    J.beginScope();
+    jitType ThenT = Then->jit(J);
+    std::set<int> ThenSlots = J.endScope();
+    J.ErrTarget = OuterErr;
+    J.cleanup(ThenSlots, J.ScopeDepth);
+    A.jmp(ThenDone);
+    J.errorPad(ThenErr, ThenSlots, OuterErr);
+
+    A.bind(IfFalse);
+    jitType ElseT = jitType::jt_undef;
+    std::set<int> ElseSlots;
+    int ElseErr = A.newLabel();
+    if (Else != nullptr)
+    {
+        J.ErrTarget = ElseErr;
+        J.beginScope();
+        ElseT = Else->jit(J);
+        ElseSlots = J.endScope();
+        J.ErrTarget = OuterErr;
+        J.cleanup(ElseSlots, J.ScopeDepth);
+    }
+
+    // Both branches end up in the join of their types.
+    jitType T = JoinType(ThenT, ElseT);
+    J.convert(ElseT, T);
+    A.jmp(Join);
+    J.errorPad(ElseErr, ElseSlots, OuterErr);
+
+    A.bind(ThenDone);
+    J.convert(ThenT, T);
+    A.bind(Join);
+    return T;
+}
+
+jitType ForExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    jitType StartT;
+    {
+        ValuePosition V(J);
+        StartT = Start->jit(J);
+    }
+
+    int OuterErr = J.ErrTarget, LoopErr = A.newLabel();
+    int CondAt = A.newLabel(), Exit = A.newLabel();
+    J.beginScope();
+
+    // the counter reuses a visible variable, like BindForVariable
+    int Counter = Slot;
+    if (Counter < 0)
+    {
+        Counter = J.localSlot(Sym);
+        J.declareLocal(Counter);
+    }
+    J.storeVar(Counter, StartT);
+
+    J.ErrTarget = LoopErr;
+    int Temps = J.allocTemps(2);
+    int StepDisp = J.tempDisp(Temps), CounterDisp = J.tempDisp(Temps + 1);
+    jitType StepT = jitType::jt_int;
+    {
+        ValuePosition V(J);
+        if (Step) StepT = Step->jit(J);
+        else A.movImm32(reg::rax, 1);
+        J.storeValue(StepT, reg::rbp, StepDisp);
+
+        A.bind(CondAt);
+        J.testFalse(End->jit(J), Exit);
+    }
+    {
+        LoopBody B(J, Exit);
+        Body->jit(J);
+    }
+
+    // counter + step, which stays an integer for integer operands
+    jitType CounterT = J.loadVar(Counter);
+    J.storeValue(CounterT, reg::rbp, CounterDisp);
+    J.storeVar(Counter, EmitBinOp(J, binOp::op_add, CounterT, J.loadValue(StepT, reg::rbp, StepDisp), CounterDisp));
+    A.jmp(CondAt);
+
+    J.ErrTarget = OuterErr;
+    A.bind(Exit);
+    std::set<int> Slots = J.endScope();
+    J.cleanup(Slots, J.ScopeDepth);
+    J.freeTemps(2);
+    J.errorPad(LoopErr, Slots, OuterErr);
+    return jitType::jt_undef;
+}
+
+jitType WhileExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    int OuterErr = J.ErrTarget, LoopErr = A.newLabel();
+    int CondAt = A.newLabel(), Exit = A.newLabel();
+
+    J.beginScope();
+    J.ErrTarget = LoopErr;
+    A.bind(CondAt);
+    {
+        ValuePosition V(J);
+        J.testFalse(Cond->jit(J), Exit);
+    }
+    {
+        LoopBody B(J, Exit);
+        Body->jit(J);
+    }
+    A.jmp(CondAt);
+
+    J.ErrTarget = OuterErr;
+    A.bind(Exit);
+    std::set<int> Slots = J.endScope();
+    J.cleanup(Slots, J.ScopeDepth);
+    J.errorPad(LoopErr, Slots, OuterErr);
+    return jitType::jt_undef;
+}
+
+jitType RepeatExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    const char* Msg = "Number of iterations should be an unsigned integer";
+    {
+        ValuePosition V(J);
+        jitType T = IterNum->jit(J);
+
+        int Valid = A.newLabel(), Invalid = A.newLabel();
+        if (T == jitType::jt_int || T == jitType::jt_dyn)
+        {
+            if (T == jitType::jt_dyn)
+            {
+                A.aluImm32(aluOp::alu_cmp, reg::rdx, tag_double);
+                A.jcc(cond::cc_e, Invalid);
+            }
+            A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+            A.jcc(cond::cc_ns, Valid);
+            A.bind(Invalid);
+            J.logError(Msg);
+        }
+        else if (T == jitType::jt_double) J.logError(Msg);
+        else J.toInt(T);
+        A.bind(Valid);
+    }
+
+    int Count = J.tempDisp(J.allocTemps(1));
+    A.store32(reg::rbp, Count, reg::rax);
+
+    int OuterErr = J.ErrTarget, LoopErr = A.newLabel();
+    int TestAt = A.newLabel(), Exit = A.newLabel();
+    J.beginScope();
+    J.ErrTarget = LoopErr;
+
+    A.bind(TestAt);
+    A.load32(reg::rax, reg::rbp, Count);
+    A.alu32(aluOp::alu_test, reg::rax, reg::rax);
+    A.jcc(cond::cc_le, Exit);
+    A.aluImm32(aluOp::alu_sub, reg::rax, 1);
+    A.store32(reg::rbp, Count, reg::rax);
+    {
+        LoopBody B(J, Exit);
+        Body->jit(J);
+    }
+    A.jmp(TestAt);
+
+    J.ErrTarget = OuterErr;
+    A.bind(Exit);
+    std::set<int> Slots = J.endScope();
+    J.cleanup(Slots, J.ScopeDepth);
+    J.freeTemps(1);
+    J.errorPad(LoopErr, Slots, OuterErr);
+    return jitType::jt_undef;
+}
+
+jitType LoopExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    int OuterErr = J.ErrTarget, LoopErr = A.newLabel();
+    int BodyAt = A.newLabel(), Exit = A.newLabel();
+
+    J.beginScope();
+    J.ErrTarget = LoopErr;
+    A.bind(BodyAt);
+    {
+        LoopBody B(J, Exit);
+        Body->jit(J);
+    }
+    A.jmp(BodyAt);
+
+    J.ErrTarget = OuterErr;
+    A.bind(Exit);
+    std::set<int> Slots = J.endScope();
+    J.cleanup(Slots, J.ScopeDepth);
+    J.errorPad(LoopErr, Slots, OuterErr);
+    return jitType::jt_undef;
+}
+
+jitType BreakExprAST::jit(JitCompiler& J)
+{
+    if (!J.BreakOK)
+    {
+        J.fail();
+        return jitType::jt_none;
+    }
+
+    ValuePosition V(J);
+    int OuterErr = J.ErrTarget, ExprErr = J.A.newLabel();
+    J.ErrTarget = ExprErr;
+    Expr->jit(J); // the value of a break is dropped by the loop
+    J.ErrTarget = OuterErr;
+    J.A.jmp(J.loopExit());
+
+    if (J.A.used(ExprErr))
+    {
+        J.A.bind(ExprErr);
+        J.logError("Failed to return a value");
+    }
+    return jitType::jt_none;
+}
+
+jitType ReturnExprAST::jit(JitCompiler& J)
+{
+    if (!J.ReturnOK)
+    {
+        J.fail();
+        return jitType::jt_none;
+    }
+
+    ValuePosition V(J);
+    int OuterErr = J.ErrTarget, ExprErr = J.A.newLabel();
+    J.ErrTarget = ExprErr;
+    jitType T = Expr->jit(J);
+    J.ErrTarget = OuterErr;
+    J.emitReturn(T);
+
+    if (J.A.used(ExprErr))
+    {
+        J.A.bind(ExprErr);
+        J.logError("Failed to return a value");
+    }
+    return jitType::jt_none;
+}
+
+jitType BlockExprAST::jit(JitCompiler& J)
+{
+    Assembler& A = J.A;
+    int OuterErr = J.ErrTarget, BlockErr = A.newLabel();
+    jitType T = jitType::jt_int;
+
+    J.beginScope();
+    if (Expressions.empty()) A.movImm32(reg::rax, 0);
+    for (int i = 0, e = Expressions.size(); i != e; ++i)
+    {
+        // An error ends the block only if it is the value of the block.
+        int Next = i == e - 1 ? BlockErr : A.newLabel();
+        J.ErrTarget = Next;
+        T = Expressions[i]->jit(J);
+        if (i != e - 1) A.bind(Next);
+    }
+    J.ErrTarget = OuterErr;
+
+    std::set<int> Slots = J.endScope();
+    J.cleanup(Slots, J.ScopeDepth);
+    J.errorPad(BlockErr, Slots, OuterErr);
+    return T;
+}
@@ -1,162 +1,362 @@
-
 // SEL Project
 // lexer.cpp
 
 #include "lexer.h"
-#include "execute.h"
-#include <iostream>
-#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <cmath>
 
-std::string IdStr;
+#if defined(__x86_64__) || defined(_M_X64)
+#define SEL_LEX_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Character classes, in the "C" locale the lexer has always used. Bytes
+// outside ASCII belong to none of them.
+static bool IsSpace(int c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static bool IsDigit(int c) { return c >= '0' && c <= '9'; }
+static bool IsAlpha(int c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+static bool IsIdChar(int c) { return IsAlpha(c) || IsDigit(c) || c == '_'; }
+static bool IsNumChar(int c) { return IsDigit(c) || c == '.'; }
+static bool IsLineEnd(int c) { return c == '\n' || c == '\r' || c == EOF; }
+
+/// Keyword - A reserved word and its token.
+typedef struct Keyword
+{
+    const char* Name;
+    unsigned int Len;
+    int Tok;
+} keyword;
 
-dataType NumType;
-double NumVal;
+static const keyword Keywords[] = {
+    { "func", 4, tok_def }, { "extern", 6, tok_extern }, { "import", 6, tok_import },
+    { "arr", 3, tok_arr }, { "if", 2, tok_if }, { "then", 4, tok_then },
+    { "else", 4, tok_else }, { "for", 3, tok_for }, { "pfor", 4, tok_pfor },
+    { "while", 5, tok_while }, { "rep", 3, tok_repeat }, { "loop", 4, tok_loop },
+    { "binary", 6, tok_binary }, { "unary", 5, tok_unary }, { "break", 5, tok_break },
+    { "return", 6, tok_return }, { "var", 3, tok_var }, { "as", 2, tok_as },
+    { "int", 3, tok_int }, { "double", 6, tok_dbl },
+    { "help", 4, cmd_help }, // interactive mode commands
+};
 
-int LastChar = ' ';
+// The length and the first and last letters tell every keyword apart, so a
+// lookup is one table probe and one comparison. A new keyword must keep the
+// hashes distinct, or the table constructor aborts.
+static const unsigned int KeywordSlots = 64;
 
-int GetTok(std::string& Code, int& Idx)
+static unsigned int HashKeyword(const char* Name, unsigned int Len)
 {
-    // Skip any whitespace.
-    while (isspace(LastChar))
+    return (Len + (unsigned char)Name[0] * 3 + ((unsigned char)Name[Len - 1] << 3)) & (KeywordSlots - 1);
+}
+
+static const struct KeywordTable
+{
+    const keyword* Slots[KeywordSlots] = {};
+
+    KeywordTable()
     {
-        if (IsInteractive) LastChar = getchar();
-        else LastChar = Code[Idx++];
+        for (const keyword& K : Keywords)
+        {
+            unsigned int Slot = HashKeyword(K.Name, K.Len);
+            if (Slots[Slot]) abort(); // not perfect any more: change HashKeyword
+            Slots[Slot] = &K;
+        }
     }
+} KeywordTbl;
 
-    if (isalpha(LastChar)) // identifier: [a-zA-Z][a-zA-Z0-9_]*
-    { 
-        IdStr = LastChar;
-        
-        while (true)
-        {
-            if (IsInteractive) LastChar = getchar();
-            else LastChar = Code[Idx++];
+static int IdentifierToken(const char* Name, unsigned int Len)
+{
+    const keyword* K = KeywordTbl.Slots[HashKeyword(Name, Len)];
+    if (K && K->Len == Len && !memcmp(K->Name, Name, Len)) return K->Tok;
+    return tok_identifier;
+}
 
-            if (isalnum(LastChar) || LastChar == '_') IdStr += LastChar;
-            else break;
-        }
+#ifdef SEL_LEX_SSE2
+// Masks of the bytes of a 16-byte block in a class. Bytes are compared as
+// signed values, so those above 0x7f fall below every range.
+static int SpaceMask(__m128i Block)
+{
+    __m128i Space = _mm_cmpeq_epi8(Block, _mm_set1_epi8(' '));
+    __m128i Ctrl = _mm_and_si128(_mm_cmpgt_epi8(Block, _mm_set1_epi8('\t' - 1)),
+        _mm_cmplt_epi8(Block, _mm_set1_epi8('\r' + 1)));
+    return _mm_movemask_epi8(_mm_or_si128(Space, Ctrl));
+}
 
-        // keywords
-        if (IdStr == "func")
-            return tok_def;
-        if (IdStr == "extern")
-            return tok_extern;
-        if (IdStr == "import")
-            return tok_import;
-        if (IdStr == "arr")
-            return tok_arr;
-        if (IdStr == "if")
-            return tok_if;
-        if (IdStr == "then")
-            return tok_then;
-        if (IdStr == "else")
-            return tok_else;
-        if (IdStr == "for")
-            return tok_for;
-        if (IdStr == "while")
-            return tok_while;
-        if (IdStr == "rep")
-            return tok_repeat;
-        if (IdStr == "loop")
-            return tok_loop;
-        if (IdStr == "binary")
-            return tok_binary;
-        if (IdStr == "unary")
-            return tok_unary;
-        if (IdStr == "break")
-            return tok_break;
-        if (IdStr == "return")
-            return tok_return;
-        if (IdStr == "var")
-            return tok_var;
-        if (IdStr == "as")
-            return tok_as;
-        if (IdStr == "int")
-            return tok_int;
-        if (IdStr == "double")
-            return tok_dbl;
-
-        // interactive mode commands
-        if (IdStr == "help")
-            return cmd_help;
-
-        return tok_identifier;
-    }
+static __m128i InRange(__m128i Block, char Lo, char Hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(Block, _mm_set1_epi8(Lo - 1)), _mm_cmplt_epi8(Block, _mm_set1_epi8(Hi + 1)));
+}
 
-    if (isdigit(LastChar) || LastChar == '.')
-    { // Number: [0-9.]+
-        std::string NumStr;
-        do
-        {
-            NumStr += LastChar;
+static int IdCharMask(__m128i Block)
+{
+    __m128i Lower = _mm_or_si128(Block, _mm_set1_epi8(0x20));
+    __m128i Id = _mm_or_si128(InRange(Lower, 'a', 'z'), InRange(Block, '0', '9'));
+    return _mm_movemask_epi8(_mm_or_si128(Id, _mm_cmpeq_epi8(Block, _mm_set1_epi8('_'))));
+}
 
-            if (IsInteractive) LastChar = getchar();
-            else LastChar = Code[Idx++];
-        } while (isdigit(LastChar) || LastChar == '.');
+static int LineEndMask(__m128i Block)
+{
+    __m128i End = _mm_or_si128(_mm_cmpeq_epi8(Block, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(Block, _mm_set1_epi8('\r')));
+    return _mm_movemask_epi8(_mm_or_si128(End, _mm_cmpeq_epi8(Block, _mm_set1_epi8((char)EOF))));
+}
+static int NotLineEndMask(__m128i Block) { return ~LineEndMask(Block); }
 
-        NumVal = strtod(NumStr.c_str(), nullptr);
+static unsigned int FirstBit(unsigned int Mask)
+{
+#ifdef _MSC_VER
+    unsigned long Idx;
+    _BitScanForward(&Idx, Mask);
+    return Idx;
+#else
+    return __builtin_ctz(Mask);
+#endif
+}
+#endif
+
+static bool NotLineEnd(int c) { return !IsLineEnd(c); }
 
-        if (trunc(NumVal) == NumVal) NumType = dataType::t_int;
-        else NumType = dataType::t_double;
+/// ScanRun - The index of the first byte of Code from Pos on that Match
+/// rejects, or Size. With SSE2, Mask tells the same for 16 bytes at a time.
+template <bool (*Match)(int)>
+static size_t ScanRun(const char* Code, size_t Pos, size_t Size)
+{
+    while (Pos < Size && Match(Code[Pos])) Pos++;
+    return Pos;
+}
 
-        return tok_number;
+#ifdef SEL_LEX_SSE2
+template <int (*Mask)(__m128i), bool (*Match)(int)>
+static size_t ScanRun(const char* Code, size_t Pos, size_t Size)
+{
+    for (; Pos + 16 <= Size; Pos += 16)
+    {
+        unsigned int Rejected = ~Mask(_mm_loadu_si128((const __m128i*)(Code + Pos))) & 0xFFFF;
+        if (Rejected) return Pos + FirstBit(Rejected);
     }
+    return ScanRun<Match>(Code, Pos, Size);
+}
+#define SEL_SCAN(Mask, Match) ScanRun<Mask, Match>
+#else
+#define SEL_SCAN(Mask, Match) ScanRun<Match>
+#endif
+
+/// BufferSource - Reads a script held in memory. Its end, or an EOF byte in
+/// it, ends the script. Last is always the byte before Idx, so a run starting at Last is found
+/// with one scan and copied at once.
+class BufferSource
+{
+    const char* Code;
+    size_t Size;
+    size_t Idx = 0;
 
-    if (LastChar == '#')
+    /// skipTo - Make the byte at End the last one read.
+    void skipTo(size_t End)
     {
-        // Comment until end of line.
-        do {
-            if (IsInteractive) LastChar = getchar();
-            else LastChar = Code[Idx++];
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+        Idx = End + 1;
+        Last = End < Size ? Code[End] : EOF;
+    }
 
-        if (LastChar != EOF)
-            return GetTok(Code, Idx);
+    void readRun(std::string& Str, size_t End)
+    {
+        Str.assign(Code + Idx - 1, End - Idx + 1);
+        skipTo(End);
     }
 
-    if (LastChar == '{')
+public:
+    int Last = ' ';
+
+    BufferSource(const char* Code, size_t Size, size_t Start) : Code(Code), Size(Size), Idx(Start) {}
+
+    int get() { return Last = Idx < Size ? Code[Idx++] : (Idx++, EOF); }
+    int pos() const { return (int)Idx - 1; }
+
+    void skipSpaces() { skipTo(SEL_SCAN(SpaceMask, IsSpace)(Code, Idx, Size)); }
+    void skipComment() { skipTo(SEL_SCAN(NotLineEndMask, NotLineEnd)(Code, Idx, Size)); }
+    void readIdentifier(std::string& Str) { readRun(Str, SEL_SCAN(IdCharMask, IsIdChar)(Code, Idx, Size)); }
+    void readNumber(std::string& Str) { readRun(Str, ScanRun<IsNumChar>(Code, Idx, Size)); }
+};
+
+/// StreamSource - Reads what is typed in the interactive shell. Last and the
+/// count of characters read live on in the TokenStream between tokens.
+class StreamSource
+{
+    int& Read;
+
+    void readRun(std::string& Str, bool (*Match)(int))
     {
-        if (IsInteractive) LastChar = getchar();
-        else LastChar = Code[Idx++];
-        return tok_openblock;
+        Str = (char)Last;
+        while (Match(get())) Str += (char)Last;
     }
-    if (LastChar == '}')
+
+public:
+    int& Last;
+
+    StreamSource(int& Last, int& Read) : Read(Read), Last(Last) {}
+
+    int get()
     {
-        if (IsInteractive) LastChar = getchar();
-        else LastChar = Code[Idx++];
-        return tok_closeblock;
+        Read++;
+        return Last = getchar();
     }
+    int pos() const { return Read - 1; }
 
-    // Check for end of file.  Don't eat the EOF.
-    if (LastChar == EOF)
-        return tok_eof;
+    void skipSpaces()
+    {
+        while (IsSpace(Last)) get();
+    }
+    void skipComment()
+    {
+        do get();
+        while (!IsLineEnd(Last));
+    }
+    void readIdentifier(std::string& Str) { readRun(Str, IsIdChar); }
+    void readNumber(std::string& Str) { readRun(Str, IsNumChar); }
+};
+
+/// LexToken - Read the token starting at or after Src.Last into L, leaving
+/// the text of identifiers in Text.
+template <typename Source>
+static void LexToken(Source& Src, lexeme& L, std::string& Text)
+{
+    while (true)
+    {
+        // Skip any whitespace.
+        if (IsSpace(Src.Last)) Src.skipSpaces();
+        L.Begin = Src.pos();
+
+        if (IsAlpha(Src.Last)) // identifier: [a-zA-Z][a-zA-Z0-9_]*
+        {
+            Src.readIdentifier(Text);
+            L.Tok = IdentifierToken(Text.data(), Text.size());
+            break;
+        }
+
+        if (IsNumChar(Src.Last))
+        { // Number: [0-9.]+
+            Src.readNumber(Text);
+
+            L.Num = strtod(Text.c_str(), nullptr);
+
+            if (trunc(L.Num) == L.Num) L.NumType = dataType::t_int;
+            else L.NumType = dataType::t_double;
 
-    // Otherwise, just return the character as its ascii value.
-    int ThisChar = LastChar;
-    if (IsInteractive) LastChar = getchar();
-    else LastChar = Code[Idx++];
-    return ThisChar;
+            L.Tok = tok_number;
+            break;
+        }
+
+        if (Src.Last != '#')
+        {
+            if (Src.Last == '{') L.Tok = tok_openblock;
+            else if (Src.Last == '}') L.Tok = tok_closeblock;
+            else L.Tok = Src.Last; // the character as its ascii value
+
+            // Check for end of file.  Don't eat the EOF.
+            if (Src.Last == EOF) L.Tok = tok_eof;
+            else Src.get();
+            break;
+        }
+
+        // Comment until end of line.
+        Src.skipComment();
+        if (Src.Last == EOF)
+        {
+            L.Begin = Src.pos();
+            L.Tok = tok_eof;
+            break;
+        }
+    }
+    L.End = Src.pos();
+    L.Next = Src.Last;
 }
 
-std::string GetPath(std::string& Code, int& Idx)
+/// LexPath - Read the rest of the line after 'import', up to a ';', as a path.
+/// The character ending it is dropped.
+template <typename Source>
+static void LexPath(Source& Src, lexeme& L, std::string& Text)
 {
-    std::string PathStr;
     // Skip any whitespace.
-    while (isspace(LastChar))
+    if (IsSpace(Src.Last)) Src.skipSpaces();
+    L.Begin = Src.pos();
+
+    Text = (char)Src.Last;
+    while (!IsLineEnd(Src.get()) && Src.Last != ';') Text += (char)Src.Last;
+
+    L.Tok = tok_path;
+    L.End = Src.pos();
+    if (Src.Last != EOF) Src.Last = ' ';
+    L.Next = Src.Last;
+}
+
+int TokenStream::intern(const std::string& Name)
+{
+    auto It = NameIds.find(Name);
+    if (It != NameIds.end()) return It->second;
+
+    Names.push_back(Name);
+    return NameIds[Name] = Names.size() - 1;
+}
+
+TokenStream::TokenStream(const char* Code, size_t Size, size_t Start) : Interactive(false)
+{
+    if (Start > Size) Start = Size;
+
+    // Most tokens are a few characters and a space.
+    Tokens.reserve((Size - Start) / 4 + 1);
+
+    BufferSource Src(Code, Size, Start);
+    std::string Text;
+    lexeme L;
+    do
     {
-        if (IsInteractive) LastChar = getchar();
-        else LastChar = Code[Idx++];
-    }
+        LexToken(Src, L, Text);
+        if (L.Tok == tok_identifier) L.Name = intern(Text);
+        Tokens.push_back(L);
 
-    PathStr = LastChar;
-    while (true)
+        if (L.Tok == tok_import)
+        {
+            LexPath(Src, L, Text);
+            L.Name = intern(Text);
+            Tokens.push_back(L);
+        }
+    } while (L.Tok != tok_eof);
+}
+
+TokenStream::TokenStream() : Interactive(true) {}
+
+/// lexStdin - Replace the tokens read so far with the next one typed, and the
+/// path after it if it is an 'import'.
+void TokenStream::lexStdin()
+{
+    Tokens.clear();
+    Pos = 0;
+
+    StreamSource Src(Lookahead, Read);
+    std::string Text;
+    lexeme L;
+    LexToken(Src, L, Text);
+    if (L.Tok == tok_identifier) L.Name = intern(Text);
+    Tokens.push_back(L);
+
+    if (L.Tok == tok_import)
     {
-        if (IsInteractive) LastChar = getchar();
-        else LastChar = Code[Idx++];
+        LexPath(Src, L, Text);
+        L.Name = intern(Text);
+        Tokens.push_back(L);
+    }
+}
 
-        if (LastChar != '\n' && LastChar != ';' && LastChar != EOF) PathStr += LastChar;
-        else break;
+/// next - The next token. The last token of a script is tok_eof, which is
+/// returned again however often it is asked for.
+const lexeme& TokenStream::next()
+{
+    if (Pos == Tokens.size())
+    {
+        if (Interactive) lexStdin();
+        else Pos--;
     }
-    return PathStr;
-}
\ No newline at end of file
+    return Tokens[Pos++];
+}
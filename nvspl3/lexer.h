@@ -5,7 +5,11 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
 #include "value.h"
+#include "arena.h"
 
 enum Token
 {
@@ -16,6 +20,7 @@ enum Token
     tok_def = -2,
     tok_extern = -3,
     tok_import = -4,
+    tok_path = -5, // the module path after 'import'
 
     // primary
     tok_identifier = -10,
@@ -29,6 +34,7 @@ enum Token
     tok_while = -20,
     tok_repeat = -21,
     tok_loop = -22,
+    tok_pfor = -23,
     tok_break = -30,
     tok_return = -31,
 
@@ -53,15 +59,58 @@ enum Token
     cmd_help = -201,
 };
 
-extern std::string IdStr;
-extern std::string PathStr;
-extern std::string MainCode;
+/// Lexeme - A token and where it came from. Identifiers and paths are
+/// interned in the stream, so a lexeme is a few words whatever it spells.
+typedef struct Lexeme
+{
+    int Tok;        // a Token, or the character itself
+    int Begin, End; // span in the source
+    int Next;       // the character right after it, which tells "<=" from "< ="
+    dataType NumType;
+    union
+    {
+        double Num; // tok_number
+        int Name;   // tok_identifier and tok_path
+    };
+} lexeme;
+
+/// TokenStream - The tokens the parser reads. A script is tokenized at once,
+/// so the parser walks an array; the interactive shell is lexed from stdin
+/// one token at a time as the parser asks for it. The AST parsed from the
+/// stream is allocated in its arena.
+class TokenStream
+{
+    std::vector<lexeme> Tokens;
+    size_t Pos = 0;
+    std::vector<std::string> Names;
+    std::unordered_map<std::string, int> NameIds;
+
+    bool Interactive;
+    int Lookahead = ' '; // stdin's next character, read ahead of the last token
+    int Read = 0;        // characters read from stdin
+    std::shared_ptr<AstArena> Arena = std::make_shared<AstArena>();
+
+    int intern(const std::string& Name);
+    void lexStdin();
+
+public:
+    /// TokenStream - Tokenize the Size bytes at Code from offset Start on. Its
+    /// end or an EOF byte ends it. The tokens do not refer to Code once it is
+    /// tokenized, but their spans are offsets into it.
+    TokenStream(const char* Code, size_t Size, size_t Start = 0);
+    /// TokenStream - Read tokens from stdin.
+    TokenStream();
+
+    const lexeme& next();
+    const lexeme& current() const { return Tokens[Pos - 1]; } // the last one returned by next
+    const std::string& name(int Id) const { return Names[Id]; }
+    size_t size() const { return Tokens.size(); }
+    AstArena& arena() { return *Arena; }
+    const std::shared_ptr<AstArena>& getArena() const { return Arena; }
+};
 
+// The current token, set by GetNextToken.
+extern std::string IdStr;
 extern dataType NumType;
 extern double NumVal;
-
-extern int LastChar;
-
-int GetTok(std::string& Code, int& Idx);
-
-std::string GetPath(std::string& Code, int& Idx);
\ No newline at end of file
+extern int NextChar;
\ No newline at end of file
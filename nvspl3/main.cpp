@@ -1,16 +1,105 @@
-
 // SEL Project
 // main.cpp
 
 #include "ast.h"
 #include "execute.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "memo.h"
+#include "vectorize.h"
+#include "parallel.h"
+#include "cache.h"
 #include "interactiveMode.h"
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+#include <thread>
+
+/// ParseStackSize - Read a byte count with an optional K, M or G suffix as a
+/// number of memory cells. Returns false for sizes that are not usable.
+static bool ParseStackSize(const char* Str, unsigned int& Cells)
+{
+    char* End;
+    unsigned long long Bytes = strtoull(Str, &End, 10);
+    if (End == Str) return false;
+
+    switch (*End)
+    {
+    case 'G': case 'g': Bytes <<= 10; // fall through
+    case 'M': case 'm': Bytes <<= 10; // fall through
+    case 'K': case 'k': Bytes <<= 10; End++; break;
+    default: break;
+    }
+    if (*End) return false;
+
+    unsigned long long Count = Bytes / sizeof(Value);
+    if (Count == 0 || Count > INT_MAX) return false;
+    Cells = (unsigned int)Count;
+    return true;
+}
 
 int main(int argc, char* argv[])
 {
-    if (argc == 1) RunInteractiveShell();
-    else if (argc == 2) ExecuteScript(argv[1]);
-    else fprintf(stderr, "You can run only one file at once.\nusage: %s \"filename.sel\"\n", argv[0]);
+    int ArgIdx = 1;
+    for (; ArgIdx < argc && argv[ArgIdx][0] == '-'; ArgIdx++)
+    {
+        if (!strcmp(argv[ArgIdx], "--vm")) UseVM = true;
+        else if (!strcmp(argv[ArgIdx], "-O0")) OptLevel = 0;
+        else if (!strcmp(argv[ArgIdx], "-O1")) OptLevel = 1;
+        else if (!strcmp(argv[ArgIdx], "-O2")) OptLevel = 2;
+        else if (!strcmp(argv[ArgIdx], "--jit")) UseJIT = true;
+        else if (!strncmp(argv[ArgIdx], "--jit-threshold=", 16))
+        {
+            UseJIT = true;
+            JitThreshold = atoi(argv[ArgIdx] + 16);
+        }
+        else if (!strcmp(argv[ArgIdx], "--memo")) MemoAll = true;
+        else if (!strncmp(argv[ArgIdx], "--memo=", 7))
+        {
+            std::string Names = argv[ArgIdx] + 7;
+            for (size_t Start = 0, End; Start <= Names.size(); Start = End + 1)
+            {
+                End = Names.find(',', Start);
+                if (End == std::string::npos) End = Names.size();
+                if (End > Start) MemoNames.push_back(Names.substr(Start, End - Start));
+            }
+        }
+        else if (!strcmp(argv[ArgIdx], "--memo-stats")) MemoStats = true;
+        else if (!strcmp(argv[ArgIdx], "--vec-report")) VecReport = true;
+        else if (!strncmp(argv[ArgIdx], "--stack-size=", 13))
+        {
+            if (!ParseStackSize(argv[ArgIdx] + 13, StackLimit))
+            {
+                fprintf(stderr, "Invalid stack size \"%s\"\n", argv[ArgIdx] + 13);
+                return 0;
+            }
+        }
+        else if (!strcmp(argv[ArgIdx], "--stack-stats")) StackStats = true;
+        else if (!strncmp(argv[ArgIdx], "--threads=", 10))
+        {
+            int Count = atoi(argv[ArgIdx] + 10);
+            if (Count < 1)
+            {
+                fprintf(stderr, "Invalid thread count \"%s\"\n", argv[ArgIdx] + 10);
+                return 0;
+            }
+            ThreadCount = Count;
+        }
+        else if (!strcmp(argv[ArgIdx], "--no-cache")) UseCache = false;
+        else if (!strncmp(argv[ArgIdx], "--cache-dir=", 12)) CacheDir = argv[ArgIdx] + 12;
+        else
+        {
+            fprintf(stderr, "Unknown option \"%s\"\n", argv[ArgIdx]);
+            return 0;
+        }
+    }
+
+    if (!ThreadCount) ThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    if (argc - ArgIdx == 0) RunInteractiveShell();
+    else if (argc - ArgIdx == 1) ExecuteScript(argv[ArgIdx]);
+    else fprintf(stderr, "You can run only one file at once.\nusage: %s [-O0|-O1|-O2] [--vm] [--jit] [--jit-threshold=N] [--memo[=f,g]] [--memo-stats] [--vec-report] [--stack-size=N[K|M|G]] [--stack-stats] [--threads=N] [--no-cache] [--cache-dir=DIR] \"filename.sel\"\n", argv[0]);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,166 @@
+// SEL Project
+// memo.cpp
+
+#include "memo.h"
+#include "execute.h"
+#include "stdfunc.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstdint>
+
+bool MemoAll = false;
+std::vector<std::string> MemoNames;
+bool MemoStats = false;
+
+// Entries of each table, a power of two.
+static const unsigned int MemoCapacity = 4096;
+
+static unsigned int PurityGeneration = 0;
+
+/// SameValue - Keys match only with the same type, so 1 and 1.0 are different
+/// calls. Boxed values are equal exactly when their bits are.
+static bool SameValue(const Value& A, const Value& B)
+{
+    return A.getBits() == B.getBits();
+}
+
+static unsigned int HashArgs(const Value* Args, int NumArgs)
+{
+    uint64_t Hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < NumArgs; i++)
+    {
+        Hash ^= Args[i].getBits();
+        Hash *= 0x100000001b3ULL;
+        Hash ^= Hash >> 29;
+    }
+    return (unsigned int)Hash & (MemoCapacity - 1);
+}
+
+const Value* MemoFunction::find(const Value* Args)
+{
+    if (!Used.empty())
+    {
+        unsigned int Idx = HashArgs(Args, NumArgs);
+        if (Used[Idx])
+        {
+            const Value* Key = &Keys[Idx * NumArgs];
+            bool Match = true;
+            for (int i = 0; i < NumArgs && Match; i++) Match = SameValue(Key[i], Args[i]);
+            if (Match)
+            {
+                Hits++;
+                return &Results[Idx];
+            }
+        }
+    }
+    Misses++;
+    return nullptr;
+}
+
+void MemoFunction::insert(const Value* Args, const Value& Result)
+{
+    if (Used.empty())
+    {
+        Keys.resize(MemoCapacity * NumArgs);
+        Results.resize(MemoCapacity);
+        Used.assign(MemoCapacity, false);
+    }
+
+    unsigned int Idx = HashArgs(Args, NumArgs);
+    std::copy(Args, Args + NumArgs, Keys.begin() + Idx * NumArgs);
+    Results[Idx] = Result;
+    Used[Idx] = true;
+}
+
+/// UpdatePurity - Find the pure functions of the current definitions. Every
+/// function starts out as pure as its own body, and a function calling
+/// anything that is not pure is dropped until nothing changes, so mutually
+/// recursive functions can be pure.
+static void UpdatePurity()
+{
+    std::vector<FunctionAST*> Defined = DefinedFunctions();
+    for (FunctionAST* F : Defined)
+    {
+        MemoFunction* M = F->getMemo().get();
+        if (M) M->Pure = M->LocalPure;
+    }
+
+    auto IsPure = [](FunctionAST* F) { return F && F->getMemo() && F->getMemo()->Pure; };
+
+    bool Changed = true;
+    while (Changed)
+    {
+        Changed = false;
+        for (FunctionAST* F : Defined)
+        {
+            MemoFunction* M = F->getMemo().get();
+            if (!M || !M->Pure) continue;
+
+            bool Pure = true;
+            for (auto& Name : M->Callees)
+                Pure &= LookupStdFunc(Name) < 0 && IsPure(FindFunction(Name).get());
+            for (auto* Slot : M->Operators)
+                Pure &= Slot && IsPure(Slot->get());
+
+            if (!Pure)
+            {
+                M->Pure = false;
+                Changed = true;
+            }
+        }
+    }
+    PurityGeneration = FunctionGeneration;
+}
+
+bool IsPure(FunctionAST& F)
+{
+    MemoFunction* M = F.getMemo().get();
+    if (!M) return false;
+
+    // Workers can't update the analysis; a stale one counts as impure.
+    if (PurityGeneration != FunctionGeneration)
+    {
+        if (InParallel) return false;
+        UpdatePurity();
+    }
+    return M->Pure;
+}
+
+MemoFunction* GetMemo(FunctionAST& F)
+{
+    // The tables aren't shared with the workers of a pfor.
+    if (InParallel || (!MemoAll && MemoNames.empty())) return nullptr;
+
+    MemoFunction* M = F.getMemo().get();
+    if (!M) return nullptr;
+
+    // A definition may change what any function computes.
+    if (M->Generation != FunctionGeneration)
+    {
+        if (PurityGeneration != FunctionGeneration) UpdatePurity();
+
+        const std::string Name = F.getFuncName();
+        M->Generation = FunctionGeneration;
+        M->NumArgs = F.argsSize();
+        M->Enabled = M->Pure && Name != "__anon_expr" &&
+            (MemoAll || std::find(MemoNames.begin(), MemoNames.end(), Name) != MemoNames.end());
+        M->clear();
+    }
+    return M->Enabled ? M : nullptr;
+}
+
+bool Cacheable(const Value& V)
+{
+    return !V.isErr();
+}
+
+void PrintMemoStats()
+{
+    for (FunctionAST* F : DefinedFunctions())
+    {
+        MemoFunction* M = F->getMemo().get();
+        if (!M || M->Hits + M->Misses == 0) continue;
+
+        fprintf(stderr, "memo %s: %llu hits, %llu misses\n", F->getFuncName().c_str(), M->Hits, M->Misses);
+    }
+}
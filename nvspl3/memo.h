@@ -0,0 +1,61 @@
+// SEL Project
+// memo.h
+
+#pragma once
+
+#include "value.h"
+#include "ast.h"
+#include <vector>
+#include <string>
+#include <memory>
+
+extern bool MemoAll;                       // --memo
+extern std::vector<std::string> MemoNames; // --memo=f,g
+extern bool MemoStats;                     // --memo-stats
+
+/// MemoFunction - Purity of a FunctionAST and the results cached for it.
+///
+/// A function is pure when its body only reads and assigns its arguments and
+/// pfor counters, never touches arrays or memory through '@' and '&', and
+/// only calls pure user functions. Every standard function does I/O. SEL is
+/// dynamically scoped, so any other name could belong to a caller; that
+/// includes the counter of a for loop, which reuses a visible variable of its
+/// name, unless the counter is an argument.
+///
+/// Results are kept in a direct-mapped table keyed on the argument values; a
+/// call that collides with an older entry replaces it.
+struct MemoFunction
+{
+    // Filled in by the resolver.
+    bool LocalPure = true;
+    std::vector<std::string> Callees;
+    std::vector<std::shared_ptr<FunctionAST>*> Operators;
+
+    unsigned int Generation = 0; // FunctionGeneration the fields below are valid for
+    bool Pure = false;
+    bool Enabled = false;
+
+    int NumArgs = 0;
+    std::vector<Value> Keys;    // NumArgs values per entry
+    std::vector<Value> Results;
+    std::vector<bool> Used;
+
+    unsigned long long Hits = 0, Misses = 0;
+
+    const Value* find(const Value* Args);
+    void insert(const Value* Args, const Value& Result);
+    void clear() { Used.assign(Used.size(), false); }
+};
+
+/// GetMemo - Return the table calls of F go through, or null when F is not
+/// memoized.
+MemoFunction* GetMemo(FunctionAST& F);
+
+/// IsPure - Whether calls of F can't see or change anything but their own
+/// arguments and locals.
+bool IsPure(FunctionAST& F);
+
+/// Cacheable - Whether a call that logged no error and returned V may be cached.
+bool Cacheable(const Value& V);
+
+void PrintMemoStats();
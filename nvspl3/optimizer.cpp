@@ -0,0 +1,287 @@
+// SEL Project
+// optimizer.cpp
+
+#include "optimizer.h"
+#include "execute.h"
+#include <climits>
+#include <algorithm>
+
+int OptLevel = 1;
+
+static const Value& ConstValue(ExprAST* E)
+{
+    return static_cast<NumberExprAST*>(E)->getValue();
+}
+
+bool IsConstant(ExprAST* E)
+{
+    return E->getNodeType() == nodeType::node_number;
+}
+
+/// IsConstantInt - Check for an integer literal of the given value.
+static bool IsConstantInt(ExprAST* E, int Val)
+{
+    if (!IsConstant(E)) return false;
+
+    const Value& V = ConstValue(E);
+    return V.getvType() == valueType::val_data && V.isInt() && V.getVal().i == Val;
+}
+
+static bool IsTrue(const Value& V)
+{
+    return V.getdVal() != 0;
+}
+
+static ExprAST* Constant(Optimizer& O, Value Val)
+{
+    return O.Arena.make<NumberExprAST>(Val);
+}
+
+/// Scoped - A branch that is taken unconditionally still runs in its own scope.
+static ExprAST* Scoped(Optimizer& O, ExprAST* E)
+{
+    if (E->getNodeType() == nodeType::node_block) return E;
+    return O.Arena.make<BlockExprAST>(ExprList(O.Arena, { E }));
+}
+
+/// CanFold - Integer division by zero traps; leave it to run time.
+static bool CanFold(binOp Opcode, const Value& L, const Value& R)
+{
+    if (Opcode != binOp::op_div && Opcode != binOp::op_mod) return true;
+    if (!L.isInt() || !R.isInt()) return true;
+    return R.getiVal() != 0 && !(L.getiVal() == INT_MIN && R.getiVal() == -1);
+}
+
+/// FoldLogical - Fold '&&' or '||' when its left operand is a constant. The left
+/// operand decides the result, or the result is the truth of the right one.
+static ExprAST* FoldLogical(Optimizer& O, binOp Opcode, ExprAST* LHS, ExprAST* RHS)
+{
+    if (!IsConstant(LHS)) return nullptr;
+
+    bool Left = IsTrue(ConstValue(LHS));
+    if (Opcode == binOp::op_and && !Left) return Constant(O, Value(0));
+    if (Opcode == binOp::op_or && Left) return Constant(O, Value(1));
+    if (IsConstant(RHS)) return Constant(O, Value(IsTrue(ConstValue(RHS)) ? 1 : 0));
+    return nullptr;
+}
+
+void Optimizer::visit(ExprAST*& E)
+{
+    if (auto Replacement = E->optimize(*this)) E = Replacement;
+}
+
+/// visitCond - Optimize an expression whose value is only tested for truth.
+void Optimizer::visitCond(ExprAST*& Cond)
+{
+    visit(Cond);
+    if (Level < 2) return;
+
+    while (true)
+    {
+        // !!x and x != 0 are true exactly when x is.
+        if (Cond->getNodeType() == nodeType::node_unary)
+        {
+            UnaryExprAST* Not = static_cast<UnaryExprAST*>(Cond);
+            if (Not->isUserOp() || Not->getOpcode() != '!') break;
+            if (Not->getOperand()->getNodeType() != nodeType::node_unary) break;
+
+            UnaryExprAST* Inner = static_cast<UnaryExprAST*>(Not->getOperand());
+            if (Inner->isUserOp() || Inner->getOpcode() != '!') break;
+            Cond = Inner->getOperand();
+        }
+        else if (Cond->getNodeType() == nodeType::node_binary)
+        {
+            BinaryExprAST* Ne = static_cast<BinaryExprAST*>(Cond);
+            if (Ne->getOpcode() != binOp::op_ne) break;
+
+            if (IsConstantInt(Ne->getRHS(), 0)) Cond = Ne->getLHS();
+            else if (IsConstantInt(Ne->getLHS(), 0)) Cond = Ne->getRHS();
+            else break;
+        }
+        else break;
+    }
+}
+
+ExprAST* NumberExprAST::optimize(Optimizer& O)
+{
+    return nullptr;
+}
+
+ExprAST* VariableExprAST::optimize(Optimizer& O)
+{
+    for (auto& Idx : Indices) O.visit(Idx);
+    return nullptr;
+}
+
+ExprAST* DeRefExprAST::optimize(Optimizer& O)
+{
+    O.visit(AddrExpr);
+    return nullptr;
+}
+
+ExprAST* ArrDeclExprAST::optimize(Optimizer& O)
+{
+    return nullptr;
+}
+
+ExprAST* UnaryExprAST::optimize(Optimizer& O)
+{
+    O.visit(Operand);
+
+    if (Opcode != '&' && !UserOp && IsConstant(Operand))
+        return Constant(O, ApplyUnaryOp(Opcode, ConstValue(Operand)));
+    return nullptr;
+}
+
+ExprAST* BinaryExprAST::optimize(Optimizer& O)
+{
+    O.visit(LHS);
+    O.visit(RHS);
+    if (Opcode == binOp::op_assign || Opcode == binOp::op_user) return nullptr;
+
+    if (IsConstant(LHS) && IsConstant(RHS) && CanFold(Opcode, ConstValue(LHS), ConstValue(RHS)))
+        return Constant(O, ApplyBinOp(Opcode, ConstValue(LHS), ConstValue(RHS)));
+
+    if (Opcode == binOp::op_and || Opcode == binOp::op_or)
+    {
+        if (auto Folded = FoldLogical(O, Opcode, LHS, RHS)) return Folded;
+        return O.Arena.make<LogicalExprAST>(Opcode, LHS, RHS);
+    }
+
+    // Identities with an integer literal keep the type of the other operand.
+    if (O.Level >= 2)
+    {
+        switch (Opcode)
+        {
+        case binOp::op_mul:
+            if (IsConstantInt(RHS, 1)) return LHS;
+            if (IsConstantInt(LHS, 1)) return RHS;
+            break;
+        case binOp::op_div:
+        case binOp::op_pow:
+            if (IsConstantInt(RHS, 1)) return LHS;
+            break;
+        case binOp::op_sub:
+            if (IsConstantInt(RHS, 0)) return LHS;
+            break;
+        default:
+            break;
+        }
+    }
+    return nullptr;
+}
+
+ExprAST* LogicalExprAST::optimize(Optimizer& O)
+{
+    O.visit(LHS);
+    O.visit(RHS);
+    return FoldLogical(O, Opcode, LHS, RHS);
+}
+
+ExprAST* CallExprAST::optimize(Optimizer& O)
+{
+    for (auto& Arg : Args) O.visit(Arg);
+    return nullptr;
+}
+
+ExprAST* IfExprAST::optimize(Optimizer& O)
+{
+    O.visitCond(Cond);
+    O.visit(Then);
+    if (Else) O.visit(Else);
+
+    if (IsConstant(Cond))
+    {
+        if (IsTrue(ConstValue(Cond))) return Scoped(O, Then);
+        if (Else) return Scoped(O, Else);
+        return Constant(O, Value(valueType::val_undef));
+    }
+
+    // if !c then a else b  ->  if c then b else a
+    if (O.Level >= 2 && Else && Cond->getNodeType() == nodeType::node_unary)
+    {
+        UnaryExprAST* Not = static_cast<UnaryExprAST*>(Cond);
+        if (!Not->isUserOp() && Not->getOpcode() == '!')
+        {
+            Cond = Not->getOperand();
+            std::swap(Then, Else);
+        }
+    }
+    return nullptr;
+}
+
+ExprAST* ForExprAST::optimize(Optimizer& O)
+{
+    // The counter is bound even if the body never runs, so the loop stays.
+    O.visit(Start);
+    O.visitCond(End);
+    if (Step) O.visit(Step);
+    O.visit(Body);
+    return nullptr;
+}
+
+ExprAST* PForExprAST::optimize(Optimizer& O)
+{
+    O.visit(Start);
+    O.visit(End);
+    O.visit(Body);
+    return nullptr;
+}
+
+ExprAST* WhileExprAST::optimize(Optimizer& O)
+{
+    O.visitCond(Cond);
+    O.visit(Body);
+
+    if (IsConstant(Cond) && !IsTrue(ConstValue(Cond))) return Constant(O, Value(valueType::val_undef));
+    return nullptr;
+}
+
+ExprAST* RepeatExprAST::optimize(Optimizer& O)
+{
+    O.visit(IterNum);
+    O.visit(Body);
+
+    if (IsConstantInt(IterNum, 0)) return Constant(O, Value(valueType::val_undef));
+    return nullptr;
+}
+
+ExprAST* LoopExprAST::optimize(Optimizer& O)
+{
+    O.visit(Body);
+    return nullptr;
+}
+
+ExprAST* BlockExprAST::optimize(Optimizer& O)
+{
+    for (auto& Expr : Expressions) O.visit(Expr);
+
+    // A constant statement has no effect unless it is the value of the block.
+    if (O.Level >= 2 && Expressions.size() > 1)
+    {
+        ExprAST** Kept = std::remove_if(Expressions.begin(), Expressions.end() - 1, IsConstant);
+        *Kept = Expressions.back();
+        Expressions.truncate(Kept - Expressions.begin() + 1);
+    }
+    return nullptr;
+}
+
+ExprAST* BreakExprAST::optimize(Optimizer& O)
+{
+    O.visit(Expr);
+    return nullptr;
+}
+
+ExprAST* ReturnExprAST::optimize(Optimizer& O)
+{
+    O.visit(Expr);
+    return nullptr;
+}
+
+void OptimizeFunction(FunctionAST& F)
+{
+    if (OptLevel <= 0) return;
+
+    Optimizer O(OptLevel, F.getArena());
+    O.visit(F.getBodySlot());
+}
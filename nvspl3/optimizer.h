@@ -0,0 +1,34 @@
+// SEL Project
+// optimizer.h
+
+#pragma once
+
+#include "ast.h"
+
+/// Optimizer - Rewrites the AST of a function before it is resolved and run.
+///
+/// -O0 runs the tree as parsed.
+/// -O1 folds operators on constants, removes branches and loops whose
+///     condition is constant, and lowers '&&' and '||' to short-circuit
+///     evaluation.
+/// -O2 also applies algebraic identities (x * 1, x - 0, ...), which may turn
+///     an undefined operand into 0, simplifies conditions and drops constant
+///     statements whose value is discarded.
+class Optimizer
+{
+public:
+    int Level;
+    AstArena& Arena; // where new nodes go
+
+    Optimizer(int Level, AstArena& Arena) : Level(Level), Arena(Arena) {}
+
+    void visit(ExprAST*& E);
+    void visitCond(ExprAST*& Cond);
+};
+
+/// OptLevel - The optimization level selected with -O0/-O1/-O2.
+extern int OptLevel;
+
+bool IsConstant(ExprAST* E);
+
+void OptimizeFunction(FunctionAST& F);
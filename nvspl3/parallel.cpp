@@ -0,0 +1,257 @@
+// SEL Project
+// parallel.cpp
+
+#include "parallel.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <deque>
+
+unsigned int ThreadCount = 0; // one per core until --threads says otherwise
+bool InParallel = false;
+
+// The worker the current thread is, or -1 off the pool.
+static thread_local int WorkerIdx = -1;
+
+/// ForkedTask - The second half of a ForkJoin, waiting in its worker's queue.
+typedef struct ForkedTask
+{
+    const std::function<void()>* Run;
+    std::atomic<bool> Done{ false };
+} forkedTask;
+
+/// WorkerPool - Threads kept waiting for the tasks of a job. Every worker
+/// owns a range of task numbers it takes from the front of, and thieves
+/// take the back half, so each steal moves a large piece of work. Tasks
+/// forked while running go to the back of the worker's queue; the worker
+/// takes them back from there and thieves take the oldest from the front.
+class WorkerPool
+{
+    typedef struct TaskRange
+    {
+        std::mutex Lock;
+        unsigned int Begin = 0, End = 0;
+        std::deque<forkedTask*> Forked;
+    } taskRange;
+
+    std::vector<std::thread> Threads;
+    std::vector<std::unique_ptr<taskRange>> Ranges;
+
+    std::mutex Lock;
+    std::condition_variable Wake, Finished;
+    unsigned int Generation = 0; // bumped for every job
+    unsigned int Running = 0;    // workers still on the current job
+    bool Quit = false;
+
+    const std::function<void(unsigned int)>* Setup = nullptr;
+    const std::function<bool(unsigned int, unsigned int)>* Task = nullptr;
+    std::atomic<bool> Stop{ false };
+    std::atomic<unsigned int> Unfinished{ 0 }; // numbered tasks not done yet
+
+    bool next(unsigned int Self, unsigned int& Item);
+    bool steal(unsigned int Self);
+    void work(unsigned int Self);
+
+public:
+    ~WorkerPool();
+
+    unsigned int size() const { return Threads.size(); }
+    void start(unsigned int Count);
+    bool run(unsigned int NumTasks, const std::function<void(unsigned int)>& Setup,
+        const std::function<bool(unsigned int, unsigned int)>& Task);
+    void forkJoin(const std::function<void()>& Left, const std::function<void()>& Right);
+};
+
+/// next - Take a task of our own, or steal half of what another worker has left.
+bool WorkerPool::next(unsigned int Self, unsigned int& Item)
+{
+    taskRange& Own = *Ranges[Self];
+    {
+        std::lock_guard<std::mutex> Guard(Own.Lock);
+        if (Own.Begin < Own.End)
+        {
+            Item = Own.Begin++;
+            return true;
+        }
+    }
+
+    // Nothing adds numbered tasks, so a sweep finding none means none are left.
+    unsigned int Workers = Ranges.size();
+    for (unsigned int k = 1; k < Workers; k++)
+    {
+        taskRange& Victim = *Ranges[(Self + k) % Workers];
+        unsigned int Begin, End;
+        {
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            unsigned int Left = Victim.End - Victim.Begin;
+            if (!Left) continue;
+            End = Victim.End;
+            Begin = Victim.End -= (Left + 1) / 2;
+        }
+
+        std::lock_guard<std::mutex> Guard(Own.Lock);
+        Own.Begin = Begin + 1;
+        Own.End = End;
+        Item = Begin;
+        return true;
+    }
+    return false;
+}
+
+/// steal - Run the oldest task forked on another worker. Returns false when
+/// there is none.
+bool WorkerPool::steal(unsigned int Self)
+{
+    unsigned int Workers = Ranges.size();
+    for (unsigned int k = 1; k < Workers; k++)
+    {
+        taskRange& Victim = *Ranges[(Self + k) % Workers];
+        forkedTask* Task;
+        {
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            if (Victim.Forked.empty()) continue;
+            Task = Victim.Forked.front();
+            Victim.Forked.pop_front();
+        }
+
+        (*Task->Run)();
+        Task->Done.store(true, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::forkJoin(const std::function<void()>& Left, const std::function<void()>& Right)
+{
+    if (WorkerIdx < 0)
+    {
+        Left();
+        Right();
+        return;
+    }
+
+    taskRange& Own = *Ranges[WorkerIdx];
+    forkedTask Task;
+    Task.Run = &Right;
+    {
+        std::lock_guard<std::mutex> Guard(Own.Lock);
+        Own.Forked.push_back(&Task);
+    }
+
+    Left();
+
+    // Left forked and joined everything it pushed, so Right is at the back
+    // unless a thief has it.
+    {
+        std::unique_lock<std::mutex> Guard(Own.Lock);
+        if (!Own.Forked.empty() && Own.Forked.back() == &Task)
+        {
+            Own.Forked.pop_back();
+            Guard.unlock();
+            Right();
+            return;
+        }
+    }
+
+    // Help with other work until the thief is done.
+    while (!Task.Done.load(std::memory_order_acquire))
+        if (!steal(WorkerIdx)) std::this_thread::yield();
+}
+
+void WorkerPool::work(unsigned int Self)
+{
+    WorkerIdx = Self;
+    unsigned int Seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> Guard(Lock);
+            Wake.wait(Guard, [&] { return Quit || Generation != Seen; });
+            if (Quit) return;
+            Seen = Generation;
+        }
+
+        // Tasks still running may fork more, so an idle worker keeps looking
+        // until every numbered task is done.
+        (*Setup)(Self);
+        unsigned int Item;
+        while (!Stop.load(std::memory_order_relaxed))
+        {
+            if (next(Self, Item))
+            {
+                if (!(*Task)(Self, Item)) Stop = true;
+                Unfinished--;
+            }
+            else if (!steal(Self))
+            {
+                if (!Unfinished) break;
+                std::this_thread::yield();
+            }
+        }
+
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (--Running == 0) Finished.notify_one();
+    }
+}
+
+void WorkerPool::start(unsigned int Count)
+{
+    for (unsigned int i = 0; i < Count; i++)
+        Ranges.push_back(std::make_unique<taskRange>());
+    for (unsigned int i = 0; i < Count; i++)
+        Threads.emplace_back(&WorkerPool::work, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Quit = true;
+    }
+    Wake.notify_all();
+    for (auto& Thread : Threads) Thread.join();
+}
+
+bool WorkerPool::run(unsigned int NumTasks, const std::function<void(unsigned int)>& Setup,
+    const std::function<bool(unsigned int, unsigned int)>& Task)
+{
+    // Every worker starts with an equal share of consecutive tasks.
+    unsigned int Workers = Ranges.size();
+    for (unsigned int i = 0; i < Workers; i++)
+    {
+        Ranges[i]->Begin = (unsigned long long)NumTasks * i / Workers;
+        Ranges[i]->End = (unsigned long long)NumTasks * (i + 1) / Workers;
+    }
+
+    std::unique_lock<std::mutex> Guard(Lock);
+    this->Setup = &Setup;
+    this->Task = &Task;
+    Stop = false;
+    Unfinished = NumTasks;
+    Running = Workers;
+    Generation++;
+    Wake.notify_all();
+    Finished.wait(Guard, [&] { return Running == 0; });
+    return !Stop;
+}
+
+static WorkerPool Pool;
+
+bool RunParallel(unsigned int NumTasks, const std::function<void(unsigned int)>& Setup,
+    const std::function<bool(unsigned int, unsigned int)>& Task)
+{
+    if (!Pool.size()) Pool.start(ThreadCount);
+
+    InParallel = true;
+    bool Done = Pool.run(NumTasks, Setup, Task);
+    InParallel = false;
+    return Done;
+}
+
+void ForkJoin(const std::function<void()>& Left, const std::function<void()>& Right)
+{
+    Pool.forkJoin(Left, Right);
+}
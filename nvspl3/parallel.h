@@ -0,0 +1,24 @@
+// SEL Project
+// parallel.h
+
+#pragma once
+
+#include <functional>
+
+extern unsigned int ThreadCount; // --threads, the workers running a pfor
+extern bool InParallel;          // workers are running a pfor
+
+/// RunParallel - Run the tasks numbered 0 to NumTasks - 1 on the worker pool
+/// and wait for them. Each worker calls Setup with its number before its
+/// first task, then runs tasks until none are left, stealing half of what
+/// another worker has left when its own run out, and then tasks forked by
+/// the others until every task is done. A task returning false
+/// stops the workers from starting any more. Returns whether every task
+/// ran and returned true.
+bool RunParallel(unsigned int NumTasks, const std::function<void(unsigned int)>& Setup,
+    const std::function<bool(unsigned int, unsigned int)>& Task);
+
+/// ForkJoin - Run Left, leaving Right for any idle worker to take, and wait
+/// for both. Right runs after Left on this thread if nobody took it. Off the
+/// workers both run here, one after the other.
+void ForkJoin(const std::function<void()>& Left, const std::function<void()>& Right);
@@ -4,10 +4,15 @@
 
 #include "lexer.h"
 #include "ast.h"
+#include "execute.h"
 #include <cstdio>
 #include <map>
 
 int CurTok;
+std::string IdStr;
+dataType NumType;
+double NumVal;
+int NextChar;
 std::map<std::string, int> BinopPrecedence;
 std::string OpChrList = "<>+-*/%!&|=";
 
@@ -30,9 +35,32 @@ void InitBinopPrec()
     BinopPrecedence["="] = 18 - 15; // lowest
 }
 
-int GetNextToken(std::string& Code, int& Idx)
+std::vector<std::pair<std::string, int>> GetBinopPrecedences()
 {
-    return CurTok = GetTok(Code, Idx);
+    // Looking an operator up adds it with no precedence, which is the same as
+    // not having it.
+    std::vector<std::pair<std::string, int>> Table;
+    for (auto& Entry : BinopPrecedence)
+        if (Entry.second > 0) Table.push_back(Entry);
+    return Table;
+}
+
+void SetBinopPrecedence(const std::string& Op, int Prec)
+{
+    BinopPrecedence[Op] = Prec;
+}
+
+int GetNextToken(TokenStream& Toks)
+{
+    const lexeme& L = Toks.next();
+    if (L.Tok == tok_identifier || L.Tok == tok_path) IdStr = Toks.name(L.Name);
+    else if (L.Tok == tok_number)
+    {
+        NumVal = L.Num;
+        NumType = L.NumType;
+    }
+    NextChar = L.Next;
+    return CurTok = L.Tok;
 }
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
@@ -45,9 +73,36 @@ int GetTokPrecedence(std::string Op)
     return TokPrec;
 }
 
+/// GetBinOpcode - Map a binary operator to its opcode, or op_user if it is not builtin.
+binOp GetBinOpcode(const std::string& Op)
+{
+    static const std::map<std::string, binOp> Opcodes = {
+        { "=", binOp::op_assign },
+        { "==", binOp::op_eq }, { "!=", binOp::op_ne },
+        { "&&", binOp::op_and }, { "||", binOp::op_or },
+        { "<", binOp::op_lt }, { ">", binOp::op_gt },
+        { "<=", binOp::op_le }, { ">=", binOp::op_ge },
+        { "+", binOp::op_add }, { "-", binOp::op_sub },
+        { "*", binOp::op_mul }, { "/", binOp::op_div },
+        { "%", binOp::op_mod }, { "**", binOp::op_pow },
+    };
+    auto It = Opcodes.find(Op);
+    return It == Opcodes.end() ? binOp::op_user : It->second;
+}
+
+/// Make - Allocate a node in the arena of the module being parsed.
+template<class T, class... Args>
+static T* Make(TokenStream& Toks, Args&&... As)
+{
+    return Toks.arena().make<T>(std::forward<Args>(As)...);
+}
+
 /// LogError* - These are little helper functions for error handling.
-std::shared_ptr<ExprAST> LogError(const char* Str)
+std::atomic<unsigned int> ErrorCount(0);
+
+ExprAST* LogError(const char* Str)
 {
+    ErrorCount++;
     fprintf(stderr, "Error: %s\n", Str);
     return nullptr;
 }
@@ -59,26 +114,26 @@ std::shared_ptr<PrototypeAST> LogErrorP(const char* Str)
 }
 
 /// numberexpr ::= number
-std::shared_ptr<ExprAST> ParseNumberExpr(std::string& Code, int& Idx)
+ExprAST* ParseNumberExpr(TokenStream& Toks)
 {
     Value Val;
     if (NumType == dataType::t_double) Val = Value(NumVal);
     else if (NumType == dataType::t_int) Val = Value((int)NumVal);
 
-    GetNextToken(Code, Idx); // consume the number
-    return std::make_shared<NumberExprAST>(Val);
+    GetNextToken(Toks); // consume the number
+    return Make<NumberExprAST>(Toks, Val);
 }
 
 /// parenexpr ::= '(' expression ')'
-std::shared_ptr<ExprAST> ParseParenExpr(std::string& Code, int& Idx)
+ExprAST* ParseParenExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat (.
-    auto Expr = ParseExpression(Code, Idx);
+    GetNextToken(Toks); // eat (.
+    auto Expr = ParseExpression(Toks);
     if (!Expr) return nullptr;
 
     if (CurTok != ')')
         return LogError("Expected ')'");
-    GetNextToken(Code, Idx); // eat ).
+    GetNextToken(Toks); // eat ).
     return Expr;
 }
 
@@ -86,49 +141,49 @@ std::shared_ptr<ExprAST> ParseParenExpr(std::string& Code, int& Idx)
 ///   ::= identifier
 ///   ::= identifier ('[' expression ']')+
 ///   ::= identifier '(' expression* ')'
-std::shared_ptr<ExprAST> ParseIdentifierExpr(std::string& Code, int& Idx)
+ExprAST* ParseIdentifierExpr(TokenStream& Toks)
 {
-    std::string IdName = IdStr;
+    const std::string* IdName = Toks.arena().intern(IdStr);
 
-    GetNextToken(Code, Idx); // eat identifier.
+    GetNextToken(Toks); // eat identifier.
 
     if (CurTok != '(') // simple variable or array element ref.
     {
-        if (CurTok != '[') return std::make_shared<VariableExprAST>(IdName);
-        GetNextToken(Code, Idx);
+        if (CurTok != '[') return Make<VariableExprAST>(Toks, IdName);
+        GetNextToken(Toks);
 
-        std::vector<std::shared_ptr<ExprAST>> Indices;
+        std::vector<ExprAST*> Indices;
         if (CurTok != ']')
         {
             while (true)
             {
-                if (auto ArrIdx = ParseExpression(Code, Idx))
-                    Indices.push_back(std::move(ArrIdx));
+                if (auto ArrIdx = ParseExpression(Toks))
+                    Indices.push_back(ArrIdx);
                 else return nullptr;
 
                 if (CurTok == ']')
                 {
-                    GetNextToken(Code, Idx);
+                    GetNextToken(Toks);
 
                     if (CurTok != '[') break;
-                    else GetNextToken(Code, Idx);
+                    else GetNextToken(Toks);
                 }
             }
         }
         else return LogError("Array index missing");
 
-        return std::make_shared<VariableExprAST>(IdName, Indices);
+        return Make<VariableExprAST>(Toks, IdName, ExprList(Toks.arena(), Indices));
     }
 
     // Call.
-    GetNextToken(Code, Idx); // eat (
-    std::vector<std::shared_ptr<ExprAST>> Args;
+    GetNextToken(Toks); // eat (
+    std::vector<ExprAST*> Args;
     if (CurTok != ')')
     {
         while (true)
         {
-            if (auto Arg = ParseExpression(Code, Idx))
-                Args.push_back(std::move(Arg));
+            if (auto Arg = ParseExpression(Toks))
+                Args.push_back(Arg);
             else return nullptr;
 
             if (CurTok == ')')
@@ -136,40 +191,40 @@ std::shared_ptr<ExprAST> ParseIdentifierExpr(std::string& Code, int& Idx)
 
             if (CurTok != ',')
                 return LogError("Expected ')' or ',' in argument list");
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
         }
     }
 
     // Eat the ')'.
-    GetNextToken(Code, Idx);
+    GetNextToken(Toks);
 
-    return std::make_shared<CallExprAST>(IdName, std::move(Args));
+    return Make<CallExprAST>(Toks, IdName, ExprList(Toks.arena(), Args));
 }
 
 /// derefexpr
 ///   ::= '@' expression
-std::shared_ptr<ExprAST> ParseDeRefExpr(std::string& Code, int& Idx)
+ExprAST* ParseDeRefExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the '@'.
+    GetNextToken(Toks); // eat the '@'.
 
-    auto Primary = ParsePrimary(Code, Idx);
+    auto Primary = ParsePrimary(Toks);
     if (!Primary)
         return nullptr;
 
-    return std::make_shared<DeRefExprAST>(std::move(Primary));
+    return Make<DeRefExprAST>(Toks, Primary);
 }
 
-/// arrdeclexpr ::= 'arr' identifier ('[' number ']')+
-std::shared_ptr<ExprAST> ParseArrDeclExpr(std::string& Code, int& Idx)
+/// arrdeclexpr ::= 'arr' identifier ('[' number ']')+ ('as' ('int' | 'double'))?
+ExprAST* ParseArrDeclExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the arr.
+    GetNextToken(Toks); // eat the arr.
 
-    std::string IdName = IdStr;
-    GetNextToken(Code, Idx);
+    const std::string* IdName = Toks.arena().intern(IdStr);
+    GetNextToken(Toks);
 
     if (CurTok != '[') return LogError("Expected '[' after array name");
 
-    GetNextToken(Code, Idx);
+    GetNextToken(Toks);
 
     std::vector<int> Indices;
 
@@ -182,167 +237,230 @@ std::shared_ptr<ExprAST> ParseArrDeclExpr(std::string& Code, int& Idx)
                 Indices.push_back((int)NumVal);
             }
             else return LogError("Length of each dimension must be an integer 1 or higher");
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
 
             if (CurTok == ']')
             {
-                if (LastChar != '[')
+                if (NextChar != '[')
                     break;
 
-                GetNextToken(Code, Idx);
-                GetNextToken(Code, Idx);
+                GetNextToken(Toks);
+                GetNextToken(Toks);
             }
         }
     }
     else return LogError("Array dimension missing");
-    GetNextToken(Code, Idx);
+    GetNextToken(Toks);
+
+    elemType Type = elemType::elem_value;
+    if (CurTok == tok_as)
+    {
+        GetNextToken(Toks); // eat the as.
+
+        if (CurTok == tok_int) Type = elemType::elem_int;
+        else if (CurTok == tok_dbl) Type = elemType::elem_double;
+        else return LogError("Expected 'int' or 'double' after 'as'");
+        GetNextToken(Toks);
+    }
 
-    return std::make_shared<ArrDeclExprAST>(IdName, Indices);
+    return Make<ArrDeclExprAST>(Toks, IdName, std::move(Indices), Type);
 }
 
 /// ifexpr ::= 'if' expression 'then' blockexpr 'else' blockexpr
-std::shared_ptr<ExprAST> ParseIfExpr(std::string& Code, int& Idx)
+ExprAST* ParseIfExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the if.
+    GetNextToken(Toks); // eat the if.
 
     // condition.
-    auto Cond = ParseExpression(Code, Idx);
+    auto Cond = ParseExpression(Toks);
     if (!Cond)
         return nullptr;
 
     if (CurTok != tok_then)
         return LogError("Expected then");
-    GetNextToken(Code, Idx); // eat the then
+    GetNextToken(Toks); // eat the then
 
-    auto Then = ParseBlockExpression(Code, Idx);
+    auto Then = ParseBlockExpression(Toks);
     if (!Then)
         return nullptr;
 
     if (CurTok == tok_else)
     {
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
 
-        auto Else = ParseBlockExpression(Code, Idx);
+        auto Else = ParseBlockExpression(Toks);
         if (!Else)
             return nullptr;
 
-        return std::make_shared<IfExprAST>(std::move(Cond), std::move(Then),
-            std::move(Else));
+        return Make<IfExprAST>(Toks, Cond, Then, Else);
     }
-    return std::make_shared<IfExprAST>(std::move(Cond), std::move(Then));
+    return Make<IfExprAST>(Toks, Cond, Then);
 }
 
 /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? blockexpr
-std::shared_ptr<ExprAST> ParseForExpr(std::string& Code, int& Idx)
+ExprAST* ParseForExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the for.
+    GetNextToken(Toks); // eat the for.
 
     if (CurTok != tok_identifier)
         return LogError("Expected identifier");
 
-    std::string IdName = IdStr;
-    GetNextToken(Code, Idx); // eat identifier.
+    const std::string* IdName = Toks.arena().intern(IdStr);
+    GetNextToken(Toks); // eat identifier.
 
     if (CurTok != '=')
         return LogError("Expected '=' after identifier");
-    GetNextToken(Code, Idx); // eat '='.
+    GetNextToken(Toks); // eat '='.
 
-    auto Start = ParseExpression(Code, Idx);
+    auto Start = ParseExpression(Toks);
     if (!Start)
         return nullptr;
     if (CurTok != ',')
         return LogError("Expected ','");
-    GetNextToken(Code, Idx);
+    GetNextToken(Toks);
 
-    auto End = ParseExpression(Code, Idx);
+    auto End = ParseExpression(Toks);
     if (!End)
         return nullptr;
 
     // The step value is optional.
-    std::shared_ptr<ExprAST> Step;
+    ExprAST* Step = nullptr;
     if (CurTok == ',') {
-        GetNextToken(Code, Idx);
-        Step = ParseExpression(Code, Idx);
+        GetNextToken(Toks);
+        Step = ParseExpression(Toks);
         if (!Step)
             return nullptr;
     }
 
-    auto Body = ParseBlockExpression(Code, Idx);
+    auto Body = ParseBlockExpression(Toks);
     if (!Body)
         return nullptr;
 
-    return std::make_shared<ForExprAST>(IdName, std::move(Start), std::move(End),
-        std::move(Step), std::move(Body));
+    return Make<ForExprAST>(Toks, IdName, Start, End, Step, Body);
+}
+
+/// pforexpr ::= 'pfor' identifier '=' expr ',' expr
+///              ('reduce' ('+' | '*') identifier (',' ('+' | '*') identifier)*)? blockexpr
+ExprAST* ParsePForExpr(TokenStream& Toks)
+{
+    GetNextToken(Toks); // eat the pfor.
+
+    if (CurTok != tok_identifier)
+        return LogError("Expected identifier");
+
+    const std::string* IdName = Toks.arena().intern(IdStr);
+    GetNextToken(Toks); // eat identifier.
+
+    if (CurTok != '=')
+        return LogError("Expected '=' after identifier");
+    GetNextToken(Toks); // eat '='.
+
+    auto Start = ParseExpression(Toks);
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("Expected ','");
+    GetNextToken(Toks);
+
+    auto End = ParseExpression(Toks);
+    if (!End)
+        return nullptr;
+
+    // 'reduce' is only a keyword here.
+    std::vector<reduction> Reductions;
+    if (CurTok == tok_identifier && IdStr == "reduce")
+    {
+        do
+        {
+            GetNextToken(Toks); // eat 'reduce' or ','.
+            if (CurTok != '+' && CurTok != '*')
+                return LogError("Expected '+' or '*' in reduce");
+            binOp Opcode = CurTok == '+' ? binOp::op_add : binOp::op_mul;
+            GetNextToken(Toks);
+
+            if (CurTok != tok_identifier)
+                return LogError("Expected identifier in reduce");
+            Reductions.push_back({ IdStr, Opcode });
+            GetNextToken(Toks);
+        } while (CurTok == ',');
+    }
+
+    auto Body = ParseBlockExpression(Toks);
+    if (!Body)
+        return nullptr;
+
+    return Make<PForExprAST>(Toks, IdName, Start, End,
+        std::move(Reductions), Body);
 }
 
 /// whileexpr ::= 'while' expr blockexpr
-std::shared_ptr<ExprAST> ParseWhileExpr(std::string& Code, int& Idx)
+ExprAST* ParseWhileExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the while.
+    GetNextToken(Toks); // eat the while.
 
-    auto Cond = ParseExpression(Code, Idx);
+    auto Cond = ParseExpression(Toks);
     if (!Cond)
         return nullptr;
 
-    auto Body = ParseBlockExpression(Code, Idx);
+    auto Body = ParseBlockExpression(Toks);
     if (!Body)
         return nullptr;
 
-    return std::make_shared<WhileExprAST>(std::move(Cond), std::move(Body));
+    return Make<WhileExprAST>(Toks, Cond, Body);
 }
 
 /// repexpr ::= 'rep' expr blockexpr
-std::shared_ptr<ExprAST> ParseRepeatExpr(std::string& Code, int& Idx)
+ExprAST* ParseRepeatExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the rep.
+    GetNextToken(Toks); // eat the rep.
 
-    auto IterNum = ParseExpression(Code, Idx);
+    auto IterNum = ParseExpression(Toks);
     if (!IterNum)
         return nullptr;
 
-    auto Body = ParseBlockExpression(Code, Idx);
+    auto Body = ParseBlockExpression(Toks);
     if (!Body)
         return nullptr;
 
-    return std::make_shared<RepeatExprAST>(std::move(IterNum), std::move(Body));
+    return Make<RepeatExprAST>(Toks, IterNum, Body);
 }
 
 /// loopexpr ::= 'loop' blockexpr
-std::shared_ptr<ExprAST> ParseLoopExpr(std::string& Code, int& Idx)
+ExprAST* ParseLoopExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the loop.
+    GetNextToken(Toks); // eat the loop.
 
-    auto Body = ParseBlockExpression(Code, Idx);
+    auto Body = ParseBlockExpression(Toks);
     if (!Body)
         return nullptr;
 
-    return std::make_shared<LoopExprAST>(std::move(Body));
+    return Make<LoopExprAST>(Toks, Body);
 }
 
 /// breakexpr
 ///   ::= 'break' expr
-std::shared_ptr<ExprAST> ParseBreakExpr(std::string& Code, int& Idx)
+ExprAST* ParseBreakExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the break.
+    GetNextToken(Toks); // eat the break.
 
-    auto Expr = ParseExpression(Code, Idx);
+    auto Expr = ParseExpression(Toks);
     if (!Expr)
         return nullptr;
 
-    return std::make_shared<BreakExprAST>(std::move(Expr));
+    return Make<BreakExprAST>(Toks, Expr);
 }
 
 /// returnexpr
 ///   ::= 'return' expr
-std::shared_ptr<ExprAST> ParseReturnExpr(std::string& Code, int& Idx)
+ExprAST* ParseReturnExpr(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat the return.
+    GetNextToken(Toks); // eat the return.
 
-    auto Expr = ParseExpression(Code, Idx);
+    auto Expr = ParseExpression(Toks);
     if (!Expr)
         return nullptr;
 
-    return std::make_shared<ReturnExprAST>(std::move(Expr));
+    return Make<ReturnExprAST>(Toks, Expr);
 }
 
 /// primary
@@ -355,61 +473,68 @@ std::shared_ptr<ExprAST> ParseReturnExpr(std::string& Code, int& Idx)
 ///   ::= whileexpr
 ///   ::= repexpr
 ///   ::= loopexpr
-std::shared_ptr<ExprAST> ParsePrimary(std::string& Code, int& Idx)
+ExprAST* ParsePrimary(TokenStream& Toks)
 {
     switch (CurTok) {
     default:
         return LogError("Unknown token when expecting an expression");
     case tok_identifier:
-        return ParseIdentifierExpr(Code, Idx);
+        return ParseIdentifierExpr(Toks);
     case '@':
-        return ParseDeRefExpr(Code, Idx);
+        return ParseDeRefExpr(Toks);
     case tok_number:
-        return ParseNumberExpr(Code, Idx);
+        return ParseNumberExpr(Toks);
     case tok_for:
-        return ParseForExpr(Code, Idx);
+        return ParseForExpr(Toks);
+    case tok_pfor:
+        return ParsePForExpr(Toks);
     case tok_while:
-        return ParseWhileExpr(Code, Idx);
+        return ParseWhileExpr(Toks);
     case tok_if:
-        return ParseIfExpr(Code, Idx);
+        return ParseIfExpr(Toks);
     case tok_repeat:
-        return ParseRepeatExpr(Code, Idx);
+        return ParseRepeatExpr(Toks);
     case tok_loop:
-        return ParseLoopExpr(Code, Idx);
+        return ParseLoopExpr(Toks);
     case '(':
-        return ParseParenExpr(Code, Idx);
+        return ParseParenExpr(Toks);
     }
 }
 
 /// unary
 ///   ::= primary
 ///   ::= unaryop unary
-std::shared_ptr<ExprAST> ParseUnary(std::string& Code, int& Idx)
+ExprAST* ParseUnary(TokenStream& Toks)
 {
     if (CurTok == tok_undef)
         return nullptr;
 
     // If the current token is not an operator, it must be a primary expr.
     if (!isascii(CurTok) || CurTok == '(' || CurTok == ',' || CurTok == '@')
-        return ParsePrimary(Code, Idx);
+        return ParsePrimary(Toks);
 
     // If this is a unary operator, read it.
     int Opc;
     if (OpChrList.find(CurTok) != std::string::npos)
     {
         Opc = CurTok;
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
     }
     else return LogError(((std::string)"Unknown token '" + (char)CurTok + (std::string)"'").c_str());
 
-    if (auto Operand = ParseUnary(Code, Idx))
-        return std::make_shared<UnaryExprAST>(Opc, std::move(Operand));
+    if (auto Operand = ParseUnary(Toks))
+    {
+        std::shared_ptr<FunctionAST>* UserOp = nullptr;
+        if (Opc != '&' && Opc != '!' && Opc != '+' && Opc != '-')
+            UserOp = GetFunctionSlot(std::string("unary") + (char)Opc);
+        return Make<UnaryExprAST>(Toks, Opc, Operand, UserOp);
+    }
     return nullptr;
 }
 
 /// binoprhs
 ///   ::= (binop unary)*
-std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec, std::shared_ptr<ExprAST> LHS)
+ExprAST* ParseBinOpRHS(TokenStream& Toks, int ExprPrec, ExprAST* LHS)
 {
     while (true)
     {
@@ -418,9 +543,9 @@ std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec
         BinOp += (char)CurTok;
 
         if (OpChrList.find(CurTok) != std::string::npos && 
-            OpChrList.find(LastChar) != std::string::npos)
+            OpChrList.find(NextChar) != std::string::npos)
         {
-            BinOp += (char)LastChar;
+            BinOp += (char)NextChar;
             DoubleCh = true;
         }
         int TokPrec = GetTokPrecedence(BinOp);
@@ -428,10 +553,10 @@ std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec
         if (TokPrec <= ExprPrec)
             return LHS;
 
-        GetNextToken(Code, Idx);
-        if (DoubleCh) GetNextToken(Code, Idx);
+        GetNextToken(Toks);
+        if (DoubleCh) GetNextToken(Toks);
 
-        auto RHS = ParseUnary(Code, Idx);
+        auto RHS = ParseUnary(Toks);
         if (!RHS)
             return nullptr;
 
@@ -439,19 +564,23 @@ std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec
         NextOp += (char)CurTok;
 
         if (OpChrList.find(CurTok) != std::string::npos &&
-            OpChrList.find(LastChar) != std::string::npos)
+            OpChrList.find(NextChar) != std::string::npos)
         {
-            NextOp += (char)LastChar;
+            NextOp += (char)NextChar;
         }
 
         int NextPrec = GetTokPrecedence(NextOp);
         if (TokPrec < NextPrec)
         {
-            RHS = ParseBinOpRHS(Code, Idx, TokPrec, std::move(RHS));
+            RHS = ParseBinOpRHS(Toks, TokPrec, RHS);
             if (!RHS) return nullptr;
         }
 
-        LHS = std::make_shared<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        binOp Opc = GetBinOpcode(BinOp);
+        std::shared_ptr<FunctionAST>* UserOp = nullptr;
+        if (Opc == binOp::op_user) UserOp = GetFunctionSlot("binary" + BinOp);
+
+        LHS = Make<BinaryExprAST>(Toks, Toks.arena().intern(BinOp), Opc, UserOp, LHS, RHS);
     }
 }
 
@@ -460,55 +589,57 @@ std::shared_ptr<ExprAST> ParseBinOpRHS(std::string& Code, int& Idx, int ExprPrec
 ///   ::= arrdeclexpr
 ///   ::= breakexpr
 ///   ::= returnexpr
-std::shared_ptr<ExprAST> ParseExpression(std::string& Code, int& Idx)
+ExprAST* ParseExpression(TokenStream& Toks)
 {
     switch (CurTok)
     {
     case tok_arr:
-        return ParseArrDeclExpr(Code, Idx);
+        return ParseArrDeclExpr(Toks);
     case tok_break:
-        return ParseBreakExpr(Code, Idx);
+        return ParseBreakExpr(Toks);
     case tok_return:
-        return ParseReturnExpr(Code, Idx);
+        return ParseReturnExpr(Toks);
     default:
-        auto LHS = ParseUnary(Code, Idx);
+        auto LHS = ParseUnary(Toks);
         if (!LHS)
             return nullptr;
-        return ParseBinOpRHS(Code, Idx, 0, std::move(LHS));
+        return ParseBinOpRHS(Toks, 0, LHS);
     }
 }
 
 /// blockexpr
 ///   ::= expression
 ///   ::= '{' expression+ '}'
-std::shared_ptr<ExprAST> ParseBlockExpression(std::string& Code, int& Idx)
+ExprAST* ParseBlockExpression(TokenStream& Toks)
 {
     if (CurTok != tok_openblock)
-        return ParseExpression(Code, Idx);
-    GetNextToken(Code, Idx);
+        return ParseExpression(Toks);
+    GetNextToken(Toks);
 
-    std::vector<std::shared_ptr<ExprAST>> ExprSeq;
+    std::vector<ExprAST*> ExprSeq;
 
     while (true)
     {
-        auto Expr = ParseBlockExpression(Code, Idx);
-        ExprSeq.push_back(std::move(Expr));
+        auto Expr = ParseBlockExpression(Toks);
+        if (!Expr)
+            return nullptr;
+        ExprSeq.push_back(Expr);
         if (CurTok == ';')
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
         if (CurTok == tok_closeblock)
         {
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
             break;
         }
     }
-    return std::make_shared<BlockExprAST>(ExprSeq);
+    return Make<BlockExprAST>(Toks, ExprList(Toks.arena(), ExprSeq));
 }
 
 /// prototype
 ///   ::= id '(' id* ')'
 ///   ::= binary LETTER(LETTER)? number? (id, id)
 ///   ::= unary LETTER (id)
-std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx)
+std::shared_ptr<PrototypeAST> ParsePrototype(TokenStream& Toks)
 {
     std::string FnName;
 
@@ -521,29 +652,29 @@ std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx)
     case tok_identifier:
         FnName = IdStr;
         Kind = 0;
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
         break;
     case tok_unary:
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
         if (!isascii(CurTok))
             return LogErrorP("Expected unary operator");
         FnName = "unary";
         FnName += (char)CurTok;
         Kind = 1;
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
         break;
     case tok_binary:
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
         if (!isascii(CurTok))
             return LogErrorP("Expected binary operator");
 
         std::string OpName;
         OpName += (char)CurTok;
-        GetNextToken(Code, Idx);
+        GetNextToken(Toks);
         if (OpChrList.find(CurTok) != std::string::npos)
         {
             OpName += (char)CurTok;
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
         }
         Kind = 2;
 
@@ -552,7 +683,7 @@ std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx)
             if (NumVal < 1 || NumVal > 18)
                 return LogErrorP("Invalid precedence: must be 1~18");
             BinaryPrecedence = (unsigned int)NumVal;
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
         }
 
         // install binary operator.
@@ -567,23 +698,23 @@ std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx)
 
     std::vector<std::string> ArgNames;
 
-    if (GetNextToken(Code, Idx) != ')')
+    if (GetNextToken(Toks) != ')')
     {
         while (true)
         {
             if (CurTok == tok_identifier)
                 ArgNames.push_back(IdStr);
 
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
             if (CurTok == ')') break;
             if (CurTok != ',')
                 return LogErrorP("Expected ',' or ')'");
 
-            GetNextToken(Code, Idx);
+            GetNextToken(Toks);
         }
     }
     // success.
-    GetNextToken(Code, Idx); // eat ')'
+    GetNextToken(Toks); // eat ')'
 
     // Verify right number of names for operator.
     if (Kind && ArgNames.size() != Kind)
@@ -594,32 +725,33 @@ std::shared_ptr<PrototypeAST> ParsePrototype(std::string& Code, int& Idx)
 }
 
 /// definition ::= 'func' prototype expression
-std::shared_ptr<FunctionAST> ParseDefinition(std::string& Code, int& Idx)
+std::shared_ptr<FunctionAST> ParseDefinition(TokenStream& Toks)
 {
-    GetNextToken(Code, Idx); // eat func.
-    auto Proto = ParsePrototype(Code, Idx);
+    GetNextToken(Toks); // eat func.
+    auto Proto = ParsePrototype(Toks);
     if (!Proto)
         return nullptr;
 
-    if (auto BlockExpr = ParseBlockExpression(Code, Idx))
-        return std::make_shared<FunctionAST>(std::move(Proto), std::move(BlockExpr));
+    if (auto BlockExpr = ParseBlockExpression(Toks))
+        return std::make_shared<FunctionAST>(Toks.getArena(), std::move(Proto), BlockExpr);
     return nullptr;
 }
 
 /// toplevelexpr ::= expression
-std::shared_ptr<FunctionAST> ParseTopLevelExpr(std::string& Code, int& Idx)
+std::shared_ptr<FunctionAST> ParseTopLevelExpr(TokenStream& Toks)
 {
-    if (auto BlockExpr = ParseBlockExpression(Code, Idx)) {
+    if (auto BlockExpr = ParseBlockExpression(Toks)) {
         // Make an anonymous proto.
         auto Proto = std::make_shared<PrototypeAST>("__anon_expr",
             std::vector<std::string>());
-        return std::make_shared<FunctionAST>(std::move(Proto), std::move(BlockExpr));
+        return std::make_shared<FunctionAST>(Toks.getArena(), std::move(Proto), BlockExpr);
     }
     return nullptr;
 }
 
 /// importexpr ::= 'import' path
-std::shared_ptr<ImportAST> ParseImport(std::string& Code, int& Idx)
+std::shared_ptr<ImportAST> ParseImport(TokenStream& Toks)
 {
-    return std::make_shared<ImportAST>(GetPath(Code, Idx) + ".sel");
+    GetNextToken(Toks); // eat import.
+    return std::make_shared<ImportAST>(IdStr + ".sel");
 }
\ No newline at end of file
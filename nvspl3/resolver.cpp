@@ -0,0 +1,357 @@
+// SEL Project
+// resolver.cpp
+
+#include "resolver.h"
+#include "execute.h"
+#include "memo.h"
+#include "stdfunc.h"
+#include "vectorize.h"
+#include <algorithm>
+
+int ScopeResolver::getSlot(const std::string& Name) const
+{
+    if (Collecting || std::find(ArrNames.begin(), ArrNames.end(), Name) != ArrNames.end() ||
+        std::find(PForNames.begin(), PForNames.end(), Name) != PForNames.end())
+        return -1;
+
+    // The last argument of a given name is the one lookups would find.
+    for (int i = ArgNames.size() - 1; i >= 0; i--)
+        if (ArgNames[i] == Name) return i;
+    return -1;
+}
+
+/// beginScope - Start collecting the bindings of a construct that may need a
+/// scope, returning what endScope needs to restore.
+bool ScopeResolver::beginScope()
+{
+    bool OuterDeclares = Declares;
+    Declares = false;
+    return OuterDeclares;
+}
+
+/// endScope - Whether the construct E has to enter and leave a scope. When it
+/// binds nothing it doesn't; when it ends with its enclosing scope its names
+/// go there instead.
+bool ScopeResolver::endScope(bool OuterDeclares, const ExprAST* E)
+{
+    bool Merged = isScopeEnd(E);
+    bool Scoped = Declares && !Merged;
+    Declares = OuterDeclares || (Declares && Merged);
+    return Scoped;
+}
+
+/// isBound - Whether a name is known to be bound here: an argument, or the
+/// counter of an enclosing loop.
+bool ScopeResolver::isBound(const std::string& Name, int Slot) const
+{
+    return Slot >= 0 || std::find(LoopVars.begin(), LoopVars.end(), Name) != LoopVars.end();
+}
+
+/// useVariable - Anything but an argument or a loop variable may be bound by a
+/// caller. A for counter that isn't an argument may be the caller's too, but
+/// the loop has already made the body impure; a pfor counter is always fresh.
+void ScopeResolver::useVariable(const std::string& Name, int Slot)
+{
+    if (!isBound(Name, Slot)) impure();
+}
+
+static bool IsCounter(ExprAST* E, const std::string& VarName)
+{
+    if (E->getNodeType() != nodeType::node_var) return false;
+
+    VariableExprAST* Var = static_cast<VariableExprAST*>(E);
+    return Var->getIndices().empty() && Var->getName() == VarName;
+}
+
+/// IsInvariant - Whether E has the same value on every iteration of a loop
+/// that assigns the names in Assigned and runs no user code.
+static bool IsInvariant(ExprAST* E, const std::set<std::string>& Assigned)
+{
+    switch (E->getNodeType())
+    {
+    case nodeType::node_number:
+        return true;
+    case nodeType::node_var:
+    {
+        VariableExprAST* Var = static_cast<VariableExprAST*>(E);
+        return Var->getIndices().empty() && !Assigned.count(Var->getName());
+    }
+    case nodeType::node_unary:
+    {
+        UnaryExprAST* Op = static_cast<UnaryExprAST*>(E);
+        return !Op->isUserOp() && Op->getOpcode() != '&' && IsInvariant(Op->getOperand(), Assigned);
+    }
+    case nodeType::node_binary:
+    {
+        BinaryExprAST* Op = static_cast<BinaryExprAST*>(E);
+        return Op->getOpcode() != binOp::op_assign && Op->getOpcode() != binOp::op_user &&
+            IsInvariant(Op->getLHS(), Assigned) && IsInvariant(Op->getRHS(), Assigned);
+    }
+    default:
+        return false;
+    }
+}
+
+void NumberExprAST::resolve(ScopeResolver& R) {}
+
+void VariableExprAST::resolve(ScopeResolver& R)
+{
+    Sym = InternSymbol(*Name);
+    Slot = Indices.empty() ? R.getSlot(*Name) : -1;
+    if (Indices.empty()) R.useVariable(*Name, Slot);
+    else R.impure();
+    for (auto& Idx : Indices) Idx->resolve(R);
+}
+
+void DeRefExprAST::resolve(ScopeResolver& R)
+{
+    R.impure();
+    AddrExpr->resolve(R);
+}
+
+void ArrDeclExprAST::resolve(ScopeResolver& R)
+{
+    Sym = InternSymbol(*Name);
+    R.declareArr(*Name);
+    R.declare();
+    R.impure();
+}
+
+void UnaryExprAST::resolve(ScopeResolver& R)
+{
+    if (UserOp)
+    {
+        R.callOperator(UserOp);
+        R.Opaque = true;
+    }
+    else if (Opcode == '&')
+    {
+        R.AddressTaken = true;
+        R.impure();
+    }
+    Operand->resolve(R);
+}
+
+void BinaryExprAST::resolve(ScopeResolver& R)
+{
+    if (Opcode == binOp::op_user)
+    {
+        R.callOperator(UserOp);
+        R.Opaque = true;
+    }
+    else if (Opcode == binOp::op_assign)
+    {
+        if (LHS->getNodeType() == nodeType::node_var)
+            R.Assigned.insert(static_cast<VariableExprAST*>(LHS)->getName());
+        else R.Opaque = true;
+    }
+    Forkable = Opcode != binOp::op_assign &&
+        LHS->getNodeType() == nodeType::node_call && RHS->getNodeType() == nodeType::node_call;
+    LHS->resolve(R);
+    RHS->resolve(R);
+
+    // Assigning a name that isn't bound yet binds it.
+    if (Opcode == binOp::op_assign && LHS->getNodeType() == nodeType::node_var)
+    {
+        VariableExprAST* Var = static_cast<VariableExprAST*>(LHS);
+        if (Var->getIndices().empty() && !R.isBound(Var->getName(), Var->getSlot())) R.declare();
+    }
+}
+
+void LogicalExprAST::resolve(ScopeResolver& R)
+{
+    LHS->resolve(R);
+    RHS->resolve(R);
+}
+
+void CallExprAST::resolve(ScopeResolver& R)
+{
+    // A pointer into the frame would see the arguments change under it.
+    Tail = R.isTail(this) && !R.AddressTaken;
+    R.call(*Callee);
+    // Array functions write memory, and a script may define one of their names.
+    int StdFunc = FindStdFunc(*Callee);
+    if (StdFunc < 0 || StdFunc >= FirstArrayFunc) R.Opaque = true;
+    for (auto& Arg : Args) Arg->resolve(R);
+}
+
+void IfExprAST::resolve(ScopeResolver& R)
+{
+    if (R.isTail(this))
+    {
+        R.markTail(Then);
+        if (Else) R.markTail(Else);
+    }
+    Cond->resolve(R);
+
+    // Each arm is the last thing run in its own scope.
+    R.markScopeEnd(Then);
+    bool Outer = R.beginScope();
+    Then->resolve(R);
+    ThenScoped = R.endScope(Outer, this);
+
+    if (Else)
+    {
+        R.markScopeEnd(Else);
+        Outer = R.beginScope();
+        Else->resolve(R);
+        ElseScoped = R.endScope(Outer, this);
+    }
+}
+
+void ForExprAST::resolve(ScopeResolver& R)
+{
+    unsigned int Id = R.Collecting ? 0 : ++LoopCount;
+    Sym = InternSymbol(*VarName);
+    Slot = R.getSlot(*VarName);
+    Start->resolve(R);
+
+    bool OuterDeclares = R.beginScope();
+    if (Slot < 0)
+    {
+        // The counter is a visible variable of that name if there is one,
+        // which may be the caller's.
+        R.declare();
+        R.impure();
+    }
+
+    std::set<std::string> OuterAssigned;
+    std::swap(OuterAssigned, R.Assigned);
+    bool OuterOpaque = R.Opaque;
+    R.Opaque = false;
+
+    R.beginLoop(*VarName);
+    End->resolve(R);
+    if (Step) Step->resolve(R);
+    Body->resolve(R);
+    R.endLoop();
+
+    R.Assigned.insert(*VarName);
+    Bound = nullptr;
+    if (!R.Opaque && End->getNodeType() == nodeType::node_binary)
+    {
+        BinaryExprAST* Cmp = static_cast<BinaryExprAST*>(End);
+        switch (Cmp->getOpcode())
+        {
+        case binOp::op_lt: case binOp::op_le: case binOp::op_gt:
+        case binOp::op_ge: case binOp::op_ne: case binOp::op_eq:
+            BoundOp = Cmp->getOpcode();
+            if (IsCounter(Cmp->getLHS(), *VarName) && IsInvariant(Cmp->getRHS(), R.Assigned))
+                Bound = Cmp->getRHS(), CounterLeft = true;
+            else if (IsCounter(Cmp->getRHS(), *VarName) && IsInvariant(Cmp->getLHS(), R.Assigned))
+                Bound = Cmp->getLHS(), CounterLeft = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!R.Collecting) Vec = AnalyzeLoop(*this, Id, R.FuncName);
+
+    R.Assigned.insert(OuterAssigned.begin(), OuterAssigned.end());
+    R.Opaque |= OuterOpaque;
+    Scoped = R.endScope(OuterDeclares, this);
+}
+
+// Every iteration of a pfor runs in a scope of its own, on top of the one
+// binding its counter and reductions.
+void PForExprAST::resolve(ScopeResolver& R)
+{
+    Sym = InternSymbol(*VarName);
+    R.declarePFor(*VarName);
+    for (auto& Red : Reductions)
+    {
+        Red.Sym = InternSymbol(Red.Name);
+        R.declarePFor(Red.Name);
+        R.Assigned.insert(Red.Name);
+    }
+    // Reductions are folded into the visible variables of their names.
+    if (!Reductions.empty()) R.impure();
+    Start->resolve(R);
+    End->resolve(R);
+
+    bool OuterDeclares = R.beginScope();
+    R.beginLoop(*VarName);
+    Body->resolve(R);
+    R.endLoop();
+    R.Declares = OuterDeclares;
+}
+
+// A loop keeps one scope for all of its iterations, so a body binding names
+// still needs its own.
+void WhileExprAST::resolve(ScopeResolver& R)
+{
+    bool Outer = R.beginScope();
+    Cond->resolve(R);
+    Body->resolve(R);
+    Scoped = R.endScope(Outer, this);
+}
+
+void RepeatExprAST::resolve(ScopeResolver& R)
+{
+    IterNum->resolve(R);
+
+    bool Outer = R.beginScope();
+    Body->resolve(R);
+    Scoped = R.endScope(Outer, this);
+}
+
+void LoopExprAST::resolve(ScopeResolver& R)
+{
+    bool Outer = R.beginScope();
+    Body->resolve(R);
+    Scoped = R.endScope(Outer, this);
+}
+
+void BlockExprAST::resolve(ScopeResolver& R)
+{
+    if (Expressions.empty())
+    {
+        Scoped = false;
+        return;
+    }
+
+    if (R.isTail(this)) R.markTail(Expressions.back());
+    R.markScopeEnd(Expressions.back());
+
+    bool Outer = R.beginScope();
+    for (auto& Expr : Expressions) Expr->resolve(R);
+    Scoped = R.endScope(Outer, this);
+}
+
+void BreakExprAST::resolve(ScopeResolver& R)
+{
+    Expr->resolve(R);
+}
+
+void ReturnExprAST::resolve(ScopeResolver& R)
+{
+    // Whatever is returned leaves the function, from any depth.
+    R.markTail(Expr);
+    Expr->resolve(R);
+}
+
+void ResolveScopes(FunctionAST& F)
+{
+    ScopeResolver R(F.getFuncArgs());
+    R.FuncName = F.getFuncName();
+    R.markTail(F.getBody());
+
+    // The frame of a function is left right after its body. The bindings of
+    // a top-level expression outlive it, but those of its blocks don't.
+    if (F.getFuncName() != "__anon_expr") R.markScopeEnd(F.getBody());
+
+    F.getBody()->resolve(R);
+    R.Collecting = false;
+    F.getBody()->resolve(R);
+
+    auto Memo = std::make_shared<MemoFunction>();
+    Memo->LocalPure = !R.Impure;
+    Memo->Callees = std::move(R.Callees);
+    Memo->Operators = std::move(R.Operators);
+    F.getMemo() = Memo;
+
+    std::vector<int> ArgSyms;
+    for (auto& Arg : F.getFuncArgs()) ArgSyms.push_back(InternSymbol(Arg));
+    F.setArgSyms(std::move(ArgSyms));
+}
@@ -0,0 +1,73 @@
+// SEL Project
+// resolver.h
+
+#pragma once
+
+#include "ast.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <set>
+
+/// ScopeResolver - Binds the identifiers of a function body before it runs.
+/// Every name is interned to a symbol id, and references to the function's
+/// own arguments are turned into frame slots. SEL is dynamically scoped, so
+/// only arguments have a fixed place in the frame; an argument is left to
+/// the symbol lookup when the body declares an array of the same name, or
+/// a pfor counter or reduction, which every worker binds for itself.
+/// It also marks the calls whose value is the value of the function, finds
+/// the blocks, branches and loops that need no scope of their own, and
+/// records what the body touches to tell whether the function is pure.
+class ScopeResolver
+{
+    std::vector<std::string> ArgNames;
+    std::vector<std::string> ArrNames;
+    std::vector<std::string> PForNames; // bound by each pfor worker
+    std::unordered_set<const ExprAST*> TailExprs;
+    std::unordered_set<const ExprAST*> ScopeEnds;
+    std::vector<std::string> LoopVars;
+
+public:
+    bool Collecting = true; // first pass: only gather array declarations
+    bool AddressTaken = false; // the body takes the address of a variable
+    bool Declares = false; // the innermost scope may bind a name
+
+    // purity, recorded on the second pass
+    bool Impure = false;
+    std::vector<std::string> Callees;
+    std::vector<std::shared_ptr<FunctionAST>*> Operators;
+
+    // effects of the innermost loop, to find invariant loop bounds
+    std::set<std::string> Assigned;
+    bool Opaque = false; // calls user code or writes through '@'
+
+    std::string FuncName; // for the --vec-report lines
+
+    ScopeResolver(std::vector<std::string> ArgNames) : ArgNames(std::move(ArgNames)) {}
+
+    void declareArr(const std::string& Name) { if (Collecting) ArrNames.push_back(Name); }
+    void declarePFor(const std::string& Name) { if (Collecting) PForNames.push_back(Name); }
+    int getSlot(const std::string& Name) const;
+
+    void markTail(const ExprAST* E) { TailExprs.insert(E); }
+    bool isTail(const ExprAST* E) const { return TailExprs.count(E) != 0; }
+
+    // E is the last thing run in its enclosing scope, so it can bind its
+    // names there instead of in a scope of its own.
+    void markScopeEnd(const ExprAST* E) { ScopeEnds.insert(E); }
+    bool isScopeEnd(const ExprAST* E) const { return ScopeEnds.count(E) != 0; }
+
+    void declare() { Declares = true; }
+    bool beginScope();
+    bool endScope(bool OuterDeclares, const ExprAST* E);
+
+    void beginLoop(const std::string& Var) { LoopVars.push_back(Var); }
+    void endLoop() { LoopVars.pop_back(); }
+    void useVariable(const std::string& Name, int Slot);
+    bool isBound(const std::string& Name, int Slot) const;
+    void impure() { if (!Collecting) Impure = true; }
+    void call(const std::string& Callee) { if (!Collecting) Callees.push_back(Callee); }
+    void callOperator(std::shared_ptr<FunctionAST>* Slot) { if (!Collecting) Operators.push_back(Slot); }
+};
+
+void ResolveScopes(FunctionAST& F);
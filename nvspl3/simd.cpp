@@ -0,0 +1,608 @@
+// SEL Project
+// simd.cpp
+
+#include "simd.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SEL_SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using AVX2 are compiled for it even when the rest of the program
+// is not, and only called once the CPU is known to have it.
+#if defined(__GNUC__) || defined(__clang__)
+#define SEL_AVX2 __attribute__((target("avx2")))
+#else
+#define SEL_AVX2
+#endif
+
+static const uint64_t LowMask = 0xFFFFFFFFULL;
+
+static double AsDouble(const Value& V)
+{
+    uint64_t Bits = V.getBits();
+    double Val;
+    memcpy(&Val, &Bits, sizeof(Val));
+    return Val;
+}
+
+static Value FromDouble(double Val)
+{
+    uint64_t Bits;
+    memcpy(&Bits, &Val, sizeof(Bits));
+    return Value::fromBits(Bits);
+}
+
+static int AsInt(const Value& V)
+{
+    return (int32_t)(uint32_t)V.getBits();
+}
+
+static Value FromInt(uint64_t Low)
+{
+    return Value::fromBits(Value::IntTag | (Low & LowMask));
+}
+
+static cellKind KindOf(bool AnyInt, bool AnyDouble)
+{
+    if (AnyInt && AnyDouble) return cellKind::cells_mixed;
+    return AnyDouble ? cellKind::cells_double : cellKind::cells_int;
+}
+
+/// SimdKernels - One implementation of every vectorized kernel.
+typedef struct SimdKernels
+{
+    const char* Name;
+    cellKind (*Classify)(const Value*, unsigned int);
+    int (*SumInts)(const Value*, unsigned int);
+    double (*SumDoubles)(const Value*, unsigned int);
+    int (*MinInts)(const Value*, unsigned int);
+    int (*MaxInts)(const Value*, unsigned int);
+    double (*MinDoubles)(const Value*, unsigned int);
+    double (*MaxDoubles)(const Value*, unsigned int);
+    int (*DotInts)(const Value*, const Value*, unsigned int);
+    double (*DotDoubles)(const Value*, const Value*, unsigned int);
+    void (*AxpyInts)(Value*, const Value*, unsigned int, int);
+    void (*AxpyDoubles)(Value*, const Value*, unsigned int, double);
+    void (*ScaleInts)(Value*, unsigned int, int);
+    void (*ScaleDoubles)(Value*, unsigned int, double);
+} simdKernels;
+
+// Scalar kernels, also finishing the elements left over by the vector loops.
+
+static cellKind ClassifyScalar(const Value* C, unsigned int N)
+{
+    bool AnyInt = false, AnyDouble = false;
+    for (unsigned int i = 0; i < N; i++)
+    {
+        if (C[i].isInt()) AnyInt = true;
+        else AnyDouble = true;
+    }
+    return KindOf(AnyInt, AnyDouble);
+}
+
+static int SumIntsScalar(const Value* C, unsigned int N)
+{
+    uint32_t Sum = 0;
+    for (unsigned int i = 0; i < N; i++) Sum += (uint32_t)C[i].getBits();
+    return (int32_t)Sum;
+}
+
+static double SumDoublesScalar(const Value* C, unsigned int N)
+{
+    double Sum = 0;
+    for (unsigned int i = 0; i < N; i++) Sum += AsDouble(C[i]);
+    return Sum;
+}
+
+static int MinIntsScalar(const Value* C, unsigned int N)
+{
+    int Min = AsInt(C[0]);
+    for (unsigned int i = 1; i < N; i++) Min = std::min(Min, AsInt(C[i]));
+    return Min;
+}
+
+static int MaxIntsScalar(const Value* C, unsigned int N)
+{
+    int Max = AsInt(C[0]);
+    for (unsigned int i = 1; i < N; i++) Max = std::max(Max, AsInt(C[i]));
+    return Max;
+}
+
+// A NaN is only the result when it is the first element.
+static double MinDoublesScalar(const Value* C, unsigned int N)
+{
+    double Min = AsDouble(C[0]);
+    for (unsigned int i = 1; i < N; i++)
+        if (AsDouble(C[i]) < Min) Min = AsDouble(C[i]);
+    return Min;
+}
+
+static double MaxDoublesScalar(const Value* C, unsigned int N)
+{
+    double Max = AsDouble(C[0]);
+    for (unsigned int i = 1; i < N; i++)
+        if (AsDouble(C[i]) > Max) Max = AsDouble(C[i]);
+    return Max;
+}
+
+static int DotIntsScalar(const Value* X, const Value* Y, unsigned int N)
+{
+    uint32_t Sum = 0;
+    for (unsigned int i = 0; i < N; i++) Sum += (uint32_t)X[i].getBits() * (uint32_t)Y[i].getBits();
+    return (int32_t)Sum;
+}
+
+static double DotDoublesScalar(const Value* X, const Value* Y, unsigned int N)
+{
+    double Sum = 0;
+    for (unsigned int i = 0; i < N; i++) Sum += AsDouble(X[i]) * AsDouble(Y[i]);
+    return Sum;
+}
+
+static void AxpyIntsScalar(Value* Y, const Value* X, unsigned int N, int A)
+{
+    for (unsigned int i = 0; i < N; i++)
+        Y[i] = FromInt((uint32_t)A * (uint32_t)X[i].getBits() + (uint32_t)Y[i].getBits());
+}
+
+static void AxpyDoublesScalar(Value* Y, const Value* X, unsigned int N, double A)
+{
+    for (unsigned int i = 0; i < N; i++) Y[i] = FromDouble(A * AsDouble(X[i]) + AsDouble(Y[i]));
+}
+
+static void ScaleIntsScalar(Value* X, unsigned int N, int A)
+{
+    for (unsigned int i = 0; i < N; i++) X[i] = FromInt((uint32_t)A * (uint32_t)X[i].getBits());
+}
+
+static void ScaleDoublesScalar(Value* X, unsigned int N, double A)
+{
+    for (unsigned int i = 0; i < N; i++) X[i] = FromDouble(A * AsDouble(X[i]));
+}
+
+static const simdKernels ScalarKernels = {
+    "scalar",
+    ClassifyScalar,
+    SumIntsScalar, SumDoublesScalar,
+    MinIntsScalar, MaxIntsScalar, MinDoublesScalar, MaxDoublesScalar,
+    DotIntsScalar, DotDoublesScalar,
+    AxpyIntsScalar, AxpyDoublesScalar,
+    ScaleIntsScalar, ScaleDoublesScalar,
+};
+
+#ifdef SEL_SIMD_X64
+
+// Cells are loaded as whole 64-bit lanes. An int keeps its value in the low
+// half of its lane, so int kernels work on the low halves and put the tag
+// back on the way out.
+
+// SSE2 kernels, two cells at a time.
+
+static __m128i Load2(const Value* C) { return _mm_loadu_si128((const __m128i*)C); }
+static __m128d Load2d(const Value* C) { return _mm_loadu_pd((const double*)C); }
+
+static cellKind ClassifySse2(const Value* C, unsigned int N)
+{
+    // The top 16 bits of a lane are at least those of IntTag for an int.
+    const __m128i Limit = _mm_set1_epi32((int)(Value::IntTag >> 48) - 1);
+    int AnyInt = 0, AnyDouble = 0;
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+    {
+        __m128i Top = _mm_srli_epi64(Load2(C + i), 48);
+        int Mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(Top, Limit))) & 5;
+        AnyInt |= Mask;
+        AnyDouble |= ~Mask & 5;
+        if (AnyInt && AnyDouble) return cellKind::cells_mixed;
+    }
+    cellKind Rest = ClassifyScalar(C + i, N - i);
+    if (i == N) return KindOf(AnyInt, AnyDouble);
+    return KindOf(AnyInt || Rest != cellKind::cells_double, AnyDouble || Rest != cellKind::cells_int);
+}
+
+static int SumIntsSse2(const Value* C, unsigned int N)
+{
+    __m128i Sum = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2) Sum = _mm_add_epi64(Sum, Load2(C + i));
+
+    uint64_t Lanes[2];
+    _mm_storeu_si128((__m128i*)Lanes, Sum);
+    return (int32_t)(uint32_t)(Lanes[0] + Lanes[1] + (uint32_t)SumIntsScalar(C + i, N - i));
+}
+
+static double SumDoublesSse2(const Value* C, unsigned int N)
+{
+    __m128d S0 = _mm_setzero_pd(), S1 = _mm_setzero_pd();
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        S0 = _mm_add_pd(S0, Load2d(C + i));
+        S1 = _mm_add_pd(S1, Load2d(C + i + 2));
+    }
+
+    double Lanes[2];
+    _mm_storeu_pd(Lanes, _mm_add_pd(S0, S1));
+    return Lanes[0] + Lanes[1] + SumDoublesScalar(C + i, N - i);
+}
+
+// SSE2 has no 32-bit min and max.
+static __m128i MinEpi32(__m128i A, __m128i B)
+{
+    __m128i Greater = _mm_cmpgt_epi32(A, B);
+    return _mm_or_si128(_mm_and_si128(Greater, B), _mm_andnot_si128(Greater, A));
+}
+
+static __m128i MaxEpi32(__m128i A, __m128i B)
+{
+    __m128i Greater = _mm_cmpgt_epi32(A, B);
+    return _mm_or_si128(_mm_and_si128(Greater, A), _mm_andnot_si128(Greater, B));
+}
+
+template <bool IsMin>
+static int ReduceIntsSse2(const Value* C, unsigned int N)
+{
+    // Copying each low half over its high half leaves only values in the lanes.
+    __m128i Acc = _mm_set1_epi32(AsInt(C[0]));
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+    {
+        __m128i V = _mm_shuffle_epi32(Load2(C + i), _MM_SHUFFLE(2, 2, 0, 0));
+        Acc = IsMin ? MinEpi32(Acc, V) : MaxEpi32(Acc, V);
+    }
+
+    int32_t Lanes[4];
+    _mm_storeu_si128((__m128i*)Lanes, Acc);
+    int Result = IsMin ? std::min(Lanes[0], Lanes[2]) : std::max(Lanes[0], Lanes[2]);
+    if (i == N) return Result;
+    int Rest = IsMin ? MinIntsScalar(C + i, N - i) : MaxIntsScalar(C + i, N - i);
+    return IsMin ? std::min(Result, Rest) : std::max(Result, Rest);
+}
+
+static int MinIntsSse2(const Value* C, unsigned int N) { return ReduceIntsSse2<true>(C, N); }
+static int MaxIntsSse2(const Value* C, unsigned int N) { return ReduceIntsSse2<false>(C, N); }
+
+// minpd and maxpd return their second operand when either is a NaN, which
+// keeps the accumulator as the scalar loop does.
+template <bool IsMin>
+static double ReduceDoublesSse2(const Value* C, unsigned int N)
+{
+    __m128d Acc = _mm_set1_pd(AsDouble(C[0]));
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+        Acc = IsMin ? _mm_min_pd(Load2d(C + i), Acc) : _mm_max_pd(Load2d(C + i), Acc);
+
+    double Lanes[2];
+    _mm_storeu_pd(Lanes, Acc);
+    double Result = Lanes[0];
+    for (int l = 1; l < 2; l++)
+        if (IsMin ? Lanes[l] < Result : Lanes[l] > Result) Result = Lanes[l];
+    for (; i < N; i++)
+        if (IsMin ? AsDouble(C[i]) < Result : AsDouble(C[i]) > Result) Result = AsDouble(C[i]);
+    return Result;
+}
+
+static double MinDoublesSse2(const Value* C, unsigned int N) { return ReduceDoublesSse2<true>(C, N); }
+static double MaxDoublesSse2(const Value* C, unsigned int N) { return ReduceDoublesSse2<false>(C, N); }
+
+static int DotIntsSse2(const Value* X, const Value* Y, unsigned int N)
+{
+    // The low 32 bits of a product don't depend on signedness.
+    __m128i Sum = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2) Sum = _mm_add_epi64(Sum, _mm_mul_epu32(Load2(X + i), Load2(Y + i)));
+
+    uint64_t Lanes[2];
+    _mm_storeu_si128((__m128i*)Lanes, Sum);
+    return (int32_t)(uint32_t)(Lanes[0] + Lanes[1] + (uint32_t)DotIntsScalar(X + i, Y + i, N - i));
+}
+
+static double DotDoublesSse2(const Value* X, const Value* Y, unsigned int N)
+{
+    __m128d S0 = _mm_setzero_pd(), S1 = _mm_setzero_pd();
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        S0 = _mm_add_pd(S0, _mm_mul_pd(Load2d(X + i), Load2d(Y + i)));
+        S1 = _mm_add_pd(S1, _mm_mul_pd(Load2d(X + i + 2), Load2d(Y + i + 2)));
+    }
+
+    double Lanes[2];
+    _mm_storeu_pd(Lanes, _mm_add_pd(S0, S1));
+    return Lanes[0] + Lanes[1] + DotDoublesScalar(X + i, Y + i, N - i);
+}
+
+static void AxpyIntsSse2(Value* Y, const Value* X, unsigned int N, int A)
+{
+    const __m128i Factor = _mm_set1_epi64x((uint32_t)A);
+    const __m128i Low = _mm_set1_epi64x(LowMask), Tag = _mm_set1_epi64x(Value::IntTag);
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+    {
+        __m128i R = _mm_add_epi64(_mm_mul_epu32(Load2(X + i), Factor), Load2(Y + i));
+        _mm_storeu_si128((__m128i*)(Y + i), _mm_or_si128(_mm_and_si128(R, Low), Tag));
+    }
+    AxpyIntsScalar(Y + i, X + i, N - i, A);
+}
+
+static void AxpyDoublesSse2(Value* Y, const Value* X, unsigned int N, double A)
+{
+    const __m128d Factor = _mm_set1_pd(A);
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+        _mm_storeu_pd((double*)(Y + i), _mm_add_pd(_mm_mul_pd(Factor, Load2d(X + i)), Load2d(Y + i)));
+    AxpyDoublesScalar(Y + i, X + i, N - i, A);
+}
+
+static void ScaleIntsSse2(Value* X, unsigned int N, int A)
+{
+    const __m128i Factor = _mm_set1_epi64x((uint32_t)A);
+    const __m128i Low = _mm_set1_epi64x(LowMask), Tag = _mm_set1_epi64x(Value::IntTag);
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+    {
+        __m128i R = _mm_mul_epu32(Load2(X + i), Factor);
+        _mm_storeu_si128((__m128i*)(X + i), _mm_or_si128(_mm_and_si128(R, Low), Tag));
+    }
+    ScaleIntsScalar(X + i, N - i, A);
+}
+
+static void ScaleDoublesSse2(Value* X, unsigned int N, double A)
+{
+    const __m128d Factor = _mm_set1_pd(A);
+    unsigned int i = 0;
+    for (; i + 2 <= N; i += 2)
+        _mm_storeu_pd((double*)(X + i), _mm_mul_pd(Factor, Load2d(X + i)));
+    ScaleDoublesScalar(X + i, N - i, A);
+}
+
+static const simdKernels Sse2Kernels = {
+    "sse2",
+    ClassifySse2,
+    SumIntsSse2, SumDoublesSse2,
+    MinIntsSse2, MaxIntsSse2, MinDoublesSse2, MaxDoublesSse2,
+    DotIntsSse2, DotDoublesSse2,
+    AxpyIntsSse2, AxpyDoublesSse2,
+    ScaleIntsSse2, ScaleDoublesSse2,
+};
+
+// AVX2 kernels, four cells at a time.
+
+SEL_AVX2 static __m256i Load4(const Value* C) { return _mm256_loadu_si256((const __m256i*)C); }
+SEL_AVX2 static __m256d Load4d(const Value* C) { return _mm256_loadu_pd((const double*)C); }
+
+SEL_AVX2 static cellKind ClassifyAvx2(const Value* C, unsigned int N)
+{
+    const __m256i Limit = _mm256_set1_epi64x((Value::IntTag >> 48) - 1);
+    int AnyInt = 0, AnyDouble = 0;
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        __m256i Top = _mm256_srli_epi64(Load4(C + i), 48);
+        int Mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(Top, Limit)));
+        AnyInt |= Mask;
+        AnyDouble |= ~Mask & 15;
+        if (AnyInt && AnyDouble) return cellKind::cells_mixed;
+    }
+    cellKind Rest = ClassifyScalar(C + i, N - i);
+    if (i == N) return KindOf(AnyInt, AnyDouble);
+    return KindOf(AnyInt || Rest != cellKind::cells_double, AnyDouble || Rest != cellKind::cells_int);
+}
+
+SEL_AVX2 static int SumIntsAvx2(const Value* C, unsigned int N)
+{
+    __m256i Sum = _mm256_setzero_si256();
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4) Sum = _mm256_add_epi64(Sum, Load4(C + i));
+
+    uint64_t Lanes[4];
+    _mm256_storeu_si256((__m256i*)Lanes, Sum);
+    return (int32_t)(uint32_t)(Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3] + (uint32_t)SumIntsScalar(C + i, N - i));
+}
+
+SEL_AVX2 static double SumDoublesAvx2(const Value* C, unsigned int N)
+{
+    __m256d S0 = _mm256_setzero_pd(), S1 = _mm256_setzero_pd();
+    unsigned int i = 0;
+    for (; i + 8 <= N; i += 8)
+    {
+        S0 = _mm256_add_pd(S0, Load4d(C + i));
+        S1 = _mm256_add_pd(S1, Load4d(C + i + 4));
+    }
+
+    double Lanes[4];
+    _mm256_storeu_pd(Lanes, _mm256_add_pd(S0, S1));
+    return (Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3]) + SumDoublesScalar(C + i, N - i);
+}
+
+template <bool IsMin>
+SEL_AVX2 static int ReduceIntsAvx2(const Value* C, unsigned int N)
+{
+    __m256i Acc = _mm256_set1_epi32(AsInt(C[0]));
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        __m256i V = _mm256_shuffle_epi32(Load4(C + i), _MM_SHUFFLE(2, 2, 0, 0));
+        Acc = IsMin ? _mm256_min_epi32(Acc, V) : _mm256_max_epi32(Acc, V);
+    }
+
+    int32_t Lanes[8];
+    _mm256_storeu_si256((__m256i*)Lanes, Acc);
+    int Result = Lanes[0];
+    for (int l = 2; l < 8; l += 2) Result = IsMin ? std::min(Result, (int)Lanes[l]) : std::max(Result, (int)Lanes[l]);
+    if (i == N) return Result;
+    int Rest = IsMin ? MinIntsScalar(C + i, N - i) : MaxIntsScalar(C + i, N - i);
+    return IsMin ? std::min(Result, Rest) : std::max(Result, Rest);
+}
+
+SEL_AVX2 static int MinIntsAvx2(const Value* C, unsigned int N) { return ReduceIntsAvx2<true>(C, N); }
+SEL_AVX2 static int MaxIntsAvx2(const Value* C, unsigned int N) { return ReduceIntsAvx2<false>(C, N); }
+
+template <bool IsMin>
+SEL_AVX2 static double ReduceDoublesAvx2(const Value* C, unsigned int N)
+{
+    __m256d Acc = _mm256_set1_pd(AsDouble(C[0]));
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+        Acc = IsMin ? _mm256_min_pd(Load4d(C + i), Acc) : _mm256_max_pd(Load4d(C + i), Acc);
+
+    double Lanes[4];
+    _mm256_storeu_pd(Lanes, Acc);
+    double Result = Lanes[0];
+    for (int l = 1; l < 4; l++)
+        if (IsMin ? Lanes[l] < Result : Lanes[l] > Result) Result = Lanes[l];
+    for (; i < N; i++)
+        if (IsMin ? AsDouble(C[i]) < Result : AsDouble(C[i]) > Result) Result = AsDouble(C[i]);
+    return Result;
+}
+
+SEL_AVX2 static double MinDoublesAvx2(const Value* C, unsigned int N) { return ReduceDoublesAvx2<true>(C, N); }
+SEL_AVX2 static double MaxDoublesAvx2(const Value* C, unsigned int N) { return ReduceDoublesAvx2<false>(C, N); }
+
+SEL_AVX2 static int DotIntsAvx2(const Value* X, const Value* Y, unsigned int N)
+{
+    __m256i Sum = _mm256_setzero_si256();
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4) Sum = _mm256_add_epi64(Sum, _mm256_mul_epu32(Load4(X + i), Load4(Y + i)));
+
+    uint64_t Lanes[4];
+    _mm256_storeu_si256((__m256i*)Lanes, Sum);
+    return (int32_t)(uint32_t)(Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3] + (uint32_t)DotIntsScalar(X + i, Y + i, N - i));
+}
+
+SEL_AVX2 static double DotDoublesAvx2(const Value* X, const Value* Y, unsigned int N)
+{
+    __m256d S0 = _mm256_setzero_pd(), S1 = _mm256_setzero_pd();
+    unsigned int i = 0;
+    for (; i + 8 <= N; i += 8)
+    {
+        S0 = _mm256_add_pd(S0, _mm256_mul_pd(Load4d(X + i), Load4d(Y + i)));
+        S1 = _mm256_add_pd(S1, _mm256_mul_pd(Load4d(X + i + 4), Load4d(Y + i + 4)));
+    }
+
+    double Lanes[4];
+    _mm256_storeu_pd(Lanes, _mm256_add_pd(S0, S1));
+    return (Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3]) + DotDoublesScalar(X + i, Y + i, N - i);
+}
+
+SEL_AVX2 static void AxpyIntsAvx2(Value* Y, const Value* X, unsigned int N, int A)
+{
+    const __m256i Factor = _mm256_set1_epi64x((uint32_t)A);
+    const __m256i Low = _mm256_set1_epi64x(LowMask), Tag = _mm256_set1_epi64x(Value::IntTag);
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        __m256i R = _mm256_add_epi64(_mm256_mul_epu32(Load4(X + i), Factor), Load4(Y + i));
+        _mm256_storeu_si256((__m256i*)(Y + i), _mm256_or_si256(_mm256_and_si256(R, Low), Tag));
+    }
+    AxpyIntsScalar(Y + i, X + i, N - i, A);
+}
+
+SEL_AVX2 static void AxpyDoublesAvx2(Value* Y, const Value* X, unsigned int N, double A)
+{
+    const __m256d Factor = _mm256_set1_pd(A);
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+        _mm256_storeu_pd((double*)(Y + i), _mm256_add_pd(_mm256_mul_pd(Factor, Load4d(X + i)), Load4d(Y + i)));
+    AxpyDoublesScalar(Y + i, X + i, N - i, A);
+}
+
+SEL_AVX2 static void ScaleIntsAvx2(Value* X, unsigned int N, int A)
+{
+    const __m256i Factor = _mm256_set1_epi64x((uint32_t)A);
+    const __m256i Low = _mm256_set1_epi64x(LowMask), Tag = _mm256_set1_epi64x(Value::IntTag);
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+    {
+        __m256i R = _mm256_mul_epu32(Load4(X + i), Factor);
+        _mm256_storeu_si256((__m256i*)(X + i), _mm256_or_si256(_mm256_and_si256(R, Low), Tag));
+    }
+    ScaleIntsScalar(X + i, N - i, A);
+}
+
+SEL_AVX2 static void ScaleDoublesAvx2(Value* X, unsigned int N, double A)
+{
+    const __m256d Factor = _mm256_set1_pd(A);
+    unsigned int i = 0;
+    for (; i + 4 <= N; i += 4)
+        _mm256_storeu_pd((double*)(X + i), _mm256_mul_pd(Factor, Load4d(X + i)));
+    ScaleDoublesScalar(X + i, N - i, A);
+}
+
+static const simdKernels Avx2Kernels = {
+    "avx2",
+    ClassifyAvx2,
+    SumIntsAvx2, SumDoublesAvx2,
+    MinIntsAvx2, MaxIntsAvx2, MinDoublesAvx2, MaxDoublesAvx2,
+    DotIntsAvx2, DotDoublesAvx2,
+    AxpyIntsAvx2, AxpyDoublesAvx2,
+    ScaleIntsAvx2, ScaleDoublesAvx2,
+};
+
+/// HasAVX2 - Whether both the CPU and the OS support AVX2.
+static bool HasAVX2()
+{
+#ifdef _MSC_VER
+    int Info[4];
+    __cpuid(Info, 0);
+    if (Info[0] < 7) return false;
+
+    // OSXSAVE and AVX, then the OS saving the YMM registers.
+    __cpuid(Info, 1);
+    if ((Info[2] & (1 << 27)) == 0 || (Info[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+
+    __cpuidex(Info, 7, 0);
+    return (Info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // SEL_SIMD_X64
+
+/// Kernels - Pick the widest kernels the CPU runs, once.
+static const simdKernels& Kernels()
+{
+#ifdef SEL_SIMD_X64
+    // SSE2 is part of x86-64.
+    static const simdKernels& Selected = HasAVX2() ? Avx2Kernels : Sse2Kernels;
+    return Selected;
+#else
+    return ScalarKernels;
+#endif
+}
+
+cellKind ClassifyCells(const Value* Cells, unsigned int N) { return Kernels().Classify(Cells, N); }
+
+void FillCells(Value* Cells, unsigned int N, Value Val)
+{
+    // Plain 64-bit stores, which compilers vectorize on their own.
+    std::fill_n(Cells, N, Val);
+}
+
+int SumInts(const Value* Cells, unsigned int N) { return Kernels().SumInts(Cells, N); }
+double SumDoubles(const Value* Cells, unsigned int N) { return Kernels().SumDoubles(Cells, N); }
+
+int MinInts(const Value* Cells, unsigned int N) { return Kernels().MinInts(Cells, N); }
+int MaxInts(const Value* Cells, unsigned int N) { return Kernels().MaxInts(Cells, N); }
+double MinDoubles(const Value* Cells, unsigned int N) { return Kernels().MinDoubles(Cells, N); }
+double MaxDoubles(const Value* Cells, unsigned int N) { return Kernels().MaxDoubles(Cells, N); }
+
+int DotInts(const Value* X, const Value* Y, unsigned int N) { return Kernels().DotInts(X, Y, N); }
+double DotDoubles(const Value* X, const Value* Y, unsigned int N) { return Kernels().DotDoubles(X, Y, N); }
+
+void AxpyInts(Value* Y, const Value* X, unsigned int N, int A) { Kernels().AxpyInts(Y, X, N, A); }
+void AxpyDoubles(Value* Y, const Value* X, unsigned int N, double A) { Kernels().AxpyDoubles(Y, X, N, A); }
+
+void ScaleInts(Value* X, unsigned int N, int A) { Kernels().ScaleInts(X, N, A); }
+void ScaleDoubles(Value* X, unsigned int N, double A) { Kernels().ScaleDoubles(X, N, A); }
+
+const char* SimdLevel() { return Kernels().Name; }
@@ -0,0 +1,46 @@
+// SEL Project
+// simd.h
+
+#pragma once
+
+#include "value.h"
+
+/// CellKind - What a run of memory cells holds. Undef and error cells count
+/// as int 0, the way arithmetic reads them.
+typedef enum class CellKind
+{
+    cells_int,
+    cells_double,
+    cells_mixed,
+} cellKind;
+
+// Bulk operations on memory cells, vectorized with AVX2 or SSE2 when the CPU
+// has them. The int kernels wrap around like SEL int arithmetic; the double
+// kernels may add in a different order than a loop would. Every kernel but
+// ClassifyCells expects cells of a single kind.
+
+cellKind ClassifyCells(const Value* Cells, unsigned int N);
+
+void FillCells(Value* Cells, unsigned int N, Value Val);
+
+int SumInts(const Value* Cells, unsigned int N);
+double SumDoubles(const Value* Cells, unsigned int N);
+
+// N must be at least 1.
+int MinInts(const Value* Cells, unsigned int N);
+int MaxInts(const Value* Cells, unsigned int N);
+double MinDoubles(const Value* Cells, unsigned int N);
+double MaxDoubles(const Value* Cells, unsigned int N);
+
+int DotInts(const Value* X, const Value* Y, unsigned int N);
+double DotDoubles(const Value* X, const Value* Y, unsigned int N);
+
+// Y = A * X + Y, element by element. X and Y don't overlap unless they are the same.
+void AxpyInts(Value* Y, const Value* X, unsigned int N, int A);
+void AxpyDoubles(Value* Y, const Value* X, unsigned int N, double A);
+
+void ScaleInts(Value* X, unsigned int N, int A);
+void ScaleDoubles(Value* X, unsigned int N, double A);
+
+/// SimdLevel - The instruction set the kernels run with: "avx2", "sse2" or "scalar".
+const char* SimdLevel();
@@ -0,0 +1,89 @@
+// SEL Project
+// source.cpp
+
+#include "source.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SourceFile::~SourceFile()
+{
+    if (!View) return;
+#ifdef _WIN32
+    UnmapViewOfFile(View);
+#else
+    munmap(View, Size);
+#endif
+}
+
+bool SourceFile::open(const char* Path)
+{
+    return map(Path) || read(Path);
+}
+
+/// map - Map a regular, non-empty file. The mapping outlives the handles.
+bool SourceFile::map(const char* Path)
+{
+#ifdef _WIN32
+    HANDLE File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (File == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER Len;
+    HANDLE Mapping = nullptr;
+    if (GetFileType(File) == FILE_TYPE_DISK && GetFileSizeEx(File, &Len) && Len.QuadPart > 0)
+        Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (Mapping)
+    {
+        View = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(Mapping);
+    }
+    CloseHandle(File);
+    if (!View) return false;
+    Size = (size_t)Len.QuadPart;
+#else
+    int Fd = ::open(Path, O_RDONLY);
+    if (Fd < 0) return false;
+
+    struct stat St;
+    if (fstat(Fd, &St) == 0 && S_ISREG(St.st_mode) && St.st_size > 0)
+    {
+        void* Mem = mmap(nullptr, (size_t)St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+        if (Mem != MAP_FAILED)
+        {
+            View = Mem;
+            Size = (size_t)St.st_size;
+            madvise(View, Size, MADV_SEQUENTIAL);
+        }
+    }
+    close(Fd);
+    if (!View) return false;
+#endif
+    Data = static_cast<const char*>(View);
+    return true;
+}
+
+/// read - Read the file into the buffer, a block at a time.
+bool SourceFile::read(const char* Path)
+{
+    FILE* fp = fopen(Path, "rb");
+    if (fp == NULL) return false;
+
+    char Block[64 * 1024];
+    size_t Len;
+    while ((Len = fread(Block, 1, sizeof(Block), fp)) > 0) Buffer.append(Block, Len);
+    bool Failed = ferror(fp) != 0;
+    fclose(fp);
+    if (Failed) return false;
+
+    Data = Buffer.data();
+    Size = Buffer.size();
+    return true;
+}
@@ -0,0 +1,33 @@
+// SEL Project
+// source.h
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/// SourceFile - The contents of a script or module, mapped into memory so the
+/// lexer reads the file in place. What cannot be mapped, like a pipe or an
+/// empty file, is read into a buffer instead.
+class SourceFile
+{
+    const char* Data = nullptr;
+    size_t Size = 0;
+    void* View = nullptr; // the mapping, if the file is mapped
+    std::string Buffer;   // the contents, if it is not
+
+    bool map(const char* Path);
+    bool read(const char* Path);
+
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile();
+
+    /// open - Load the file at Path. Returns false if it cannot be read.
+    bool open(const char* Path);
+
+    const char* data() const { return Data; }
+    size_t size() const { return Size; }
+};
@@ -5,6 +5,8 @@
 #include "stdfunc.h"
 #include "execute.h"
 #include "value.h"
+#include "simd.h"
+#include <cstring>
 
 std::vector<std::string> StdFuncList = {
     "print",
@@ -12,54 +14,96 @@ std::vector<std::string> StdFuncList = {
     "printch",
     "input",
     "inputch",
+
+    // array functions, from FirstArrayFunc on
+    "fill",
+    "copy",
+    "sum",
+    "min",
+    "max",
+    "dot",
+    "axpy",
+    "scale",
 };
 
-Value CallStdFunc(const std::string& Name, const std::vector<Value>& Args)
+const int FirstArrayFunc = 5;
+
+typedef Value (*stdFunc)(const Value* Args, int NumArgs);
+
+// Indexed like StdFuncList.
+static const stdFunc StdFuncTable[] = {
+    print,
+    println,
+    printch,
+    input,
+    inputch,
+
+    arrFill,
+    arrCopy,
+    arrSum,
+    arrMin,
+    arrMax,
+    arrDot,
+    arrAxpy,
+    arrScale,
+};
+
+/// FindStdFunc - Return the id of a standard function, or -1 if Name is not one.
+int FindStdFunc(const std::string& Name)
 {
-    if (Name == "print") return print(Args);
-    else if (Name == "println") return println(Args);
-    else if (Name == "printch") return printch(Args);
-    else if (Name == "input") return input(Args);
-    else if (Name == "inputch") return inputch(Args);
+    for (int i = 0; i < StdFuncList.size(); i++)
+        if (StdFuncList[i] == Name) return i;
+    return -1;
+}
 
-    return Value(valueType::val_err);
+int LookupStdFunc(const std::string& Name)
+{
+    int Id = FindStdFunc(Name);
+    if (Id >= FirstArrayFunc && FindFunction(Name)) return -1;
+    return Id;
 }
 
-Value print(const std::vector<Value>& Args)
+Value CallStdFunc(int Id, const Value* Args, int NumArgs)
 {
-    for (auto Arg : Args)
+    if (Id < 0 || Id >= StdFuncList.size()) return Value(valueType::val_err);
+    return StdFuncTable[Id](Args, NumArgs);
+}
+
+Value print(const Value* Args, int NumArgs)
+{
+    for (int i = 0; i < NumArgs; i++)
     {
-        if (Arg.getdType() == dataType::t_double) fprintf(stderr, "%f ", Arg.getVal().dbl);
-        else if (Arg.getdType() == dataType::t_int) fprintf(stderr, "%d ", Arg.getVal().i);
+        if (Args[i].getdType() == dataType::t_double) fprintf(stderr, "%f ", Args[i].getVal().dbl);
+        else if (Args[i].getdType() == dataType::t_int) fprintf(stderr, "%d ", Args[i].getVal().i);
     }
     return Value(valueType::val_undef);
 }
 
-Value println(const std::vector<Value>& Args)
+Value println(const Value* Args, int NumArgs)
 {
-    for (auto Arg : Args)
+    for (int i = 0; i < NumArgs; i++)
     {
-        if (Arg.getdType() == dataType::t_double) fprintf(stderr, "%f ", Arg.getVal().dbl);
-        else if (Arg.getdType() == dataType::t_int) fprintf(stderr, "%d ", Arg.getVal().i);
+        if (Args[i].getdType() == dataType::t_double) fprintf(stderr, "%f ", Args[i].getVal().dbl);
+        else if (Args[i].getdType() == dataType::t_int) fprintf(stderr, "%d ", Args[i].getVal().i);
     }
     fprintf(stderr, "\n");
     return Value(valueType::val_undef);
 }
 
-Value printch(const std::vector<Value>& Args)
+Value printch(const Value* Args, int NumArgs)
 {
-    for (auto Arg : Args)
+    for (int i = 0; i < NumArgs; i++)
     {
-        if (Arg.getdType() == dataType::t_double) fprintf(stderr, "%c ", (char)Arg.getVal().dbl);
-        else if (Arg.getdType() == dataType::t_int) fprintf(stderr, "%c ", (char)Arg.getVal().i);
+        if (Args[i].getdType() == dataType::t_double) fprintf(stderr, "%c ", (char)Args[i].getVal().dbl);
+        else if (Args[i].getdType() == dataType::t_int) fprintf(stderr, "%c ", (char)Args[i].getVal().i);
     }
     fprintf(stderr, "\n");
     return Value(valueType::val_undef);
 }
 
-Value input(const std::vector<Value>& Args)
+Value input(const Value* Args, int NumArgs)
 {
-    if (Args.size() != 0) return LogErrorV("input() requires no arguments");
+    if (NumArgs != 0) return LogErrorV("input() requires no arguments");
 
     double Val;
     fscanf(stdin, "%lf", &Val);
@@ -68,11 +112,182 @@ Value input(const std::vector<Value>& Args)
     else return Value(Val);
 }
 
-Value inputch(const std::vector<Value>& Args)
+Value inputch(const Value* Args, int NumArgs)
 {
-    if (Args.size() != 0) return LogErrorV("inputch() requires no arguments");
+    if (NumArgs != 0) return LogErrorV("inputch() requires no arguments");
     
     char Val;
     fscanf(stdin, "%c", &Val);
     return Value(Val);
-}
\ No newline at end of file
+}
+
+/// CellRange - Check that Addr and Len name cells of the stack memory and
+/// return the first one, or report an error for Func and return null.
+static Value* CellRange(const char* Func, const Value& Addr, const Value& Len)
+{
+    unsigned int Size;
+    Value* Cells = GetMemoryBlock(Size);
+    if (!Addr.isUInt() || !Len.isUInt() || (unsigned long long)Addr.getiVal() + Len.getiVal() > Size)
+    {
+        LogErrorV((std::string(Func) + "() got an invalid memory range").c_str());
+        return nullptr;
+    }
+    return Cells + Addr.getiVal();
+}
+
+static bool ArgCount(const char* Func, int NumArgs, int Expected)
+{
+    if (NumArgs == Expected) return true;
+    LogErrorV((std::string(Func) + "() requires " + std::to_string(Expected) + " arguments").c_str());
+    return false;
+}
+
+// The array functions below work on memory cells, usually from '&arr'. Cells
+// that are all ints or all doubles go through the vectorized kernels; mixed
+// cells are computed one by one as SEL arithmetic would.
+
+/// fill(p, n, v) - Store v into the n cells from p.
+Value arrFill(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("fill", NumArgs, 3)) return Value(valueType::val_err);
+    Value* Cells = CellRange("fill", Args[0], Args[1]);
+    if (!Cells) return Value(valueType::val_err);
+
+    FillCells(Cells, Args[1].getiVal(), Args[2]);
+    return Value(valueType::val_undef);
+}
+
+/// copy(dst, src, n) - Copy n cells from src to dst; the ranges may overlap.
+Value arrCopy(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("copy", NumArgs, 3)) return Value(valueType::val_err);
+    Value* Dst = CellRange("copy", Args[0], Args[2]);
+    Value* Src = CellRange("copy", Args[1], Args[2]);
+    if (!Dst || !Src) return Value(valueType::val_err);
+
+    memmove(Dst, Src, Args[2].getiVal() * sizeof(Value));
+    return Value(valueType::val_undef);
+}
+
+/// sum(p, n) - The sum of n cells from p.
+Value arrSum(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("sum", NumArgs, 2)) return Value(valueType::val_err);
+    Value* Cells = CellRange("sum", Args[0], Args[1]);
+    if (!Cells) return Value(valueType::val_err);
+
+    unsigned int N = Args[1].getiVal();
+    switch (ClassifyCells(Cells, N))
+    {
+    case cellKind::cells_int:
+        return Value(SumInts(Cells, N));
+    case cellKind::cells_double:
+        return Value(SumDoubles(Cells, N));
+    default:
+    {
+        Value Sum(0);
+        for (unsigned int i = 0; i < N; i++) Sum = ApplyBinOp(binOp::op_add, Sum, Cells[i]);
+        return Sum;
+    }
+    }
+}
+
+static Value MinMax(const char* Func, const Value* Args, int NumArgs, bool IsMin)
+{
+    if (!ArgCount(Func, NumArgs, 2)) return Value(valueType::val_err);
+    Value* Cells = CellRange(Func, Args[0], Args[1]);
+    if (!Cells) return Value(valueType::val_err);
+
+    unsigned int N = Args[1].getiVal();
+    if (N == 0) return Value(valueType::val_undef);
+    switch (ClassifyCells(Cells, N))
+    {
+    case cellKind::cells_int:
+        return Value(IsMin ? MinInts(Cells, N) : MaxInts(Cells, N));
+    case cellKind::cells_double:
+        return Value(IsMin ? MinDoubles(Cells, N) : MaxDoubles(Cells, N));
+    default:
+    {
+        Value Result = Cells[0];
+        for (unsigned int i = 1; i < N; i++)
+        {
+            double Val = Cells[i].getdVal();
+            if (IsMin ? Val < Result.getdVal() : Val > Result.getdVal()) Result = Cells[i];
+        }
+        return Result;
+    }
+    }
+}
+
+/// min(p, n), max(p, n) - The smallest or largest of n cells from p, or undef when n is 0.
+Value arrMin(const Value* Args, int NumArgs) { return MinMax("min", Args, NumArgs, true); }
+Value arrMax(const Value* Args, int NumArgs) { return MinMax("max", Args, NumArgs, false); }
+
+/// dot(p, q, n) - The sum of the products of n cells from p and q.
+Value arrDot(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("dot", NumArgs, 3)) return Value(valueType::val_err);
+    Value* X = CellRange("dot", Args[0], Args[2]);
+    Value* Y = CellRange("dot", Args[1], Args[2]);
+    if (!X || !Y) return Value(valueType::val_err);
+
+    unsigned int N = Args[2].getiVal();
+    cellKind Kind = ClassifyCells(X, N);
+    if (Kind != cellKind::cells_mixed && ClassifyCells(Y, N) == Kind)
+        return Kind == cellKind::cells_int ? Value(DotInts(X, Y, N)) : Value(DotDoubles(X, Y, N));
+
+    Value Sum(0);
+    for (unsigned int i = 0; i < N; i++)
+        Sum = ApplyBinOp(binOp::op_add, Sum, ApplyBinOp(binOp::op_mul, X[i], Y[i]));
+    return Sum;
+}
+
+/// axpy(y, x, n, a) - Set each of n cells from y to a * x + y.
+Value arrAxpy(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("axpy", NumArgs, 4)) return Value(valueType::val_err);
+    Value* Y = CellRange("axpy", Args[0], Args[2]);
+    Value* X = CellRange("axpy", Args[1], Args[2]);
+    if (!X || !Y) return Value(valueType::val_err);
+
+    unsigned int N = Args[2].getiVal();
+    const Value& A = Args[3];
+    bool Overlap = X != Y && X < Y + N && Y < X + N;
+    cellKind Kind = ClassifyCells(X, N);
+    if (!Overlap && Kind != cellKind::cells_mixed && ClassifyCells(Y, N) == Kind)
+    {
+        if (Kind == cellKind::cells_double)
+        {
+            AxpyDoubles(Y, X, N, A.getdVal());
+            return Value(valueType::val_undef);
+        }
+        if (A.isInt())
+        {
+            AxpyInts(Y, X, N, A.getiVal());
+            return Value(valueType::val_undef);
+        }
+    }
+
+    for (unsigned int i = 0; i < N; i++)
+        Y[i] = ApplyBinOp(binOp::op_add, ApplyBinOp(binOp::op_mul, A, X[i]), Y[i]);
+    return Value(valueType::val_undef);
+}
+
+/// scale(p, n, a) - Multiply each of n cells from p by a.
+Value arrScale(const Value* Args, int NumArgs)
+{
+    if (!ArgCount("scale", NumArgs, 3)) return Value(valueType::val_err);
+    Value* Cells = CellRange("scale", Args[0], Args[1]);
+    if (!Cells) return Value(valueType::val_err);
+
+    unsigned int N = Args[1].getiVal();
+    const Value& A = Args[2];
+    cellKind Kind = ClassifyCells(Cells, N);
+    if (Kind == cellKind::cells_double) ScaleDoubles(Cells, N, A.getdVal());
+    else if (Kind == cellKind::cells_int && A.isInt()) ScaleInts(Cells, N, A.getiVal());
+    else
+    {
+        for (unsigned int i = 0; i < N; i++) Cells[i] = ApplyBinOp(binOp::op_mul, Cells[i], A);
+    }
+    return Value(valueType::val_undef);
+}
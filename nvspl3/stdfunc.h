@@ -9,15 +9,38 @@
 #include "value.h"
 
 extern std::vector<std::string> StdFuncList;
+extern const int FirstArrayFunc;
 
-Value CallStdFunc(const std::string& Name, const std::vector<Value>& Args);
+int FindStdFunc(const std::string& Name);
 
-Value print(const std::vector<Value>& Args);
+/// LookupStdFunc - The standard function a call to Name runs, or -1. A user
+/// function of the same name hides an array function, but not an I/O one.
+int LookupStdFunc(const std::string& Name);
 
-Value println(const std::vector<Value>& Args);
+Value CallStdFunc(int Id, const Value* Args, int NumArgs);
 
-Value printch(const std::vector<Value>& Args);
+Value print(const Value* Args, int NumArgs);
 
-Value input(const std::vector<Value>& Args);
+Value println(const Value* Args, int NumArgs);
 
-Value inputch(const std::vector<Value>& Args);
\ No newline at end of file
+Value printch(const Value* Args, int NumArgs);
+
+Value input(const Value* Args, int NumArgs);
+
+Value inputch(const Value* Args, int NumArgs);
+
+Value arrFill(const Value* Args, int NumArgs);
+
+Value arrCopy(const Value* Args, int NumArgs);
+
+Value arrSum(const Value* Args, int NumArgs);
+
+Value arrMin(const Value* Args, int NumArgs);
+
+Value arrMax(const Value* Args, int NumArgs);
+
+Value arrDot(const Value* Args, int NumArgs);
+
+Value arrAxpy(const Value* Args, int NumArgs);
+
+Value arrScale(const Value* Args, int NumArgs);
@@ -1,9 +1,11 @@
-
 // SEL Project
 // value.h
 
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+
 typedef enum class DataType
 {
     t_int = 1,
@@ -13,10 +15,8 @@ typedef enum class DataType
 typedef enum class ValueType
 {
     val_data = 0,
-    val_return = 1,
-    val_break = 2,
-    val_err = 3,
-	val_undef = 4,
+    val_err = 1,
+	val_undef = 2,
 } valueType;
 
 typedef union
@@ -25,46 +25,59 @@ typedef union
     double dbl;
 } valueData;
 
+/// Value - An int, a double, undef or an error in 8 bytes (NaN boxing).
+///
+/// A double is stored as its own bits, with every NaN folded into one quiet
+/// NaN. The other kinds live in the negative quiet NaN space, which no
+/// arithmetic on those doubles produces:
+///   0xFFF9'0000'xxxx'xxxx  int, in the low 32 bits
+///   0xFFFA'0000'0000'0000  undef
+///   0xFFFB'0000'0000'0000  error
+/// Undef and errors read as int 0, as they always have.
 class Value
 {
-    valueType vType = valueType::val_data;
-    dataType dType = dataType::t_int;
-    valueData Data;
+public:
+    static const uint64_t IntTag = 0xFFF9000000000000ULL;
+    static const uint64_t UndefBits = 0xFFFA000000000000ULL;
+    static const uint64_t ErrBits = 0xFFFB000000000000ULL;
+    static const uint64_t NaNBits = 0x7FF8000000000000ULL;
+
+private:
+    uint64_t Bits = IntTag;
+
 public:
     Value() {}
-    Value(valueType vType) : vType(vType) {}
-    Value(dataType dType) : dType(dType) {}
-    Value(valueType vType, dataType dType, valueData Val)
-        : vType(vType), dType(dType), Data(Val) {}
-    Value(dataType dType, valueData Val)
-        : dType(dType), Data(Val) {}
-    Value(valueType vType, double dVal)
-		: vType(vType), dType(dataType::t_double) {
-		Data.dbl = dVal;
-	}
-    Value(valueType vType, int iVal)
-        : vType(vType), dType(dataType::t_int) {
-        Data.i = iVal;
+    Value(valueType vType)
+        : Bits(vType == valueType::val_err ? ErrBits : vType == valueType::val_undef ? UndefBits : IntTag) {}
+    Value(double dVal) {
+        if (dVal != dVal) Bits = NaNBits;
+        else memcpy(&Bits, &dVal, sizeof(dVal));
     }
-    Value(double dVal) { dType = dataType::t_double; Data.dbl = dVal; }
-    Value(int iVal) { dType = dataType::t_int; Data.i = iVal; }
+    Value(int iVal) : Bits(IntTag | (uint32_t)iVal) {}
+
+    static Value fromBits(uint64_t Bits) { Value V; V.Bits = Bits; return V; }
+    uint64_t getBits() const { return Bits; }
 
-    void setvType(valueType vTy) { vType = vTy; }
-    void setdType(dataType dTy) { dType = dTy; }
-    void updateVal(valueData Val) { Data = Val; }
+    bool isErr() const { return Bits == ErrBits; }
+    bool isUndef() const { return Bits == UndefBits; }
+    bool isInt() const { return Bits >= IntTag; }
+    bool isUInt() const { return isInt() && (int32_t)Bits >= 0; }
 
-    bool isErr() { return vType == valueType::val_err; }
-	bool isBreak() { return vType == valueType::val_break; }
-	bool isReturn() { return vType == valueType::val_return; }
-    bool isInt() { return dType == dataType::t_int; }
-    bool isUInt() { return isInt() && Data.i >= 0; }
+    valueType getvType() const {
+        if (Bits == ErrBits) return valueType::val_err;
+        if (Bits == UndefBits) return valueType::val_undef;
+        return valueType::val_data;
+    }
+    dataType getdType() const { return isInt() ? dataType::t_int : dataType::t_double; }
+    valueData getVal() const {
+        valueData Val;
+        if (isInt()) Val.i = (int32_t)Bits;
+        else memcpy(&Val.dbl, &Bits, sizeof(Val.dbl));
+        return Val;
+    }
 
-    valueType getvType() { return vType; }
-    dataType getdType() { return dType; }
-    valueData getVal() { return Data; }
+    int getiVal() const { return isInt() ? (int32_t)Bits : (int)getVal().dbl; }
+    double getdVal() const { return isInt() ? (double)(int32_t)Bits : getVal().dbl; }
+};
 
-    int getiVal() { if (dType == dataType::t_double) return (int)Data.dbl;
-                    else if (dType == dataType::t_int) return Data.i; }
-    double getdVal() { if (dType == dataType::t_double) return Data.dbl;
-                       else if (dType == dataType::t_int) return (double)Data.i; }
-};
\ No newline at end of file
+static_assert(sizeof(Value) == 8, "Value is NaN-boxed into 8 bytes");
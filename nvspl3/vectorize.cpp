@@ -0,0 +1,930 @@
+// SEL Project
+// vectorize.cpp
+
+#include "vectorize.h"
+#include "execute.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <unordered_map>
+
+bool VecReport = false;
+unsigned int LoopCount = 0;
+
+// Iterations computed by each step of a vectorized loop. Operators always run
+// over a whole chunk so that their trip count is a constant the compiler can
+// vectorize; lanes past the last iteration hold stale values that are never
+// stored.
+static const unsigned int VecChunk = 256;
+
+//===----------------------------------------------------------------------===//
+// Analysis
+//===----------------------------------------------------------------------===//
+
+/// LoopAnalyzer - Translates the body of a for loop into the nodes of a
+/// VecLoop, or finds the reason it can't.
+class LoopAnalyzer
+{
+    VecLoop& L;
+    const std::string& Counter;
+    std::vector<std::string> Reduced; // variables of reductions
+    std::vector<std::string> Read;    // variables read anywhere else
+
+    int add(std::vector<vecNode>& Nodes, vecNode Node)
+    {
+        Nodes.push_back(Node);
+        return Nodes.size() - 1;
+    }
+
+public:
+    std::string Reason;
+
+    LoopAnalyzer(VecLoop& L, const std::string& Counter) : L(L), Counter(Counter) {}
+
+    int fail(const std::string& Why)
+    {
+        if (Reason.empty()) Reason = Why;
+        return -1;
+    }
+
+    int invariant(ExprAST* E);
+    int element(ExprAST* E);
+    int access(VariableExprAST* Var);
+    bool statement(ExprAST* E);
+    bool finish();
+};
+
+/// invariant - Add an expression with the same value on every iteration:
+/// constants, variables and builtin operators on them.
+int LoopAnalyzer::invariant(ExprAST* E)
+{
+    vecNode Node;
+    switch (E->getNodeType())
+    {
+    case nodeType::node_number:
+        Node.Op = vecOp::vec_const;
+        Node.Val = static_cast<NumberExprAST*>(E)->getValue();
+        return add(L.Invariants, Node);
+    case nodeType::node_var:
+    {
+        VariableExprAST* Var = static_cast<VariableExprAST*>(E);
+        if (!Var->getIndices().empty()) return fail("an index reads \"" + Var->getName() + "\"");
+        if (Var->getName() == Counter) return fail("the counter is not the last index");
+        Read.push_back(Var->getName());
+        Node.Op = vecOp::vec_scalar;
+        Node.Sym = Var->getSymbol();
+        Node.Slot = Var->getSlot();
+        return add(L.Invariants, Node);
+    }
+    case nodeType::node_unary:
+    {
+        UnaryExprAST* Op = static_cast<UnaryExprAST*>(E);
+        if (Op->isUserOp() || Op->getOpcode() == '&') return fail("an index is not a plain expression");
+        Node.Op = vecOp::vec_unary;
+        Node.Unary = Op->getOpcode();
+        if ((Node.L = invariant(Op->getOperand())) < 0) return -1;
+        return add(L.Invariants, Node);
+    }
+    case nodeType::node_binary:
+    {
+        BinaryExprAST* Op = static_cast<BinaryExprAST*>(E);
+        if (Op->getOpcode() == binOp::op_assign || Op->getOpcode() == binOp::op_user)
+            return fail("an index is not a plain expression");
+        Node.Op = vecOp::vec_binary;
+        Node.Opcode = Op->getOpcode();
+        if ((Node.L = invariant(Op->getLHS())) < 0 || (Node.R = invariant(Op->getRHS())) < 0) return -1;
+        return add(L.Invariants, Node);
+    }
+    default:
+        if (LogicalExprAST* Op = dynamic_cast<LogicalExprAST*>(E))
+        {
+            Node.Op = vecOp::vec_binary;
+            Node.Opcode = Op->getOpcode();
+            if ((Node.L = invariant(Op->getLHS())) < 0 || (Node.R = invariant(Op->getRHS())) < 0) return -1;
+            return add(L.Invariants, Node);
+        }
+        return fail("an index is not a plain expression");
+    }
+}
+
+/// access - Add an array element whose last index is the counter.
+int LoopAnalyzer::access(VariableExprAST* Var)
+{
+    const ExprList& Indices = Var->getIndices();
+    ExprAST* Last = Indices.back();
+    if (Last->getNodeType() != nodeType::node_var ||
+        static_cast<VariableExprAST*>(Last)->getName() != Counter ||
+        !static_cast<VariableExprAST*>(Last)->getIndices().empty())
+        return fail("\"" + Var->getName() + "\" is not indexed by the counter in its last dimension");
+
+    vecAccess Access;
+    Access.Sym = Var->getSymbol();
+    for (size_t d = 0; d + 1 < Indices.size(); d++)
+    {
+        int Lead = invariant(Indices[d]);
+        if (Lead < 0) return -1;
+        Access.Lead.push_back(Lead);
+    }
+    L.Accesses.push_back(Access);
+    return L.Accesses.size() - 1;
+}
+
+/// element - Add an expression computed for each iteration.
+int LoopAnalyzer::element(ExprAST* E)
+{
+    vecNode Node;
+    switch (E->getNodeType())
+    {
+    case nodeType::node_number:
+        Node.Op = vecOp::vec_const;
+        Node.Val = static_cast<NumberExprAST*>(E)->getValue();
+        return add(L.Nodes, Node);
+    case nodeType::node_var:
+    {
+        VariableExprAST* Var = static_cast<VariableExprAST*>(E);
+        if (!Var->getIndices().empty())
+        {
+            Node.Op = vecOp::vec_load;
+            if ((Node.Access = access(Var)) < 0) return -1;
+        }
+        else if (Var->getName() == Counter) Node.Op = vecOp::vec_counter;
+        else
+        {
+            Read.push_back(Var->getName());
+            Node.Op = vecOp::vec_scalar;
+            Node.Sym = Var->getSymbol();
+            Node.Slot = Var->getSlot();
+        }
+        return add(L.Nodes, Node);
+    }
+    case nodeType::node_deref:
+        return fail("it reads memory through '@'");
+    case nodeType::node_unary:
+    {
+        UnaryExprAST* Op = static_cast<UnaryExprAST*>(E);
+        if (Op->isUserOp()) return fail("it calls a user-defined operator");
+        if (Op->getOpcode() == '&') return fail("it takes an address with '&'");
+        Node.Op = vecOp::vec_unary;
+        Node.Unary = Op->getOpcode();
+        if ((Node.L = element(Op->getOperand())) < 0) return -1;
+        return add(L.Nodes, Node);
+    }
+    case nodeType::node_binary:
+    {
+        BinaryExprAST* Op = static_cast<BinaryExprAST*>(E);
+        if (Op->getOpcode() == binOp::op_user) return fail("it calls a user-defined operator");
+        if (Op->getOpcode() == binOp::op_assign) return fail("it assigns inside an expression");
+        Node.Op = vecOp::vec_binary;
+        Node.Opcode = Op->getOpcode();
+        if ((Node.L = element(Op->getLHS())) < 0 || (Node.R = element(Op->getRHS())) < 0) return -1;
+        return add(L.Nodes, Node);
+    }
+    default:
+        break;
+    }
+
+    // Both operands of '&&' and '||' can be evaluated, having no effects here.
+    if (LogicalExprAST* Op = dynamic_cast<LogicalExprAST*>(E))
+    {
+        Node.Op = vecOp::vec_binary;
+        Node.Opcode = Op->getOpcode();
+        if ((Node.L = element(Op->getLHS())) < 0 || (Node.R = element(Op->getRHS())) < 0) return -1;
+        return add(L.Nodes, Node);
+    }
+    if (CallExprAST* Call = dynamic_cast<CallExprAST*>(E))
+        return fail("it calls \"" + Call->getCallee() + "\"");
+    if (dynamic_cast<ArrDeclExprAST*>(E))
+        return fail("it declares an array");
+    return fail("it has control flow in its body");
+}
+
+/// statement - Add 'a[...][i] = e' or 's = s op e', or every statement of a block.
+bool LoopAnalyzer::statement(ExprAST* E)
+{
+    if (E->getNodeType() == nodeType::node_block)
+    {
+        for (auto& Stmt : static_cast<BlockExprAST*>(E)->getExpressions())
+            if (!statement(Stmt)) return false;
+        return true;
+    }
+
+    BinaryExprAST* Assign = E->getNodeType() == nodeType::node_binary ? static_cast<BinaryExprAST*>(E) : nullptr;
+    if (!Assign || Assign->getOpcode() != binOp::op_assign)
+    {
+        element(E);
+        return fail("it has a statement that is not an assignment") >= 0;
+    }
+    if (Assign->getLHS()->getNodeType() != nodeType::node_var)
+        return fail("it writes memory through '@'") >= 0;
+
+    VariableExprAST* Var = static_cast<VariableExprAST*>(Assign->getLHS());
+    vecStmt Stmt;
+    Stmt.First = L.Nodes.size();
+    if (!Var->getIndices().empty())
+    {
+        if ((Stmt.Target = access(Var)) < 0 || (Stmt.Root = element(Assign->getRHS())) < 0) return false;
+        L.Stmts.push_back(Stmt);
+        return true;
+    }
+
+    const std::string& Name = Var->getName();
+    if (Name == Counter) return fail("it assigns the counter") >= 0;
+
+    // s = s + e, s = e + s, s = s - e, s = s * e or s = e * s
+    auto IsTarget = [&](ExprAST* Side) {
+        return Side->getNodeType() == nodeType::node_var &&
+            static_cast<VariableExprAST*>(Side)->getIndices().empty() &&
+            static_cast<VariableExprAST*>(Side)->getName() == Name;
+    };
+    ExprAST* Operand = nullptr;
+    if (Assign->getRHS()->getNodeType() == nodeType::node_binary)
+    {
+        BinaryExprAST* Op = static_cast<BinaryExprAST*>(Assign->getRHS());
+        Stmt.Opcode = Op->getOpcode();
+        bool Commutes = Stmt.Opcode == binOp::op_add || Stmt.Opcode == binOp::op_mul;
+        if (Commutes || Stmt.Opcode == binOp::op_sub)
+        {
+            if (IsTarget(Op->getLHS())) Operand = Op->getRHS();
+            else if (Commutes && IsTarget(Op->getRHS())) Operand = Op->getLHS();
+        }
+    }
+    if (!Operand) return fail("it assigns \"" + Name + "\", which is not a sum or product over the loop") >= 0;
+    if (std::find(Reduced.begin(), Reduced.end(), Name) != Reduced.end())
+        return fail("it updates \"" + Name + "\" twice") >= 0;
+    Reduced.push_back(Name);
+
+    Stmt.Reduce = true;
+    Stmt.Sym = Var->getSymbol();
+    Stmt.Slot = Var->getSlot();
+    if ((Stmt.Root = element(Operand)) < 0) return false;
+    L.Stmts.push_back(Stmt);
+    return true;
+}
+
+/// finish - A variable summed into can't be read by any other expression,
+/// which would see it change from one iteration to the next.
+bool LoopAnalyzer::finish()
+{
+    for (auto& Name : Read)
+        if (std::find(Reduced.begin(), Reduced.end(), Name) != Reduced.end())
+            return fail("it reads \"" + Name + "\" while summing into it") >= 0;
+    return true;
+}
+
+static bool IsConstantOne(ExprAST* E)
+{
+    if (E->getNodeType() != nodeType::node_number) return false;
+    const Value& V = static_cast<NumberExprAST*>(E)->getValue();
+    return V.getvType() == valueType::val_data && V.isInt() && V.getiVal() == 1;
+}
+
+std::shared_ptr<VecLoop> AnalyzeLoop(const ForExprAST& Loop, unsigned int Id, const std::string& FuncName)
+{
+    if (OptLevel < 1) return nullptr;
+
+    auto L = std::make_shared<VecLoop>();
+    L->Where = "loop " + std::to_string(Id) + " (for " + Loop.getVarName() +
+        (FuncName == "__anon_expr" ? " at top level)" : " in " + FuncName + ")");
+    L->CounterSym = Loop.getSymbol();
+    L->CounterSlot = Loop.getSlot();
+
+    LoopAnalyzer A(*L, Loop.getVarName());
+    if (A.statement(Loop.getBody()) && A.finish())
+    {
+        // The counter must run up by one to a bound known on entry.
+        if (Loop.getStep() && !IsConstantOne(Loop.getStep())) A.fail("its step is not 1");
+        else if (!Loop.getBound()) A.fail("its end condition is not the counter against a loop-invariant bound");
+        else
+        {
+            binOp Op = Loop.getBoundOp();
+            if (!Loop.isCounterLeft()) Op = Op == binOp::op_gt ? binOp::op_lt : Op == binOp::op_ge ? binOp::op_le : Op;
+            if (Op != binOp::op_lt && Op != binOp::op_le && Op != binOp::op_ne) A.fail("it doesn't count up to its bound");
+            L->BoundOp = Op;
+            L->Bound = A.invariant(Loop.getBound());
+        }
+    }
+
+    if (!A.Reason.empty())
+    {
+        if (VecReport) fprintf(stderr, "vectorize: %s: not vectorized: %s\n", L->Where.c_str(), A.Reason.c_str());
+        return nullptr;
+    }
+
+    if (VecReport)
+    {
+        unsigned int Maps = 0;
+        for (auto& Stmt : L->Stmts) Maps += !Stmt.Reduce;
+        fprintf(stderr, "vectorize: %s: vectorized, %u map%s and %u reduction%s\n", L->Where.c_str(),
+            Maps, Maps == 1 ? "" : "s", (unsigned int)L->Stmts.size() - Maps, L->Stmts.size() - Maps == 1 ? "" : "s");
+    }
+    return L;
+}
+
+//===----------------------------------------------------------------------===//
+// Kernels
+//===----------------------------------------------------------------------===//
+
+static int32_t* IntLanes(VecLoop& L, int Node) { return L.Ints.data() + (size_t)Node * VecChunk; }
+static double* DoubleLanes(VecLoop& L, int Node) { return L.Doubles.data() + (size_t)Node * VecChunk; }
+static Value* ValueLanes(VecLoop& L, int Node) { return L.Values.data() + (size_t)Node * VecChunk; }
+
+template <typename D, typename S, typename F>
+static void Map(D* __restrict Dst, const S* __restrict X, F Fn)
+{
+    for (unsigned int k = 0; k < VecChunk; k++) Dst[k] = Fn(X[k]);
+}
+
+template <typename D, typename S, typename F>
+static void Map(D* __restrict Dst, const S* __restrict X, const S* __restrict Y, F Fn)
+{
+    for (unsigned int k = 0; k < VecChunk; k++) Dst[k] = Fn(X[k], Y[k]);
+}
+
+// Operators compute what ApplyIntBinOp and ApplyDoubleBinOp would. Ints wrap
+// around, computed unsigned.
+static void IntBinary(binOp Opcode, int32_t* D, const int32_t* X, const int32_t* Y)
+{
+    switch (Opcode)
+    {
+    case binOp::op_eq: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A == B); }); break;
+    case binOp::op_ne: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A != B); }); break;
+    case binOp::op_and: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A && B); }); break;
+    case binOp::op_or: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A || B); }); break;
+    case binOp::op_lt: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A < B); }); break;
+    case binOp::op_gt: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A > B); }); break;
+    case binOp::op_le: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A <= B); }); break;
+    case binOp::op_ge: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)(A >= B); }); break;
+    case binOp::op_add: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)((uint32_t)A + (uint32_t)B); }); break;
+    case binOp::op_sub: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)((uint32_t)A - (uint32_t)B); }); break;
+    case binOp::op_mul: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)((uint32_t)A * (uint32_t)B); }); break;
+    case binOp::op_div: Map(D, X, Y, [](int32_t A, int32_t B) { return A / B; }); break;
+    case binOp::op_mod: Map(D, X, Y, [](int32_t A, int32_t B) { return A % B; }); break;
+    case binOp::op_pow: Map(D, X, Y, [](int32_t A, int32_t B) { return (int32_t)pow(A, B); }); break;
+    default: break;
+    }
+}
+
+static void DoubleBinary(binOp Opcode, double* D, const double* X, const double* Y)
+{
+    switch (Opcode)
+    {
+    case binOp::op_add: Map(D, X, Y, [](double A, double B) { return A + B; }); break;
+    case binOp::op_sub: Map(D, X, Y, [](double A, double B) { return A - B; }); break;
+    case binOp::op_mul: Map(D, X, Y, [](double A, double B) { return A * B; }); break;
+    case binOp::op_div: Map(D, X, Y, [](double A, double B) { return A / B; }); break;
+    case binOp::op_mod: Map(D, X, Y, [](double A, double B) { return (double)fmod(A, B); }); break;
+    case binOp::op_pow: Map(D, X, Y, [](double A, double B) { return (double)pow(A, B); }); break;
+    default: break;
+    }
+}
+
+static void DoubleCompare(binOp Opcode, int32_t* D, const double* X, const double* Y)
+{
+    switch (Opcode)
+    {
+    case binOp::op_eq: Map(D, X, Y, [](double A, double B) { return (int32_t)(A == B); }); break;
+    case binOp::op_ne: Map(D, X, Y, [](double A, double B) { return (int32_t)(A != B); }); break;
+    case binOp::op_and: Map(D, X, Y, [](double A, double B) { return (int32_t)(A && B); }); break;
+    case binOp::op_or: Map(D, X, Y, [](double A, double B) { return (int32_t)(A || B); }); break;
+    case binOp::op_lt: Map(D, X, Y, [](double A, double B) { return (int32_t)(A < B); }); break;
+    case binOp::op_gt: Map(D, X, Y, [](double A, double B) { return (int32_t)(A > B); }); break;
+    case binOp::op_le: Map(D, X, Y, [](double A, double B) { return (int32_t)(A <= B); }); break;
+    case binOp::op_ge: Map(D, X, Y, [](double A, double B) { return (int32_t)(A >= B); }); break;
+    default: break;
+    }
+}
+
+static bool IsComparison(binOp Opcode)
+{
+    switch (Opcode)
+    {
+    case binOp::op_eq: case binOp::op_ne: case binOp::op_and: case binOp::op_or:
+    case binOp::op_lt: case binOp::op_gt: case binOp::op_le: case binOp::op_ge:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void Unary(VecLoop& L, int j)
+{
+    const vecNode& N = L.Nodes[j];
+    if (L.Types[N.L] == vecType::vt_int)
+    {
+        const int32_t* X = IntLanes(L, N.L);
+        int32_t* D = IntLanes(L, j);
+        if (N.Unary == '!') Map(D, X, [](int32_t A) { return (int32_t)!A; });
+        else if (N.Unary == '+') Map(D, X, [](int32_t A) { return A; });
+        else Map(D, X, [](int32_t A) { return (int32_t)(0u - (uint32_t)A); });
+        return;
+    }
+
+    const double* X = DoubleLanes(L, N.L);
+    if (N.Unary == '!') Map(IntLanes(L, j), X, [](double A) { return (int32_t)(A == 0); });
+    else if (N.Unary == '+') Map(DoubleLanes(L, j), X, [](double A) { return A; });
+    else Map(DoubleLanes(L, j), X, [](double A) { return -A; });
+}
+
+/// Operand - The double lanes of an operand, converted into Spare if it is an int.
+static const double* Operand(VecLoop& L, int Node, int Spare)
+{
+    if (L.Types[Node] != vecType::vt_int) return DoubleLanes(L, Node);
+
+    double* D = DoubleLanes(L, Spare);
+    Map(D, IntLanes(L, Node), [](int32_t A) { return (double)A; });
+    return D;
+}
+
+static void Binary(VecLoop& L, int j)
+{
+    const vecNode& N = L.Nodes[j];
+    if (L.Types[N.L] == vecType::vt_int && L.Types[N.R] == vecType::vt_int)
+        return IntBinary(N.Opcode, IntLanes(L, j), IntLanes(L, N.L), IntLanes(L, N.R));
+
+    // Ints meeting doubles are converted, as ApplyBinOp does.
+    int Spare = L.Nodes.size();
+    const double* X = Operand(L, N.L, Spare);
+    const double* Y = Operand(L, N.R, Spare + 1);
+    if (L.Types[j] == vecType::vt_int) DoubleCompare(N.Opcode, IntLanes(L, j), X, Y);
+    else DoubleBinary(N.Opcode, DoubleLanes(L, j), X, Y);
+}
+
+// Loads and stores move the iterations of the chunk, all VecChunk of them
+// but in the last one; Fixed is VecChunk or 0 for a count known at run time.
+
+template <unsigned int Fixed>
+static void Load(VecLoop& L, int j, unsigned int Begin, unsigned int Count)
+{
+    const unsigned int N = Fixed ? Fixed : Count;
+    const VecLoop::accessState& A = L.State[L.Nodes[j].Access];
+    switch (L.Types[j])
+    {
+    case vecType::vt_int:
+        if (A.Type == elemType::elem_int)
+            memcpy(IntLanes(L, j), A.Packed + (size_t)Begin * sizeof(int32_t), N * sizeof(int32_t));
+        else
+        {
+            int32_t* __restrict D = IntLanes(L, j);
+            const Value* __restrict S = A.Cells + Begin;
+            for (unsigned int k = 0; k < N; k++) D[k] = (int32_t)S[k].getBits();
+        }
+        break;
+    case vecType::vt_double:
+        // Both plain and 'as double' cells hold the bits of the double.
+        memcpy(DoubleLanes(L, j), A.Cells + Begin, N * sizeof(double));
+        break;
+    case vecType::vt_value:
+        if (A.Type == elemType::elem_int)
+        {
+            Value* D = ValueLanes(L, j);
+            for (unsigned int k = 0; k < N; k++)
+            {
+                int32_t Elem;
+                memcpy(&Elem, A.Packed + (size_t)(Begin + k) * sizeof(int32_t), sizeof(Elem));
+                D[k] = Value(Elem);
+            }
+        }
+        else memcpy(ValueLanes(L, j), A.Cells + Begin, N * sizeof(Value));
+        break;
+    }
+}
+
+template <unsigned int Fixed>
+static void StoreDoubles(Value* __restrict D, const double* __restrict X, unsigned int Count)
+{
+    const unsigned int N = Fixed ? Fixed : Count;
+    for (unsigned int k = 0; k < N; k++)
+    {
+        uint64_t Bits;
+        memcpy(&Bits, &X[k], sizeof(Bits));
+        D[k] = Value::fromBits(X[k] != X[k] ? Value::NaNBits : Bits);
+    }
+}
+
+/// Store - Assign the result of a map the way ArrElement converts it for the array.
+template <unsigned int Fixed>
+static void Store(VecLoop& L, const vecStmt& S, unsigned int Begin, unsigned int Count)
+{
+    const unsigned int N = Fixed ? Fixed : Count;
+    const VecLoop::accessState& A = L.State[S.Target];
+    vecType Type = L.Types[S.Root];
+
+    if (A.Type == elemType::elem_int)
+    {
+        char* D = A.Packed + (size_t)Begin * sizeof(int32_t);
+        if (Type == vecType::vt_int)
+        {
+            memcpy(D, IntLanes(L, S.Root), N * sizeof(int32_t));
+            return;
+        }
+        for (unsigned int k = 0; k < N; k++)
+        {
+            int32_t Elem = Type == vecType::vt_double ? (int32_t)DoubleLanes(L, S.Root)[k] : ValueLanes(L, S.Root)[k].getiVal();
+            memcpy(D + (size_t)k * sizeof(int32_t), &Elem, sizeof(Elem));
+        }
+        return;
+    }
+
+    Value* __restrict D = A.Cells + Begin;
+    switch (Type)
+    {
+    case vecType::vt_int:
+    {
+        const int32_t* __restrict X = IntLanes(L, S.Root);
+        if (A.Type == elemType::elem_double)
+            for (unsigned int k = 0; k < N; k++) D[k] = Value((double)X[k]);
+        else
+            for (unsigned int k = 0; k < N; k++) D[k] = Value::fromBits(Value::IntTag | (uint32_t)X[k]);
+        break;
+    }
+    case vecType::vt_double:
+        StoreDoubles<Fixed>(D, DoubleLanes(L, S.Root), Count);
+        break;
+    case vecType::vt_value:
+    {
+        const Value* X = ValueLanes(L, S.Root);
+        if (A.Type == elemType::elem_double)
+            for (unsigned int k = 0; k < N; k++) D[k] = Value(X[k].getdVal());
+        else memcpy(D, X, N * sizeof(Value));
+        break;
+    }
+    }
+}
+
+static uint32_t SumLanes(const int32_t* X)
+{
+    uint32_t Sum = 0;
+    for (unsigned int k = 0; k < VecChunk; k++) Sum += (uint32_t)X[k];
+    return Sum;
+}
+
+static uint32_t ProductLanes(const int32_t* X)
+{
+    uint32_t Product = 1;
+    for (unsigned int k = 0; k < VecChunk; k++) Product *= (uint32_t)X[k];
+    return Product;
+}
+
+/// Accumulate - Fold a chunk into a double in iteration order, so the
+/// result is rounded exactly as the loop would round it.
+template <typename T>
+static double Accumulate(double Acc, binOp Opcode, const T* X, unsigned int Count)
+{
+    switch (Opcode)
+    {
+    case binOp::op_sub: for (unsigned int k = 0; k < Count; k++) Acc = Acc - X[k]; break;
+    case binOp::op_mul: for (unsigned int k = 0; k < Count; k++) Acc = Acc * X[k]; break;
+    default: for (unsigned int k = 0; k < Count; k++) Acc = Acc + X[k]; break;
+    }
+    return Acc;
+}
+
+/// Reduce - Fold a chunk into the variable of a reduction. Int sums and
+/// products wrap around, so they can be taken in any order.
+template <unsigned int Fixed>
+static void Reduce(VecLoop& L, size_t s, unsigned int Count)
+{
+    const vecStmt& S = L.Stmts[s];
+    if (L.IntReduce[s])
+    {
+        int32_t* X = IntLanes(L, S.Root);
+        if (!Fixed) std::fill(X + Count, X + VecChunk, S.Opcode == binOp::op_mul ? 1 : 0);
+
+        uint32_t& Acc = L.IntAcc[s];
+        if (S.Opcode == binOp::op_mul) Acc *= ProductLanes(X);
+        else if (S.Opcode == binOp::op_sub) Acc -= SumLanes(X);
+        else Acc += SumLanes(X);
+    }
+    else if (L.Types[S.Root] == vecType::vt_int)
+        L.DoubleAcc[s] = Accumulate(L.DoubleAcc[s], S.Opcode, IntLanes(L, S.Root), Count);
+    else
+        L.DoubleAcc[s] = Accumulate(L.DoubleAcc[s], S.Opcode, DoubleLanes(L, S.Root), Count);
+}
+
+/// RunChunk - Run Count iterations from the Begin-th one, statement by statement.
+template <unsigned int Fixed>
+static void RunChunk(VecLoop& L, unsigned int Begin, unsigned int Count)
+{
+    for (size_t s = 0; s < L.Stmts.size(); s++)
+    {
+        const vecStmt& S = L.Stmts[s];
+        for (int j = S.First; j <= S.Root; j++)
+        {
+            switch (L.Nodes[j].Op)
+            {
+            case vecOp::vec_counter:
+            {
+                uint32_t First = (uint32_t)L.Start + Begin;
+                int32_t* D = IntLanes(L, j);
+                for (unsigned int k = 0; k < VecChunk; k++) D[k] = (int32_t)(First + k);
+                break;
+            }
+            case vecOp::vec_load: Load<Fixed>(L, j, Begin, Count); break;
+            case vecOp::vec_unary: Unary(L, j); break;
+            case vecOp::vec_binary: Binary(L, j); break;
+            default: break; // filled before the first chunk
+            }
+        }
+        if (S.Reduce) Reduce<Fixed>(L, s, Count);
+        else Store<Fixed>(L, S, Begin, Count);
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Running
+//===----------------------------------------------------------------------===//
+
+/// Fallback - Give the loop back to the interpreter, saying why the first time.
+static bool Fallback(VecLoop& L, const char* Why, int Sym = -1)
+{
+    if (VecReport && !L.Reported)
+    {
+        fprintf(stderr, "vectorize: %s: ran as a loop: ", L.Where.c_str());
+        fprintf(stderr, Why, Sym >= 0 ? SymbolName(Sym).c_str() : "");
+        fprintf(stderr, "\n");
+    }
+    L.Reported = true;
+    return false;
+}
+
+static bool ReadVariable(int Sym, int Slot, unsigned int FrameBase, Value& Val)
+{
+    if (Slot >= 0)
+    {
+        Val = GetMemory(FrameBase + Slot);
+        return true;
+    }
+    const namedValue* Binding = FindVariableBinding(Sym, true);
+    if (!Binding) return false;
+    Val = GetMemory(Binding->Addr);
+    return true;
+}
+
+/// EvalInvariants - Compute the invariant nodes as the interpreter would.
+static bool EvalInvariants(VecLoop& L, unsigned int FrameBase)
+{
+    L.InvariantVals.resize(L.Invariants.size());
+    for (size_t j = 0; j < L.Invariants.size(); j++)
+    {
+        const vecNode& N = L.Invariants[j];
+        Value& V = L.InvariantVals[j];
+        switch (N.Op)
+        {
+        case vecOp::vec_const:
+            V = N.Val;
+            break;
+        case vecOp::vec_scalar:
+            if (!ReadVariable(N.Sym, N.Slot, FrameBase, V)) return Fallback(L, "\"%s\" is not bound", N.Sym);
+            break;
+        case vecOp::vec_unary:
+            V = ApplyUnaryOp(N.Unary, L.InvariantVals[N.L]);
+            break;
+        default:
+        {
+            const Value& X = L.InvariantVals[N.L];
+            const Value& Y = L.InvariantVals[N.R];
+            if ((N.Opcode == binOp::op_div || N.Opcode == binOp::op_mod) && X.isInt() && Y.isInt() &&
+                (Y.getiVal() == 0 || (X.getiVal() == INT_MIN && Y.getiVal() == -1)))
+                return Fallback(L, "an index or the bound divides by zero");
+            V = ApplyBinOp(N.Opcode, X, Y);
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+/// KindOf - What a plain array access holds when statement s reads it: what
+/// an earlier map stored there, or what was there on entry.
+static cellKind KindOf(VecLoop& L, size_t s, int Access, unsigned int Trip)
+{
+    VecLoop::accessState& A = L.State[Access];
+    for (size_t k = s; k-- > 0;)
+    {
+        const vecStmt& Earlier = L.Stmts[k];
+        if (!Earlier.Reduce && L.State[Earlier.Target].Type == elemType::elem_value && L.State[Earlier.Target].Cells == A.Cells)
+            return L.Stored[k];
+    }
+    if (!A.Classified)
+    {
+        A.Kind = ClassifyCells(A.Cells, Trip);
+        A.Classified = true;
+    }
+    return A.Kind;
+}
+
+/// InferTypes - Give every node the type of its lanes on this run.
+static bool InferTypes(VecLoop& L, unsigned int FrameBase, unsigned int Trip)
+{
+    L.Types.resize(L.Nodes.size());
+    L.Leaves.resize(L.Nodes.size());
+    L.Stored.assign(L.Stmts.size(), cellKind::cells_mixed);
+    L.IntReduce.assign(L.Stmts.size(), false);
+    L.IntAcc.resize(L.Stmts.size());
+    L.DoubleAcc.resize(L.Stmts.size());
+
+    for (size_t s = 0; s < L.Stmts.size(); s++)
+    {
+        const vecStmt& S = L.Stmts[s];
+        for (int j = S.First; j <= S.Root; j++)
+        {
+            const vecNode& N = L.Nodes[j];
+            bool Copied = j == S.Root && !S.Reduce; // a map storing it as it is
+            vecType& T = L.Types[j];
+            switch (N.Op)
+            {
+            case vecOp::vec_const:
+            case vecOp::vec_scalar:
+                if (N.Op == vecOp::vec_const) L.Leaves[j] = N.Val;
+                else if (!ReadVariable(N.Sym, N.Slot, FrameBase, L.Leaves[j])) return Fallback(L, "\"%s\" is not bound", N.Sym);
+                T = Copied ? vecType::vt_value : L.Leaves[j].isInt() ? vecType::vt_int : vecType::vt_double;
+                break;
+            case vecOp::vec_counter:
+                T = vecType::vt_int;
+                break;
+            case vecOp::vec_load:
+            {
+                elemType Type = L.State[N.Access].Type;
+                if (Copied) T = vecType::vt_value;
+                else if (Type == elemType::elem_int) T = vecType::vt_int;
+                else if (Type == elemType::elem_double) T = vecType::vt_double;
+                else
+                {
+                    cellKind Kind = KindOf(L, s, N.Access, Trip);
+                    if (Kind == cellKind::cells_mixed) return Fallback(L, "\"%s\" holds both ints and doubles", L.Accesses[N.Access].Sym);
+                    T = Kind == cellKind::cells_int ? vecType::vt_int : vecType::vt_double;
+                }
+                break;
+            }
+            case vecOp::vec_unary:
+                T = N.Unary == '!' ? vecType::vt_int : L.Types[N.L];
+                break;
+            case vecOp::vec_binary:
+            {
+                // Ints divide only by a divisor known not to trap in any lane.
+                bool Ints = L.Types[N.L] == vecType::vt_int && L.Types[N.R] == vecType::vt_int;
+                if (Ints && (N.Opcode == binOp::op_div || N.Opcode == binOp::op_mod))
+                {
+                    const vecNode& Divisor = L.Nodes[N.R];
+                    bool Known = Divisor.Op == vecOp::vec_const || Divisor.Op == vecOp::vec_scalar;
+                    if (!Known || L.Leaves[N.R].getiVal() == 0 || L.Leaves[N.R].getiVal() == -1)
+                        return Fallback(L, "it divides ints by a value that may trap");
+                }
+                T = Ints || IsComparison(N.Opcode) ? vecType::vt_int : vecType::vt_double;
+                break;
+            }
+            }
+        }
+
+        if (S.Reduce)
+        {
+            Value Acc;
+            if (!ReadVariable(S.Sym, S.Slot, FrameBase, Acc)) return Fallback(L, "\"%s\" is not bound", S.Sym);
+            L.IntReduce[s] = Acc.isInt() && L.Types[S.Root] == vecType::vt_int;
+            L.IntAcc[s] = (uint32_t)Acc.getiVal();
+            L.DoubleAcc[s] = Acc.getdVal();
+        }
+        else if (L.State[S.Target].Type == elemType::elem_value)
+        {
+            const vecNode& Root = L.Nodes[S.Root];
+            switch (L.Types[S.Root])
+            {
+            case vecType::vt_int: L.Stored[s] = cellKind::cells_int; break;
+            case vecType::vt_double: L.Stored[s] = cellKind::cells_double; break;
+            case vecType::vt_value:
+                if (Root.Op != vecOp::vec_load)
+                    L.Stored[s] = L.Leaves[S.Root].isInt() ? cellKind::cells_int : cellKind::cells_double;
+                else if (L.State[Root.Access].Type == elemType::elem_int) L.Stored[s] = cellKind::cells_int;
+                else if (L.State[Root.Access].Type == elemType::elem_double) L.Stored[s] = cellKind::cells_double;
+                else L.Stored[s] = KindOf(L, s, Root.Access, Trip);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static bool RunLoop(VecLoop& L, unsigned int CounterAddr, Value StepVal, unsigned int FrameBase)
+{
+    // The body has to read the counter this loop steps.
+    if (L.CounterSlot < 0)
+    {
+        const namedValue* Counter = FindVariableBinding(L.CounterSym, true);
+        if (!Counter || Counter->Addr != (int)CounterAddr) return Fallback(L, "an array hides the counter");
+    }
+
+    Value StartVal = GetMemory(CounterAddr);
+    if (StartVal.getvType() != valueType::val_data || !StartVal.isInt()) return Fallback(L, "the counter doesn't start as an int");
+    if (StepVal.getBits() != Value(1).getBits()) return Fallback(L, "the step is not 1");
+    if (!EvalInvariants(L, FrameBase)) return false;
+
+    const Value& BoundVal = L.InvariantVals[L.Bound];
+    if (!BoundVal.isInt()) return Fallback(L, "the bound is not an int");
+
+    long long First = StartVal.getiVal(), Last = BoundVal.getiVal(); // Last is past the final iteration
+    if (L.BoundOp == binOp::op_le)
+    {
+        if (Last == INT_MAX) return Fallback(L, "the counter would wrap around");
+        Last++;
+    }
+    else if (L.BoundOp == binOp::op_ne && Last < First) return Fallback(L, "the counter would wrap around");
+    if (Last <= First) return true;
+    unsigned int Trip = (unsigned int)(Last - First);
+
+    // Arrays are found through the dynamic scope, so the checks are redone on every entry.
+    unsigned int Size;
+    Value* Cells = GetMemoryBlock(Size);
+    L.State.resize(L.Accesses.size());
+    for (size_t a = 0; a < L.Accesses.size(); a++)
+    {
+        const vecAccess& Access = L.Accesses[a];
+        const namedValue* Arr = FindArrayBinding(Access.Sym);
+        if (!Arr) return Fallback(L, "\"%s\" is not an array", Access.Sym);
+        if (Arr->DimInfo.size() != Access.Lead.size() + 1) return Fallback(L, "\"%s\" has another number of dimensions", Access.Sym);
+
+        long long Offset = 0;
+        for (size_t d = 0; d < Access.Lead.size(); d++)
+        {
+            const Value& Idx = L.InvariantVals[Access.Lead[d]];
+            if (!Idx.isInt() || Idx.getiVal() < 0 || Idx.getiVal() >= Arr->DimInfo[d])
+                return Fallback(L, "\"%s\" is indexed out of its bounds", Access.Sym);
+            Offset += (long long)Idx.getiVal() * Arr->Strides[d];
+        }
+        if (First < 0 || Last > Arr->DimInfo.back()) return Fallback(L, "\"%s\" is indexed out of its bounds", Access.Sym);
+        Offset += First;
+
+        VecLoop::accessState& State = L.State[a];
+        State.Type = Arr->ElemType;
+        State.Cells = State.Type == elemType::elem_int ? nullptr : Cells + Arr->Addr + Offset;
+        State.Packed = State.Type == elemType::elem_int ? (char*)(Cells + Arr->Addr) + Offset * sizeof(int32_t) : nullptr;
+        State.Classified = false;
+    }
+
+    // A sum lands where the interpreter would assign it, which must be the
+    // variable it reads.
+    for (auto& S : L.Stmts)
+    {
+        if (!S.Reduce || S.Slot >= 0) continue;
+        const namedValue* Var = FindVariableBinding(S.Sym, false);
+        if (!Var || Var->IsArr) return Fallback(L, "\"%s\" is not a variable here", S.Sym);
+    }
+
+    if (!InferTypes(L, FrameBase, Trip)) return false;
+
+    size_t Lanes = L.Nodes.size() * VecChunk;
+    if (L.Ints.size() < Lanes)
+    {
+        L.Ints.resize(Lanes);
+        L.Doubles.resize(Lanes + 2 * VecChunk);
+        L.Values.resize(Lanes);
+    }
+    for (size_t j = 0; j < L.Nodes.size(); j++)
+    {
+        if (L.Nodes[j].Op != vecOp::vec_const && L.Nodes[j].Op != vecOp::vec_scalar) continue;
+
+        const Value& V = L.Leaves[j];
+        switch (L.Types[j])
+        {
+        case vecType::vt_int: std::fill_n(IntLanes(L, j), VecChunk, V.getiVal()); break;
+        case vecType::vt_double: std::fill_n(DoubleLanes(L, j), VecChunk, V.getdVal()); break;
+        case vecType::vt_value: std::fill_n(ValueLanes(L, j), VecChunk, V); break;
+        }
+    }
+
+    L.Start = (int)First;
+    unsigned int Begin = 0;
+    for (; Trip - Begin >= VecChunk; Begin += VecChunk) RunChunk<VecChunk>(L, Begin, VecChunk);
+    if (Begin < Trip) RunChunk<0>(L, Begin, Trip - Begin);
+
+    for (size_t s = 0; s < L.Stmts.size(); s++)
+    {
+        const vecStmt& S = L.Stmts[s];
+        if (!S.Reduce) continue;
+
+        Value Result = L.IntReduce[s] ? Value((int32_t)L.IntAcc[s]) : Value(L.DoubleAcc[s]);
+        SetMemory(S.Slot >= 0 ? FrameBase + S.Slot : FindVariableBinding(S.Sym, false)->Addr, Result);
+    }
+    SetMemory(CounterAddr, Value((int)Last));
+    return true;
+}
+
+// A worker of a pfor runs each loop on a copy of its plan, having buffers and
+// run state of its own.
+static thread_local std::unordered_map<const VecLoop*, std::unique_ptr<VecLoop>> WorkerLoops;
+
+void ResetWorkerLoops()
+{
+    WorkerLoops.clear();
+}
+
+bool RunVecLoop(VecLoop& L, unsigned int CounterAddr, Value StepVal, unsigned int FrameBase)
+{
+    if (!InParallel) return RunLoop(L, CounterAddr, StepVal, FrameBase);
+
+    std::unique_ptr<VecLoop>& Copy = WorkerLoops[&L];
+    if (!Copy) Copy = std::make_unique<VecLoop>(L);
+    return RunLoop(*Copy, CounterAddr, StepVal, FrameBase);
+}
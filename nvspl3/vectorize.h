@@ -0,0 +1,126 @@
+// SEL Project
+// vectorize.h
+
+#pragma once
+
+#include "value.h"
+#include "ast.h"
+#include "simd.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+extern bool VecReport;          // --vec-report
+extern unsigned int LoopCount;  // for loops resolved so far, numbering the report
+
+typedef enum class VecOp : unsigned char
+{
+    vec_const,   // Val
+    vec_counter, // the loop counter
+    vec_scalar,  // variable Sym, or argument slot Slot
+    vec_load,    // the element of access Access
+    vec_unary,   // builtin unary operator Unary on L
+    vec_binary,  // builtin binary operator Opcode on L and R
+} vecOp;
+
+/// VecNode - An operation of a vectorized loop. Operands come before the
+/// nodes using them.
+typedef struct VecNode
+{
+    vecOp Op;
+    binOp Opcode = binOp::op_add;
+    char Unary = 0;
+    int L = -1, R = -1;
+    int Sym = -1, Slot = -1;
+    int Access = -1;
+    Value Val;
+} vecNode;
+
+/// VecAccess - An array element whose last index is the counter and whose
+/// other indices are loop-invariant nodes.
+typedef struct VecAccess
+{
+    int Sym;
+    std::vector<int> Lead;
+} vecAccess;
+
+/// VecStmt - 'a[...][i] = e', a map, or 's = s op e', a reduction, where e
+/// is made of the nodes First to Root.
+typedef struct VecStmt
+{
+    bool Reduce = false;
+    int Target = -1;         // access a map stores to
+    int Sym = -1, Slot = -1; // variable a reduction updates
+    binOp Opcode = binOp::op_add;
+    int First = 0, Root = 0;
+} vecStmt;
+
+typedef enum class VecType : unsigned char
+{
+    vt_int,
+    vt_double,
+    vt_value, // copied as is: a map storing a plain element, variable or constant
+} vecType;
+
+/// VecLoop - A for loop whose body only computes array elements at the index
+/// of its counter and sums into variables, so it can run a chunk of
+/// iterations at a time, one statement after the other, with every operator
+/// applied to a whole chunk of unboxed values. Iteration i only ever touches
+/// elements at index i, so this computes what the loop would.
+///
+/// The resolver builds it; whether it runs is decided each time the loop is
+/// entered, after the arrays are found, bounds checked and types classified.
+struct VecLoop
+{
+    std::string Where;
+    int CounterSym = -1, CounterSlot = -1;
+    binOp BoundOp = binOp::op_lt; // op_lt, op_le or op_ne, counter on the left
+    int Bound = -1;               // invariant node
+
+    std::vector<vecNode> Invariants; // evaluated once per run
+    std::vector<vecNode> Nodes;      // evaluated for each chunk
+    std::vector<vecAccess> Accesses;
+    std::vector<vecStmt> Stmts;
+
+    bool Reported = false; // a fallback to the loop has been reported
+
+    // state of a run, kept to reuse the buffers
+    typedef struct AccessState
+    {
+        elemType Type;
+        Value* Cells;  // the element at the first counter value
+        char* Packed;  // the same in an int array
+        cellKind Kind;
+        bool Classified;
+    } accessState;
+
+    int Start = 0;
+    std::vector<Value> InvariantVals;
+    std::vector<Value> Leaves;     // values of constant and variable nodes
+    std::vector<vecType> Types;
+    std::vector<accessState> State;
+    std::vector<cellKind> Stored;  // cells a map leaves in a plain array
+    std::vector<bool> IntReduce;   // reductions kept in int arithmetic
+    std::vector<uint32_t> IntAcc;
+    std::vector<double> DoubleAcc;
+    std::vector<int32_t> Ints;     // a chunk of lanes per node
+    std::vector<double> Doubles;   // the same, plus two for converted operands
+    std::vector<Value> Values;
+};
+
+class ForExprAST;
+
+/// AnalyzeLoop - Translate a resolved for loop into a VecLoop, or return null
+/// when it doesn't fit, reporting either way under --vec-report.
+std::shared_ptr<VecLoop> AnalyzeLoop(const ForExprAST& Loop, unsigned int Id, const std::string& FuncName);
+
+/// RunVecLoop - Run the loop whose counter was just set at CounterAddr, and
+/// leave the counter where the loop would. Returns false without touching
+/// anything when the loop has to run as usual. FrameBase is the stack address
+/// of the first argument of the running function.
+bool RunVecLoop(VecLoop& L, unsigned int CounterAddr, Value StepVal, unsigned int FrameBase);
+
+/// ResetWorkerLoops - Drop the copies of loops a pfor worker made on its
+/// last job, whose plans may since have been freed.
+void ResetWorkerLoops();
@@ -0,0 +1,411 @@
+// SEL Project
+// vm.cpp
+
+#include "vm.h"
+#include "execute.h"
+#include "stdfunc.h"
+#include "jit.h"
+#include "memo.h"
+#include "vectorize.h"
+#include <algorithm>
+#include <cmath>
+
+typedef struct CallFrame
+{
+    const Chunk* Code;
+    const instr* IP;        // resume point while a callee is running
+    unsigned int Base;      // operand stack base of the frame
+    unsigned int ArgBase;   // stack memory address of the first argument
+    unsigned int ScopeBase; // first scope mark owned by the frame
+    MemoFunction* Memo;     // table the result goes to, if memoized
+    unsigned int MemoKey;   // arguments of the call in MemoArgs
+    unsigned int Errors;    // ErrorCount when the call began
+} callFrame;
+
+/// Quicken - Rewrite the binary operator at At into the variant for the operand
+/// types it has seen. A failed guard turns it into the generic operator for good.
+static void Quicken(const Chunk* Code, const instr* At, opFeedback Feedback)
+{
+    instr& I = Code->Code[At - Code->Code.data()];
+    switch (Feedback)
+    {
+    case opFeedback::fb_int:
+        I.Op = opCode::op_binary_int;
+        break;
+    case opFeedback::fb_double:
+        I.Op = opCode::op_binary_double;
+        break;
+    default:
+        I.Op = opCode::op_binary;
+        I.B = 1;
+        break;
+    }
+}
+
+/// RunVM - Execute a top-level function on the stack VM, or with Args, a call
+/// of F with argsSize() values there. Calls made from the bytecode are handled
+/// by the dispatch loop itself instead of recursing.
+Value RunVM(FunctionAST& F, const Value* Args)
+{
+    std::vector<Value> Stack;
+    std::vector<scopeMark> Marks;
+    std::vector<callFrame> Frames;
+    std::vector<Value> MemoArgs;
+
+    const Chunk* Code = F.getBytecode();
+    const instr* IP = Code->Code.data();
+    unsigned int Base = 0, Sp = 0, ArgBase = 0;
+
+    if (Args)
+    {
+        Marks.push_back(EnterScope());
+        ArgBase = Marks.back().StackIdx;
+        auto& ArgSyms = F.getArgSyms();
+        for (size_t i = 0; i < ArgSyms.size(); i++)
+        {
+            if (DeclareVariable(ArgSyms[i], Args[i])) continue;
+            LeaveScope(Marks.back());
+            return Value(valueType::val_err);
+        }
+    }
+
+    Stack.resize(Code->MaxDepth + 16);
+    Frames.push_back({ Code, IP, Base, ArgBase, 0, nullptr, 0, 0 });
+
+    while (true)
+    {
+        const instr& I = *IP++;
+
+        switch (I.Op)
+        {
+        case opCode::op_const:
+            Stack[Sp++] = Code->Consts[I.A];
+            break;
+        case opCode::op_undef:
+            Stack[Sp++] = Value(valueType::val_undef);
+            break;
+        case opCode::op_error:
+            if (I.A >= 0) LogErrorV(Code->Names[I.A].c_str());
+            Stack[Sp++] = Value(valueType::val_err);
+            break;
+        case opCode::op_pop:
+            Sp -= I.A;
+            break;
+
+        case opCode::op_load:
+            Stack[Sp++] = GetVariable(I.A);
+            break;
+        case opCode::op_store:
+            if (!Stack[Sp - 1].isErr()) Stack[Sp - 1] = SetVariable(I.A, Stack[Sp - 1]);
+            else Stack[Sp - 1] = Value(valueType::val_err);
+            break;
+        case opCode::op_addr:
+            Stack[Sp++] = GetVariableAddr(I.A);
+            break;
+        case opCode::op_load_arg:
+            Stack[Sp++] = GetMemory(ArgBase + I.A);
+            break;
+        case opCode::op_store_arg:
+            if (!Stack[Sp - 1].isErr()) SetMemory(ArgBase + I.A, Stack[Sp - 1]);
+            else Stack[Sp - 1] = Value(valueType::val_err);
+            break;
+        case opCode::op_addr_arg:
+            Stack[Sp++] = Value((int)(ArgBase + I.A));
+            break;
+        case opCode::op_load_elem:
+        {
+            Value Elem = AccessArr(I.A, &Stack[Sp - I.B], I.B, arrAction::getVal, Value());
+            Sp -= I.B;
+            Stack[Sp++] = Elem;
+            break;
+        }
+        case opCode::op_addr_elem:
+        {
+            Value Addr = AccessArr(I.A, &Stack[Sp - I.B], I.B, arrAction::getAddr, Value());
+            Sp -= I.B;
+            Stack[Sp++] = Addr;
+            break;
+        }
+        case opCode::op_store_elem:
+        {
+            Value& Val = Stack[Sp - I.B - 1];
+            if (!Val.isErr()) Val = AccessArr(I.A, &Stack[Sp - I.B], I.B, arrAction::setVal, Val);
+            else Val = Value(valueType::val_err);
+            Sp -= I.B;
+            break;
+        }
+        case opCode::op_deref:
+        {
+            Value& Addr = Stack[Sp - 1];
+            if (Addr.isErr()) Addr = Value(valueType::val_err);
+            else if (Addr.isUInt()) Addr = GetMemory(Addr.getVal().i);
+            else Addr = LogErrorV("Address must be an unsigned integer");
+            break;
+        }
+        case opCode::op_store_deref:
+        {
+            Value Addr = Stack[--Sp];
+            Value& Val = Stack[Sp - 1];
+            if (Val.isErr()) Val = Value(valueType::val_err);
+            else if (!Addr.isUInt()) Val = LogErrorV("Address must be an unsigned integer");
+            else SetMemory(Addr.getVal().i, Val);
+            break;
+        }
+        case opCode::op_arr_decl:
+            Stack[Sp++] = DeclareArr(I.A, Code->Dims[I.B], Code->ElemTypes[I.B]);
+            break;
+
+        case opCode::op_unary:
+        {
+            Value& V = Stack[Sp - 1];
+            if (V.isErr()) V = Value(valueType::val_err);
+            else V = ApplyUnaryOp((char)I.A, V);
+            break;
+        }
+        case opCode::op_binary:
+        {
+            Value R = Stack[--Sp];
+            Value& L = Stack[Sp - 1];
+            if (L.isErr() || R.isErr())
+            {
+                L = Value(valueType::val_err);
+                break;
+            }
+            if (!I.B) Quicken(Code, IP - 1, OperandFeedback(L, R));
+            L = ApplyBinOp((binOp)I.A, L, R);
+            break;
+        }
+        case opCode::op_binary_int:
+        {
+            Value R = Stack[--Sp];
+            Value& L = Stack[Sp - 1];
+            if (L.isErr() || R.isErr()) L = Value(valueType::val_err);
+            else if (L.isInt() && R.isInt()) L = ApplyIntBinOp((binOp)I.A, L.getVal().i, R.getVal().i);
+            else
+            {
+                Quicken(Code, IP - 1, opFeedback::fb_generic);
+                L = ApplyBinOp((binOp)I.A, L, R);
+            }
+            break;
+        }
+        case opCode::op_binary_double:
+        {
+            Value R = Stack[--Sp];
+            Value& L = Stack[Sp - 1];
+            if (L.isErr() || R.isErr()) L = Value(valueType::val_err);
+            else if (!L.isInt() && !R.isInt()) L = ApplyDoubleBinOp((binOp)I.A, L.getVal().dbl, R.getVal().dbl);
+            else
+            {
+                Quicken(Code, IP - 1, opFeedback::fb_generic);
+                L = ApplyBinOp((binOp)I.A, L, R);
+            }
+            break;
+        }
+
+        case opCode::op_call:
+        case opCode::op_call_op:
+        {
+            Value* Args = &Stack[Sp - I.B];
+            FunctionAST* CalleeF = nullptr;
+
+            if (I.Op == opCode::op_call)
+            {
+                callCache& Cache = Code->CallSites[I.A];
+                if (Cache.Generation != FunctionGeneration)
+                    ResolveCallee(Code->CallNames[I.A], Cache);
+
+                if (Cache.StdFunc >= 0)
+                {
+                    Value RetVal = CallStdFunc(Cache.StdFunc, Args, I.B);
+                    Sp -= I.B;
+                    Stack[Sp++] = RetVal;
+                    break;
+                }
+
+                CalleeF = Cache.Func;
+                if (!CalleeF || CalleeF->argsSize() != I.B)
+                {
+                    Sp -= I.B;
+                    Stack[Sp++] = LogErrorV(CalleeF ? "Incorrect number of arguments passed" : "Unknown function referenced");
+                    break;
+                }
+            }
+            else
+            {
+                bool IsErr = false;
+                for (int i = 0; i < I.B; i++) IsErr |= Args[i].isErr();
+
+                if (!IsErr) CalleeF = Code->OpSlots[I.A]->get();
+                if (!CalleeF)
+                {
+                    Sp -= I.B;
+                    if (IsErr) Stack[Sp++] = Value(valueType::val_err);
+                    else Stack[Sp++] = LogErrorV(I.B == 1 ? "Unknown unary operator" : "Binary operator not found");
+                    break;
+                }
+            }
+
+            Value NativeVal;
+            MemoFunction* Memo = GetMemo(*CalleeF);
+            if (Memo)
+            {
+                if (const Value* Cached = Memo->find(Args))
+                {
+                    Sp -= I.B;
+                    Stack[Sp++] = *Cached;
+                    break;
+                }
+            }
+            else if (UseJIT && RunNative(*CalleeF, Args, I.B, NativeVal))
+            {
+                Sp -= I.B;
+                Stack[Sp++] = NativeVal;
+                break;
+            }
+
+            unsigned int MemoKey = MemoArgs.size();
+            if (Memo) MemoArgs.insert(MemoArgs.end(), Args, Args + I.B);
+
+            Marks.push_back(EnterScope());
+            auto& ArgSyms = CalleeF->getArgSyms();
+            bool Bound = true;
+            for (int i = 0; i < I.B && Bound; i++) Bound = DeclareVariable(ArgSyms[i], Args[i]);
+            Sp -= I.B;
+            if (!Bound)
+            {
+                LeaveScope(Marks.back());
+                Marks.pop_back();
+                MemoArgs.resize(MemoKey);
+                Stack[Sp++] = Value(valueType::val_err);
+                break;
+            }
+
+            Frames.back().IP = IP;
+            Code = CalleeF->getBytecode();
+            IP = Code->Code.data();
+            Base = Sp;
+            ArgBase = Marks.back().StackIdx;
+            Frames.push_back({ Code, IP, Base, ArgBase, (unsigned int)Marks.size() - 1, Memo, MemoKey, ErrorCount });
+
+            if (Stack.size() < Base + Code->MaxDepth + 16) Stack.resize((Base + Code->MaxDepth + 16) * 2);
+            break;
+        }
+        case opCode::op_arg_check:
+            if (Stack[Sp - 1].isErr())
+            {
+                Sp -= I.B;
+                Stack[Sp++] = Value(valueType::val_err);
+                IP = Code->Code.data() + I.A;
+            }
+            break;
+
+        case opCode::op_jump:
+            IP = Code->Code.data() + I.A;
+            break;
+        case opCode::op_jump_if_err:
+            if (Stack[Sp - 1].isErr()) IP = Code->Code.data() + I.A;
+            break;
+        case opCode::op_branch:
+        {
+            Value Cond = Stack[--Sp];
+            if (Cond.isErr()) IP = Code->Code.data() + I.B;
+            else if (!Cond.getdVal()) IP = Code->Code.data() + I.A;
+            break;
+        }
+        case opCode::op_loop_body:
+            if (Stack[--Sp].isErr()) IP = Code->Code.data() + I.A;
+            break;
+        case opCode::op_ctrl_check:
+            if (Stack[Sp - 1].isErr())
+            {
+                Stack[Sp - 1] = LogErrorV("Failed to return a value");
+                IP = Code->Code.data() + I.A;
+            }
+            break;
+        case opCode::op_enter_scope:
+            Marks.push_back(EnterScope());
+            break;
+        case opCode::op_leave_scope:
+            LeaveScope(Marks[Marks.size() - I.A]);
+            Marks.resize(Marks.size() - I.A);
+            break;
+        case opCode::op_for_bind:
+        {
+            int Addr = BindForVariable(I.A, Stack[Sp - 1]);
+            if (Addr >= 0)
+            {
+                Stack[Sp - 1] = Value(Addr);
+                break;
+            }
+            Stack[Sp - 1] = Value(valueType::val_err);
+            Stack[Sp++] = Value(valueType::val_err);
+            IP = Code->Code.data() + I.B;
+            break;
+        }
+        case opCode::op_for_bind_arg:
+            SetMemory(ArgBase + I.A, Stack[Sp - 1]);
+            Stack[Sp - 1] = Value((int)(ArgBase + I.A));
+            break;
+        case opCode::op_for_step:
+        {
+            unsigned int Addr = Stack[Base + I.A].getVal().i;
+            SetMemory(Addr, ApplyBinOp(binOp::op_add, GetMemory(Addr), Stack[Base + I.A + 1]));
+            break;
+        }
+        case opCode::op_for_vec:
+        {
+            const vecSite& Site = Code->VecSites[I.B];
+            if (RunVecLoop(*Site.Loop, Stack[Base + Site.Slot].getVal().i, Stack[Base + Site.Slot + 1], ArgBase))
+                IP = Code->Code.data() + I.A;
+            break;
+        }
+        case opCode::op_walk:
+            Stack[Sp++] = ExecuteInFrame(*Code->Walked[I.A], ArgBase);
+            break;
+        case opCode::op_rep_init:
+            if (!Stack[Sp - 1].isUInt())
+            {
+                Stack[Sp - 1] = LogErrorV("Number of iterations should be an unsigned integer");
+                IP = Code->Code.data() + I.A;
+            }
+            break;
+        case opCode::op_rep_test:
+        {
+            Value& Counter = Stack[Base + I.B];
+            if (Counter.getVal().i <= 0) IP = Code->Code.data() + I.A;
+            else Counter = Value(Counter.getVal().i - 1);
+            break;
+        }
+
+        case opCode::op_ret:
+        {
+            Value RetVal = Stack[--Sp];
+            if (RetVal.isErr()) RetVal = Value(valueType::val_err);
+
+            callFrame& Frame = Frames.back();
+            if (Marks.size() > Frame.ScopeBase)
+            {
+                LeaveScope(Marks[Frame.ScopeBase]);
+                Marks.resize(Frame.ScopeBase);
+            }
+            if (Frame.Memo)
+            {
+                if (ErrorCount == Frame.Errors && Cacheable(RetVal))
+                    Frame.Memo->insert(&MemoArgs[Frame.MemoKey], RetVal);
+                MemoArgs.resize(Frame.MemoKey);
+            }
+            Sp = Frame.Base;
+            Frames.pop_back();
+
+            if (Frames.empty()) return RetVal;
+
+            Code = Frames.back().Code;
+            IP = Frames.back().IP;
+            Base = Frames.back().Base;
+            ArgBase = Frames.back().ArgBase;
+            Stack[Sp++] = RetVal;
+            break;
+        }
+        }
+    }
+}
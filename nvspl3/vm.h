@@ -0,0 +1,138 @@
+// SEL Project
+// vm.h
+
+#pragma once
+
+#include "value.h"
+#include "ast.h"
+#include <vector>
+#include <string>
+#include <memory>
+
+typedef enum class OpCode : unsigned char
+{
+    // constants & stack
+    op_const,        // push Consts[A]
+    op_undef,        // push an undefined value
+    op_error,        // report Names[A] (unless A < 0) and push an error value
+    op_pop,          // drop A values
+
+    // variables & memory
+    op_load,         // push variable of symbol A
+    op_store,        // assign the top value to variable of symbol A
+    op_addr,         // push the address of variable of symbol A
+    op_load_arg,     // push argument slot A
+    op_store_arg,    // assign the top value to argument slot A
+    op_addr_arg,     // push the address of argument slot A
+    op_load_elem,    // pop B indices, push the element of array of symbol A
+    op_store_elem,   // pop B indices, assign the value below them to the element of array of symbol A
+    op_addr_elem,    // pop B indices, push the address of the element of array of symbol A
+    op_deref,        // pop an address, push the value stored there
+    op_store_deref,  // pop an address, store the value below it there
+    op_arr_decl,     // declare array of symbol A with dimensions Dims[B] and elements ElemTypes[B]
+
+    // operators
+    op_unary,        // apply builtin unary operator A to the top value
+    op_binary,       // pop two values, push the result of builtin binary operator A (a binOp); B is set once it has gone generic
+    op_binary_int,   // op_binary quickened for two int operands
+    op_binary_double,// op_binary quickened for two double operands
+
+    // calls
+    op_call,         // call the function of call site CallSites[A] with B arguments
+    op_call_op,      // call user-defined operator OpSlots[A] with B operands
+    op_arg_check,    // if the top is an error, drop B values, push an error and jump to A
+
+    // control flow
+    op_jump,         // jump to A
+    op_jump_if_err,  // jump to A if the top is an error (not popped)
+    op_branch,       // pop a condition, jump to B if it is an error or to A if it is false
+    op_loop_body,    // pop a loop body value, jump to A if it is an error
+    op_ctrl_check,   // if the value of break/return is an error, report it and jump to A
+    op_enter_scope,
+    op_leave_scope,  // leave A scopes (the operand stack is untouched)
+    op_for_bind,     // bind for variable of symbol A to the popped start value, push its address;
+                     // when the stack is full, push two errors and jump to B
+    op_for_bind_arg, // same as op_for_bind for argument slot A
+    op_for_step,     // add the step at slot A + 1 to the counter whose address is at slot A
+    op_for_vec,      // run the loop of VecSites[B] in vector kernels and jump to A if it could
+    op_rep_init,     // check that the iteration count on top is an unsigned integer, else jump to A
+    op_rep_test,     // decrement the counter at slot B, jump to A when it is exhausted
+    op_walk,         // push the value of Walked[A], run by the tree walker
+    op_ret,          // return the top value
+} opCode;
+
+/// Instr - A single VM instruction with up to two immediate operands.
+typedef struct Instr
+{
+    opCode Op;
+    int A;
+    int B;
+} instr;
+
+/// VecSite - A loop that may run in vector kernels, with its counter address
+/// at operand slot Slot and its step right above it.
+typedef struct VecSite
+{
+    std::shared_ptr<VecLoop> Loop;
+    int Slot;
+} vecSite;
+
+/// Chunk - The bytecode of a single function body.
+struct Chunk
+{
+    mutable std::vector<instr> Code; // operators are quickened in place
+    std::vector<Value> Consts;
+    std::vector<std::string> Names;
+    std::vector<std::vector<int>> Dims;
+    std::vector<elemType> ElemTypes; // element type of the array declared with each Dims entry
+    std::vector<std::shared_ptr<FunctionAST>*> OpSlots;
+    mutable std::vector<callCache> CallSites; // indexed like CallNames
+    std::vector<std::string> CallNames;
+    std::vector<vecSite> VecSites;
+    std::vector<ExprAST*> Walked; // constructs left to the tree walker
+
+    bool KeepScope = false; // top-level expressions leave their variables alive
+    int MaxDepth = 0;       // deepest operand stack use relative to the frame
+};
+
+/// Compiler - Lowers the AST of a single function into a Chunk.
+class Compiler
+{
+    typedef struct LoopInfo
+    {
+        int Depth;
+        int ScopeDepth;
+        std::vector<int> BreakJumps;
+    } loopInfo;
+
+    Chunk& Code;
+    std::vector<loopInfo> Loops;
+
+public:
+    int Depth = 0;      // operand stack depth at the current instruction
+    int ScopeDepth = 0; // scopes entered at the current instruction
+
+    Compiler(Chunk& Code) : Code(Code) {}
+
+    int emit(opCode Op, int A = 0, int B = 0);
+    int here() const { return Code.Code.size(); }
+    void patch(int At, int Target) { Code.Code[At].A = Target; }
+    void patchB(int At, int Target) { Code.Code[At].B = Target; }
+
+    int addConst(Value Val);
+    int addName(const std::string& Name);
+    int addDims(const std::vector<int>& Dims, elemType Type);
+    int addOpSlot(std::shared_ptr<FunctionAST>* Slot);
+    int addCallSite(const std::string& Callee);
+    int addVecSite(const std::shared_ptr<VecLoop>& Loop, int Slot);
+    int addWalked(ExprAST* E);
+
+    void beginLoop();
+    void endLoop(int ExitTarget);
+    void emitBreak();
+    bool inLoop() const { return !Loops.empty(); }
+};
+
+std::shared_ptr<Chunk> CompileFunction(FunctionAST& F);
+
+Value RunVM(FunctionAST& F, const Value* Args = nullptr);
@@ -0,0 +1,350 @@
+// SEL Project
+// x64.cpp
+
+#include "x64.h"
+
+void Assembler::dword(uint32_t D)
+{
+    for (int i = 0; i < 4; i++) byte((D >> (i * 8)) & 0xFF);
+}
+
+void Assembler::qword(uint64_t Q)
+{
+    for (int i = 0; i < 8; i++) byte((Q >> (i * 8)) & 0xFF);
+}
+
+void Assembler::rex(bool W, int Reg, int Base, bool Force)
+{
+    uint8_t R = 0x40 | (W ? 8 : 0) | ((Reg & 8) ? 4 : 0) | ((Base & 8) ? 1 : 0);
+    if (R != 0x40 || Force) byte(R);
+}
+
+void Assembler::mem(int Reg, reg Base, int Disp)
+{
+    byte(0x80 | ((Reg & 7) << 3) | ((int)Base & 7));
+    if (((int)Base & 7) == 4) byte(0x24); // rsp and r12 need a SIB byte
+    dword(Disp);
+}
+
+void Assembler::rel32(int Label)
+{
+    LabelUses[Label]++;
+    Fixups.push_back({ (int)Code.size(), Label });
+    dword(0);
+}
+
+int Assembler::newLabel()
+{
+    Labels.push_back(-1);
+    LabelUses.push_back(0);
+    return Labels.size() - 1;
+}
+
+void Assembler::bind(int Label)
+{
+    Labels[Label] = Code.size();
+}
+
+bool Assembler::finish()
+{
+    for (auto& Fix : Fixups)
+    {
+        int Target = Labels[Fix.second];
+        if (Target < 0) return false;
+
+        uint32_t Rel = Target - (Fix.first + 4);
+        for (int i = 0; i < 4; i++) Code[Fix.first + i] = (Rel >> (i * 8)) & 0xFF;
+    }
+    Fixups.clear();
+    return true;
+}
+
+void Assembler::patch32(int At, uint32_t Imm)
+{
+    for (int i = 0; i < 4; i++) Code[At + i] = (Imm >> (i * 8)) & 0xFF;
+}
+
+void Assembler::push(reg R)
+{
+    rex(false, 0, (int)R);
+    byte(0x50 + ((int)R & 7));
+}
+
+void Assembler::pop(reg R)
+{
+    rex(false, 0, (int)R);
+    byte(0x58 + ((int)R & 7));
+}
+
+void Assembler::movImm32(reg Dst, uint32_t Imm)
+{
+    rex(false, 0, (int)Dst);
+    byte(0xB8 + ((int)Dst & 7));
+    dword(Imm);
+}
+
+void Assembler::movImm64(reg Dst, uint64_t Imm)
+{
+    rex(true, 0, (int)Dst);
+    byte(0xB8 + ((int)Dst & 7));
+    qword(Imm);
+}
+
+void Assembler::load32(reg Dst, reg Base, int Disp)
+{
+    rex(false, (int)Dst, (int)Base);
+    byte(0x8B);
+    mem((int)Dst, Base, Disp);
+}
+
+void Assembler::load64(reg Dst, reg Base, int Disp)
+{
+    rex(true, (int)Dst, (int)Base);
+    byte(0x8B);
+    mem((int)Dst, Base, Disp);
+}
+
+void Assembler::store32(reg Base, int Disp, reg Src)
+{
+    rex(false, (int)Src, (int)Base);
+    byte(0x89);
+    mem((int)Src, Base, Disp);
+}
+
+void Assembler::store64(reg Base, int Disp, reg Src)
+{
+    rex(true, (int)Src, (int)Base);
+    byte(0x89);
+    mem((int)Src, Base, Disp);
+}
+
+void Assembler::storeImm32(reg Base, int Disp, uint32_t Imm)
+{
+    rex(false, 0, (int)Base);
+    byte(0xC7);
+    mem(0, Base, Disp);
+    dword(Imm);
+}
+
+void Assembler::cmpImm32(reg Base, int Disp, uint32_t Imm)
+{
+    rex(false, 0, (int)Base);
+    byte(0x81);
+    mem(7, Base, Disp);
+    dword(Imm);
+}
+
+void Assembler::lea(reg Dst, reg Base, int Disp)
+{
+    rex(true, (int)Dst, (int)Base);
+    byte(0x8D);
+    mem((int)Dst, Base, Disp);
+}
+
+void Assembler::alu32(aluOp Op, reg Dst, reg Src)
+{
+    rex(false, (int)Src, (int)Dst);
+    byte((uint8_t)Op);
+    modrm((int)Src, (int)Dst);
+}
+
+void Assembler::alu64(aluOp Op, reg Dst, reg Src)
+{
+    rex(true, (int)Src, (int)Dst);
+    byte((uint8_t)Op);
+    modrm((int)Src, (int)Dst);
+}
+
+void Assembler::alu32Mem(aluOp Op, reg Dst, reg Base, int Disp)
+{
+    // the "r, r/m" form of every operation except test is its opcode + 2
+    rex(false, (int)Dst, (int)Base);
+    byte((uint8_t)Op + (Op == aluOp::alu_test ? 0 : 2));
+    mem((int)Dst, Base, Disp);
+}
+
+static int AluExtension(aluOp Op)
+{
+    switch (Op)
+    {
+    case aluOp::alu_add: return 0;
+    case aluOp::alu_or: return 1;
+    case aluOp::alu_and: return 4;
+    case aluOp::alu_sub: return 5;
+    case aluOp::alu_xor: return 6;
+    default: return 7; // cmp
+    }
+}
+
+void Assembler::aluImm32(aluOp Op, reg Dst, uint32_t Imm)
+{
+    rex(false, 0, (int)Dst);
+    byte(0x81);
+    modrm(AluExtension(Op), (int)Dst);
+    dword(Imm);
+}
+
+void Assembler::aluImm64(aluOp Op, reg Dst, uint32_t Imm)
+{
+    rex(true, 0, (int)Dst);
+    byte(0x81);
+    modrm(AluExtension(Op), (int)Dst);
+    dword(Imm);
+}
+
+void Assembler::imul32(reg Dst, reg Src)
+{
+    rex(false, (int)Dst, (int)Src);
+    byte(0x0F); byte(0xAF);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::imul32Mem(reg Dst, reg Base, int Disp)
+{
+    rex(false, (int)Dst, (int)Base);
+    byte(0x0F); byte(0xAF);
+    mem((int)Dst, Base, Disp);
+}
+
+void Assembler::shl64(reg Dst, uint8_t Imm)
+{
+    rex(true, 0, (int)Dst);
+    byte(0xC1);
+    modrm(4, (int)Dst);
+    byte(Imm);
+}
+
+void Assembler::shr64(reg Dst, uint8_t Imm)
+{
+    rex(true, 0, (int)Dst);
+    byte(0xC1);
+    modrm(5, (int)Dst);
+    byte(Imm);
+}
+
+void Assembler::idiv32(reg Src)
+{
+    rex(false, 0, (int)Src);
+    byte(0xF7);
+    modrm(7, (int)Src);
+}
+
+void Assembler::neg32(reg Dst)
+{
+    rex(false, 0, (int)Dst);
+    byte(0xF7);
+    modrm(3, (int)Dst);
+}
+
+void Assembler::setcc(cond Cc, reg Dst)
+{
+    byte(0x0F); byte(0x90 + (int)Cc);
+    modrm(0, (int)Dst);
+}
+
+void Assembler::movzx8(reg Dst, reg Src)
+{
+    rex(false, (int)Dst, (int)Src);
+    byte(0x0F); byte(0xB6);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::sse(sseOp Op, xreg Dst, xreg Src)
+{
+    byte(0xF2);
+    byte(0x0F); byte((uint8_t)Op);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::ucomisd(xreg A, xreg B)
+{
+    byte(0x66);
+    byte(0x0F); byte(0x2E);
+    modrm((int)A, (int)B);
+}
+
+void Assembler::xorpd(xreg Dst, xreg Src)
+{
+    byte(0x66);
+    byte(0x0F); byte(0x57);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::cvtsi2sd(xreg Dst, reg Src)
+{
+    byte(0xF2);
+    rex(false, (int)Dst, (int)Src);
+    byte(0x0F); byte(0x2A);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::cvttsd2si(reg Dst, xreg Src)
+{
+    byte(0xF2);
+    rex(false, (int)Dst, (int)Src);
+    byte(0x0F); byte(0x2C);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::movqToX(xreg Dst, reg Src)
+{
+    byte(0x66);
+    rex(true, (int)Dst, (int)Src);
+    byte(0x0F); byte(0x6E);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::movqFromX(reg Dst, xreg Src)
+{
+    byte(0x66);
+    rex(true, (int)Src, (int)Dst);
+    byte(0x0F); byte(0x7E);
+    modrm((int)Src, (int)Dst);
+}
+
+void Assembler::movsdLoad(xreg Dst, reg Base, int Disp)
+{
+    byte(0xF2);
+    rex(false, (int)Dst, (int)Base);
+    byte(0x0F); byte(0x10);
+    mem((int)Dst, Base, Disp);
+}
+
+void Assembler::movsdStore(reg Base, int Disp, xreg Src)
+{
+    byte(0xF2);
+    rex(false, (int)Src, (int)Base);
+    byte(0x0F); byte(0x11);
+    mem((int)Src, Base, Disp);
+}
+
+void Assembler::movapd(xreg Dst, xreg Src)
+{
+    byte(0x66);
+    byte(0x0F); byte(0x28);
+    modrm((int)Dst, (int)Src);
+}
+
+void Assembler::jmp(int Label)
+{
+    byte(0xE9);
+    rel32(Label);
+}
+
+void Assembler::jcc(cond Cc, int Label)
+{
+    byte(0x0F); byte(0x80 + (int)Cc);
+    rel32(Label);
+}
+
+void Assembler::call(int Label)
+{
+    byte(0xE8);
+    rel32(Label);
+}
+
+void Assembler::call(const void* Fn)
+{
+    movImm64(reg::rax, Fn);
+    byte(0xFF); byte(0xD0);
+}
@@ -0,0 +1,123 @@
+// SEL Project
+// x64.h
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+typedef enum class Reg
+{
+    rax = 0, rcx = 1, rdx = 2, rbx = 3, rsp = 4, rbp = 5, rsi = 6, rdi = 7,
+    r8 = 8, r9 = 9, r10 = 10, r11 = 11, r12 = 12, r13 = 13, r14 = 14, r15 = 15,
+} reg;
+
+typedef enum class XReg
+{
+    xmm0 = 0, xmm1 = 1, xmm2 = 2, xmm3 = 3,
+} xreg;
+
+typedef enum class Cond
+{
+    cc_o = 0x0, cc_no = 0x1, cc_b = 0x2, cc_ae = 0x3,
+    cc_e = 0x4, cc_ne = 0x5, cc_be = 0x6, cc_a = 0x7,
+    cc_s = 0x8, cc_ns = 0x9, cc_p = 0xA, cc_np = 0xB,
+    cc_l = 0xC, cc_ge = 0xD, cc_le = 0xE, cc_g = 0xF,
+} cond;
+
+// two-operand integer instructions, by their "r/m, r" opcode
+typedef enum class AluOp : uint8_t
+{
+    alu_add = 0x01,
+    alu_or = 0x09,
+    alu_and = 0x21,
+    alu_sub = 0x29,
+    alu_xor = 0x31,
+    alu_cmp = 0x39,
+    alu_test = 0x85,
+    alu_mov = 0x89,
+} aluOp;
+
+// scalar double instructions, by their opcode after 0x0F
+typedef enum class SseOp : uint8_t
+{
+    sse_add = 0x58,
+    sse_mul = 0x59,
+    sse_sub = 0x5C,
+    sse_div = 0x5E,
+} sseOp;
+
+/// Assembler - Emits x86-64 machine code into a byte buffer. Memory operands
+/// are always [base + disp32]. Labels are resolved when they are bound, so
+/// forward jumps may be emitted before their target is known.
+class Assembler
+{
+    std::vector<uint8_t> Code;
+    std::vector<int> Labels;                    // bound position, or -1
+    std::vector<int> LabelUses;                 // number of references
+    std::vector<std::pair<int, int>> Fixups;    // (rel32 position, label)
+
+    void byte(uint8_t B) { Code.push_back(B); }
+    void dword(uint32_t D);
+    void qword(uint64_t Q);
+    void rex(bool W, int Reg, int Base, bool Force = false);
+    void modrm(int Reg, int Rm) { byte(0xC0 | ((Reg & 7) << 3) | (Rm & 7)); }
+    void mem(int Reg, reg Base, int Disp);
+    void rel32(int Label);
+
+public:
+    const std::vector<uint8_t>& code() const { return Code; }
+    int size() const { return Code.size(); }
+    bool finish(); // patch every jump, false if a used label was never bound
+    void patch32(int At, uint32_t Imm);
+
+    int newLabel();
+    void bind(int Label);
+    bool used(int Label) const { return LabelUses[Label] > 0; }
+
+    void push(reg R);
+    void pop(reg R);
+    void ret() { byte(0xC3); }
+
+    void movImm32(reg Dst, uint32_t Imm);
+    void movImm64(reg Dst, uint64_t Imm);
+    void movImm64(reg Dst, const void* Ptr) { movImm64(Dst, (uint64_t)(uintptr_t)Ptr); }
+    void load32(reg Dst, reg Base, int Disp);
+    void load64(reg Dst, reg Base, int Disp);
+    void store32(reg Base, int Disp, reg Src);
+    void store64(reg Base, int Disp, reg Src);
+    void storeImm32(reg Base, int Disp, uint32_t Imm);
+    void cmpImm32(reg Base, int Disp, uint32_t Imm);
+    void lea(reg Dst, reg Base, int Disp);
+
+    void alu32(aluOp Op, reg Dst, reg Src);
+    void alu64(aluOp Op, reg Dst, reg Src);
+    void alu32Mem(aluOp Op, reg Dst, reg Base, int Disp); // Dst op= [Base + Disp]
+    void aluImm32(aluOp Op, reg Dst, uint32_t Imm);
+    void aluImm64(aluOp Op, reg Dst, uint32_t Imm);
+    void imul32(reg Dst, reg Src);
+    void imul32Mem(reg Dst, reg Base, int Disp);
+    void shl64(reg Dst, uint8_t Imm);
+    void shr64(reg Dst, uint8_t Imm);
+    void cdq() { byte(0x99); }
+    void idiv32(reg Src);
+    void neg32(reg Dst);
+    void setcc(cond Cc, reg Dst);  // Dst must be one of rax..rbx
+    void movzx8(reg Dst, reg Src); // Src must be one of rax..rbx
+
+    void sse(sseOp Op, xreg Dst, xreg Src);
+    void ucomisd(xreg A, xreg B);
+    void xorpd(xreg Dst, xreg Src);
+    void cvtsi2sd(xreg Dst, reg Src);
+    void cvttsd2si(reg Dst, xreg Src);
+    void movqToX(xreg Dst, reg Src);
+    void movqFromX(reg Dst, xreg Src);
+    void movsdLoad(xreg Dst, reg Base, int Disp);
+    void movsdStore(reg Base, int Disp, xreg Src);
+    void movapd(xreg Dst, xreg Src);
+
+    void jmp(int Label);
+    void jcc(cond Cc, int Label);
+    void call(int Label);
+    void call(const void* Fn); // clobbers rax
+};
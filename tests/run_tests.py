@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# SEL Project
+# run_tests.py
+
+"""Differential tests for the execution modes of sel.
+
+Every script in this directory is run by the tree walker on one thread, the
+reference implementation, and then in each mode below. A mode passes a script
+when it prints the same output and errors and exits the same way.
+
+    python tests/run_tests.py path/to/sel [script.sel ...]
+"""
+
+import glob
+import os
+import subprocess
+import sys
+
+REFERENCE = ["--threads=1"]
+MODES = [
+    ["--threads=4"],
+    ["--vm"],
+    ["--jit", "--jit-threshold=0"],
+    ["--vm", "--jit", "--jit-threshold=0"],
+    ["--memo"],
+]
+TIMEOUT = 120
+
+
+def run(sel, flags, script):
+    """Run script and return what is compared: exit status, output, errors."""
+    try:
+        proc = subprocess.run([sel, "--no-cache"] + flags + [script],
+                              stdin=subprocess.DEVNULL, capture_output=True, timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return ("timeout", b"", b"")
+    return (proc.returncode, untimed(proc.stdout), untimed(proc.stderr))
+
+
+def untimed(text):
+    """Drop the closing line, which reports how long the run took."""
+    return b"\n".join(line for line in text.splitlines()
+                      if not line.startswith(b"Execution finished"))
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__.strip().splitlines()[-1].strip())
+        return 2
+    sel = sys.argv[1]
+    scripts = sys.argv[2:] or sorted(glob.glob(os.path.join(os.path.dirname(os.path.abspath(__file__)), "*.sel")))
+
+    failed = 0
+    for script in scripts:
+        expected = run(sel, REFERENCE, script)
+        for flags in MODES:
+            actual = run(sel, flags, script)
+            if actual == expected:
+                continue
+            failed += 1
+            print("FAIL %s %s" % (os.path.basename(script), " ".join(flags)))
+            for what, e, a in zip(("status", "output", "errors"), expected, actual):
+                if e != a:
+                    print("  %s: expected %r, got %r" % (what, e, a))
+
+    print("%d scripts, %d modes, %d failures" % (len(scripts), len(MODES), failed))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())